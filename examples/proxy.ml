@@ -0,0 +1,26 @@
+open Zookeeper
+
+(* A session proxy daemon: the processes of this host connect to the
+ * socket with proxy_connect and share its sessions.
+ *
+ *   proxy.byte [servers] [socket] [sessions] *)
+let arg n default = if Array.length Sys.argv > n then Sys.argv.(n) else default
+
+let servers = arg 1 "127.0.0.1:2181"
+let socket = arg 2 "/tmp/zkocaml.sock"
+let sessions = int_of_string (arg 3 "2")
+
+let watcher_fn zhandle event_type conn_state path watcher_ctx =
+  if event_type = Zookeeper.ZOO_SESSION_EVENT then
+    if conn_state = Zookeeper.ZOO_EXPIRED_SESSION_STATE then
+      print_string "Zookeeper session expired\n"
+
+let zhs =
+  Array.init sessions (fun _ ->
+      init servers watcher_fn 30000 {client_id = 0L; passwd=""} "proxy" 0)
+
+let stop = serve_proxy socket zhs;;
+
+read_line ();;
+stop ();;
+Array.iter (fun zh -> ignore (close zh)) zhs;;
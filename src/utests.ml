@@ -168,6 +168,776 @@ let () = reg "watcher_after_gc" @@ fun () ->
   Gc.compact ();
   printf "DONE\n"
 
+let () = reg "watch_dedup" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let fired = ref 0 in
+  let watcher zhandle event_type conn_state path watcher_ctx =
+    printf "fan-out %s: %s %s\n" watcher_ctx (show_event event_type) path;
+    incr fired
+  in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ create zh "/watch_dedup" "" acl create_flag;
+  for i = 1 to 10 do
+    ignore @@ wget zh "/watch_dedup" watcher (string_of_int i)
+  done;
+  let n = watch_count zh "/watch_dedup" in
+  printf "watch_count : %d\n" n; if n <> 10 then exit 1;
+  ignore @@ set zh "/watch_dedup" "changed" (-1);
+  Thread.delay 0.1;
+  printf "fired : %d\n" !fired; if !fired <> 10 then exit 1;
+  if watch_count zh "/watch_dedup" <> 0 then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "coalesced_reads" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let completed = ref 0 in
+  let completion err value _len _stat data =
+    printf "%s: %s %S\n" data (show_error err) value;
+    if err = ZOK && value = "shared" then incr completed
+  in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ create zh "/coalesced_reads" "shared" acl create_flag;
+  set_coalescing zh true;
+  for i = 1 to 20 do
+    let err = aget zh "/coalesced_reads" 0 completion (string_of_int i) in
+    if err <> ZOK then exit 1
+  done;
+  Thread.delay 0.1;
+  printf "completed : %d\n" !completed; if !completed <> 20 then exit 1;
+  (* A read issued after a write does not join one sent before it. *)
+  let seen = ref "" in
+  let err = aget zh "/coalesced_reads" 0 (fun _ _ _ _ _ -> ()) "before" in
+  if err <> ZOK then exit 1;
+  let err = aset zh "/coalesced_reads" "written" (-1) (fun _ _ _ -> ()) "" in
+  if err <> ZOK then exit 1;
+  let err = aget zh "/coalesced_reads" 0 (fun _ value _ _ _ -> seen := value) "after" in
+  if err <> ZOK then exit 1;
+  Thread.delay 0.1;
+  printf "after write : %S\n" !seen; if !seen <> "written" then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "inflight_window" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let completed = ref 0 in
+  let completion err _stat data =
+    printf "%s: %s\n" data (show_error err);
+    if err = ZOK then incr completed
+  in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ create zh "/inflight_window" "" acl create_flag;
+  set_max_inflight zh 4 (Queue 100);
+  for i = 1 to 50 do
+    let err = aset zh "/inflight_window" (string_of_int i) (-1) completion (string_of_int i) in
+    if err <> ZOK then exit 1
+  done;
+  Thread.delay 0.5;
+  let stats = window_stats zh in
+  printf "completed : %d throttled : %d\n" !completed stats.throttled;
+  if !completed <> 50 || stats.inflight <> 0 || stats.queued <> 0 || stats.throttled = 0 then exit 1;
+  set_max_inflight zh 1 Reject;
+  let err = aset zh "/inflight_window" "a" (-1) completion "a" in if err <> ZOK then exit 1;
+  let err = aset zh "/inflight_window" "b" (-1) completion "b" in
+  printf "second : %s\n" (show_error err); if err <> ZTHROTTLEDOP then exit 1;
+  Thread.delay 0.1;
+  let _,value,_ = get zh "/inflight_window" 0 in if value <> "a" then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "deadlines" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let delivered = ref 0 and timed_out = ref 0 in
+  let completion err _value _len _stat _data =
+    incr delivered;
+    if err = ZOPERATIONTIMEOUT then incr timed_out
+    else if err <> ZOK then exit 1
+  in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ create zh "/deadlines" "late" acl create_flag;
+  for i = 1 to 200 do
+    let err = aget ~timeout:0.001 zh "/deadlines" 0 completion (string_of_int i) in
+    if err <> ZOK then exit 1
+  done;
+  Thread.delay 0.5;
+  printf "delivered : %d timed out : %d\n" !delivered !timed_out;
+  if !delivered <> 200 then exit 1;
+  let err, value, _ = get ~timeout:5.0 zh "/deadlines" 0 in
+  printf "get : %s %S\n" (show_error err) value;
+  if err <> ZOK || value <> "late" then exit 1;
+  ignore @@ close zh;
+  (* Nothing ever answers there: only the deadline completes the call. *)
+  let sock = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
+  Unix.bind sock (Unix.ADDR_INET (Unix.inet_addr_loopback, 0));
+  Unix.listen sock 1;
+  let port = match Unix.getsockname sock with Unix.ADDR_INET (_, p) -> p | _ -> exit 1 in
+  let zh = init (sprintf "127.0.0.1:%d" port) watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  let fired = ref [] in
+  let completion err _value _len _stat data = fired := (err, data) :: !fired in
+  if aget ~timeout:0.05 zh "/deadlines" 0 completion "silent" <> ZOK then exit 1;
+  Thread.delay 0.5;
+  printf "silent : %d\n" (List.length !fired);
+  if !fired <> [ZOPERATIONTIMEOUT, "silent"] then exit 1;
+  ignore @@ close zh;
+  Unix.close sock;
+  (* The late completion is not delivered again. *)
+  if !fired <> [ZOPERATIONTIMEOUT, "silent"] then exit 1;
+  printf "DONE\n"
+
+let () = reg "retry_policy" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let completed = ref 0 in
+  let completion err _stat _data = if err = ZOK then incr completed in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  set_retry_policy zh {max_attempts = 5; base_delay = 0.01; max_delay = 0.5; budget = 100};
+  ignore @@ create zh "/retry_policy" "" acl create_flag;
+  let err, _ = exists zh "/retry_policy" 0 in if err <> ZOK then exit 1;
+  for i = 1 to 10 do
+    let err = aset zh "/retry_policy" (string_of_int i) (-1) completion "" in
+    if err <> ZOK then exit 1
+  done;
+  Thread.delay 0.1;
+  let stats = retry_stats zh Op_set in
+  printf "completed : %d retries : %d\n" !completed stats.retries;
+  if !completed <> 10 || stats.retries <> 0 || stats.given_up <> 0 then exit 1;
+  ignore @@ close zh;
+  (* Nothing listens on port 1: every attempt ends in ZCONNECTIONLOSS. *)
+  let zh = init "127.0.0.1:1" watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  let await_loss op submit =
+    let result = ref None in
+    let start = Unix.gettimeofday () in
+    if submit (fun err -> result := Some (err, Unix.gettimeofday () -. start)) <> ZOK then exit 1;
+    let deadline = start +. 10. in
+    while !result = None && Unix.gettimeofday () < deadline do Thread.delay 0.01 done;
+    match !result with
+    | Some (ZCONNECTIONLOSS, elapsed) -> elapsed, retry_stats zh op
+    | _ -> exit 1
+  in
+  (* Backoffs are drawn below 0.1, 0.2 and 0.2 seconds. *)
+  set_retry_policy zh {max_attempts = 3; base_delay = 0.1; max_delay = 0.2; budget = 0};
+  let elapsed, stats = await_loss Op_get (fun k ->
+      aget zh "/retry_policy" 0 (fun err _ _ _ _ -> k err) "") in
+  printf "elapsed : %.3f retries : %d given up : %d\n" elapsed stats.retries stats.given_up;
+  if stats.retries <> 3 || stats.given_up <> 1 || elapsed > 0.5 +. 3. then exit 1;
+  (* A budget of one retry per second cuts the next call short. *)
+  set_retry_policy zh {max_attempts = 3; base_delay = 0.1; max_delay = 0.2; budget = 1};
+  let _, stats = await_loss Op_exists (fun k ->
+      aexists zh "/retry_policy" 0 (fun err _ _ -> k err) "") in
+  printf "budgeted retries : %d given up : %d\n" stats.retries stats.given_up;
+  if stats.retries <> 1 || stats.given_up <> 1 then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "close_async" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let delivered = ref 0 and closed = ref None in
+  let completion _err _value _len _stat _data = incr delivered in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ create zh "/close_async" "" acl create_flag;
+  for i = 1 to 20 do
+    let err = aget zh "/close_async" 0 completion (string_of_int i) in
+    if err <> ZOK then exit 1
+  done;
+  close_async zh (fun err -> closed := Some (!delivered, err));
+  Thread.delay 0.5;
+  (match !closed with
+   | Some (n, err) ->
+     printf "delivered before close : %d %s\n" n (show_error err);
+     if n <> 20 || err <> ZOK then exit 1
+   | None -> exit 1);
+  let err = aget zh "/close_async" 0 completion "late" in
+  printf "after close : %s\n" (show_error err); if err = ZOK then exit 1;
+  printf "DONE\n"
+
+let () = reg "acl_handle" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let prepared = acl_handle acl in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  if acl_handle_acls prepared <> acl then exit 1;
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  for i = 1 to 10 do
+    let err, _ = create_prepared zh (sprintf "/acl_handle_%d" i) "" prepared create_flag in
+    if err <> ZOK then exit 1
+  done;
+  let err = set_acl_prepared zh "/acl_handle_1" (-1) prepared in
+  printf "set_acl : %s\n" (show_error err); if err <> ZOK then exit 1;
+  let err, acls, _ = get_acl zh "/acl_handle_1" in
+  printf "get_acl : %s %d\n" (show_error err) (Array.length acls);
+  if err <> ZOK || acls <> acl then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "interned_paths" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let p = intern_path "/interned_paths" in
+  if p <> intern_path "/interned_paths" || path_name p <> "/interned_paths" then exit 1;
+  (match intern_path "/interned_paths/" with
+   | _ -> exit 1
+   | exception Invalid_argument _ -> ());
+  let fired = ref false in
+  let watcher _zh event _state watched _ctx =
+    printf "%s %s\n" (show_event event) (path_name watched);
+    if watched == p then fired := true
+  in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ create zh "/interned_paths" "one" acl create_flag;
+  let err, value, _ = wget_path zh p watcher "" in
+  printf "wget_path : %s %S\n" (show_error err) value;
+  if err <> ZOK || value <> "one" then exit 1;
+  let err = set_path zh p "two" (-1) in if err <> ZOK then exit 1;
+  Thread.delay 0.1;
+  if not !fired then exit 1;
+  let err, value, _ = get_path zh p 0 in
+  if err <> ZOK || value <> "two" then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "namespace" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let fired = ref false in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ create zh "/namespace" "" acl [||];
+  let ns = namespace zh "/namespace" in
+  if namespace_prefix ns <> "/namespace" then exit 1;
+  let watcher wzh event _state path _ctx =
+    printf "%s %s\n" (show_event event) path;
+    if wzh == ns && path = "/node" then fired := true
+  in
+  let err, created = create ns "/node" "tenant" acl create_flag in
+  printf "create : %s %s\n" (show_error err) created;
+  if err <> ZOK || created <> "/node" then exit 1;
+  let err, value, _ = get zh "/namespace/node" 0 in
+  if err <> ZOK || value <> "tenant" then exit 1;
+  let err, _ = wexists ns "/node" watcher "" in if err <> ZOK then exit 1;
+  let err = delete ns "/node" (-1) in if err <> ZOK then exit 1;
+  Thread.delay 0.1;
+  if not !fired then exit 1;
+  if close ns <> ZBADARGUMENTS then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "create2" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let created = ref None in
+  let completion err path stat _data = created := Some (err, path, stat) in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  let err, path, stat = create2 zh "/create2" "abc" acl create_flag in
+  printf "create2 : %s %s\n" (show_error err) path;
+  if err <> ZOK || path <> "/create2" || stat.data_length <> 3
+     || stat.ephemeral_owner <> (client_id zh).client_id then exit 1;
+  let err = acreate2 zh "/create2_async" "" acl create_flag completion "" in
+  if err <> ZOK then exit 1;
+  Thread.delay 0.1;
+  (match !created with
+   | Some (ZOK, "/create2_async", stat) when stat.czxid > 0L -> ()
+   | _ -> exit 1);
+  let err, _, _ = create2 zh "/create2_container" "" acl [|ZOO_CONTAINER|] in
+  printf "container : %s\n" (show_error err);
+  if err <> ZOK && err <> ZNODEEXISTS then exit 1;
+  let err, _, _ = create2 zh "/create2_bad" "" acl [|ZOO_CONTAINER; ZOO_EPHEMERAL|] in
+  if err <> ZBADARGUMENTS then exit 1;
+  let err, _, _ = create2 ~ttl:1000L zh "/create2_bad" "" acl create_flag in
+  if err <> ZBADARGUMENTS then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "subtree_queries" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ create zh "/subtree_queries" "" acl [||];
+  for i = 1 to 3 do
+    let parent = sprintf "/subtree_queries/%d" i in
+    ignore @@ create zh parent "" acl [||];
+    ignore @@ create zh (parent ^ "/e") "" acl [|ZOO_EPHEMERAL|]
+  done;
+  let err, n = get_all_children_number zh "/subtree_queries" in
+  printf "all children : %s %d\n" (show_error err) n;
+  if err <> ZOK || n <> 6 then exit 1;
+  let err, paths = get_ephemerals ~timeout:5.0 zh "/subtree_queries" in
+  printf "ephemerals : %s %d\n" (show_error err) (Array.length paths);
+  if err <> ZOK || Array.length paths <> 3 then exit 1;
+  let err, _ = get_all_children_number zh "/subtree_queries_missing" in
+  if err <> ZNONODE then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "dynamic_servers" @@ fun () ->
+  let config =
+    "server.1=10.0.0.1:2888:3888:participant;0.0.0.0:2181\n\
+     server.2=10.0.0.2:2888:3888:participant;10.1.0.2:2182\n\
+     server.3=10.0.0.3:2888:3888:observer;2183\n\
+     version=100000000"
+  in
+  let servers = servers_of_config config in
+  printf "servers : %s\n" servers;
+  if servers <> "10.0.0.1:2181,10.1.0.2:2182,10.0.0.3:2183" then exit 1;
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  let connected = get_connected_host zh and current = get_current_server zh in
+  printf "connected : %s current : %s\n" connected current;
+  if connected = "" || current = "" then exit 1;
+  let previous = set_watcher zh watcher_fn in
+  if previous != watcher_fn then exit 1;
+  let err = set_servers zh host in
+  printf "set_servers : %s\n" (show_error err); if err <> ZOK then exit 1;
+  let err, _, _ = getconfig zh 0 in
+  printf "getconfig : %s\n" (show_error err);
+  if err <> ZOK && err <> ZNONODE then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "readonly" @@ fun () ->
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  let ro = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" zoo_readonly in
+  let state = zstate ro in
+  printf "readonly state : %s\n" (show_state state);
+  if state <> ZOO_CONNECTED_STATE && state <> ZOO_READONLY_STATE then exit 1;
+  if is_readonly ro <> (state = ZOO_READONLY_STATE) then exit 1;
+  if read_handle zh ro != zh then exit 1;
+  let err, _, _ = get (read_handle zh ro) "/" 0 in
+  printf "get : %s\n" (show_error err); if err <> ZOK then exit 1;
+  ignore @@ close zh;
+  if read_handle zh ro != ro then exit 1;
+  let err, _, _ = get (read_handle zh ro) "/" 0 in
+  printf "fallback get : %s\n" (show_error err); if err <> ZOK then exit 1;
+  ignore @@ close ro;
+  printf "DONE\n"
+
+let () = reg "batched_watches" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let create_flag = [|Zookeeper.ZOO_EPHEMERAL|] in
+  let batches = ref [] and unbatched = ref 0 in
+  let batch _zh events = batches := events :: !batches in
+  let watcher _ _ _ _ _ = incr unbatched in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  let err = set_batch_watcher ~window:0.1 ~coalesce:true zh (Some batch) in
+  printf "set_batch_watcher : %s\n" (show_error err); if err <> ZOK then exit 1;
+  ignore @@ wexists zh "/batch_a" watcher "a";
+  ignore @@ wexists zh "/batch_a" watcher "a";
+  ignore @@ wexists zh "/batch_b" watcher "b";
+  ignore @@ create zh "/batch_a" "" acl create_flag;
+  ignore @@ create zh "/batch_b" "" acl create_flag;
+  Thread.delay 0.5;
+  let events = Array.concat !batches in
+  Array.iter (fun e -> printf "%s %s %s\n" (show_event e.event) e.path e.watcher_ctx) events;
+  printf "batches : %d events : %d\n" (List.length !batches) (Array.length events);
+  if Array.length events <> 2 || !unbatched <> 0 then exit 1;
+  if set_batch_watcher zh None <> ZOK then exit 1;
+  ignore @@ wexists zh "/batch_c" watcher "c";
+  ignore @@ create zh "/batch_c" "" acl create_flag;
+  Thread.delay 0.1;
+  if !unbatched <> 1 then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "recovering_handle" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let zh0 = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  let err, results = multi zh0
+      [|Create_op ("/multi_a", "a", acl, [|ZOO_EPHEMERAL|]);
+        Check_op ("/multi_a", 0);
+        Set_op ("/multi_a", "b", 0);
+        Delete_op ("/multi_a", 1)|] in
+  printf "multi : %s %d\n" (show_error err) (Array.length results);
+  if err <> ZOK || Array.length results <> 4 then exit 1;
+  if results.(0).op_path <> "/multi_a" || results.(2).op_stat.version <> 1 then exit 1;
+  ignore @@ close zh0;
+  let r = recovering_init host watcher_fn 3600 "hello world" 0 in
+  let zh = recovering_handle r in
+  let fired = ref false in
+  let watcher _ event _ path _ = printf "%s %s\n" (show_event event) path; fired := true in
+  for i = 1 to 20 do
+    let err = register_ephemeral r (sprintf "/recover_%d" i) "up" acl in
+    if err <> ZOK then exit 1
+  done;
+  let err, _ = wexists zh "/recover_watched" watcher "" in if err <> ZOK && err <> ZNONODE then exit 1;
+  let session = (client_id zh).client_id in
+  let err = recover r in
+  printf "recover : %s\n" (show_error err); if err <> ZOK then exit 1;
+  if (client_id zh).client_id = session then exit 1;
+  for i = 1 to 20 do
+    let err, value, stat = get zh (sprintf "/recover_%d" i) 0 in
+    if err <> ZOK || value <> "up" || stat.ephemeral_owner <> (client_id zh).client_id then exit 1
+  done;
+  ignore @@ create zh "/recover_watched" "" acl [|ZOO_EPHEMERAL|];
+  Thread.delay 0.1;
+  if not !fired then exit 1;
+  if unregister_ephemeral r "/recover_1" <> ZOK then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "shared_snapshot" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let name = "/tmp/zkocaml_snapshot_test" in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  let err, _ = create zh "/snapshot_root" "" acl [||] in
+  if err <> ZOK && err <> ZNODEEXISTS then exit 1;
+  ignore @@ delete zh "/snapshot_root/a" (-1);
+  ignore @@ create zh "/snapshot_root/a" "1" acl [||];
+  let stop = publish_snapshot zh "/snapshot_root" name in
+  Thread.delay 0.5;
+  let reader = match snapshot_open name with Some r -> r | None -> exit 1 in
+  let generation = snapshot_generation reader in
+  (match snapshot_find reader "/snapshot_root/a" with
+   | Some ("1", _) -> ()
+   | _ -> exit 1);
+  if snapshot_find reader "/snapshot_root/b" <> None then exit 1;
+  ignore @@ set zh "/snapshot_root/a" "2" (-1);
+  Thread.delay 0.5;
+  printf "generations : %d %d\n" generation (snapshot_generation reader);
+  if snapshot_generation reader <= generation then exit 1;
+  (match snapshot_find reader "/snapshot_root/a" with
+   | Some ("2", _) -> ()
+   | _ -> exit 1);
+  stop ();
+  ignore @@ delete zh "/snapshot_root/a" (-1);
+  ignore @@ delete zh "/snapshot_root" (-1);
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "proxy" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let socket = "/tmp/zkocaml_proxy_test.sock" in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  Thread.delay 0.5;
+  let stop = serve_proxy socket [|zh|] in
+  let p = match proxy_connect socket with Some p -> p | None -> exit 1 in
+  ignore @@ proxy_delete p "/proxy" (-1);
+  let err, path = proxy_create p "/proxy" "1" acl [||] in
+  printf "proxy_create : %s %s\n" (show_error err) path;
+  if err <> ZOK || path <> "/proxy" then exit 1;
+  let err, _ = proxy_create p "/proxy_ephemeral" "" acl [|ZOO_EPHEMERAL|] in
+  printf "proxy_create ephemeral : %s\n" (show_error err);
+  if err <> ZBADARGUMENTS then exit 1;
+  (* The watcher calls the proxy back. *)
+  let fired = ref None in
+  let watcher event _ path =
+    let err, value, _ = proxy_get p path in
+    fired := Some (event, path, err, value)
+  in
+  let err, value, _ = proxy_get ~watcher p "/proxy" in
+  if err <> ZOK || value <> "1" then exit 1;
+  let err, stat = proxy_set p "/proxy" "2" 0 in
+  if err <> ZOK || stat.version <> 1 then exit 1;
+  Thread.delay 0.5;
+  if !fired <> Some (ZOO_CHANGED_EVENT, "/proxy", ZOK, "2") then exit 1;
+  let err, children = proxy_get_children p "/" in
+  if err <> ZOK || not (Array.mem "proxy" children) then exit 1;
+  if proxy_delete p "/proxy" 0 <> ZBADVERSION then exit 1;
+  if proxy_delete p "/proxy" 1 <> ZOK then exit 1;
+  let err, _ = proxy_exists p "/proxy" in
+  if err <> ZNONODE then exit 1;
+  proxy_close p;
+  Thread.delay 0.1;
+  if proxy_delete p "/proxy" (-1) <> ZCONNECTIONLOSS then exit 1;
+  stop ();
+  if proxy_connect socket <> None then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "warm_cache" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let name = "/tmp/zkocaml_warm_cache_test" in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  List.iter (fun path -> ignore @@ delete zh path (-1)) ["/warm/a"; "/warm/b"; "/warm"];
+  ignore @@ create zh "/warm" "" acl [||];
+  ignore @@ create zh "/warm/a" "1" acl [||];
+  let validated = ref None in
+  let cache = warm_cache ~on_valid:(fun err -> validated := Some err) zh "/warm" name in
+  Thread.delay 0.5;
+  if !validated <> Some ZOK || warm_cache_find cache "/warm/a" <> Some "1" then exit 1;
+  ignore @@ set zh "/warm/a" "2" (-1);
+  ignore @@ create zh "/warm/b" "3" acl [||];
+  validated := None;
+  let cache = warm_cache ~on_valid:(fun err -> validated := Some err) zh "/warm" name in
+  printf "warm_cache_find : %s\n"
+    (match warm_cache_find cache "/warm/a" with Some v -> v | None -> "None");
+  Thread.delay 0.5;
+  if !validated <> Some ZOK || not (warm_cache_valid cache) then exit 1;
+  if warm_cache_find cache "/warm/a" <> Some "2" then exit 1;
+  if warm_cache_find cache "/warm/b" <> Some "3" then exit 1;
+  ignore @@ delete zh "/warm/b" (-1);
+  validated := None;
+  let cache = warm_cache ~on_valid:(fun err -> validated := Some err) zh "/warm" name in
+  Thread.delay 0.5;
+  if !validated <> Some ZOK || warm_cache_find cache "/warm/b" <> None then exit 1;
+  List.iter (fun path -> ignore @@ delete zh path (-1)) ["/warm/a"; "/warm"];
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "export_import" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let file = "/tmp/zkocaml_export_test" in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  let nodes = ["/export_src"; "/export_src/a"; "/export_src/a/b"; "/export_src/c"] in
+  let copies = ["/export_dst"; "/export_dst/a"; "/export_dst/a/b"; "/export_dst/c"] in
+  List.iter (fun path -> ignore @@ delete zh path (-1)) (List.rev nodes @ List.rev copies);
+  List.iter (fun path -> ignore @@ create zh path path acl [||]) nodes;
+  ignore @@ create zh "/export_src/e" "" acl [|ZOO_EPHEMERAL|];
+  let err, count = export_subtree ~window:2 zh "/export_src" file in
+  printf "export_subtree : %s %d\n" (show_error err) count;
+  if err <> ZOK || count <> 4 then exit 1;
+  let err, count = import_subtree ~max_ops:2 zh file "/export_dst" acl in
+  printf "import_subtree : %s %d\n" (show_error err) count;
+  if err <> ZOK || count <> 4 then exit 1;
+  List.iter2 (fun path copy ->
+      let err, value, _ = get zh copy 0 in
+      if err <> ZOK || value <> path then exit 1) nodes copies;
+  let err, _ = exists zh "/export_dst/e" 0 in
+  if err <> ZNONODE then exit 1;
+  let err, _ = import_subtree zh file "/export_dst" acl in
+  if err <> ZOK then exit 1;
+  ignore @@ delete zh "/export_src/e" (-1);
+  List.iter (fun path -> ignore @@ delete zh path (-1)) (List.rev nodes @ List.rev copies);
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "zk_data_files" @@ fun () ->
+  let file = "/tmp/zkocaml_zk_data_test" in
+  let write b =
+    let out = open_out_bin file in
+    output_string out (Buffer.contents b);
+    close_out out
+  in
+  let str b s = Buffer.add_int32_be b (Int32.of_int (String.length s)); Buffer.add_string b s in
+  let b = Buffer.create 256 in
+  Buffer.add_int32_be b 0x5a4b534el; Buffer.add_int32_be b 2l; Buffer.add_int64_be b 0L;
+  Buffer.add_int32_be b 0l; Buffer.add_int32_be b 0l;
+  List.iteri (fun i (path, data) ->
+      str b path; str b data; Buffer.add_int64_be b (-1L);
+      for _ = 1 to 4 do Buffer.add_int64_be b (Int64.of_int i) done;
+      for _ = 1 to 3 do Buffer.add_int32_be b 0l done;
+      Buffer.add_int64_be b 0L; Buffer.add_int64_be b 0L)
+    ["", ""; "/a", "1"; "/a/b", "22"; "/c", "333"];
+  str b "/";
+  write b;
+  let nodes = ref [] in
+  let err = zk_snapshot_iter file true (fun path data stat ->
+      nodes := (path, data, stat.num_children, stat.data_length) :: !nodes) in
+  printf "zk_snapshot_iter : %s %d\n" (show_error err) (List.length !nodes);
+  if err <> ZOK then exit 1;
+  if List.rev !nodes <> ["/a/b", "22", 0, 2; "/a", "1", 1, 1; "/c", "333", 0, 3; "/", "", 2, 0]
+  then exit 1;
+  let b = Buffer.create 256 in
+  Buffer.add_int32_be b 0x5a4b4c47l; Buffer.add_int32_be b 2l; Buffer.add_int64_be b 0L;
+  let entry = Buffer.create 64 in
+  Buffer.add_int64_be entry 7L; Buffer.add_int32_be entry 1l;
+  Buffer.add_int64_be entry 42L; Buffer.add_int64_be entry 0L; Buffer.add_int32_be entry 5l;
+  str entry "/a"; str entry "xyz"; Buffer.add_int32_be entry 0l;
+  Buffer.add_int64_be b 0L; str b (Buffer.contents entry); Buffer.add_char b 'B';
+  Buffer.add_string b (String.make 64 '\000');
+  write b;
+  let txns = ref [] in
+  let err = zk_txnlog_iter file (fun txn -> txns := txn :: !txns) in
+  printf "zk_txnlog_iter : %s %d\n" (show_error err) (List.length !txns);
+  (match err, !txns with
+   | ZOK, [{txn_zxid = 42L; txn_type = 5; txn_path = "/a"; txn_data_length = 3; _}] -> ()
+   | _ -> exit 1);
+  if zk_snapshot_iter file false (fun _ _ _ -> ()) <> ZBADARGUMENTS then exit 1;
+  Sys.remove file;
+  if zk_txnlog_iter file ignore <> ZSYSTEMERROR then exit 1;
+  printf "DONE\n"
+
+let () = reg "value_codec" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ codec_delete zh "/codec" (-1);
+  let small = String.concat "," (List.init 100 (fun i -> "route" ^ string_of_int (i mod 7))) in
+  let err, _ = codec_create zh "/codec" small acl [||] in
+  if err <> ZOK then exit 1;
+  let _, stored, _ = get zh "/codec" 0 in
+  printf "codec stored : %d of %d\n" (String.length stored) (String.length small);
+  if String.length stored >= String.length small then exit 1;
+  let err, value, _ = codec_get zh "/codec" in
+  if err <> ZOK || value <> small then exit 1;
+  let large = String.init (3 * 1024 * 1024) (fun i -> Char.chr ((i * 7919) mod 251)) in
+  if codec_set ~compress:false ~chunk_size:(256 * 1024) zh "/codec" large (-1) <> ZOK then exit 1;
+  let err, value, _ = codec_get zh "/codec" in
+  if err <> ZOK || value <> large then exit 1;
+  let err, children = get_children zh "/codec" 0 in
+  printf "codec chunks : %d\n" (Array.length children);
+  if err <> ZOK || Array.length children < 12 then exit 1;
+  if codec_set zh "/codec" small (-1) <> ZOK then exit 1;
+  let err, children = get_children zh "/codec" 0 in
+  if err <> ZOK || Array.length children <> 0 then exit 1;
+  ignore @@ set zh "/codec" "plain" (-1);
+  let err, value, _ = codec_get zh "/codec" in
+  if err <> ZOK || value <> "plain" then exit 1;
+  if lz4_decompress (lz4_compress small) (String.length small) <> Some small then exit 1;
+  if lz4_decompress "\255" 10 <> None then exit 1;
+  if codec_delete zh "/codec" (-1) <> ZOK then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "decoded_cache" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ delete zh "/decoded" (-1);
+  ignore @@ create zh "/decoded" "41" acl [||];
+  let decodes = ref 0 in
+  let cache = decoded_cache zh in
+  register_decoder cache "/decoded" (fun s -> incr decodes; int_of_string s);
+  for _ = 1 to 100 do
+    if decoded_get cache "/decoded" <> (ZOK, Some 41) then exit 1
+  done;
+  if !decodes <> 1 then exit 1;
+  ignore @@ set zh "/decoded" "42" (-1);
+  Thread.delay 0.5;
+  printf "decodes : %d\n" !decodes;
+  if !decodes <> 2 || decoded_get cache "/decoded" <> (ZOK, Some 42) then exit 1;
+  if decoded_get cache "/other" <> (ZBADARGUMENTS, None) then exit 1;
+  ignore @@ set zh "/decoded" "not a number" (-1);
+  Thread.delay 0.5;
+  if fst (decoded_get cache "/decoded") <> ZMARSHALLINGERROR then exit 1;
+  ignore @@ delete zh "/decoded" (-1);
+  Thread.delay 0.5;
+  if fst (decoded_get cache "/decoded") <> ZNONODE then exit 1;
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "write_batcher" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  List.iter (fun path -> ignore @@ delete zh path (-1)) ["/batched_a"; "/batched_b"];
+  ignore @@ create zh "/batched_a" "" acl [||];
+  let b = write_batcher ~window:0.05 zh in
+  let lock = Mutex.create () and results = ref [] in
+  let record name r =
+    Mutex.lock lock;
+    results := (name, r.op_error) :: !results;
+    Mutex.unlock lock
+  in
+  for i = 1 to 50 do
+    batched_set b "/batched_a" (string_of_int i) (-1) (record "set")
+  done;
+  batched_create b "/batched_a" "" acl [||] (record "conflict");
+  batched_create b "/batched_b" "b" acl [||] (record "create");
+  Thread.delay 0.5;
+  printf "write_batcher : %d results\n" (List.length !results);
+  if List.length !results <> 52 then exit 1;
+  (* The conflict fails alone: the writes batched with it succeed. *)
+  if List.exists (fun (name, err) ->
+      err <> (if name = "conflict" then ZNODEEXISTS else ZOK)) !results
+  then exit 1;
+  let err, value, stat = get zh "/batched_a" 0 in
+  if err <> ZOK || value <> "50" || stat.version <> 1 then exit 1;
+  let err, value, _ = get zh "/batched_b" 0 in
+  if err <> ZOK || value <> "b" then exit 1;
+  results := [];
+  batched_set b "/batched_a" "51" (-1) (record "set");
+  batched_delete b "/batched_b" 5 (record "bad version");
+  batched_delete b "/batched_b" (-1) (record "delete");
+  Thread.delay 0.5;
+  if List.sort compare !results
+     <> List.sort compare ["set", ZOK; "bad version", ZBADVERSION; "delete", ZOK]
+  then exit 1;
+  let err, value, stat = get zh "/batched_a" 0 in
+  if err <> ZOK || value <> "51" || stat.version <> 2 then exit 1;
+  if fst (exists zh "/batched_b" 0) <> ZNONODE then exit 1;
+  batcher_close b;
+  let closed = ref ZOK in
+  batched_delete b "/batched_b" (-1) (fun r -> closed := r.op_error);
+  if !closed <> ZCLOSING then exit 1;
+  List.iter (fun path -> ignore @@ delete zh path (-1)) ["/batched_a"; "/batched_b"];
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "dispatch_queue" @@ fun () ->
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ delete zh "/dispatch_queue" (-1);
+  ignore @@ create zh "/dispatch_queue" "routed" acl [||];
+  set_coalescing zh true;
+  let q = dispatch_queue () in
+  set_dispatch_queue zh (Some q);
+  let self = Thread.id (Thread.self ()) in
+  let ran = ref 0 and elsewhere = ref 0 and values = ref [] in
+  let here () =
+    incr ran;
+    if Thread.id (Thread.self ()) <> self then incr elsewhere
+  in
+  for i = 1 to 20 do
+    let completion err value _ _ data =
+      here ();
+      if err = ZOK then values := (data, value) :: !values
+    in
+    ignore @@ aget zh "/dispatch_queue" 0 completion (string_of_int i)
+  done;
+  ignore @@ aget_children zh "/" 0 (fun err _ _ -> if err = ZOK then here ()) "";
+  ignore @@ aset zh "/dispatch_queue" "changed" (-1) (fun err _ _ -> if err = ZOK then here ()) "";
+  (* Nothing runs until the queue is drained on this thread. *)
+  Thread.delay 0.5;
+  if !ran <> 0 then exit 1;
+  let deadline = Unix.gettimeofday () +. 5. in
+  while !ran < 22 && Unix.gettimeofday () < deadline do
+    ignore @@ run_dispatch_queue q 100
+  done;
+  let stats = dispatch_stats q in
+  printf "dispatch_queue : %d run, %d routed, %d pending\n" !ran stats.routed stats.pending;
+  if !ran <> 22 || !elsewhere <> 0 || stats.pending <> 0 then exit 1;
+  if List.exists (fun (_, value) -> value <> "routed") !values then exit 1;
+  set_dispatch_queue zh None;
+  close_dispatch_queue q;
+  if run_dispatch_queue q (-1) <> -1 then exit 1;
+  let direct = ref false in
+  ignore @@ aexists zh "/dispatch_queue" 0 (fun _ _ _ -> direct := true) "";
+  Thread.delay 0.5;
+  if not !direct then exit 1;
+  ignore @@ delete zh "/dispatch_queue" (-1);
+  ignore @@ close zh;
+  printf "DONE\n"
+
+let () = reg "direct_style" @@ fun () ->
+  let module Zk = Direct (Thread_suspend) in
+  (* Gives up at once, as a cancelled fiber would. *)
+  let module Cancelled = Direct (struct
+      let suspend register = register (fun _ -> ()); raise Exit
+    end) in
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let zh = init host watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0 in
+  ignore @@ delete zh "/direct" (-1);
+  if fst (Zk.create zh "/direct" "" acl [||]) <> ZOK then exit 1;
+  let failures = ref 0 and lock = Mutex.create () in
+  let fiber i =
+    let path = sprintf "/direct/%d" i in
+    let ok =
+      fst (Zk.create zh path "a" acl [||]) = ZOK
+      && Zk.set zh path (string_of_int i) 0 = ZOK
+      && (match Zk.get zh path 0 with
+          | ZOK, value, stat -> value = string_of_int i && stat.version = 1
+          | _ -> false)
+      && Zk.delete zh path 1 = ZOK
+      && fst (Zk.exists zh path 0) = ZNONODE
+    in
+    if not ok then begin
+      Mutex.lock lock;
+      incr failures;
+      Mutex.unlock lock
+    end
+  in
+  List.iter Thread.join (List.init 50 (Thread.create fiber));
+  printf "direct_style : %d failures\n" !failures;
+  if !failures <> 0 then exit 1;
+  (match Cancelled.get zh "/direct" 0 with
+   | _ -> exit 1
+   | exception Exit -> ());
+  if Zk.sync zh "/direct" <> ZOK then exit 1;
+  let err, children = Zk.get_children zh "/direct" 0 in
+  if err <> ZOK || children <> [||] then exit 1;
+  if Zk.delete zh "/direct" (-1) <> ZOK then exit 1;
+  ignore @@ close zh;
+  (* Not submitted: no suspension, the error comes back directly. *)
+  if fst (Zk.exists zh "/direct" 0) = ZOK then exit 1;
+  printf "DONE\n"
+
 let () =
   match (List.tl @@ Array.to_list @@ Sys.argv) with
     | ["init"] -> List.iter (fun (n,_) -> printf "%s\n" n) !tests
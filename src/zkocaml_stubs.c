@@ -17,8 +17,18 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <caml/alloc.h>
 #include <caml/callback.h>
@@ -26,6 +36,7 @@
 #include <caml/fail.h>
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
+#include <caml/printexc.h>
 #include <caml/signals.h>
 #include <caml/threads.h>
 
@@ -37,13 +48,95 @@
 
 #include "zkocaml_stubs.h"
 
+/* Shared by every handle, of any domain: set and flushed under the lock. */
+static FILE *zkocaml_log_stream = NULL;
+static pthread_mutex_t zkocaml_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Nonzero while the current thread runs OCaml code from a dispatch. */
+static __thread int zkocaml_dispatching = 0;
+
+/* Nonzero while a thread of zookeeper or of the bindings (completion,
+ * timer, reaper) runs callbacks: nothing there can catch what they raise. */
+static __thread int zkocaml_foreign = 0;
+
+/* Nonzero while the current thread replays routed completions. */
+static __thread int zkocaml_replaying = 0;
+
+/* The first exception a replayed callback raised on this thread, for
+ * zkocaml_route_run to raise; Val_unit if none. */
+static __thread value zkocaml_replay_exn = Val_unit;
+
+/**
+ * Logs @exn, raised by a callback on a thread it cannot be raised on.
+ */
+static void
+zkocaml_log_exn(value exn)
+{
+  char *msg = caml_format_exception(exn);
+
+  pthread_mutex_lock(&zkocaml_log_lock);
+  fprintf(zkocaml_log_stream != NULL ? zkocaml_log_stream : stderr,
+          "zookeeper: exception raised by a callback: %s\n", msg);
+  pthread_mutex_unlock(&zkocaml_log_lock);
+  caml_stat_free(msg);
+}
+
+/**
+ * Logs the exception of the callback result @res, if any: for the
+ * callbacks whose cleanup must run whatever they raise.
+ */
+static void
+zkocaml_log_result(value res)
+{
+  if (Is_exception_result(res)) zkocaml_log_exn(Extract_exception(res));
+}
+
+/**
+ * Raises the exception of the callback result @res, if any; unless
+ * completions are being replayed, where it is kept for the replay to
+ * raise once each dispatch has cleaned up after itself, or the thread
+ * is not an OCaml one, where it is logged.
+ */
+static void
+zkocaml_callback_result(value res)
+{
+  if (!Is_exception_result(res)) return;
+  if (zkocaml_replaying) {
+    if (zkocaml_replay_exn == Val_unit) {
+      zkocaml_replay_exn = Extract_exception(res);
+      caml_register_generational_global_root(&zkocaml_replay_exn);
+    }
+    return;
+  }
+  if (zkocaml_foreign) {
+    zkocaml_log_exn(Extract_exception(res));
+    return;
+  }
+  caml_raise(Extract_exception(res));
+}
+
+#define zkocaml_callback1(f, a) \
+  zkocaml_callback_result(caml_callback_exn(f, a))
+#define zkocaml_callback2(f, a, b) \
+  zkocaml_callback_result(caml_callback2_exn(f, a, b))
+#define zkocaml_callback3(f, a, b, c) \
+  zkocaml_callback_result(caml_callback3_exn(f, a, b, c))
+#define zkocaml_callbackN(f, n, args) \
+  zkocaml_callback_result(caml_callbackN_exn(f, n, args))
+
 #define zkocaml_enter_callback() \
   int zkocaml_c_thread_registered = caml_c_thread_register(); \
-  if (zkocaml_c_thread_registered) caml_acquire_runtime_system()
+  if (zkocaml_c_thread_registered) { \
+    caml_acquire_runtime_system(); \
+    zkocaml_foreign++; \
+  } \
+  zkocaml_dispatching++
 
 #define zkocaml_leave_callback()                \
     do {                                        \
+        zkocaml_dispatching--;                  \
         if (zkocaml_c_thread_registered) {      \
+            zkocaml_foreign--;                  \
             caml_release_runtime_system();      \
             caml_c_thread_unregister();         \
         }                                       \
@@ -56,8 +149,11 @@
   sizeof(v) / sizeof(v[0])
 
 #define ZKOCAML_MAX_PATH_BUFFER_SIZE 4096
+#define ZKOCAML_MAX_CONFIG_BUFFER_SIZE 65536
 
-static FILE *zkocaml_log_stream = NULL;
+/* Same code as ZTHROTTLEDOP in libzookeeper >= 3.7, which older
+ * headers lack; also returned when the in-flight window is full. */
+#define ZKOCAML_THROTTLED ((enum ZOO_ERRORS)-127)
 
 static const enum ZOO_ERRORS ZOO_ERRORS_TABLE[] = {
   ZOK,
@@ -83,7 +179,12 @@ static const enum ZOO_ERRORS ZOO_ERRORS_TABLE[] = {
   ZAUTHFAILED,
   ZCLOSING,
   ZNOTHING,
-  ZSESSIONMOVED
+  ZSESSIONMOVED,
+  ZKOCAML_THROTTLED,
+  ZNEWCONFIGNOQUORUM,
+  ZRECONFIGINPROGRESS,
+  ZRECONFIGDISABLED,
+  ZNOTREADONLY
 };
 
 static const ZooLogLevel ZOO_LOG_LEVEL_TABLE[] = {
@@ -107,7 +208,8 @@ static const ZOO_STATE_AUX ZOO_STATE_TABLE[] = {
   ZOO_AUTH_FAILED_STATE_AUX,
   ZOO_CONNECTING_STATE_AUX,
   ZOO_ASSOCIATING_STATE_AUX,
-  ZOO_CONNECTED_STATE_AUX
+  ZOO_CONNECTED_STATE_AUX,
+  ZOO_READONLY_STATE_AUX
 };
 
 static const ZOO_PERM_AUX ZOO_PERM_TABLE[] = {
@@ -121,7 +223,8 @@ static const ZOO_PERM_AUX ZOO_PERM_TABLE[] = {
 
 static const ZOO_CREATE_FLAG_AUX ZOO_CREATE_FLAG_TABLE[] = {
     ZOO_EPHEMERAL_AUX,
-    ZOO_SEQUENCE_AUX
+    ZOO_SEQUENCE_AUX,
+    ZOO_CONTAINER_AUX
 };
 
 static enum ZOO_ERRORS
@@ -243,6 +346,9 @@ zkocaml_enum_state_ml2c(value v)
   case ZOO_CONNECTED_STATE_AUX:
     state = ZOO_CONNECTED_STATE;
     break;
+  case ZOO_READONLY_STATE_AUX:
+    state = ZOO_READONLY_STATE;
+    break;
   }
 
   return state;
@@ -264,6 +370,8 @@ zkocaml_enum_state_c2ml(int state)
     state_aux = ZOO_ASSOCIATING_STATE_AUX;
   } else if (state == ZOO_CONNECTED_STATE) {
     state_aux = ZOO_CONNECTED_STATE_AUX;
+  } else if (state == ZOO_READONLY_STATE) {
+    state_aux = ZOO_READONLY_STATE_AUX;
   }
 
   for (; i < zkocaml_table_len(ZOO_STATE_TABLE); i++) {
@@ -348,11 +456,30 @@ zkocaml_enum_create_flag_ml2c(value v)
       case ZOO_SEQUENCE_AUX:
           create_flag |= ZOO_SEQUENCE;
           break;
+      case ZOO_CONTAINER_AUX:
+          create_flag |= ZOO_CONTAINER;
+          break;
       }
   }
   return create_flag;
 }
 
+/**
+ * The create mode for the create @flags and a @ttl in milliseconds,
+ * 0 for none, or -1 if they do not go together: containers take no
+ * other flag, and TTLs only apply to persistent nodes.
+ */
+static int
+zkocaml_create_mode(int flags, int64_t ttl)
+{
+  if (flags & ZOO_CONTAINER)
+    return (flags == ZOO_CONTAINER && ttl == 0) ? ZOO_CONTAINER : -1;
+  if (ttl == 0) return flags;
+  if (ttl < 0 || (flags & ZOO_EPHEMERAL)) return -1;
+  return (flags & ZOO_SEQUENCE) ? ZOO_PERSISTENT_SEQUENTIAL_WITH_TTL
+                                : ZOO_PERSISTENT_WITH_TTL;
+}
+
 static value
 zkocaml_enum_create_flag_c2ml(int create_flag)
 {
@@ -363,6 +490,8 @@ zkocaml_enum_create_flag_c2ml(int create_flag)
     create_flag_aux = ZOO_EPHEMERAL_AUX;
   } else if (create_flag == ZOO_SEQUENCE) {
     create_flag_aux = ZOO_SEQUENCE_AUX;
+  } else if (create_flag == ZOO_CONTAINER) {
+    create_flag_aux = ZOO_CONTAINER_AUX;
   }
 
   for (; i < zkocaml_table_len(ZOO_CREATE_FLAG_TABLE); i++) {
@@ -419,7 +548,7 @@ zkocaml_parse_acls(value v, struct ACL_vector *acls)
   acls->count = vlen;
   acls->data = (struct ACL *)calloc(acls->count, sizeof(struct ACL));
   for (; i < vlen; i++) {
-      acls->data[i].perms = Field(Field(v, i), 0);
+      acls->data[i].perms = Int_val(Field(Field(v, i), 0));
       acls->data[i].id.scheme = strdup(String_val(Field(Field(v, i), 1)));
       acls->data[i].id.id = strdup(String_val(Field(Field(v, i), 2)));
   }
@@ -427,6 +556,25 @@ zkocaml_parse_acls(value v, struct ACL_vector *acls)
   return 1;
 }
 
+static void
+zkocaml_free_acls(struct ACL_vector *acls)
+{
+  int i = 0;
+  for (; i < acls->count; i++) {
+      free(acls->data[i].id.scheme);
+      free(acls->data[i].id.id);
+  }
+  free(acls->data);
+  acls->data = NULL;
+  acls->count = 0;
+}
+
+static const char *
+zkocaml_null_if_empty(value v)
+{
+  return caml_string_length(v) == 0 ? NULL : String_val(v);
+}
+
 static value
 zkocaml_build_client_id_struct(const clientid_t *cid)
 {
@@ -457,6 +605,13 @@ zkocaml_build_stat_struct(const struct Stat *stat)
   CAMLparam0();
   CAMLlocal1(v);
 
+  /* Completions of failed requests carry no stat. */
+  struct Stat empty_stat;
+  if (stat == NULL) {
+    memset(&empty_stat, 0, sizeof(empty_stat));
+    stat = &empty_stat;
+  }
+
   v = caml_alloc(11, 0);
   Store_field(v,  0, caml_copy_int64(stat->czxid));
   Store_field(v,  1, caml_copy_int64(stat->mzxid));
@@ -480,6 +635,7 @@ zkocaml_build_strings_struct(const struct String_vector *strings)
   CAMLlocal1(v);
 
   int i = 0;
+  if (strings == NULL) CAMLreturn (Atom(0));
   v = caml_alloc(strings->count, 0);
   for (; i < strings->count; i++) {
     Store_field(v, i, caml_copy_string(strings->data[i]));
@@ -498,7 +654,7 @@ zkocaml_build_acls_struct(const struct ACL_vector *acls)
   v = caml_alloc(acls->count, 0);
   for (; i < acls->count; i++) {
     acl = caml_alloc(3, 0);
-    Store_field(acl, 0, acls->data[i].perms);
+    Store_field(acl, 0, Val_int(acls->data[i].perms));
     Store_field(acl, 1, caml_copy_string(acls->data[i].id.scheme));
     Store_field(acl, 2, caml_copy_string(acls->data[i].id.id));
 
@@ -508,11 +664,221 @@ zkocaml_build_acls_struct(const struct ACL_vector *acls)
   CAMLreturn (v);
 }
 
+static size_t
+zkocaml_path_hash(const char *path, int salt)
+{
+  /* FNV-1a */
+  size_t h = 2166136261u;
+  for (; *path; path++) {
+    h ^= (unsigned char)*path;
+    h *= 16777619u;
+  }
+  return h ^ (size_t)salt;
+}
+
+/**
+ * Interned paths.
+ *
+ * A path handle is validated once and points to the single C copy of
+ * its string, found by a hash of the string contents. Handles hash
+ * by that same value and compare equal by address, falling back to
+ * the strings for ordering; the stubs read a path argument from
+ * either a string or a handle. A watch set
+ * through a handle reports events with that same handle rather than
+ * with a fresh string.
+ */
+
+#define ZKOCAML_PATH_BUCKETS 4096
+
+#define ZkO_path_val(v) (*(zkocaml_path_t **)Data_custom_val(v))
+
+static struct {
+  pthread_mutex_t lock;
+  zkocaml_path_t *buckets[ZKOCAML_PATH_BUCKETS];
+} zkocaml_paths = { PTHREAD_MUTEX_INITIALIZER };
+
+static const char *
+zkocaml_path_val(value v)
+{
+  if (Tag_val(v) == String_tag) return String_val(v);
+  return ZkO_path_val(v)->name;
+}
+
+/**
+ * Namespaces.
+ *
+ * A namespaced handle is a second custom block over the same
+ * zkocaml_handle_t, carrying a path prefix. The stubs join the prefix
+ * and their path argument in a per-thread buffer that keeps the prefix
+ * of the last namespace used, and paths coming back (created nodes,
+ * watch events) are stripped of it before reaching OCaml. Paths must
+ * be absolute, so a tenant cannot name a node outside its subtree.
+ */
+
+static struct custom_operations namespace_ops;
+
+#define ZkO_namespace_val(v)                                            \
+  (Custom_ops_val(v) == &namespace_ops                                  \
+   ? ((zkocaml_namespace_t **)Data_custom_val(v))[1] : NULL)
+
+static atomic_uint_fast64_t zkocaml_namespace_ids = 1;
+static __thread char zkocaml_ns_buffer[ZKOCAML_MAX_PATH_BUFFER_SIZE];
+static __thread uint64_t zkocaml_ns_buffered = 0;
+
+/**
+ * The path a stub called on @zh sends to zookeeper for @path.
+ */
+static const char *
+zkocaml_ns_path(value zh, value path)
+{
+  const char *local_path = zkocaml_path_val(path);
+  zkocaml_namespace_t *ns = ZkO_namespace_val(zh);
+  size_t len = 0;
+
+  if (ns == NULL) return local_path;
+  if (local_path[0] != '/') return "";
+  if (local_path[1] == '\0') return ns->prefix;
+  len = strlen(local_path);
+  if (ns->len + len >= ZKOCAML_MAX_PATH_BUFFER_SIZE) return "";
+  if (zkocaml_ns_buffered != ns->id) {
+    memcpy(zkocaml_ns_buffer, ns->prefix, ns->len);
+    zkocaml_ns_buffered = ns->id;
+  }
+  memcpy(zkocaml_ns_buffer + ns->len, local_path, len + 1);
+  return zkocaml_ns_buffer;
+}
+
+static size_t
+zkocaml_ns_len(value zh)
+{
+  zkocaml_namespace_t *ns = ZkO_namespace_val(zh);
+  return ns == NULL ? 0 : ns->len;
+}
+
+/**
+ * @path as seen from a namespace of @strip bytes.
+ */
+static const char *
+zkocaml_ns_strip(const char *path, size_t strip)
+{
+  if (strip == 0 || path == NULL || strlen(path) < strip) return path;
+  return path[strip] == '\0' ? "/" : path + strip;
+}
+
+/* Same rules as the server: absolute, no empty, "." or ".." segment,
+ * no trailing slash but for the root. */
+static int
+zkocaml_path_valid(const char *path, size_t len)
+{
+  size_t i = 0;
+  if (len == 0 || path[0] != '/' || strlen(path) != len) return 0;
+  if (len == 1) return 1;
+  if (path[len - 1] == '/') return 0;
+  for (; i < len; i++) {
+    if (path[i] != '/') continue;
+    if (path[i + 1] == '/') return 0;
+    if (path[i + 1] == '.'
+        && (path[i + 2] == '/' || path[i + 2] == '\0'
+            || (path[i + 2] == '.' && (path[i + 3] == '/' || path[i + 3] == '\0'))))
+      return 0;
+  }
+  return 1;
+}
+
+static void path_finalize (value v) {
+  zkocaml_path_t *path = ZkO_path_val(v), **link = NULL;
+
+  pthread_mutex_lock(&zkocaml_paths.lock);
+  if (--path->refs == 0) {
+    link = &zkocaml_paths.buckets[path->hash % ZKOCAML_PATH_BUCKETS];
+    for (; *link != path; link = &(*link)->next);
+    *link = path->next;
+    free(path);
+  }
+  pthread_mutex_unlock(&zkocaml_paths.lock);
+}
+
+static int path_compare (value v1, value v2) {
+  zkocaml_path_t *p1 = ZkO_path_val(v1), *p2 = ZkO_path_val(v2);
+  return p1 == p2 ? 0 : strcmp(p1->name, p2->name);
+}
+
+static intnat path_hash (value v) {
+  return (intnat) ZkO_path_val(v)->hash;
+}
+
+static struct custom_operations path_ops = {
+  "zkocaml.path",
+  path_finalize,
+  path_compare,
+  path_hash,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+/**
+ * Interns @path, raising Invalid_argument if it is not a valid znode
+ * path.
+ */
+CAMLprim value
+zkocaml_path_intern(value path)
+{
+  CAMLparam1(path);
+  CAMLlocal1(result);
+
+  const char *local_path = String_val(path);
+  size_t len = caml_string_length(path);
+  if (!zkocaml_path_valid(local_path, len))
+    caml_invalid_argument("Zookeeper.intern_path");
+
+  size_t hash = zkocaml_path_hash(local_path, 0);
+  result = caml_alloc_custom(&path_ops, sizeof(zkocaml_path_t *), 0, 1);
+
+  pthread_mutex_lock(&zkocaml_paths.lock);
+  zkocaml_path_t *interned = zkocaml_paths.buckets[hash % ZKOCAML_PATH_BUCKETS];
+  for (; interned != NULL; interned = interned->next) {
+    if (interned->hash == hash && interned->len == len
+        && memcmp(interned->name, local_path, len) == 0)
+      break;
+  }
+  if (interned == NULL) {
+    interned = (zkocaml_path_t *)malloc(sizeof(zkocaml_path_t) + len + 1);
+    interned->refs = 0;
+    interned->hash = hash;
+    interned->len = len;
+    memcpy(interned->name, local_path, len + 1);
+    interned->next = zkocaml_paths.buckets[hash % ZKOCAML_PATH_BUCKETS];
+    zkocaml_paths.buckets[hash % ZKOCAML_PATH_BUCKETS] = interned;
+  }
+  interned->refs++;
+  pthread_mutex_unlock(&zkocaml_paths.lock);
+  ZkO_path_val(result) = interned;
+
+  CAMLreturn(result);
+}
+
+/**
+ * The string a path handle was interned from.
+ */
+CAMLprim value
+zkocaml_path_name(value path)
+{
+  CAMLparam1(path);
+  CAMLreturn(caml_copy_string(ZkO_path_val(path)->name));
+}
+
+/**
+ * A session connected to a read-only server is usable too: reads
+ * are served and writes fail with ZNOTREADONLY.
+ */
 static int
 is_connected(zhandle_t* zh)
 {
   int state = zoo_state(zh);
-  return (state==ZOO_CONNECTED_STATE);
+  return (state==ZOO_CONNECTED_STATE || state==ZOO_READONLY_STATE);
 }
 
 #define RETURN_IF_NO_HANDLE(h_,v)               \
@@ -521,16 +887,28 @@ is_connected(zhandle_t* zh)
 
 #define ZkO_handle_val(v) (*(zkocaml_handle_t**)Data_custom_val(v))
 
+/* The acquire may wait with the runtime released while the handle is
+ * closed: h_ is read and validated again once the slot is taken. */
+#define RETURN_IF_THROTTLED(zh_,h_)                                     \
+    if (zkocaml_window_acquire(ZkO_handle_val(zh_)->window) != ZOK)     \
+        CAMLreturn(zkocaml_enum_error_c2ml(ZKOCAML_THROTTLED));         \
+    h_ = zkocaml_handle_struct_val(zh_);                                \
+    if (!h_) {                                                          \
+        zkocaml_window_cancel(ZkO_handle_val(zh_)->window);             \
+        CAMLreturn(zkocaml_enum_error_c2ml(ZINVALIDSTATE));             \
+    }
+
 static zhandle_t*
 zkocaml_handle_struct_val (value zh)
 {
   zkocaml_handle_t* handle = ZkO_handle_val(zh);
-  if (!handle->zhandle ||
-      !is_connected(handle->zhandle) ||
+  zhandle_t *zhandle = handle->zhandle;
+  if (!zhandle ||
+      !is_connected(zhandle) ||
       !handle->refcount ||
       atomic_load(handle->refcount) <= 0)
     return 0;
-  return handle->zhandle;
+  return zhandle;
 }
 
 static value
@@ -542,679 +920,4511 @@ zkocaml_copy_zh(value zh)
   CAMLreturn (zh);
 }
 
+static int zkocaml_reap(zkocaml_handle_t *handle, ZKOCAML_REAP_OP op, int wait);
+
+/**
+ * Drops a reference to the handle. The last one closes the session on
+ * the reaper thread; with @wait the caller sleeps until it is closed
+ * and gets the result of zookeeper_close.
+ */
 static value
-zkocaml_destroy_handle (value zh)
+zkocaml_destroy_handle (value zh, int wait)
 {
   CAMLparam0();
   CAMLlocal1(result);
   result = zkocaml_enum_error_c2ml(ZOK);
   zkocaml_handle_t* handle = ZkO_handle_val(zh);
 
-  if (!handle->zhandle || !is_connected(handle->zhandle)) goto skip;
+  if (!handle->zhandle) goto skip;
   int tmp = atomic_fetch_sub(handle->refcount,1) - 1;
-  if (tmp == 0) {
-    result = Val_int(zookeeper_close(handle->zhandle));
-    if (zkocaml_log_stream != NULL) fclose(zkocaml_log_stream);
-  }
+  if (tmp == 0)
+    result = zkocaml_enum_error_c2ml(zkocaml_reap(handle, ZKOCAML_REAP_CLOSE, wait));
 skip: CAMLreturn (result);
 }
 
-static void finalize (value zh) {
-  zkocaml_handle_t* handle = ZkO_handle_val(zh);
-  free(handle->refcount);
-  if (handle->zhandle && is_connected(handle->zhandle)) zookeeper_close(handle->zhandle);
-  free(handle);
-}
-
-static struct custom_operations handle_ops = {
-  "zhandle",
-  finalize,
-  custom_compare_default,
-  custom_hash_default,
-  custom_serialize_default,
-  custom_deserialize_default,
-#if defined(custom_compare_ext_default)
-  custom_compare_ext_default,
-#endif
-};
-
+/**
+ * Watch registry.
+ *
+ * Every "w" getter subscribes its OCaml watcher to the entry of its
+ * (path, kind) pair and hands the entry itself to zookeeper as the
+ * watcher context. Since zookeeper keeps a single copy of a given
+ * (watcher, context) pair per path, any number of subscribers costs
+ * one watch, and a triggered watch is fanned out to all of them from
+ * a single runtime acquisition.
+ *
+ * An entry is freed once it has no subscriber, no watch request in
+ * flight and zookeeper does not hold it: a request that completes
+ * after the event re-activates the watch, so the entry outlives a fired
+ * watch while such a request is in flight. A request settled after the
+ * event of its own watch (a sync call, or a completion routed to a
+ * dispatch queue) leaves the entry held until the handle goes.
+ */
 
-#define DISPOSABLE 0
-#define PERMANENT 1
+#define ZKOCAML_WATCH_BUCKETS 64
 
-zkocaml_completion_context_t*
-make_completion_context(value data,
-                        value callback)
+static zkocaml_watch_registry_t *
+zkocaml_watch_registry_new(void)
 {
-    zkocaml_completion_context_t *local_data = (zkocaml_completion_context_t *)
-        malloc(sizeof(zkocaml_completion_context_t));
-    local_data->data = String_val(data);
-    local_data->completion_callback = callback;
-    caml_register_generational_global_root(&(local_data->completion_callback));
-
-    return local_data;
+  zkocaml_watch_registry_t *registry = (zkocaml_watch_registry_t *)
+      malloc(sizeof(zkocaml_watch_registry_t));
+  pthread_mutex_init(&registry->lock, NULL);
+  registry->next_id = 0;
+  registry->size = 0;
+  registry->nbuckets = ZKOCAML_WATCH_BUCKETS;
+  registry->buckets = (zkocaml_watch_entry_t **)
+      calloc(registry->nbuckets, sizeof(zkocaml_watch_entry_t *));
+  registry->batch = NULL;
+  return registry;
 }
 
-zkocaml_watcher_context_t*
-make_watcher_context(value watcher_ctx,
-                     value callback,
-                     int kind,
-                     value zh)
+static void
+zkocaml_watch_subs_free(zkocaml_watch_sub_t *sub)
 {
-  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  local_ctx->watcher_ctx = String_val(watcher_ctx);
-  local_ctx->watcher_callback = callback;
-  local_ctx->permanent = kind;
-  local_ctx->zh = zh;
-  caml_register_generational_global_root(&(local_ctx->watcher_callback));
-  caml_register_generational_global_root(&(local_ctx->zh));
-
-  return local_ctx;
+  while (sub != NULL) {
+    zkocaml_watch_sub_t *next = sub->next;
+    caml_remove_generational_global_root(&(sub->watcher_callback));
+    caml_remove_generational_global_root(&(sub->zh));
+    caml_remove_generational_global_root(&(sub->interned));
+    free(sub->watcher_ctx);
+    free(sub);
+    sub = next;
+  }
 }
 
 static void
-watcher_dispatch(zhandle_t *_zhandle, // ignore this, because we have our handle in ctx
-                 int type,
-                 int state,
-                 const char *path,
-                 void *watcher_ctx)
+zkocaml_watch_registry_free(zkocaml_watch_registry_t *registry)
 {
-  zkocaml_enter_callback();
-  CAMLparam0();
-
-  CAMLlocal5(local_zh, local_type, local_state, local_path, local_watcher_ctx);
-  CAMLlocalN(args, 5);
-
-  zkocaml_watcher_context_t *ctx = (zkocaml_watcher_context_t* )(watcher_ctx);
-  if (!zkocaml_handle_struct_val(ctx->zh)) goto skip;
-
-  local_zh = zkocaml_copy_zh(ctx->zh);
-  local_type = zkocaml_enum_event_c2ml(type);
-  local_state = zkocaml_enum_state_c2ml(state);
-  local_path = caml_copy_string(path);
-  local_watcher_ctx = caml_copy_string(ctx->watcher_ctx);
+  size_t i = 0;
+  if (registry == NULL) return;
+  for (; i < registry->nbuckets; i++) {
+    zkocaml_watch_entry_t *entry = registry->buckets[i];
+    while (entry != NULL) {
+      zkocaml_watch_entry_t *next = entry->next;
+      zkocaml_watch_subs_free(entry->subs);
+      free(entry->path);
+      free(entry);
+      entry = next;
+    }
+  }
+  free(registry->buckets);
+  pthread_mutex_destroy(&registry->lock);
+  free(registry);
+}
 
-  Store_field(args, 0, local_zh);
-  Store_field(args, 1, local_type);
-  Store_field(args, 2, local_state);
-  Store_field(args, 3, local_path);
-  Store_field(args, 4, local_watcher_ctx);
-  callbackN(ctx->watcher_callback, 5, args);
-  zkocaml_destroy_handle(ctx->zh);
+/* Must be called with the registry lock held. */
+static zkocaml_watch_entry_t *
+zkocaml_watch_find(zkocaml_watch_registry_t *registry,
+                   const char *path,
+                   ZKOCAML_WATCH_KIND kind)
+{
+  size_t b = zkocaml_path_hash(path, kind) % registry->nbuckets;
+  zkocaml_watch_entry_t *entry = registry->buckets[b];
+  for (; entry != NULL; entry = entry->next) {
+    if (entry->kind == kind && strcmp(entry->path, path) == 0)
+      return entry;
+  }
+  return NULL;
+}
 
-skip:
-  if (!ctx->permanent) {
-    caml_remove_generational_global_root(&(ctx->watcher_callback));
-    caml_remove_generational_global_root(&(ctx->zh));
+/* Must be called with the registry lock held. */
+static void
+zkocaml_watch_grow(zkocaml_watch_registry_t *registry)
+{
+  size_t i = 0, nbuckets = registry->nbuckets * 2;
+  zkocaml_watch_entry_t **buckets = (zkocaml_watch_entry_t **)
+      calloc(nbuckets, sizeof(zkocaml_watch_entry_t *));
+  for (; i < registry->nbuckets; i++) {
+    zkocaml_watch_entry_t *entry = registry->buckets[i];
+    while (entry != NULL) {
+      zkocaml_watch_entry_t *next = entry->next;
+      size_t b = zkocaml_path_hash(entry->path, entry->kind) % nbuckets;
+      entry->next = buckets[b];
+      buckets[b] = entry;
+      entry = next;
+    }
   }
-  CAMLdrop;
-  zkocaml_leave_callback();
+  free(registry->buckets);
+  registry->buckets = buckets;
+  registry->nbuckets = nbuckets;
 }
 
 /**
- * The completion callbacks (from asynchronous calls) are
- * implemented similarly.
+ * Subscribes an OCaml watcher to the (path, kind) entry of the handle,
+ * creating the entry if needed. The subscription id is stored in @id.
  */
+static zkocaml_watch_entry_t *
+zkocaml_watch_subscribe(value zh,
+                        value path,
+                        ZKOCAML_WATCH_KIND kind,
+                        value watcher_callback,
+                        value watcher_ctx,
+                        uint64_t *id)
+{
+  zkocaml_watch_registry_t *registry = ZkO_handle_val(zh)->watches;
+  zkocaml_watch_sub_t *sub = (zkocaml_watch_sub_t *)
+      malloc(sizeof(zkocaml_watch_sub_t));
+  sub->interned = Tag_val(path) != String_tag ? path : Val_unit;
+  caml_register_generational_global_root(&(sub->interned));
+  sub->zh = ZkO_namespace_val(zh) != NULL ? zh : Val_unit;
+  caml_register_generational_global_root(&(sub->zh));
+  sub->strip = zkocaml_ns_len(zh);
+  sub->watcher_ctx = strdup(String_val(watcher_ctx));
+  sub->watcher_callback = watcher_callback;
+  caml_register_generational_global_root(&(sub->watcher_callback));
+
+  pthread_mutex_lock(&registry->lock);
+  zkocaml_watch_entry_t *entry = zkocaml_watch_find(registry, zkocaml_ns_path(zh, path), kind);
+  if (entry == NULL) {
+    if (registry->size >= 2 * registry->nbuckets) zkocaml_watch_grow(registry);
+    size_t b = zkocaml_path_hash(zkocaml_ns_path(zh, path), kind) % registry->nbuckets;
+    entry = (zkocaml_watch_entry_t *) malloc(sizeof(zkocaml_watch_entry_t));
+    entry->registry = registry;
+    entry->path = strdup(zkocaml_ns_path(zh, path));
+    entry->kind = kind;
+    entry->count = 0;
+    entry->inflight = 0;
+    entry->held = 0;
+    entry->subs = NULL;
+    entry->next = registry->buckets[b];
+    registry->buckets[b] = entry;
+    registry->size++;
+  }
+  sub->id = ++registry->next_id;
+  sub->next = entry->subs;
+  entry->subs = sub;
+  entry->count++;
+  entry->inflight++;
+  pthread_mutex_unlock(&registry->lock);
+
+  *id = sub->id;
+  return entry;
+}
 
 /**
- * Called when an asynchronous call that returns void completes and
- * dispatches user provided callback
+ * Unlinks and frees @entry if nothing refers to it any more. Must be
+ * called with the registry lock held.
  */
 static void
-void_completion_dispatch(int rc, const void *data)
+zkocaml_watch_release(zkocaml_watch_entry_t *entry)
 {
-  zkocaml_enter_callback();
-  CAMLparam0();
-
-  CAMLlocal1(completion_callback);
-  CAMLlocal2(local_rc, local_data);
-
-  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_data = caml_copy_string(ctx->data);
+  zkocaml_watch_registry_t *registry = entry->registry;
+  zkocaml_watch_entry_t **link = NULL;
+
+  if (entry->subs != NULL || entry->inflight > 0 || entry->held) return;
+  link = &registry->buckets[zkocaml_path_hash(entry->path, entry->kind) % registry->nbuckets];
+  for (; *link != entry; link = &(*link)->next);
+  *link = entry->next;
+  registry->size--;
+  free(entry->path);
+  free(entry);
+}
 
-  callback2(completion_callback, local_rc, local_data);
+/**
+ * Settles a watch request on @entry: if it left a watch behind,
+ * zookeeper holds the entry, otherwise subscription @id is dropped
+ * (0 for none). The subscription may already be gone if the watch
+ * fired meanwhile.
+ */
+static void
+zkocaml_watch_done(zkocaml_watch_entry_t *entry, uint64_t id, int armed)
+{
+  zkocaml_watch_sub_t *sub = NULL, **link = NULL;
 
-  caml_remove_generational_global_root(&(ctx->completion_callback));
+  pthread_mutex_lock(&entry->registry->lock);
+  entry->inflight--;
+  if (armed) {
+    entry->held = 1;
+  } else {
+    for (link = &entry->subs; *link != NULL; link = &(*link)->next) {
+      if ((*link)->id == id) {
+        sub = *link;
+        *link = sub->next;
+        sub->next = NULL;
+        entry->count--;
+        break;
+      }
+    }
+  }
+  zkocaml_watch_release(entry);
+  pthread_mutex_unlock(&entry->registry->lock);
 
-  CAMLdrop;
-  zkocaml_leave_callback();
+  zkocaml_watch_subs_free(sub);
 }
 
 /**
- * Called when an asynchronous call that returns a stat structure
- * completes and dispatches user provided callback
+ * Whether a request of the given kind that completed with @rc
+ * left a watch on the server.
  */
+static int
+zkocaml_watch_armed(ZKOCAML_WATCH_KIND kind, int rc)
+{
+  return rc == ZOK || (kind == ZKOCAML_WATCH_EXIST && rc == ZNONODE);
+}
+
 static void
-stat_completion_dispatch(int rc,
-                         const struct Stat *stat,
-                         const void *data)
+zkocaml_watch_settle(zkocaml_completion_context_t *ctx, int rc)
 {
-  zkocaml_enter_callback();
-  CAMLparam0();
+  if (ctx->watch == NULL) return;
+  zkocaml_watch_done(ctx->watch, ctx->watch_sub,
+                     zkocaml_watch_armed(ctx->watch->kind, rc));
+}
 
-  CAMLlocal1(completion_callback);
-  CAMLlocal3(local_rc, local_stat, local_data);
+/**
+ * Batched watch delivery.
+ *
+ * With a batch watcher set on a handle, the registry dispatch does not
+ * take the runtime for watch events: it queues one event per subscriber
+ * and a flusher thread hands all the events queued since its last pass
+ * to the batch watcher as one array, from a single runtime acquisition.
+ * The flusher waits the batch window after the first event of a pass,
+ * so that bursts are gathered. With coalescing on, an event equal to
+ * one still queued (same type, path and watcher context) is dropped.
+ * Session events are still delivered to every subscriber at once.
+ */
 
-  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_stat = zkocaml_build_stat_struct(stat);
-  local_data = caml_copy_string(ctx->data);
+#define ZKOCAML_BATCH_BUCKETS 1024
 
-  callback3(completion_callback, local_rc, local_stat, local_data);
+static size_t
+zkocaml_watch_batch_hash(int type, const char *path, const char *watcher_ctx)
+{
+  return (zkocaml_path_hash(path, type) * 31 +
+          zkocaml_path_hash(watcher_ctx, 0)) % ZKOCAML_BATCH_BUCKETS;
+}
 
-  caml_remove_generational_global_root(&(ctx->completion_callback));
+/**
+ * Queues the event of @path for each of @subs, which the batch takes
+ * over. Must be called with the registry lock held.
+ */
+static void
+zkocaml_watch_batch_push(zkocaml_watch_batch_t *batch,
+                         int type,
+                         int state,
+                         const char *path,
+                         zkocaml_watch_sub_t *subs)
+{
+  zkocaml_watch_sub_t *sub = NULL, *last = NULL;
+
+  pthread_mutex_lock(&batch->lock);
+  for (sub = subs; sub != NULL; last = sub, sub = sub->next) {
+    const char *sub_path = zkocaml_ns_strip(path, sub->strip);
+    zkocaml_watch_event_t *event = NULL;
+    size_t b = 0;
+
+    if (batch->coalesce) {
+      b = zkocaml_watch_batch_hash(type, sub_path, sub->watcher_ctx);
+      for (event = batch->index[b]; event != NULL; event = event->chain) {
+        if (event->type == type &&
+            strcmp(event->path, sub_path) == 0 &&
+            strcmp(event->watcher_ctx, sub->watcher_ctx) == 0)
+          break;
+      }
+      if (event != NULL) {
+        event->state = state;
+        continue;
+      }
+    }
 
-  CAMLdrop;
-  zkocaml_leave_callback();
+    event = (zkocaml_watch_event_t *) malloc(sizeof(zkocaml_watch_event_t));
+    event->type = type;
+    event->state = state;
+    event->path = strdup(sub_path);
+    event->watcher_ctx = strdup(sub->watcher_ctx);
+    event->next = NULL;
+    event->chain = NULL;
+    if (batch->coalesce) {
+      event->chain = batch->index[b];
+      batch->index[b] = event;
+    }
+    if (batch->tail != NULL) batch->tail->next = event;
+    else batch->head = event;
+    batch->tail = event;
+  }
+  /* The subscriptions hold roots, freed by the flusher with the runtime. */
+  last->next = batch->dead;
+  batch->dead = subs;
+  pthread_cond_signal(&batch->cond);
+  pthread_mutex_unlock(&batch->lock);
 }
+
 /**
- * Called when an asynchronous call that returns a stat structure and
- * some untyped data completes and dispatches user provided
- * callback (used by aget)
+ * Delivers @events to the batch watcher and frees them along with the
+ * @dead subscriptions, then the batch itself if it is @closed.
  */
 static void
-data_completion_dispatch(int rc,
-                         const char *val,
-                         int val_len,
-                         const struct Stat *stat,
-                         const void *data)
+zkocaml_watch_batch_deliver(zkocaml_watch_batch_t *batch,
+                            zkocaml_watch_event_t *events,
+                            zkocaml_watch_sub_t *dead,
+                            int closed)
 {
+  zkocaml_watch_event_t *event = NULL;
+  size_t i = 0, n = 0;
+
   zkocaml_enter_callback();
   CAMLparam0();
+  CAMLlocal4(zh, local_events, local_event, local_field);
+
+  zkocaml_watch_subs_free(dead);
+  for (event = events; event != NULL; event = event->next) n++;
+
+  if (n > 0 && zkocaml_handle_struct_val(batch->zh)) {
+    zh = zkocaml_copy_zh(batch->zh);
+    local_events = caml_alloc(n, 0);
+    for (event = events; event != NULL; event = event->next, i++) {
+      local_event = caml_alloc(4, 0);
+      Store_field(local_event, 0, zkocaml_enum_event_c2ml(event->type));
+      Store_field(local_event, 1, zkocaml_enum_state_c2ml(event->state));
+      local_field = caml_copy_string(event->path);
+      Store_field(local_event, 2, local_field);
+      local_field = caml_copy_string(event->watcher_ctx);
+      Store_field(local_event, 3, local_field);
+      Store_field(local_events, i, local_event);
+    }
+    zkocaml_log_result(caml_callback2_exn(batch->batch_callback, zh, local_events));
+    zkocaml_destroy_handle(zh, 0);
+  }
 
-  CAMLlocal1(completion_callback);
-  CAMLlocal5(local_rc, local_val, local_val_len, local_stat, local_data);
-  CAMLlocalN(args, 5);
-
-  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_val = caml_copy_string(val);
-  local_val_len = Val_int(val_len);
-  local_stat = zkocaml_build_stat_struct(stat);
-  local_data = caml_copy_string(ctx->data);
-
-  Store_field(args, 0, local_rc);
-  Store_field(args, 1, local_val);
-  Store_field(args, 2, local_val_len);
-  Store_field(args, 3, local_stat);
-  Store_field(args, 4, local_data);
-
-  callbackN(completion_callback, 5, args);
+  while (events != NULL) {
+    event = events->next;
+    free(events->path);
+    free(events->watcher_ctx);
+    free(events);
+    events = event;
+  }
 
-  caml_remove_generational_global_root(&(ctx->completion_callback));
+  if (closed) {
+    caml_remove_generational_global_root(&(batch->zh));
+    caml_remove_generational_global_root(&(batch->batch_callback));
+    pthread_cond_destroy(&batch->cond);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch->index);
+    free(batch);
+  }
 
   CAMLdrop;
   zkocaml_leave_callback();
 }
 
+static void *
+zkocaml_watch_batch_loop(void *arg)
+{
+  zkocaml_watch_batch_t *batch = (zkocaml_watch_batch_t *) arg;
+  struct timespec ts = { batch->window_ms / 1000,
+                         (batch->window_ms % 1000) * 1000000L };
+  int closed = 0;
+
+  while (!closed) {
+    zkocaml_watch_event_t *events = NULL;
+    zkocaml_watch_sub_t *dead = NULL;
+
+    pthread_mutex_lock(&batch->lock);
+    while (batch->head == NULL && batch->dead == NULL && !batch->closed)
+      pthread_cond_wait(&batch->cond, &batch->lock);
+    if (batch->window_ms > 0 && batch->head != NULL && !batch->closed) {
+      pthread_mutex_unlock(&batch->lock);
+      nanosleep(&ts, NULL);
+      pthread_mutex_lock(&batch->lock);
+    }
+    events = batch->head;
+    dead = batch->dead;
+    closed = batch->closed;
+    batch->head = NULL;
+    batch->tail = NULL;
+    batch->dead = NULL;
+    if (batch->coalesce)
+      memset(batch->index, 0, ZKOCAML_BATCH_BUCKETS * sizeof(zkocaml_watch_event_t *));
+    pthread_mutex_unlock(&batch->lock);
+
+    zkocaml_watch_batch_deliver(batch, events, dead, closed);
+  }
+  return NULL;
+}
+
 /**
- * Called when an asynchronous call that returns a list of strings
- * completes and dispatches user provided callback.
+ * Detaches the batch of @registry, if any. Its flusher delivers what
+ * is still queued, then frees it. Must be called with the runtime held.
  */
 static void
-strings_completion_dispatch(int rc,
-                            const struct String_vector *strings,
-                            const void *data)
+zkocaml_watch_batch_stop(zkocaml_watch_registry_t *registry)
+{
+  zkocaml_watch_batch_t *batch = NULL;
+
+  if (registry == NULL) return;
+  pthread_mutex_lock(&registry->lock);
+  batch = registry->batch;
+  registry->batch = NULL;
+  if (batch != NULL) {
+    pthread_mutex_lock(&batch->lock);
+    batch->closed = 1;
+    pthread_cond_signal(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+  }
+  pthread_mutex_unlock(&registry->lock);
+}
+
+/**
+ * Starts a batch delivering to @batch_callback and attaches it to
+ * @registry. Returns 0 if its flusher thread could not be started.
+ */
+static int
+zkocaml_watch_batch_start(zkocaml_watch_registry_t *registry,
+                          value zh,
+                          value batch_callback,
+                          int window_ms,
+                          int coalesce)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  int rc = 0;
+  zkocaml_watch_batch_t *batch = (zkocaml_watch_batch_t *)
+      calloc(1, sizeof(zkocaml_watch_batch_t));
+
+  pthread_mutex_init(&batch->lock, NULL);
+  pthread_cond_init(&batch->cond, NULL);
+  batch->window_ms = window_ms;
+  batch->coalesce = coalesce;
+  batch->index = (zkocaml_watch_event_t **)
+      calloc(ZKOCAML_BATCH_BUCKETS, sizeof(zkocaml_watch_event_t *));
+  batch->zh = zh;
+  caml_register_generational_global_root(&(batch->zh));
+  batch->batch_callback = batch_callback;
+  caml_register_generational_global_root(&(batch->batch_callback));
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create(&thread, &attr, zkocaml_watch_batch_loop, batch);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    caml_remove_generational_global_root(&(batch->zh));
+    caml_remove_generational_global_root(&(batch->batch_callback));
+    pthread_cond_destroy(&batch->cond);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch->index);
+    free(batch);
+    return 0;
+  }
+
+  pthread_mutex_lock(&registry->lock);
+  registry->batch = batch;
+  pthread_mutex_unlock(&registry->lock);
+  return 1;
+}
+
+static void
+watch_registry_dispatch(zhandle_t *zhandle,
+                        int type,
+                        int state,
+                        const char *path,
+                        void *watcher_ctx)
 {
+  zkocaml_watch_entry_t *entry = (zkocaml_watch_entry_t *)(watcher_ctx);
+  zkocaml_watch_sub_t *subs = NULL, *sub = NULL;
+  int count = 0;
+
+  pthread_mutex_lock(&entry->registry->lock);
+  subs = entry->subs;
+  count = entry->count;
+  entry->subs = NULL;
+  entry->count = 0;
+  if (subs != NULL && type != ZOO_SESSION_EVENT && entry->registry->batch != NULL) {
+    zkocaml_watch_batch_push(entry->registry->batch, type, state, path, subs);
+    subs = NULL;
+  }
+  if (type != ZOO_SESSION_EVENT) {
+    /* Fired: zookeeper dropped its copy of the watch. The entry is
+     * kept until the subscribers have been called. */
+    entry->held = 0;
+    if (subs == NULL)
+      zkocaml_watch_release(entry);
+    else
+      entry->inflight++;
+  }
+  pthread_mutex_unlock(&entry->registry->lock);
+  if (subs == NULL) return;
+
   zkocaml_enter_callback();
   CAMLparam0();
 
-  CAMLlocal1(completion_callback);
-  CAMLlocal3(local_rc, local_strings, local_data);
-
-  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_strings = zkocaml_build_strings_struct(strings);
-  local_data = caml_copy_string(ctx->data);
+  CAMLlocal5(zh, local_zh, local_type, local_state, local_path);
+  CAMLlocal2(local_watcher_ctx, local_sub_path);
+  CAMLlocalN(args, 5);
 
-  callback3(completion_callback, local_rc, local_strings, local_data);
+  zh = ((zkocaml_watcher_context_t *) zoo_get_context(zhandle))->zh;
+  if (!zkocaml_handle_struct_val(zh)) goto skip;
 
-  caml_remove_generational_global_root(&(ctx->completion_callback));
+  local_zh = zkocaml_copy_zh(zh);
+  local_type = zkocaml_enum_event_c2ml(type);
+  local_state = zkocaml_enum_state_c2ml(state);
+  for (sub = subs; sub != NULL; sub = sub->next)
+    if (!Is_block(sub->interned) && !Is_block(sub->zh)) { local_path = caml_copy_string(path); break; }
+
+  for (sub = subs; sub != NULL; sub = sub->next) {
+    local_watcher_ctx = caml_copy_string(sub->watcher_ctx);
+    if (Is_block(sub->interned))
+      local_sub_path = sub->interned;
+    else if (Is_block(sub->zh))
+      local_sub_path = caml_copy_string(zkocaml_ns_strip(path, sub->strip));
+    else
+      local_sub_path = local_path;
+    Store_field(args, 0, Is_block(sub->zh) ? sub->zh : local_zh);
+    Store_field(args, 1, local_type);
+    Store_field(args, 2, local_state);
+    Store_field(args, 3, local_sub_path);
+    Store_field(args, 4, local_watcher_ctx);
+    zkocaml_log_result(caml_callbackN_exn(sub->watcher_callback, 5, args));
+  }
+  zkocaml_destroy_handle(zh, 0);
 
+skip:
+  /* Session events do not consume the watch. */
+  if (type == ZOO_SESSION_EVENT) {
+    pthread_mutex_lock(&entry->registry->lock);
+    for (sub = subs; sub->next != NULL; sub = sub->next);
+    sub->next = entry->subs;
+    entry->subs = subs;
+    entry->count += count;
+    pthread_mutex_unlock(&entry->registry->lock);
+  } else {
+    zkocaml_watch_subs_free(subs);
+    zkocaml_watch_done(entry, 0, 0);
+  }
   CAMLdrop;
   zkocaml_leave_callback();
 }
 
 /**
- * Called when an asynchronous call that returns a list of strings
- * and a stat structure completes and dispatches user provided callback.
+ * Dispatch queues.
+ *
+ * The completions of a handle routed to a dispatch queue do not enter
+ * the runtime on the zookeeper completion thread: they copy what
+ * zookeeper passed in, queue it and return. The thread draining the
+ * queue (see zkocaml_route_run), typically one per domain, then runs
+ * the usual dispatch, in the order the completions came in. Watchers,
+ * expired deadlines and close callbacks are not routed.
  */
-static void
-strings_stat_completion_dispatch(int rc,
-                                 const struct String_vector *strings,
-                                 const struct Stat *stat,
-                                 const void *data)
-{
-  zkocaml_enter_callback();
-  CAMLparam0();
 
-  CAMLlocal1(completion_callback);
-  CAMLlocal4(local_rc, local_strings, local_stat, local_data);
-  CAMLlocalN(args, 4);
+#define ZkO_route_val(v) (*(zkocaml_route_t **)Data_custom_val(v))
 
-  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_strings = zkocaml_build_strings_struct(strings);
-  local_stat = zkocaml_build_stat_struct(stat);
-  local_data = caml_copy_string(ctx->data);
+/* The dispatch queue the current thread last drained. */
+static __thread zkocaml_route_t *zkocaml_route_drainer = NULL;
 
-  Store_field(args, 0, local_rc);
-  Store_field(args, 1, local_strings);
-  Store_field(args, 2, local_stat);
-  Store_field(args, 3, local_data);
+static void zkocaml_route_replay(zkocaml_routed_t *routed);
 
-  callbackN(completion_callback, 4, args);
+static zkocaml_route_t *
+zkocaml_route_hold(zkocaml_route_t *route)
+{
+  if (route != NULL) atomic_fetch_add(&route->refcount, 1);
+  return route;
+}
 
-  caml_remove_generational_global_root(&(ctx->completion_callback));
+static void
+zkocaml_routed_free(zkocaml_routed_t *routed)
+{
+  int i = 0;
 
-  CAMLdrop;
-  zkocaml_leave_callback();
+  if (routed->strings != NULL) {
+    for (i = 0; i < routed->strings->count; i++)
+      free(routed->strings->data[i]);
+    free(routed->strings->data);
+    free(routed->strings);
+  }
+  if (routed->acl != NULL) {
+    for (i = 0; i < routed->acl->count; i++) {
+      free(routed->acl->data[i].id.scheme);
+      free(routed->acl->data[i].id.id);
+    }
+    free(routed->acl->data);
+    free(routed->acl);
+  }
+  free(routed->stat);
+  free(routed->val);
+  free(routed);
 }
 
 /**
- * Called when an asynchronous call that returns a single string
- * completes and dispatches user provided callback.
+ * Drops a reference to @route, freeing it with the last one. Each
+ * queued completion holds one, so the queue is empty by then.
  */
 static void
-string_completion_dispatch(int rc,
-                           const char *val,
-                           const void *data)
+zkocaml_route_release(zkocaml_route_t *route)
 {
-  zkocaml_enter_callback();
-  CAMLparam0();
+  if (route == NULL || atomic_fetch_sub(&route->refcount, 1) > 1) return;
+  pthread_cond_destroy(&route->cond);
+  pthread_mutex_destroy(&route->lock);
+  free(route);
+}
 
-  CAMLlocal1(completion_callback);
-  CAMLlocal3(local_rc, local_val, local_data);
+/**
+ * Raises the exception a replayed callback raised on this thread, if
+ * any, unless still replaying: the outer replay raises it then. It is
+ * logged on a thread it cannot be raised on.
+ */
+static void
+zkocaml_replay_raise(void)
+{
+  value exn = zkocaml_replay_exn;
 
-  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  if (val != NULL)
-      local_val = caml_copy_string(val);
+  if (exn == Val_unit || zkocaml_replaying) return;
+  caml_remove_generational_global_root(&zkocaml_replay_exn);
+  zkocaml_replay_exn = Val_unit;
+  if (zkocaml_foreign)
+    zkocaml_log_exn(exn);
   else
-      local_val = caml_alloc_string(0);
-  local_data = caml_copy_string(ctx->data);
+    caml_raise(exn);
+}
 
-  callback3(completion_callback, local_rc, local_val, local_data);
+/**
+ * Runs on the calling thread, in order, the completions queued on
+ * @route for @window, or all of them if @window is NULL: those of a
+ * handle leaving the queue, or of a queue nobody drains any more. An
+ * exception a callback raises is kept for zkocaml_replay_raise.
+ */
+static void
+zkocaml_route_flush(zkocaml_route_t *route, zkocaml_window_t *window)
+{
+  zkocaml_routed_t *routed = NULL, *prev = NULL;
+  int replaying = zkocaml_replaying;
 
-  caml_remove_generational_global_root(&(ctx->completion_callback));
+  if (route == NULL) return;
+  zkocaml_enter_callback();
+  zkocaml_replaying = 1;
+  for (;;) {
+    pthread_mutex_lock(&route->lock);
+    prev = NULL;
+    for (routed = route->head; routed != NULL; routed = routed->next) {
+      if (window == NULL || routed->ctx->window == window) break;
+      prev = routed;
+    }
+    if (routed != NULL) {
+      if (prev != NULL)
+        prev->next = routed->next;
+      else
+        route->head = routed->next;
+      if (route->tail == routed) route->tail = prev;
+      route->pending--;
+      route->dispatched++;
+    }
+    pthread_mutex_unlock(&route->lock);
+    if (routed == NULL) break;
 
-  CAMLdrop;
+    zkocaml_route_replay(routed);
+    zkocaml_routed_free(routed);
+    zkocaml_route_release(route);
+  }
+  zkocaml_replaying = replaying;
   zkocaml_leave_callback();
 }
 
 /**
- * Called when an asynchronous call that returns a list of ACLs
- * completes and dispatches user provided callback.
+ * Copies a completion of @ctx (the waiters of a coalesced read if
+ * @flight) to the dispatch queue its handle is routed to and returns
+ * 1, or returns 0 if it must be dispatched right away: the handle is
+ * not routed, its queue is closed, or this is the replay itself.
+ */
+static int
+zkocaml_route_defer(zkocaml_completion_context_t *ctx,
+                    ZKOCAML_COMPLETION_KIND kind,
+                    int flight,
+                    int rc,
+                    const char *val,
+                    int val_len,
+                    const struct Stat *stat,
+                    const struct String_vector *strings,
+                    const struct ACL_vector *acl)
+{
+  zkocaml_window_t *window = ctx != NULL ? ctx->window : NULL;
+  zkocaml_route_t *route = NULL, *orphaned = NULL;
+  zkocaml_routed_t *routed = NULL;
+  int i = 0, queued = 0;
+
+  if (window == NULL || zkocaml_replaying) return 0;
+  pthread_mutex_lock(&window->lock);
+  route = window->route;
+  if (route != NULL) {
+    pthread_mutex_lock(&route->lock);
+    if (route->orphaned && route->head != NULL)
+      orphaned = zkocaml_route_hold(route);
+    pthread_mutex_unlock(&route->lock);
+  }
+  pthread_mutex_unlock(&window->lock);
+  if (orphaned != NULL) {
+    /* Nobody drains it any more: run what it holds, then this one. */
+    zkocaml_route_flush(orphaned, NULL);
+    zkocaml_route_release(orphaned);
+    if (zkocaml_replay_exn != Val_unit) {
+      zkocaml_enter_callback();
+      zkocaml_replay_raise();
+      zkocaml_leave_callback();
+    }
+    return 0;
+  }
+  if (route == NULL) return 0;
+
+  routed = (zkocaml_routed_t *)calloc(1, sizeof(zkocaml_routed_t));
+  routed->kind = kind;
+  routed->flight = flight;
+  routed->ctx = ctx;
+  routed->rc = rc;
+  routed->val_len = val_len;
+  if (val != NULL && kind == ZKOCAML_COMPLETION_DATA) {
+    routed->val = (char *)malloc(val_len > 0 ? val_len : 1);
+    if (val_len > 0) memcpy(routed->val, val, val_len);
+  } else if (val != NULL) {
+    routed->val = strdup(val);
+  }
+  if (stat != NULL) {
+    routed->stat = (struct Stat *)malloc(sizeof(struct Stat));
+    memcpy(routed->stat, stat, sizeof(struct Stat));
+  }
+  if (strings != NULL) {
+    routed->strings = (struct String_vector *)malloc(sizeof(struct String_vector));
+    routed->strings->count = strings->count;
+    routed->strings->data = (char **)calloc(strings->count + 1, sizeof(char *));
+    for (i = 0; i < strings->count; i++)
+      routed->strings->data[i] = strdup(strings->data[i]);
+  }
+  if (acl != NULL) {
+    routed->acl = (struct ACL_vector *)malloc(sizeof(struct ACL_vector));
+    routed->acl->count = acl->count;
+    routed->acl->data = (struct ACL *)calloc(acl->count + 1, sizeof(struct ACL));
+    for (i = 0; i < acl->count; i++) {
+      routed->acl->data[i].perms = acl->data[i].perms;
+      routed->acl->data[i].id.scheme = strdup(acl->data[i].id.scheme);
+      routed->acl->data[i].id.id = strdup(acl->data[i].id.id);
+    }
+  }
+
+  /* An expiry takes no slot: the late completion releases it. */
+  for (; ctx != NULL && kind != ZKOCAML_COMPLETION_EXPIRED; ctx = flight ? ctx->next : NULL)
+    if (ctx->window != NULL) routed->lent++;
+
+  /* The route may have been changed or closed while copying. */
+  pthread_mutex_lock(&window->lock);
+  route = window->route;
+  if (route != NULL) {
+    pthread_mutex_lock(&route->lock);
+    if (!route->closed) {
+      if (route->tail != NULL)
+        route->tail->next = routed;
+      else
+        route->head = routed;
+      route->tail = routed;
+      route->routed++;
+      route->pending++;
+      zkocaml_route_hold(route);
+      pthread_cond_signal(&route->cond);
+      queued = 1;
+    }
+    pthread_mutex_unlock(&route->lock);
+  }
+  if (queued) {
+    /* The slots stay taken until the replay, but the thread draining
+     * the queue may count them free: see zkocaml_window_full. */
+    window->parked += routed->lent;
+    pthread_cond_broadcast(&window->cond);
+  }
+  pthread_mutex_unlock(&window->lock);
+
+  if (!queued) zkocaml_routed_free(routed);
+  return queued;
+}
+
+static void route_finalize (value v) {
+  zkocaml_route_t *route = ZkO_route_val(v);
+
+  /* What is still queued is run by the next completion routed to it,
+   * or when its handle is freed. */
+  pthread_mutex_lock(&route->lock);
+  route->closed = 1;
+  route->orphaned = 1;
+  pthread_cond_broadcast(&route->cond);
+  pthread_mutex_unlock(&route->lock);
+  zkocaml_route_release(route);
+}
+
+static struct custom_operations route_ops = {
+  "zkocaml.route",
+  route_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+/**
+ * In-flight window.
+ *
+ * Every async call takes a slot of the window of its handle before it
+ * is submitted and gives it back once its completion is dispatched.
+ * With a limit set, a call finding the window full either waits for a
+ * slot with the runtime released, fails with ZKOCAML_THROTTLED, or is
+ * parked in a bounded queue of thunks that completions drain in order.
  */
+
+static zkocaml_window_t *
+zkocaml_window_new(void)
+{
+  zkocaml_window_t *window = (zkocaml_window_t *)
+      calloc(1, sizeof(zkocaml_window_t));
+  pthread_mutex_init(&window->lock, NULL);
+  pthread_cond_init(&window->cond, NULL);
+  window->mode = ZKOCAML_WINDOW_BLOCK;
+  return window;
+}
+
 static void
-acl_completion_dispatch(int rc,
-                        struct ACL_vector *acl,
-                        struct Stat *stat,
-                        const void *data)
+zkocaml_window_free(zkocaml_window_t *window)
 {
-  zkocaml_enter_callback();
-  CAMLparam0();
+  zkocaml_deferred_t *deferred = NULL, *next = NULL;
+  if (window == NULL) return;
+  /* Run what is still queued for it, while it is there to release. */
+  zkocaml_route_flush(window->route, window);
+  for (deferred = window->queue_head; deferred != NULL; deferred = next) {
+    next = deferred->next;
+    caml_remove_generational_global_root(&deferred->thunk);
+    free(deferred);
+  }
+  zkocaml_route_release(window->route);
+  pthread_cond_destroy(&window->cond);
+  pthread_mutex_destroy(&window->lock);
+  free(window);
+}
 
-  CAMLlocal1(completion_callback);
-  CAMLlocal4(local_rc, local_acl, local_stat, local_data);
-  CAMLlocalN(args, 4);
+static int
+zkocaml_window_full(zkocaml_window_t *window)
+{
+  int inflight = window->inflight;
+
+  if (window->limit <= 0) return 0;
+  /* Only the thread draining the queue can free the slots of the
+   * completions parked there: it must not wait on them. */
+  if (window->route != NULL && window->route == zkocaml_route_drainer)
+    inflight -= window->parked;
+  if (inflight >= window->limit) return 1;
+  /* Keep FIFO order: parked calls go first unless being drained. */
+  return window->queue_len > 0 && !window->draining;
+}
 
-  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_acl = zkocaml_build_acls_struct(acl);
-  local_stat = zkocaml_build_stat_struct(stat);
-  local_data = caml_copy_string(ctx->data);
+/* The window whose freed slot was handed to the parked call being
+ * resubmitted on this thread, see zkocaml_window_drain. */
+static __thread zkocaml_window_t *zkocaml_window_handed = NULL;
 
-  Store_field(args, 0, local_rc);
-  Store_field(args, 1, local_acl);
-  Store_field(args, 2, local_stat);
-  Store_field(args, 3, local_data);
+/**
+ * Takes a slot of @window for a call about to be submitted. Returns
+ * ZOK, or ZKOCAML_THROTTLED if the window is full and the call must
+ * not wait. A blocking wait is skipped from within a dispatch, where
+ * it could only be ended by the very thread that waits: the call then
+ * takes a slot over the limit.
+ */
+static int
+zkocaml_window_acquire(zkocaml_window_t *window)
+{
+  int rc = ZOK;
+
+  pthread_mutex_lock(&window->lock);
+  if (zkocaml_window_handed == window) {
+    /* Resubmitting a parked call: its slot is already taken. */
+    zkocaml_window_handed = NULL;
+    window->submitted++;
+    pthread_mutex_unlock(&window->lock);
+    return ZOK;
+  }
+  while (zkocaml_window_full(window)) {
+    if (window->mode != ZKOCAML_WINDOW_BLOCK) {
+      window->throttled++;
+      rc = ZKOCAML_THROTTLED;
+      break;
+    }
+    if (zkocaml_dispatching) break;
+    pthread_mutex_unlock(&window->lock);
+    caml_enter_blocking_section();
+    pthread_mutex_lock(&window->lock);
+    while (window->mode == ZKOCAML_WINDOW_BLOCK && zkocaml_window_full(window))
+      pthread_cond_wait(&window->cond, &window->lock);
+    pthread_mutex_unlock(&window->lock);
+    caml_leave_blocking_section();
+    pthread_mutex_lock(&window->lock);
+  }
+  if (rc == ZOK) {
+    window->inflight++;
+    window->submitted++;
+  }
+  pthread_mutex_unlock(&window->lock);
 
-  callbackN(completion_callback, 4, args);
+  return rc;
+}
 
-  caml_remove_generational_global_root(&(ctx->completion_callback));
+static void
+zkocaml_window_release(zkocaml_window_t *window)
+{
+  if (window == NULL) return;
+  pthread_mutex_lock(&window->lock);
+  window->inflight--;
+  window->completed++;
+  pthread_cond_signal(&window->cond);
+  pthread_mutex_unlock(&window->lock);
+}
 
-  CAMLdrop;
-  zkocaml_leave_callback();
+/**
+ * Gives back a slot taken for a call that was not submitted after all.
+ */
+static void
+zkocaml_window_cancel(zkocaml_window_t *window)
+{
+  pthread_mutex_lock(&window->lock);
+  window->inflight--;
+  window->submitted--;
+  pthread_cond_signal(&window->cond);
+  pthread_mutex_unlock(&window->lock);
 }
 
 /**
- * Create a handle to used communicate with zookeeper.
- *
- * This method creates a new handle and a zookeeper session that corresponds
- * to that handle. Session establishment is asynchronous, meaning that the
- * session should not be considered established until (and unless) an
- * event of state ZOO_CONNECTED_STATE is received.
- *
- * @host Comma separated host:port pairs, each corresponding to a zk
- *   server. e.g. "127.0.0.1:3000,127.0.0.1:3001,127.0.0.1:3002"
- *
- * @watcher_callback The global watcher callback function. When notifications are
- *   triggered this function will be invoked.
- *
- * @clientid The id of a previously established session that this
- *   client will be reconnecting to. Pass 0 if not reconnecting to a previous
- *   session. Clients can access the session id of an established, valid,
- *   connection by calling zoo_client_id. If the session corresponding to
- *   the specified clientid has expired, or if the clientid is invalid for
- *   any reason, the returned zhandle_t will be invalid -- the zhandle_t
- *   state will indicate the reason for failure (typically
- *   ZOO_EXPIRED_SESSION_STATE).
- *
- * @context The handback object that will be associated with this instance
- *   of zhandle_t. Application can access it (for example, in the watcher
- *   callback) using zoo_get_context. The object is not used by zookeeper
- *   internally and can be null.
- *
- * @flags Reserved for future use. Should be set to zero.
- *
- * @return A pointer to the opaque zhandle structure. If it fails to create
- * a new zhandle the function returns NULL and the errno variable indicates
- * the reason.
+ * Resubmits parked calls while @window has free slots. Must be called
+ * with the runtime held. Each freed slot is handed to the call at the
+ * head of the queue, so that new callers cannot take it first and
+ * have the parked call fail with ZKOCAML_THROTTLED; if the call does
+ * not take it, the slot is given back.
  */
-
-CAMLprim value
-zkocaml_init_native(value host,
-                    value watcher_callback,
-                    value recv_timeout,
-                    value clientid,
-                    value context,
-                    value flag)
+static void
+zkocaml_window_drain(zkocaml_window_t *window)
 {
-  CAMLparam5(host, watcher_callback, recv_timeout, clientid, context);
-  CAMLxparam1(flag);
-  CAMLlocal1(zh);
+  CAMLparam0();
+  CAMLlocal2(thunk, res);
 
-  const char *local_host = String_val(host);
-  int local_recv_timeout = Long_val(recv_timeout);
-  clientid_t *cid = NULL;
-  zh = caml_alloc_custom(&handle_ops,sizeof(zkocaml_handle_t*),1,100000);
+  if (window == NULL) CAMLreturn0;
+  for (;;) {
+    zkocaml_deferred_t *deferred = NULL;
 
-  zkocaml_watcher_context_t *ctx = make_watcher_context(context, watcher_callback, PERMANENT, zh);;
+    pthread_mutex_lock(&window->lock);
+    deferred = window->queue_head;
+    if (deferred == NULL
+        || (window->limit > 0 && window->inflight >= window->limit)) {
+      pthread_mutex_unlock(&window->lock);
+      break;
+    }
+    window->queue_head = deferred->next;
+    if (window->queue_head == NULL) window->queue_tail = NULL;
+    window->queue_len--;
+    window->draining++;
+    window->inflight++;
+    pthread_mutex_unlock(&window->lock);
+
+    thunk = deferred->thunk;
+    caml_remove_generational_global_root(&deferred->thunk);
+    free(deferred);
+    zkocaml_window_handed = window;
+    res = caml_callback_exn(thunk, Val_unit);
+
+    pthread_mutex_lock(&window->lock);
+    if (zkocaml_window_handed == window) {
+      zkocaml_window_handed = NULL;
+      window->inflight--;
+      pthread_cond_signal(&window->cond);
+    }
+    window->draining--;
+    pthread_mutex_unlock(&window->lock);
+    zkocaml_callback_result(res);
+  }
 
-  cid = zkocaml_parse_clientid(clientid);
-  zhandle_t *zhandle = zookeeper_init(local_host, watcher_dispatch, local_recv_timeout, cid, ctx, 0);
+  CAMLreturn0;
+}
 
-  zkocaml_handle_t* handle = (zkocaml_handle_t*) malloc(sizeof(zkocaml_handle_t));
-  handle->refcount = (atomic_int*) malloc(sizeof(atomic_int));
-  atomic_init(handle->refcount,1);
-  handle->zhandle = zhandle;
-  ZkO_handle_val(zh) = handle;
+/**
+ * Deadlines.
+ *
+ * An async call issued while the calling thread has a deadline set
+ * (see zkocaml_set_call_deadline) is armed on a timer wheel shared by
+ * every handle. If the deadline passes first, the timer thread
+ * completes the call with ZOPERATIONTIMEOUT and the late completion
+ * from zookeeper is dropped; otherwise the completion disarms it.
+ * Whoever moves the context out of ARMED, under the wheel lock,
+ * delivers the result.
+ */
 
-  CAMLreturn(zh);
+#define ZKOCAML_TIMER_TICK_MS 10
+#define ZKOCAML_TIMER_SLOTS 512
+
+static __thread int64_t zkocaml_call_deadline = 0;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int started;
+  size_t armed;
+  int64_t tick;
+  zkocaml_completion_context_t *slots[ZKOCAML_TIMER_SLOTS];
+} zkocaml_timer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int64_t
+zkocaml_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-CAMLprim value
-zkocaml_init_bytecode(value *argv, int argn)
+static void
+zkocaml_timer_unlink(zkocaml_completion_context_t *ctx)
 {
-  return zkocaml_init_native(argv[0], argv[1], argv[2],
-                             argv[3], argv[4], argv[5]);
+  if (ctx->timer_prev != NULL)
+    ctx->timer_prev->timer_next = ctx->timer_next;
+  else
+    zkocaml_timer.slots[ctx->timer_slot] = ctx->timer_next;
+  if (ctx->timer_next != NULL)
+    ctx->timer_next->timer_prev = ctx->timer_prev;
+  ctx->timer_prev = ctx->timer_next = NULL;
+  zkocaml_timer.armed--;
 }
 
 /**
- * Close the zookeeper handle and free up any resources.
- *
- * After this call, the client session will no longer be valid. The function
- * will flush any outstanding send requests before return. As a result it may
- * block.
- *
- * This method should only be called only once on a zookeeper handle. Calling
- * twice will cause undefined (and probably undesirable behavior). Calling any other
- * zookeeper method after calling close is undefined behaviour and should be avoided.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @return a result code. Regardless of the error code returned, the zhandle
- * will be destroyed and all resources freed.
- *   ZOK - success
- *   ZBADARGUMENTS - invalid input parameters
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
- *   ZOPERATIONTIMEOUT - failed to flush the buffers within the specified timeout.
- *   ZCONNECTIONLOSS - a network error occured while attempting to send request to server
- *   ZSYSTEMERROR -- a system (OS) error occured; it's worth checking errno to get details
+ * Returns the first armed context whose deadline is not after @now,
+ * looking at the slots of the ticks up to @tick that have not been
+ * swept yet. The wheel lock must be held.
  */
-
-CAMLprim value
-zkocaml_close(value zh)
+static zkocaml_completion_context_t *
+zkocaml_timer_due(int64_t now, int64_t tick)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
-  result = zkocaml_destroy_handle(zh);
-  CAMLreturn(result);
+  int64_t t = zkocaml_timer.tick + 1;
+  if (tick - t >= ZKOCAML_TIMER_SLOTS) t = tick - ZKOCAML_TIMER_SLOTS + 1;
+  for (; t <= tick; t++) {
+    zkocaml_completion_context_t *ctx = zkocaml_timer.slots[t % ZKOCAML_TIMER_SLOTS];
+    for (; ctx != NULL; ctx = ctx->timer_next)
+      if (ctx->deadline <= now) return ctx;
+  }
+  return NULL;
 }
 
 /**
- * Return the client session id, only valid if the connections
- * is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE)
+ * Frees @ctx once its completion is done with it: dispatched, or on
+ * the wheel alone. By then a deadline it had either fired or was
+ * disarmed, so that the timer no longer refers to it.
  */
-CAMLprim value
-zkocaml_client_id(value zh)
+static void
+zkocaml_completion_free(zkocaml_completion_context_t *ctx)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
-
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE(handle, zkocaml_build_dummy_client_id_struct());
-
-  const clientid_t *cid = zoo_client_id(handle);
-  result = zkocaml_build_client_id_struct(cid);
+  caml_remove_generational_global_root(&(ctx->completion_callback));
+  free(ctx->data);
+  free(ctx);
+}
 
-  CAMLreturn(result);
+/**
+ * Queues the expiry of @ctx to the dispatch queue its handle is routed
+ * to, if any, and returns 1. What is queued is a copy of @ctx, which
+ * the late completion frees meanwhile.
+ */
+static int
+zkocaml_deadline_route(zkocaml_completion_context_t *ctx)
+{
+  zkocaml_completion_context_t *copy = NULL;
+
+  if (ctx->window == NULL || zkocaml_replaying) return 0;
+  copy = (zkocaml_completion_context_t *)calloc(1, sizeof(zkocaml_completion_context_t));
+  copy->data = ctx->data != NULL ? strdup(ctx->data) : NULL;
+  copy->completion_callback = ctx->completion_callback;
+  caml_register_generational_global_root(&(copy->completion_callback));
+  copy->window = ctx->window;
+  copy->strip = ctx->strip;
+  copy->kind = ctx->kind;
+  if (zkocaml_route_defer(copy, ZKOCAML_COMPLETION_EXPIRED, 0, ZOPERATIONTIMEOUT,
+                          NULL, 0, NULL, NULL, NULL))
+    return 1;
+  zkocaml_completion_free(copy);
+  return 0;
 }
 
 /**
- * Return the timeout for this session, only valid if the connections
- * is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE). This
- * value may change after a server re-connect.
+ * Completes @ctx with ZOPERATIONTIMEOUT and empty results, as the
+ * dispatch of its kind would, on the dispatch queue of its handle if
+ * routed. Called with the runtime held.
  */
-CAMLprim value
-zkocaml_recv_timeout(value zh)
+static void
+zkocaml_deadline_expire(zkocaml_completion_context_t *ctx)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
+  CAMLparam0();
+  CAMLlocal5(completion_callback, local_rc, local_empty, local_stat, local_data);
+  CAMLlocalN(args, 5);
 
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE(handle,Val_int(-1));
+  completion_callback = ctx->completion_callback;
+  if (ctx->kind == ZKOCAML_COMPLETION_THUNK) {
+    /* Scheduled by zkocaml_retry_after, owned by the wheel alone. */
+    zkocaml_completion_free(ctx);
+    zkocaml_callback1(completion_callback, Val_unit);
+    CAMLreturn0;
+  }
+  if (zkocaml_deadline_route(ctx)) CAMLreturn0;
+  local_rc = zkocaml_enum_error_c2ml(ZOPERATIONTIMEOUT);
+  local_empty = caml_alloc_string(0);
+  local_stat = zkocaml_build_stat_struct(NULL);
+  local_data = caml_copy_string(ctx->data);
 
-  int recv_timeout = zoo_recv_timeout(handle);
-  result = Val_int(recv_timeout);
+  switch (ctx->kind) {
+  case ZKOCAML_COMPLETION_VOID:
+    zkocaml_callback2(completion_callback, local_rc, local_data);
+    break;
+  case ZKOCAML_COMPLETION_STAT:
+    zkocaml_callback3(completion_callback, local_rc, local_stat, local_data);
+    break;
+  case ZKOCAML_COMPLETION_DATA:
+    args[0] = local_rc;
+    args[1] = local_empty;
+    args[2] = Val_int(0);
+    args[3] = local_stat;
+    args[4] = local_data;
+    zkocaml_callbackN(completion_callback, 5, args);
+    break;
+  case ZKOCAML_COMPLETION_STRINGS:
+    zkocaml_callback3(completion_callback, local_rc, Atom(0), local_data);
+    break;
+  case ZKOCAML_COMPLETION_STRINGS_STAT:
+  case ZKOCAML_COMPLETION_ACL:
+    args[0] = local_rc;
+    args[1] = Atom(0);
+    args[2] = local_stat;
+    args[3] = local_data;
+    zkocaml_callbackN(completion_callback, 4, args);
+    break;
+  case ZKOCAML_COMPLETION_STRING:
+    zkocaml_callback3(completion_callback, local_rc, local_empty, local_data);
+    break;
+  case ZKOCAML_COMPLETION_STRING_STAT:
+    args[0] = local_rc;
+    args[1] = local_empty;
+    args[2] = local_stat;
+    args[3] = local_data;
+    zkocaml_callbackN(completion_callback, 4, args);
+    break;
+  case ZKOCAML_COMPLETION_MULTI:
+    /* The multi itself is freed by the late completion. */
+    zkocaml_callback3(completion_callback, local_rc, Atom(0), local_data);
+    break;
+  case ZKOCAML_COMPLETION_THUNK:
+  case ZKOCAML_COMPLETION_EXPIRED:
+    break;
+  }
 
-  CAMLreturn(result);
+  CAMLreturn0;
 }
 
 /**
- * Return the context for this handle.
+ * Sweeps the wheel up to now. Contexts are fired one at a time with
+ * the runtime held, so that a completion racing with the timer cannot
+ * free one between its firing and its expiry.
  */
-CAMLprim value
-zkocaml_get_context(value zh)
+static void
+zkocaml_timer_sweep(void)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
+  int64_t now = zkocaml_now_ms();
+  int64_t tick = now / ZKOCAML_TIMER_TICK_MS;
+  zkocaml_completion_context_t *ctx = NULL;
 
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle,caml_copy_string(""));
+  pthread_mutex_lock(&zkocaml_timer.lock);
+  ctx = zkocaml_timer_due(now, tick);
+  if (ctx == NULL) zkocaml_timer.tick = tick;
+  pthread_mutex_unlock(&zkocaml_timer.lock);
+  if (ctx == NULL) return;
 
-  zkocaml_watcher_context_t *ctx = (zkocaml_watcher_context_t*) zoo_get_context(handle);
-  result = caml_copy_string((char*)ctx->watcher_ctx);
+  zkocaml_enter_callback();
+  for (;;) {
+    pthread_mutex_lock(&zkocaml_timer.lock);
+    ctx = zkocaml_timer_due(now, tick);
+    if (ctx != NULL) {
+      zkocaml_timer_unlink(ctx);
+      ctx->deadline_state = ZKOCAML_DEADLINE_FIRED;
+    } else {
+      zkocaml_timer.tick = tick;
+    }
+    pthread_mutex_unlock(&zkocaml_timer.lock);
+    if (ctx == NULL) break;
+    zkocaml_deadline_expire(ctx);
+  }
+  zkocaml_leave_callback();
+}
 
-  CAMLreturn(result);
+static void *
+zkocaml_timer_loop(void *arg)
+{
+  struct timespec ts = { 0, ZKOCAML_TIMER_TICK_MS * 1000000L };
+  (void)arg;
+
+  for (;;) {
+    pthread_mutex_lock(&zkocaml_timer.lock);
+    while (zkocaml_timer.armed == 0)
+      pthread_cond_wait(&zkocaml_timer.cond, &zkocaml_timer.lock);
+    pthread_mutex_unlock(&zkocaml_timer.lock);
+    nanosleep(&ts, NULL);
+    zkocaml_timer_sweep();
+  }
+  return NULL;
 }
 
 /**
- * Set the context for this handle.
+ * Puts @ctx on the wheel to fire at @deadline. Returns 0 if the timer
+ * thread could not be started.
  */
-CAMLprim value
-zkocaml_set_context(value zh, value context)
+static int
+zkocaml_timer_arm(zkocaml_completion_context_t *ctx, int64_t deadline)
 {
-  CAMLparam2(zh, context);
-
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle,Val_unit);
+  int64_t tick = 0;
+
+  pthread_mutex_lock(&zkocaml_timer.lock);
+  if (!zkocaml_timer.started) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, zkocaml_timer_loop, NULL) == 0)
+      zkocaml_timer.started = 1;
+    pthread_attr_destroy(&attr);
+    if (!zkocaml_timer.started) {
+      pthread_mutex_unlock(&zkocaml_timer.lock);
+      return 0;
+    }
+  }
+  if (zkocaml_timer.armed == 0)
+    zkocaml_timer.tick = zkocaml_now_ms() / ZKOCAML_TIMER_TICK_MS;
+  /* A deadline already due goes in the next slot to be swept. */
+  tick = deadline / ZKOCAML_TIMER_TICK_MS;
+  if (tick <= zkocaml_timer.tick) tick = zkocaml_timer.tick + 1;
+
+  ctx->deadline = deadline;
+  ctx->deadline_state = ZKOCAML_DEADLINE_ARMED;
+  ctx->timer_slot = tick % ZKOCAML_TIMER_SLOTS;
+  ctx->timer_prev = NULL;
+  ctx->timer_next = zkocaml_timer.slots[ctx->timer_slot];
+  if (ctx->timer_next != NULL) ctx->timer_next->timer_prev = ctx;
+  zkocaml_timer.slots[ctx->timer_slot] = ctx;
+  if (zkocaml_timer.armed++ == 0) pthread_cond_signal(&zkocaml_timer.cond);
+  pthread_mutex_unlock(&zkocaml_timer.lock);
 
-  zkocaml_watcher_context_t *ctx = (zkocaml_watcher_context_t*) zoo_get_context(handle);
-  ctx->watcher_ctx = String_val(context);
+  return 1;
+}
 
-  CAMLreturn(Val_unit);
+/**
+ * Arms @ctx with the deadline of the calling thread, if any. Must be
+ * called before the request is submitted, as it may complete at once.
+ */
+static void
+zkocaml_deadline_arm(zkocaml_completion_context_t *ctx,
+                     ZKOCAML_COMPLETION_KIND kind)
+{
+  ctx->kind = kind;
+  if (zkocaml_call_deadline != 0) zkocaml_timer_arm(ctx, zkocaml_call_deadline);
 }
 
 /**
- * Set a watcher function
- * @return previous watcher function
+ * Takes @ctx off the wheel. Returns 0 if its deadline already fired,
+ * in which case the caller must not deliver the result.
  */
-CAMLprim value
-zkocaml_set_watcher(value zh, value watcher_callback)
+static int
+zkocaml_deadline_disarm(zkocaml_completion_context_t *ctx)
 {
-  CAMLparam2(zh, watcher_callback);
-  int not_implemented;
-  // TODO: implement this later.
-  CAMLreturn(Val_unit);
+  int delivered = 0;
+
+  if (ctx->deadline_state == ZKOCAML_DEADLINE_NONE) return 1;
+  pthread_mutex_lock(&zkocaml_timer.lock);
+  if (ctx->deadline_state == ZKOCAML_DEADLINE_ARMED) {
+    zkocaml_timer_unlink(ctx);
+    ctx->deadline_state = ZKOCAML_DEADLINE_DONE;
+  }
+  delivered = ctx->deadline_state == ZKOCAML_DEADLINE_FIRED;
+  pthread_mutex_unlock(&zkocaml_timer.lock);
+
+  return !delivered;
 }
 
 /**
- * Returns the socket address for the current connection
- *
- * @return socket address of the connected host or NULL on failure, only valid if the
- * connection is current connected
+ * Undoes the setup of an async call that could not be submitted: no
+ * completion will come to free @ctx. Its slot is given back to the
+ * parked calls, if any. Called with the runtime held.
  */
-CAMLprim value
-zkocaml_get_connected_host(value zh)
+static void
+zkocaml_completion_abort(zkocaml_completion_context_t *ctx)
 {
-  CAMLparam1(zh);
-  int not_implemented;
-  // TODO: implement this later.
-  CAMLreturn(Val_unit);
+  zkocaml_window_t *window = ctx->window;
+
+  if (window != NULL) zkocaml_window_cancel(window);
+  zkocaml_deadline_disarm(ctx);
+  zkocaml_completion_free(ctx);
+  zkocaml_window_drain(window);
 }
 
 /**
- * Get the state of the zookeeper connection.
+ * Retry policy.
  *
- * The return value will be one of the state consts.
+ * The OCaml wrappers of idempotent calls ask zkocaml_retry_next how
+ * long to back off before retrying a call that failed with
+ * ZCONNECTIONLOSS, or whether to give up. Retries are disabled until
+ * a policy is set.
  */
-CAMLprim value
-zkocaml_state(value zh)
+
+static zkocaml_retry_t *
+zkocaml_retry_new(void)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(state);
+  zkocaml_retry_t *retry = (zkocaml_retry_t *)
+      calloc(1, sizeof(zkocaml_retry_t));
+  pthread_mutex_init(&retry->lock, NULL);
+  retry->seed = (uint64_t)zkocaml_now_ms() ^ (uint64_t)(uintptr_t)retry;
+  if (retry->seed == 0) retry->seed = 1;
+  return retry;
+}
 
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+static void
+zkocaml_retry_free(zkocaml_retry_t *retry)
+{
+  if (retry == NULL) return;
+  pthread_mutex_destroy(&retry->lock);
+  free(retry);
+}
 
-  state = zoo_state(handle);
+/**
+ * Returns the backoff in milliseconds before retry number @attempt
+ * (from 0) of an @op call, or -1 if it must not be retried. The lock
+ * of @retry must be held.
+ */
+static int64_t
+zkocaml_retry_next(zkocaml_retry_t *retry, ZKOCAML_RETRY_OP op, int attempt)
+{
+  int64_t now = zkocaml_now_ms();
+  int64_t cap = retry->base_ms;
 
-  CAMLreturn(state);
+  if (retry->max_attempts <= 0) return -1;
+  if (attempt >= retry->max_attempts) {
+    retry->given_up[op]++;
+    return -1;
+  }
+  if (retry->budget > 0) {
+    retry->tokens += (double)(now - retry->refilled) * retry->budget / 1000.0;
+    if (retry->tokens > retry->budget) retry->tokens = retry->budget;
+    retry->refilled = now;
+    if (retry->tokens < 1.0) {
+      retry->given_up[op]++;
+      return -1;
+    }
+    retry->tokens -= 1.0;
+  }
+  while (attempt-- > 0 && cap < retry->max_ms) cap *= 2;
+  if (cap > retry->max_ms) cap = retry->max_ms;
+  retry->retries[op]++;
+
+  /* xorshift64*, full jitter over [0, cap] */
+  retry->seed ^= retry->seed >> 12;
+  retry->seed ^= retry->seed << 25;
+  retry->seed ^= retry->seed >> 27;
+  return cap > 0 ? (int64_t)((retry->seed * 2685821657736338717ULL) % (uint64_t)(cap + 1)) : 0;
 }
 
 /**
- * Create a node.
- *
- * This method will create a node in ZooKeeper. A node can only be created if
- * it does not already exists. The Create Flags affect the creation of nodes.
- * If ZOO_EPHEMERAL flag is set, the node will automatically get removed if the
- * client session goes away. If the ZOO_SEQUENCE flag is set, a unique
- * monotonically increasing sequence number is appended to the path name. The
- * sequence number is always fixed length of 10 digits, 0 padded.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @path The name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @value The data to be stored in the node.
- *
- * @acl The initial ACL of the node. The ACL must not be null or empty.
- *
- * @flags this parameter can be set to 0 for normal create or an OR
- * of the Create Flags
- *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
- *   ZOK operation completed successfully
- *   ZNONODE the parent node does not exist.
- *   ZNODEEXISTS the node already exists
- *   ZNOAUTH the client does not have permission.
- *   ZNOCHILDRENFOREPHEMERALS cannot create children of ephemeral nodes.
- *
- * @data The data that will be passed to the completion routine when the
- * function completes.
+ * Read coalescing.
  *
- * @return ZOK on success or one of the following errcodes on failure:
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * When enabled on a handle, an aget, aexists or aget_children issued
+ * while an identical read (same path and watch flag) is still in
+ * flight does not go to the server: its completion context is queued
+ * on the pending read, and every waiter is completed with the result
+ * of that single request.
  */
 
-CAMLprim value
-zkocaml_acreate_native(value zh,
-                       value path,
+#define ZKOCAML_FLIGHT_BUCKETS 64
+
+static zkocaml_flight_table_t *
+zkocaml_flight_table_new(void)
+{
+  zkocaml_flight_table_t *table = (zkocaml_flight_table_t *)
+      malloc(sizeof(zkocaml_flight_table_t));
+  pthread_mutex_init(&table->lock, NULL);
+  table->enabled = 0;
+  table->nbuckets = ZKOCAML_FLIGHT_BUCKETS;
+  table->buckets = (zkocaml_flight_t **)
+      calloc(table->nbuckets, sizeof(zkocaml_flight_t *));
+  return table;
+}
+
+static void
+zkocaml_flight_table_free(zkocaml_flight_table_t *table)
+{
+  size_t i = 0;
+  if (table == NULL) return;
+  for (; i < table->nbuckets; i++) {
+    zkocaml_flight_t *flight = table->buckets[i];
+    while (flight != NULL) {
+      zkocaml_flight_t *next = flight->next;
+      free(flight->path);
+      free(flight);
+      flight = next;
+    }
+  }
+  free(table->buckets);
+  pthread_mutex_destroy(&table->lock);
+  free(table);
+}
+
+/**
+ * Queues @ctx on the read identical to (op, path, watch) if one is in
+ * flight and returns 1. Otherwise returns 0 and the caller must issue
+ * the read itself, with the new flight stored in @flight as completion
+ * data, or with @ctx as usual if coalescing is disabled (@flight NULL).
+ */
+static int
+zkocaml_flight_join(zkocaml_handle_t *handle,
+                    ZKOCAML_FLIGHT_OP op,
+                    const char *path,
+                    int watch,
+                    zkocaml_completion_context_t *ctx,
+                    zkocaml_flight_t **flight)
+{
+  zkocaml_flight_table_t *table = handle->flights;
+  zkocaml_flight_t *f = NULL;
+  size_t b = 0;
+
+  *flight = NULL;
+  pthread_mutex_lock(&table->lock);
+  if (!table->enabled) {
+    pthread_mutex_unlock(&table->lock);
+    return 0;
+  }
+  b = zkocaml_path_hash(path, op) % table->nbuckets;
+  for (f = table->buckets[b]; f != NULL; f = f->next) {
+    if (f->op == op && f->watch == watch && strcmp(f->path, path) == 0) {
+      ctx->next = f->waiters;
+      f->waiters = ctx;
+      pthread_mutex_unlock(&table->lock);
+      return 1;
+    }
+  }
+  f = (zkocaml_flight_t *) malloc(sizeof(zkocaml_flight_t));
+  f->table = table;
+  f->path = strdup(path);
+  f->op = op;
+  f->watch = watch;
+  f->waiters = ctx;
+  ctx->next = NULL;
+  f->next = table->buckets[b];
+  table->buckets[b] = f;
+  pthread_mutex_unlock(&table->lock);
+
+  *flight = f;
+  return 0;
+}
+
+/**
+ * Takes the (@op, @path) reads off the table, whatever their watch
+ * flag. The table lock must be held.
+ */
+static void
+zkocaml_flight_unlink(zkocaml_flight_table_t *table,
+                      ZKOCAML_FLIGHT_OP op,
+                      const char *path)
+{
+  zkocaml_flight_t **link = NULL;
+  size_t b = zkocaml_path_hash(path, op) % table->nbuckets;
+
+  for (link = &table->buckets[b]; *link != NULL; ) {
+    if ((*link)->op == op && strcmp((*link)->path, path) == 0)
+      *link = (*link)->next;
+    else
+      link = &(*link)->next;
+  }
+}
+
+/**
+ * Detaches the reads in flight that a write to @path may change: the
+ * data and stat of @path, the children of its parent. Reads issued
+ * after the write then start their own rather than join one sent
+ * before it, which would answer them with what the write replaced.
+ * Detached reads still complete their waiters.
+ */
+static void
+zkocaml_flight_detach(zkocaml_handle_t *handle, const char *path)
+{
+  zkocaml_flight_table_t *table = handle->flights;
+  const char *slash = strrchr(path, '/');
+  char *parent = NULL;
+
+  if (slash != NULL)
+    parent = slash == path ? strdup("/") : strndup(path, slash - path);
+  pthread_mutex_lock(&table->lock);
+  zkocaml_flight_unlink(table, ZKOCAML_FLIGHT_GET, path);
+  zkocaml_flight_unlink(table, ZKOCAML_FLIGHT_EXISTS, path);
+  if (parent != NULL) zkocaml_flight_unlink(table, ZKOCAML_FLIGHT_CHILDREN, parent);
+  pthread_mutex_unlock(&table->lock);
+  free(parent);
+}
+
+/**
+ * Removes a completed read from the table, frees it and returns its
+ * waiters in arrival order. Callers joining from now on start a new read.
+ */
+static zkocaml_completion_context_t *
+zkocaml_flight_land(zkocaml_flight_t *flight)
+{
+  zkocaml_flight_table_t *table = flight->table;
+  zkocaml_flight_t **link = NULL;
+  zkocaml_completion_context_t *waiters = NULL, *ctx = NULL, *next = NULL;
+  size_t b = zkocaml_path_hash(flight->path, flight->op) % table->nbuckets;
+
+  pthread_mutex_lock(&table->lock);
+  for (link = &table->buckets[b]; *link != NULL; link = &(*link)->next) {
+    if (*link == flight) {
+      *link = flight->next;
+      break;
+    }
+  }
+  ctx = flight->waiters;
+  pthread_mutex_unlock(&table->lock);
+
+  for (; ctx != NULL; ctx = next) {
+    next = ctx->next;
+    ctx->next = waiters;
+    waiters = ctx;
+  }
+  free(flight->path);
+  free(flight);
+  return waiters;
+}
+
+static void
+zkocaml_flight_release(zkocaml_completion_context_t *ctx)
+{
+  zkocaml_deadline_disarm(ctx);
+  zkocaml_completion_free(ctx);
+}
+
+/**
+ * Dispatches the result of a coalesced aget to every waiter.
+ */
+static void
+data_flight_deliver(int rc,
+                    const char *val,
+                    int val_len,
+                    const struct Stat *stat,
+                    zkocaml_completion_context_t *waiters)
+{
+  zkocaml_completion_context_t *ctx = NULL, *next = NULL;
+  zkocaml_window_t *window = NULL;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal5(local_rc, local_val, local_val_len, local_stat, local_data);
+  CAMLlocalN(args, 5);
+
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  if (val != NULL)
+    local_val = caml_alloc_initialized_string(val_len, val);
+  else
+    local_val = caml_alloc_string(0);
+  local_val_len = Val_int(val_len);
+  local_stat = zkocaml_build_stat_struct(stat);
+
+  for (ctx = waiters; ctx != NULL; ctx = next) {
+    next = ctx->next;
+    if (ctx->window != NULL) {
+      window = ctx->window;
+      zkocaml_window_release(window);
+    }
+    local_data = caml_copy_string(ctx->data);
+    Store_field(args, 0, local_rc);
+    Store_field(args, 1, local_val);
+    Store_field(args, 2, local_val_len);
+    Store_field(args, 3, local_stat);
+    Store_field(args, 4, local_data);
+    if (zkocaml_deadline_disarm(ctx))
+      zkocaml_callbackN(ctx->completion_callback, 5, args);
+    zkocaml_flight_release(ctx);
+  }
+  zkocaml_window_drain(window);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when a coalesced aget completes, with its waiters taken off
+ * the table right away so that later callers start a new read.
+ */
+static void
+data_flight_dispatch(int rc,
+                     const char *val,
+                     int val_len,
+                     const struct Stat *stat,
+                     const void *data)
+{
+  zkocaml_completion_context_t *waiters = zkocaml_flight_land((zkocaml_flight_t *)data);
+
+  if (!zkocaml_route_defer(waiters, ZKOCAML_COMPLETION_DATA, 1, rc,
+                           val, val_len, stat, NULL, NULL))
+    data_flight_deliver(rc, val, val_len, stat, waiters);
+}
+
+/**
+ * Dispatches the result of a coalesced aexists to every waiter.
+ */
+static void
+stat_flight_deliver(int rc,
+                    const struct Stat *stat,
+                    zkocaml_completion_context_t *waiters)
+{
+  zkocaml_completion_context_t *ctx = NULL, *next = NULL;
+  zkocaml_window_t *window = NULL;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal3(local_rc, local_stat, local_data);
+
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_stat = zkocaml_build_stat_struct(stat);
+
+  for (ctx = waiters; ctx != NULL; ctx = next) {
+    next = ctx->next;
+    if (ctx->window != NULL) {
+      window = ctx->window;
+      zkocaml_window_release(window);
+    }
+    local_data = caml_copy_string(ctx->data);
+    if (zkocaml_deadline_disarm(ctx))
+      zkocaml_callback3(ctx->completion_callback, local_rc, local_stat, local_data);
+    zkocaml_flight_release(ctx);
+  }
+  zkocaml_window_drain(window);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when a coalesced aexists completes, with its waiters taken off
+ * the table right away so that later callers start a new read.
+ */
+static void
+stat_flight_dispatch(int rc,
+                     const struct Stat *stat,
+                     const void *data)
+{
+  zkocaml_completion_context_t *waiters = zkocaml_flight_land((zkocaml_flight_t *)data);
+
+  if (!zkocaml_route_defer(waiters, ZKOCAML_COMPLETION_STAT, 1, rc,
+                           NULL, 0, stat, NULL, NULL))
+    stat_flight_deliver(rc, stat, waiters);
+}
+
+/**
+ * Dispatches the result of a coalesced aget_children to every waiter.
+ * Arrays are mutable, so each waiter gets its own.
+ */
+static void
+strings_flight_deliver(int rc,
+                       const struct String_vector *strings,
+                       zkocaml_completion_context_t *waiters)
+{
+  zkocaml_completion_context_t *ctx = NULL, *next = NULL;
+  zkocaml_window_t *window = NULL;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal3(local_rc, local_strings, local_data);
+
+  local_rc = zkocaml_enum_error_c2ml(rc);
+
+  for (ctx = waiters; ctx != NULL; ctx = next) {
+    next = ctx->next;
+    if (ctx->window != NULL) {
+      window = ctx->window;
+      zkocaml_window_release(window);
+    }
+    local_strings = zkocaml_build_strings_struct(strings);
+    local_data = caml_copy_string(ctx->data);
+    if (zkocaml_deadline_disarm(ctx))
+      zkocaml_callback3(ctx->completion_callback, local_rc, local_strings, local_data);
+    zkocaml_flight_release(ctx);
+  }
+  zkocaml_window_drain(window);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when a coalesced aget_children completes, with its waiters taken off
+ * the table right away so that later callers start a new read.
+ */
+static void
+strings_flight_dispatch(int rc,
+                        const struct String_vector *strings,
+                        const void *data)
+{
+  zkocaml_completion_context_t *waiters = zkocaml_flight_land((zkocaml_flight_t *)data);
+
+  if (!zkocaml_route_defer(waiters, ZKOCAML_COMPLETION_STRINGS, 1, rc,
+                           NULL, 0, NULL, strings, NULL))
+    strings_flight_deliver(rc, strings, waiters);
+}
+
+/**
+ * The read of @flight could not be submitted: its leader gets @rc as
+ * the return value of its own call, anyone who joined it meanwhile
+ * is completed with @rc.
+ */
+static void
+zkocaml_flight_abort(zkocaml_flight_t *flight,
+                     zkocaml_completion_context_t *leader,
+                     int rc)
+{
+  zkocaml_completion_context_t **link = NULL;
+
+  pthread_mutex_lock(&flight->table->lock);
+  for (link = &flight->waiters; *link != NULL; link = &(*link)->next) {
+    if (*link == leader) {
+      *link = leader->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&flight->table->lock);
+  zkocaml_completion_abort(leader);
+
+  switch (flight->op) {
+  case ZKOCAML_FLIGHT_GET:
+    data_flight_dispatch(rc, NULL, 0, NULL, flight);
+    break;
+  case ZKOCAML_FLIGHT_EXISTS:
+    stat_flight_dispatch(rc, NULL, flight);
+    break;
+  case ZKOCAML_FLIGHT_CHILDREN:
+    strings_flight_dispatch(rc, NULL, flight);
+    break;
+  }
+}
+
+/**
+ * Reaper.
+ *
+ * Sessions are closed and handles freed on a thread of their own:
+ * zookeeper_close flushes outstanding requests and may block for up
+ * to the receive timeout, which must neither happen inside the GC nor
+ * with the runtime held while completions still need it.
+ */
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t done;
+  int started;
+  zkocaml_reap_t *head;
+  zkocaml_reap_t *tail;
+} zkocaml_reaper = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                     PTHREAD_COND_INITIALIZER };
+
+/**
+ * Frees the watcher context of @handle, once no session refers to it.
+ * Called with the runtime held.
+ */
+static void
+zkocaml_context_free(zkocaml_handle_t *handle)
+{
+  if (handle->context == NULL) return;
+  caml_remove_generational_global_root(&(handle->context->watcher_callback));
+  caml_remove_generational_global_root(&(handle->context->zh));
+  free(handle->context->watcher_ctx);
+  free(handle->context);
+  handle->context = NULL;
+}
+
+static void
+zkocaml_reap_run(zkocaml_reap_t *job)
+{
+  zkocaml_handle_t *handle = job->handle;
+  zhandle_t *zhandle = NULL;
+  int reiniting = 0;
+
+  if (job->op == ZKOCAML_REAP_SESSION) {
+    job->rc = zookeeper_close(job->stale);
+    return;
+  }
+
+  /* Under the window lock, against async calls taking a slot and
+   * zkocaml_reinit storing a new session. */
+  pthread_mutex_lock(&handle->window->lock);
+  zhandle = handle->zhandle;
+  handle->zhandle = NULL;
+  handle->closing = 1;
+  reiniting = handle->reiniting;
+  pthread_mutex_unlock(&handle->window->lock);
+  job->rc = ZOK;
+  if (zhandle != NULL) {
+    job->rc = zookeeper_close(zhandle);
+    /* Other handles may still log to it: flushed, never closed. */
+    pthread_mutex_lock(&zkocaml_log_lock);
+    if (zkocaml_log_stream != NULL) fflush(zkocaml_log_stream);
+    pthread_mutex_unlock(&zkocaml_log_lock);
+  }
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+  CAMLlocal1(close_callback);
+
+  /* The session is gone: the handle no longer needs to be kept alive. */
+  zkocaml_watch_batch_stop(handle->watches);
+  /* A session being created still refers to the watcher context:
+   * zkocaml_reinit closes it and frees the context itself. */
+  if (!reiniting) zkocaml_context_free(handle);
+
+  if (job->op == ZKOCAML_REAP_CLOSE) {
+    close_callback = handle->close_callback;
+    if (Is_block(close_callback)) {
+      caml_modify_generational_global_root(&(handle->close_callback), Val_unit);
+      zkocaml_callback1(close_callback, zkocaml_enum_error_c2ml(job->rc));
+    }
+  } else {
+    caml_remove_generational_global_root(&(handle->close_callback));
+    free(handle->refcount);
+    zkocaml_watch_registry_free(handle->watches);
+    zkocaml_flight_table_free(handle->flights);
+    zkocaml_window_free(handle->window);
+    zkocaml_retry_free(handle->retry);
+    free(handle);
+    zkocaml_replay_raise();
+  }
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+static void *
+zkocaml_reaper_loop(void *arg)
+{
+  (void)arg;
+
+  for (;;) {
+    zkocaml_reap_t *job = NULL;
+
+    pthread_mutex_lock(&zkocaml_reaper.lock);
+    while (zkocaml_reaper.head == NULL)
+      pthread_cond_wait(&zkocaml_reaper.cond, &zkocaml_reaper.lock);
+    job = zkocaml_reaper.head;
+    zkocaml_reaper.head = job->next;
+    if (zkocaml_reaper.head == NULL) zkocaml_reaper.tail = NULL;
+    pthread_mutex_unlock(&zkocaml_reaper.lock);
+
+    zkocaml_reap_run(job);
+
+    pthread_mutex_lock(&zkocaml_reaper.lock);
+    if (job->waited) {
+      job->done = 1;
+      pthread_cond_broadcast(&zkocaml_reaper.done);
+    } else {
+      free(job);
+    }
+    pthread_mutex_unlock(&zkocaml_reaper.lock);
+  }
+  return NULL;
+}
+
+/**
+ * Queues @job for the reaper thread, starting it if needed. Returns 0
+ * if there is no reaper thread to run it.
+ */
+static int
+zkocaml_reaper_push(zkocaml_reap_t *job)
+{
+  pthread_mutex_lock(&zkocaml_reaper.lock);
+  if (!zkocaml_reaper.started) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, zkocaml_reaper_loop, NULL) == 0)
+      zkocaml_reaper.started = 1;
+    pthread_attr_destroy(&attr);
+  }
+  if (!zkocaml_reaper.started) {
+    pthread_mutex_unlock(&zkocaml_reaper.lock);
+    return 0;
+  }
+  if (zkocaml_reaper.tail != NULL)
+    zkocaml_reaper.tail->next = job;
+  else
+    zkocaml_reaper.head = job;
+  zkocaml_reaper.tail = job;
+  pthread_cond_signal(&zkocaml_reaper.cond);
+  pthread_mutex_unlock(&zkocaml_reaper.lock);
+  return 1;
+}
+
+/**
+ * Hands @handle, or the @stale session of a re-initialized handle, to
+ * the reaper thread. With @wait, and unless called from a dispatch
+ * that the close would have to wait for, sleeps with the runtime
+ * released until the job is done and returns its result.
+ */
+static int
+zkocaml_reap_job(zkocaml_handle_t *handle,
+                 zhandle_t *stale,
+                 ZKOCAML_REAP_OP op,
+                 int wait)
+{
+  zkocaml_reap_t local, *job = &local;
+
+  if (!wait || zkocaml_dispatching) {
+    job = (zkocaml_reap_t *)malloc(sizeof(zkocaml_reap_t));
+    wait = 0;
+  }
+  job->handle = handle;
+  job->stale = stale;
+  job->op = op;
+  job->waited = wait;
+  job->done = 0;
+  job->rc = ZOK;
+  job->next = NULL;
+
+  if (!zkocaml_reaper_push(job)) {
+    /* No reaper: do it here, the old blocking way. */
+    zkocaml_reap_run(job);
+    if (job != &local) free(job);
+    return wait ? local.rc : ZOK;
+  }
+  if (!wait) return ZOK;
+
+  caml_enter_blocking_section();
+  pthread_mutex_lock(&zkocaml_reaper.lock);
+  while (!local.done)
+    pthread_cond_wait(&zkocaml_reaper.done, &zkocaml_reaper.lock);
+  pthread_mutex_unlock(&zkocaml_reaper.lock);
+  caml_leave_blocking_section();
+
+  return local.rc;
+}
+
+static int
+zkocaml_reap(zkocaml_handle_t *handle, ZKOCAML_REAP_OP op, int wait)
+{
+  return zkocaml_reap_job(handle, NULL, op, wait);
+}
+
+static void finalize (value zh) {
+  zkocaml_reap(ZkO_handle_val(zh), ZKOCAML_REAP_FREE, 0);
+}
+
+static struct custom_operations handle_ops = {
+  "zhandle",
+  finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+/**
+ * Prepared ACLs.
+ *
+ * An acl_handle owns the ACL_vector parsed once from OCaml acls, so
+ * the create and set_acl variants taking one neither walk the array
+ * nor allocate on each call. The vector lives outside the heap as
+ * the calls keep it across a possible release of the runtime.
+ */
+
+#define ZkO_acl_val(v) (*(struct ACL_vector **)Data_custom_val(v))
+
+static void acl_finalize (value acl) {
+  struct ACL_vector *local_acl = ZkO_acl_val(acl);
+  if (local_acl == NULL) return;
+  zkocaml_free_acls(local_acl);
+  free(local_acl);
+}
+
+static struct custom_operations acl_handle_ops = {
+  "zkocaml.acl_handle",
+  acl_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+/**
+ * Prepares @acls for the *_prepared calls; an empty array stands for
+ * ZOO_OPEN_ACL_UNSAFE, as elsewhere.
+ */
+CAMLprim value
+zkocaml_acl_handle(value acls)
+{
+  CAMLparam1(acls);
+  CAMLlocal1(result);
+
+  result = caml_alloc_custom(&acl_handle_ops, sizeof(struct ACL_vector *), 0, 1);
+  struct ACL_vector *local_acl = (struct ACL_vector *)
+      calloc(1, sizeof(struct ACL_vector));
+  ZkO_acl_val(result) = local_acl;
+  if (!zkocaml_parse_acls(acls, local_acl)) {
+    int i = 0;
+    local_acl->count = ZOO_OPEN_ACL_UNSAFE.count;
+    local_acl->data = (struct ACL *)calloc(local_acl->count, sizeof(struct ACL));
+    for (; i < local_acl->count; i++) {
+      local_acl->data[i].perms = ZOO_OPEN_ACL_UNSAFE.data[i].perms;
+      local_acl->data[i].id.scheme = strdup(ZOO_OPEN_ACL_UNSAFE.data[i].id.scheme);
+      local_acl->data[i].id.id = strdup(ZOO_OPEN_ACL_UNSAFE.data[i].id.id);
+    }
+  }
+
+  CAMLreturn(result);
+}
+
+/**
+ * The acls an acl_handle was prepared from.
+ */
+CAMLprim value
+zkocaml_acl_handle_acls(value acl)
+{
+  CAMLparam1(acl);
+  CAMLreturn(zkocaml_build_acls_struct(ZkO_acl_val(acl)));
+}
+
+static void namespace_finalize (value zh) {
+  zkocaml_namespace_t *ns = ZkO_namespace_val(zh);
+  caml_remove_generational_global_root(&(ns->parent));
+  free(ns);
+}
+
+static struct custom_operations namespace_ops = {
+  "zkocaml.namespace",
+  namespace_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+/**
+ * A handle on the session of @zh whose paths are relative to @prefix,
+ * itself relative to the namespace of @zh if it has one. Raises
+ * Invalid_argument if @prefix is not a valid path other than "/".
+ */
+CAMLprim value
+zkocaml_namespace(value zh, value prefix)
+{
+  CAMLparam2(zh, prefix);
+  CAMLlocal1(result);
+
+  zkocaml_namespace_t *outer = ZkO_namespace_val(zh);
+  const char *local_prefix = String_val(prefix);
+  size_t outer_len = outer == NULL ? 0 : outer->len;
+  size_t len = caml_string_length(prefix);
+  if (!zkocaml_path_valid(local_prefix, len) || len == 1
+      || outer_len + len >= ZKOCAML_MAX_PATH_BUFFER_SIZE)
+    caml_invalid_argument("Zookeeper.namespace");
+
+  zkocaml_namespace_t *ns = (zkocaml_namespace_t *)
+      malloc(sizeof(zkocaml_namespace_t) + outer_len + len + 1);
+  ns->id = atomic_fetch_add(&zkocaml_namespace_ids, 1);
+  ns->parent = outer == NULL ? zh : outer->parent;
+  ns->len = outer_len + len;
+  if (outer != NULL) memcpy(ns->prefix, outer->prefix, outer_len);
+  memcpy(ns->prefix + outer_len, local_prefix, len + 1);
+  caml_register_generational_global_root(&(ns->parent));
+
+  result = caml_alloc_custom(&namespace_ops, 2 * sizeof(void *), 0, 1);
+  ((zkocaml_handle_t **)Data_custom_val(result))[0] = ZkO_handle_val(zh);
+  ((zkocaml_namespace_t **)Data_custom_val(result))[1] = ns;
+
+  CAMLreturn(result);
+}
+
+/**
+ * The prefix of a namespaced handle, "/" for a plain one.
+ */
+CAMLprim value
+zkocaml_namespace_prefix(value zh)
+{
+  CAMLparam1(zh);
+  zkocaml_namespace_t *ns = ZkO_namespace_val(zh);
+  CAMLreturn(caml_copy_string(ns == NULL ? "/" : ns->prefix));
+}
+
+
+#define DISPOSABLE 0
+#define PERMANENT 1
+
+zkocaml_completion_context_t*
+make_completion_context(value data,
+                        value callback)
+{
+    zkocaml_completion_context_t *local_data = (zkocaml_completion_context_t *)
+        malloc(sizeof(zkocaml_completion_context_t));
+    /* Copied: the string may be moved by the GC of any domain. */
+    local_data->data = strdup(String_val(data));
+    local_data->completion_callback = callback;
+    local_data->watch = NULL;
+    local_data->watch_sub = 0;
+    local_data->window = NULL;
+    local_data->multi = NULL;
+    local_data->strip = 0;
+    local_data->kind = ZKOCAML_COMPLETION_VOID;
+    local_data->deadline_state = ZKOCAML_DEADLINE_NONE;
+    local_data->deadline = 0;
+    local_data->timer_slot = 0;
+    local_data->timer_prev = NULL;
+    local_data->timer_next = NULL;
+    local_data->next = NULL;
+    caml_register_generational_global_root(&(local_data->completion_callback));
+
+    return local_data;
+}
+
+zkocaml_watcher_context_t*
+make_watcher_context(value watcher_ctx,
+                     value callback,
+                     int kind,
+                     value zh)
+{
+  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
+      malloc(sizeof(zkocaml_watcher_context_t));
+  local_ctx->watcher_ctx = strdup(String_val(watcher_ctx));
+  local_ctx->watcher_callback = callback;
+  local_ctx->permanent = kind;
+  local_ctx->zh = zh;
+  caml_register_generational_global_root(&(local_ctx->watcher_callback));
+  caml_register_generational_global_root(&(local_ctx->zh));
+
+  return local_ctx;
+}
+
+static void
+watcher_dispatch(zhandle_t *_zhandle, // ignore this, because we have our handle in ctx
+                 int type,
+                 int state,
+                 const char *path,
+                 void *watcher_ctx)
+{
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal5(local_zh, local_type, local_state, local_path, local_watcher_ctx);
+  CAMLlocalN(args, 5);
+
+  zkocaml_watcher_context_t *ctx = (zkocaml_watcher_context_t* )(watcher_ctx);
+  if (!zkocaml_handle_struct_val(ctx->zh)) goto skip;
+
+  local_zh = zkocaml_copy_zh(ctx->zh);
+  local_type = zkocaml_enum_event_c2ml(type);
+  local_state = zkocaml_enum_state_c2ml(state);
+  local_path = caml_copy_string(path);
+  local_watcher_ctx = caml_copy_string(ctx->watcher_ctx);
+
+  Store_field(args, 0, local_zh);
+  Store_field(args, 1, local_type);
+  Store_field(args, 2, local_state);
+  Store_field(args, 3, local_path);
+  Store_field(args, 4, local_watcher_ctx);
+  callbackN(ctx->watcher_callback, 5, args);
+  zkocaml_destroy_handle(ctx->zh, 0);
+
+skip:
+  if (!ctx->permanent) {
+    caml_remove_generational_global_root(&(ctx->watcher_callback));
+    caml_remove_generational_global_root(&(ctx->zh));
+  }
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * The completion callbacks (from asynchronous calls) are
+ * implemented similarly.
+ */
+
+/**
+ * Called when an asynchronous call that returns void completes and
+ * dispatches user provided callback
+ */
+static void
+void_completion_dispatch(int rc, const void *data)
+{
+  if (zkocaml_route_defer((zkocaml_completion_context_t *)data,
+                          ZKOCAML_COMPLETION_VOID, 0, rc,
+                          NULL, 0, NULL, NULL, NULL))
+    return;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal1(completion_callback);
+  CAMLlocal2(local_rc, local_data);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  completion_callback = ctx->completion_callback;
+  zkocaml_window_release(ctx->window);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_data = caml_copy_string(ctx->data);
+
+  if (zkocaml_deadline_disarm(ctx))
+    zkocaml_callback2(completion_callback, local_rc, local_data);
+
+  zkocaml_window_drain(ctx->window);
+  zkocaml_completion_free(ctx);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a stat structure
+ * completes and dispatches user provided callback
+ */
+static void
+stat_completion_dispatch(int rc,
+                         const struct Stat *stat,
+                         const void *data)
+{
+  if (zkocaml_route_defer((zkocaml_completion_context_t *)data,
+                          ZKOCAML_COMPLETION_STAT, 0, rc,
+                          NULL, 0, stat, NULL, NULL))
+    return;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal1(completion_callback);
+  CAMLlocal3(local_rc, local_stat, local_data);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  completion_callback = ctx->completion_callback;
+  zkocaml_window_release(ctx->window);
+  zkocaml_watch_settle(ctx, rc);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_stat = zkocaml_build_stat_struct(stat);
+  local_data = caml_copy_string(ctx->data);
+
+  if (zkocaml_deadline_disarm(ctx))
+    zkocaml_callback3(completion_callback, local_rc, local_stat, local_data);
+
+  zkocaml_window_drain(ctx->window);
+  zkocaml_completion_free(ctx);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+/**
+ * Called when an asynchronous call that returns a stat structure and
+ * some untyped data completes and dispatches user provided
+ * callback (used by aget)
+ */
+static void
+data_completion_dispatch(int rc,
+                         const char *val,
+                         int val_len,
+                         const struct Stat *stat,
+                         const void *data)
+{
+  if (zkocaml_route_defer((zkocaml_completion_context_t *)data,
+                          ZKOCAML_COMPLETION_DATA, 0, rc,
+                          val, val_len, stat, NULL, NULL))
+    return;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal1(completion_callback);
+  CAMLlocal5(local_rc, local_val, local_val_len, local_stat, local_data);
+  CAMLlocalN(args, 5);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  completion_callback = ctx->completion_callback;
+  zkocaml_window_release(ctx->window);
+  zkocaml_watch_settle(ctx, rc);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  if (val != NULL)
+    local_val = caml_alloc_initialized_string(val_len, val);
+  else
+    local_val = caml_alloc_string(0);
+  local_val_len = Val_int(val_len);
+  local_stat = zkocaml_build_stat_struct(stat);
+  local_data = caml_copy_string(ctx->data);
+
+  Store_field(args, 0, local_rc);
+  Store_field(args, 1, local_val);
+  Store_field(args, 2, local_val_len);
+  Store_field(args, 3, local_stat);
+  Store_field(args, 4, local_data);
+
+  if (zkocaml_deadline_disarm(ctx))
+    zkocaml_callbackN(completion_callback, 5, args);
+
+  zkocaml_window_drain(ctx->window);
+  zkocaml_completion_free(ctx);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a list of strings
+ * completes and dispatches user provided callback.
+ */
+static void
+strings_completion_dispatch(int rc,
+                            const struct String_vector *strings,
+                            const void *data)
+{
+  if (zkocaml_route_defer((zkocaml_completion_context_t *)data,
+                          ZKOCAML_COMPLETION_STRINGS, 0, rc,
+                          NULL, 0, NULL, strings, NULL))
+    return;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal1(completion_callback);
+  CAMLlocal3(local_rc, local_strings, local_data);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  completion_callback = ctx->completion_callback;
+  zkocaml_window_release(ctx->window);
+  zkocaml_watch_settle(ctx, rc);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_strings = zkocaml_build_strings_struct(strings);
+  local_data = caml_copy_string(ctx->data);
+
+  if (zkocaml_deadline_disarm(ctx))
+    zkocaml_callback3(completion_callback, local_rc, local_strings, local_data);
+
+  zkocaml_window_drain(ctx->window);
+  zkocaml_completion_free(ctx);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a list of strings
+ * and a stat structure completes and dispatches user provided callback.
+ */
+static void
+strings_stat_completion_dispatch(int rc,
+                                 const struct String_vector *strings,
+                                 const struct Stat *stat,
+                                 const void *data)
+{
+  if (zkocaml_route_defer((zkocaml_completion_context_t *)data,
+                          ZKOCAML_COMPLETION_STRINGS_STAT, 0, rc,
+                          NULL, 0, stat, strings, NULL))
+    return;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal1(completion_callback);
+  CAMLlocal4(local_rc, local_strings, local_stat, local_data);
+  CAMLlocalN(args, 4);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  completion_callback = ctx->completion_callback;
+  zkocaml_window_release(ctx->window);
+  zkocaml_watch_settle(ctx, rc);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_strings = zkocaml_build_strings_struct(strings);
+  local_stat = zkocaml_build_stat_struct(stat);
+  local_data = caml_copy_string(ctx->data);
+
+  Store_field(args, 0, local_rc);
+  Store_field(args, 1, local_strings);
+  Store_field(args, 2, local_stat);
+  Store_field(args, 3, local_data);
+
+  if (zkocaml_deadline_disarm(ctx))
+    zkocaml_callbackN(completion_callback, 4, args);
+
+  zkocaml_window_drain(ctx->window);
+  zkocaml_completion_free(ctx);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a single string
+ * completes and dispatches user provided callback.
+ */
+static void
+string_completion_dispatch(int rc,
+                           const char *val,
+                           const void *data)
+{
+  if (zkocaml_route_defer((zkocaml_completion_context_t *)data,
+                          ZKOCAML_COMPLETION_STRING, 0, rc,
+                          val, 0, NULL, NULL, NULL))
+    return;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal1(completion_callback);
+  CAMLlocal3(local_rc, local_val, local_data);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  completion_callback = ctx->completion_callback;
+  zkocaml_window_release(ctx->window);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  if (val != NULL)
+      local_val = caml_copy_string(zkocaml_ns_strip(val, ctx->strip));
+  else
+      local_val = caml_alloc_string(0);
+  local_data = caml_copy_string(ctx->data);
+
+  if (zkocaml_deadline_disarm(ctx))
+    zkocaml_callback3(completion_callback, local_rc, local_val, local_data);
+
+  zkocaml_window_drain(ctx->window);
+  zkocaml_completion_free(ctx);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a string and a stat
+ * completes and dispatches user provided callback.
+ */
+static void
+string_stat_completion_dispatch(int rc,
+                                const char *val,
+                                const struct Stat *stat,
+                                const void *data)
+{
+  if (zkocaml_route_defer((zkocaml_completion_context_t *)data,
+                          ZKOCAML_COMPLETION_STRING_STAT, 0, rc,
+                          val, 0, stat, NULL, NULL))
+    return;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal1(completion_callback);
+  CAMLlocal4(local_rc, local_val, local_stat, local_data);
+  CAMLlocalN(args, 4);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  completion_callback = ctx->completion_callback;
+  zkocaml_window_release(ctx->window);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  if (val != NULL)
+      local_val = caml_copy_string(zkocaml_ns_strip(val, ctx->strip));
+  else
+      local_val = caml_alloc_string(0);
+  local_stat = zkocaml_build_stat_struct(stat);
+  local_data = caml_copy_string(ctx->data);
+
+  Store_field(args, 0, local_rc);
+  Store_field(args, 1, local_val);
+  Store_field(args, 2, local_stat);
+  Store_field(args, 3, local_data);
+  if (zkocaml_deadline_disarm(ctx))
+    zkocaml_callbackN(completion_callback, 4, args);
+
+  zkocaml_window_drain(ctx->window);
+  zkocaml_completion_free(ctx);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a list of ACLs
+ * completes and dispatches user provided callback.
+ */
+static void
+acl_completion_dispatch(int rc,
+                        struct ACL_vector *acl,
+                        struct Stat *stat,
+                        const void *data)
+{
+  if (zkocaml_route_defer((zkocaml_completion_context_t *)data,
+                          ZKOCAML_COMPLETION_ACL, 0, rc,
+                          NULL, 0, stat, NULL, acl))
+    return;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal1(completion_callback);
+  CAMLlocal4(local_rc, local_acl, local_stat, local_data);
+  CAMLlocalN(args, 4);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  completion_callback = ctx->completion_callback;
+  zkocaml_window_release(ctx->window);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_acl = zkocaml_build_acls_struct(acl);
+  local_stat = zkocaml_build_stat_struct(stat);
+  local_data = caml_copy_string(ctx->data);
+
+  Store_field(args, 0, local_rc);
+  Store_field(args, 1, local_acl);
+  Store_field(args, 2, local_stat);
+  Store_field(args, 3, local_data);
+
+  if (zkocaml_deadline_disarm(ctx))
+    zkocaml_callbackN(completion_callback, 4, args);
+
+  zkocaml_window_drain(ctx->window);
+  zkocaml_completion_free(ctx);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+
+/**
+ * Create a handle to used communicate with zookeeper.
+ *
+ * This method creates a new handle and a zookeeper session that corresponds
+ * to that handle. Session establishment is asynchronous, meaning that the
+ * session should not be considered established until (and unless) an
+ * event of state ZOO_CONNECTED_STATE is received.
+ *
+ * @host Comma separated host:port pairs, each corresponding to a zk
+ *   server. e.g. "127.0.0.1:3000,127.0.0.1:3001,127.0.0.1:3002"
+ *
+ * @watcher_callback The global watcher callback function. When notifications are
+ *   triggered this function will be invoked.
+ *
+ * @clientid The id of a previously established session that this
+ *   client will be reconnecting to. Pass 0 if not reconnecting to a previous
+ *   session. Clients can access the session id of an established, valid,
+ *   connection by calling zoo_client_id. If the session corresponding to
+ *   the specified clientid has expired, or if the clientid is invalid for
+ *   any reason, the returned zhandle_t will be invalid -- the zhandle_t
+ *   state will indicate the reason for failure (typically
+ *   ZOO_EXPIRED_SESSION_STATE).
+ *
+ * @context The handback object that will be associated with this instance
+ *   of zhandle_t. Application can access it (for example, in the watcher
+ *   callback) using zoo_get_context. The object is not used by zookeeper
+ *   internally and can be null.
+ *
+ * @flags 0, or ZOO_READONLY to allow the session to connect to a
+ * read-only server while the ensemble has lost its quorum.
+ *
+ * @return A pointer to the opaque zhandle structure. If it fails to create
+ * a new zhandle the function returns NULL and the errno variable indicates
+ * the reason.
+ */
+
+CAMLprim value
+zkocaml_init_native(value host,
+                    value watcher_callback,
+                    value recv_timeout,
+                    value clientid,
+                    value context,
+                    value flag)
+{
+  CAMLparam5(host, watcher_callback, recv_timeout, clientid, context);
+  CAMLxparam1(flag);
+  CAMLlocal1(zh);
+
+  const char *local_host = String_val(host);
+  int local_recv_timeout = Long_val(recv_timeout);
+  clientid_t *cid = NULL;
+  zh = caml_alloc_custom(&handle_ops,sizeof(zkocaml_handle_t*),1,100000);
+
+  zkocaml_watcher_context_t *ctx = make_watcher_context(context, watcher_callback, PERMANENT, zh);;
+
+  cid = zkocaml_parse_clientid(clientid);
+  zhandle_t *zhandle = zookeeper_init(local_host, watcher_dispatch, local_recv_timeout, cid, ctx, Int_val(flag) & ZOO_READONLY);
+
+  zkocaml_handle_t* handle = (zkocaml_handle_t*) malloc(sizeof(zkocaml_handle_t));
+  handle->refcount = (atomic_int*) malloc(sizeof(atomic_int));
+  atomic_init(handle->refcount,1);
+  handle->zhandle = zhandle;
+  handle->watches = zkocaml_watch_registry_new();
+  handle->flights = zkocaml_flight_table_new();
+  handle->window = zkocaml_window_new();
+  handle->retry = zkocaml_retry_new();
+  handle->context = ctx;
+  handle->close_callback = Val_unit;
+  handle->closing = 0;
+  handle->reiniting = 0;
+  caml_register_generational_global_root(&(handle->close_callback));
+  ZkO_handle_val(zh) = handle;
+
+  CAMLreturn(zh);
+}
+
+CAMLprim value
+zkocaml_init_bytecode(value *argv, int argn)
+{
+  return zkocaml_init_native(argv[0], argv[1], argv[2],
+                             argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Re-initialize a handle in place on a new session, as after the
+ * expiry of its own: the handle keeps its watcher context, watch
+ * registry and settings. The stale session is closed first, by the
+ * reaper thread, and its ephemerals are gone by the time the new
+ * session connects; except when called from a completion or a
+ * watcher, which cannot wait for the reaper: the stale session is
+ * then closed concurrently. Watches are not re-armed, see
+ * rearm_watches.
+ *
+ * @return ZOK, ZBADARGUMENTS if the handle is namespaced, ZCLOSING if
+ * it is closed, or ZSYSTEMERROR if no session could be created.
+ */
+CAMLprim value
+zkocaml_reinit(value zh,
+               value host,
+               value recv_timeout,
+               value flag)
+{
+  CAMLparam4(zh, host, recv_timeout, flag);
+
+  zkocaml_handle_t *handle = ZkO_handle_val(zh);
+  zhandle_t *stale = NULL, *zhandle = NULL;
+  int closing = 0;
+  if (ZkO_namespace_val(zh) != NULL)
+    CAMLreturn(zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+
+  /* While reiniting, a close leaves the watcher context to us. */
+  pthread_mutex_lock(&handle->window->lock);
+  closing = handle->closing || handle->reiniting;
+  if (!closing) {
+    stale = handle->zhandle;
+    handle->zhandle = NULL;
+    handle->reiniting = 1;
+  }
+  pthread_mutex_unlock(&handle->window->lock);
+  if (closing) CAMLreturn(zkocaml_enum_error_c2ml(ZCLOSING));
+  if (stale != NULL) zkocaml_reap_job(handle, stale, ZKOCAML_REAP_SESSION, 1);
+
+  zhandle = zookeeper_init(String_val(host),
+                           watcher_dispatch,
+                           Long_val(recv_timeout),
+                           NULL,
+                           handle->context,
+                           Int_val(flag) & ZOO_READONLY);
+
+  pthread_mutex_lock(&handle->window->lock);
+  closing = handle->closing;
+  if (!closing) handle->zhandle = zhandle;
+  handle->reiniting = 0;
+  pthread_mutex_unlock(&handle->window->lock);
+
+  if (closing) {
+    /* Closed meanwhile: the new session goes, then the context. */
+    if (zhandle != NULL) {
+      caml_enter_blocking_section();
+      zookeeper_close(zhandle);
+      caml_leave_blocking_section();
+    }
+    zkocaml_context_free(handle);
+    CAMLreturn(zkocaml_enum_error_c2ml(ZCLOSING));
+  }
+  if (zhandle == NULL) CAMLreturn(zkocaml_enum_error_c2ml(ZSYSTEMERROR));
+
+  CAMLreturn(zkocaml_enum_error_c2ml(ZOK));
+}
+
+/**
+ * Settles a re-armed watch: if its node is gone, which leaves no data
+ * or child watch behind, its subscribers get ZOO_DELETED_EVENT.
+ */
+static void
+zkocaml_rearm_settle(zkocaml_rearm_t *rearm, int rc)
+{
+  zkocaml_watch_entry_t *entry = rearm->entry;
+  zhandle_t *zhandle = rearm->zhandle;
+
+  free(rearm);
+  if (rc == ZNONODE && !zkocaml_watch_armed(entry->kind, rc))
+    watch_registry_dispatch(zhandle, ZOO_DELETED_EVENT, ZOO_CONNECTED_STATE,
+                            entry->path, entry);
+  zkocaml_watch_done(entry, 0, zkocaml_watch_armed(entry->kind, rc));
+}
+
+static void
+zkocaml_rearm_stat_completion(int rc, const struct Stat *stat, const void *data)
+{
+  zkocaml_rearm_settle((zkocaml_rearm_t *) data, rc);
+}
+
+static void
+zkocaml_rearm_data_completion(int rc, const char *val, int val_len,
+                              const struct Stat *stat, const void *data)
+{
+  zkocaml_rearm_settle((zkocaml_rearm_t *) data, rc);
+}
+
+static void
+zkocaml_rearm_strings_completion(int rc, const struct String_vector *strings,
+                                 const void *data)
+{
+  zkocaml_rearm_settle((zkocaml_rearm_t *) data, rc);
+}
+
+/**
+ * Re-arm on the current session every watch of the registry of the
+ * handle that still has subscribers, one pipelined request per (path,
+ * kind) pair and no OCaml allocation: the subscribers keep their
+ * watchers and contexts.
+ *
+ * @return the number of watches re-armed, or -1 if the handle is not
+ * connected
+ */
+CAMLprim value
+zkocaml_rearm_watches(value zh)
+{
+  CAMLparam1(zh);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, Val_int(-1));
+
+  zkocaml_watch_registry_t *registry = ZkO_handle_val(zh)->watches;
+  zkocaml_watch_entry_t **entries = NULL, *entry = NULL;
+  size_t i = 0, n = 0;
+  int armed = 0;
+
+  pthread_mutex_lock(&registry->lock);
+  entries = (zkocaml_watch_entry_t **)
+      malloc((registry->size + 1) * sizeof(zkocaml_watch_entry_t *));
+  for (i = 0; i < registry->nbuckets; i++)
+    for (entry = registry->buckets[i]; entry != NULL; entry = entry->next)
+      if (entry->subs != NULL) {
+        entry->inflight++;
+        entries[n++] = entry;
+      }
+  pthread_mutex_unlock(&registry->lock);
+
+  for (i = 0; i < n; i++) {
+    zkocaml_rearm_t *rearm = (zkocaml_rearm_t *) malloc(sizeof(zkocaml_rearm_t));
+    int rc = ZOK;
+    rearm->zhandle = handle;
+    rearm->entry = entries[i];
+    switch (entries[i]->kind) {
+    case ZKOCAML_WATCH_DATA:
+      rc = zoo_awget(handle, entries[i]->path,
+                     watch_registry_dispatch, entries[i],
+                     zkocaml_rearm_data_completion, rearm);
+      break;
+    case ZKOCAML_WATCH_EXIST:
+      rc = zoo_awexists(handle, entries[i]->path,
+                        watch_registry_dispatch, entries[i],
+                        zkocaml_rearm_stat_completion, rearm);
+      break;
+    case ZKOCAML_WATCH_CHILD:
+      rc = zoo_awget_children(handle, entries[i]->path,
+                              watch_registry_dispatch, entries[i],
+                              zkocaml_rearm_strings_completion, rearm);
+      break;
+    }
+    if (rc == ZOK) {
+      armed++;
+    } else {
+      free(rearm);
+      zkocaml_watch_done(entries[i], 0, 0);
+    }
+  }
+  free(entries);
+
+  CAMLreturn(Val_int(armed));
+}
+
+/**
+ * Close the zookeeper handle and free up any resources.
+ *
+ * After this call, the client session will no longer be valid. The function
+ * will flush any outstanding send requests before return. As a result it may
+ * block.
+ *
+ * This method should only be called only once on a zookeeper handle. Calling
+ * twice will cause undefined (and probably undesirable behavior). Calling any other
+ * zookeeper method after calling close is undefined behaviour and should be avoided.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @return a result code. Regardless of the error code returned, the zhandle
+ * will be destroyed and all resources freed.
+ *   ZOK - success
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ *   ZOPERATIONTIMEOUT - failed to flush the buffers within the specified timeout.
+ *   ZCONNECTIONLOSS - a network error occured while attempting to send request to server
+ *   ZSYSTEMERROR -- a system (OS) error occured; it's worth checking errno to get details
+ */
+
+CAMLprim value
+zkocaml_close(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+  /* The session belongs to the parent handle. */
+  if (ZkO_namespace_val(zh) != NULL)
+    CAMLreturn(zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+
+  result = zkocaml_destroy_handle(zh, 1);
+  CAMLreturn(result);
+}
+
+/**
+ * Close the zookeeper handle without waiting.
+ *
+ * The session is closed on the reaper thread, which then calls
+ * @callback with the result of zookeeper_close, once every completion
+ * still pending has been dispatched (with ZCLOSING for the requests
+ * that did not make it).
+ */
+CAMLprim value
+zkocaml_close_async(value zh, value close_callback)
+{
+  CAMLparam2(zh, close_callback);
+
+  zkocaml_handle_t *handle = ZkO_handle_val(zh);
+  if (ZkO_namespace_val(zh) != NULL) {
+    caml_callback(close_callback, zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+    CAMLreturn(Val_unit);
+  }
+  caml_modify_generational_global_root(&(handle->close_callback), close_callback);
+  if (handle->zhandle == NULL)
+    zkocaml_reap(handle, ZKOCAML_REAP_CLOSE, 0);
+  else
+    zkocaml_destroy_handle(zh, 0);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Return the client session id, only valid if the connections
+ * is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE)
+ */
+CAMLprim value
+zkocaml_client_id(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE(handle, zkocaml_build_dummy_client_id_struct());
+
+  const clientid_t *cid = zoo_client_id(handle);
+  result = zkocaml_build_client_id_struct(cid);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Return the timeout for this session, only valid if the connections
+ * is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE). This
+ * value may change after a server re-connect.
+ */
+CAMLprim value
+zkocaml_recv_timeout(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE(handle,Val_int(-1));
+
+  int recv_timeout = zoo_recv_timeout(handle);
+  result = Val_int(recv_timeout);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Return the context for this handle.
+ */
+CAMLprim value
+zkocaml_get_context(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle,caml_copy_string(""));
+
+  zkocaml_watcher_context_t *ctx = (zkocaml_watcher_context_t*) zoo_get_context(handle);
+  result = caml_copy_string((char*)ctx->watcher_ctx);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Set the context for this handle.
+ */
+CAMLprim value
+zkocaml_set_context(value zh, value context)
+{
+  CAMLparam2(zh, context);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle,Val_unit);
+
+  zkocaml_watcher_context_t *ctx = (zkocaml_watcher_context_t*) zoo_get_context(handle);
+  void *old = ctx->watcher_ctx;
+  ctx->watcher_ctx = strdup(String_val(context));
+  free(old);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Set a watcher function
+ * @return previous watcher function
+ */
+CAMLprim value
+zkocaml_set_watcher(value zh, value watcher_callback)
+{
+  CAMLparam2(zh, watcher_callback);
+  CAMLlocal1(result);
+
+  zkocaml_watcher_context_t *ctx = ZkO_handle_val(zh)->context;
+  if (ctx == NULL) CAMLreturn(watcher_callback);
+
+  result = ctx->watcher_callback;
+  caml_modify_generational_global_root(&(ctx->watcher_callback), watcher_callback);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Set or clear the batch watcher of a handle, see "Batched watch
+ * delivery". Replacing a batch watcher delivers the events queued for
+ * the previous one first.
+ *
+ * @window how long in milliseconds the flusher gathers events
+ * @coalesce whether to drop events equal to one still queued
+ *
+ * @return ZOK, or ZBADARGUMENTS if the handle is closed or @window is
+ * negative, or ZSYSTEMERROR if the flusher thread could not be started
+ */
+CAMLprim value
+zkocaml_set_batch_watcher(value zh,
+                          value window,
+                          value coalesce,
+                          value batch_callback)
+{
+  CAMLparam4(zh, window, coalesce, batch_callback);
+
+  zkocaml_handle_t *handle = ZkO_handle_val(zh);
+  if (handle->context == NULL || Int_val(window) < 0)
+    CAMLreturn(zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+
+  zkocaml_watch_batch_stop(handle->watches);
+  if (Is_block(batch_callback) &&
+      !zkocaml_watch_batch_start(handle->watches, handle->context->zh,
+                                 Field(batch_callback, 0),
+                                 Int_val(window), Bool_val(coalesce)))
+    CAMLreturn(zkocaml_enum_error_c2ml(ZSYSTEMERROR));
+
+  CAMLreturn(zkocaml_enum_error_c2ml(ZOK));
+}
+
+/**
+ * Returns the socket address for the current connection
+ *
+ * @return "host:port" of the connected host, "[host]:port" for IPv6,
+ * or "" if the handle is not connected
+ */
+CAMLprim value
+zkocaml_get_connected_host(value zh)
+{
+  CAMLparam1(zh);
+
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  char host[INET6_ADDRSTRLEN];
+  char buffer[INET6_ADDRSTRLEN + 16];
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, caml_copy_string(""));
+
+  if (zookeeper_get_connected_host(handle, (struct sockaddr *)&addr, &addr_len) == NULL)
+    CAMLreturn(caml_copy_string(""));
+  if (addr.ss_family == AF_INET6) {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+    inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+    snprintf(buffer, sizeof(buffer), "[%s]:%d", host, ntohs(in6->sin6_port));
+  } else {
+    struct sockaddr_in *in4 = (struct sockaddr_in *)&addr;
+    inet_ntop(AF_INET, &in4->sin_addr, host, sizeof(host));
+    snprintf(buffer, sizeof(buffer), "%s:%d", host, ntohs(in4->sin_port));
+  }
+
+  CAMLreturn(caml_copy_string(buffer));
+}
+
+/**
+ * Replaces the server list of the handle with @hosts, a comma separated
+ * list of host:port pairs. The client may then move to a new server so
+ * that the load evens out across the ensemble.
+ *
+ * @return ZOK on success, ZBADARGUMENTS if @hosts cannot be resolved,
+ * ZSYSTEMERROR on a failure to allocate
+ */
+CAMLprim value
+zkocaml_set_servers(value zh, value hosts)
+{
+  CAMLparam2(zh, hosts);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+
+  int rc = zoo_set_servers(handle, String_val(hosts));
+
+  CAMLreturn(zkocaml_enum_error_c2ml(rc));
+}
+
+/**
+ * Returns the host:port of the server the handle uses, connected or
+ * not, or "" if there is none.
+ */
+CAMLprim value
+zkocaml_get_current_server(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, caml_copy_string(""));
+
+  char *server = zoo_get_current_server(handle);
+  result = caml_copy_string(server != NULL ? server : "");
+  free(server);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Get the state of the zookeeper connection.
+ *
+ * The return value will be one of the state consts.
+ */
+CAMLprim value
+zkocaml_state(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(state);
+
+  zkocaml_handle_t *handle = ZkO_handle_val(zh);
+
+  if (!handle->zhandle)
+    state = zkocaml_enum_state_c2ml(ZOO_EXPIRED_SESSION_STATE);
+  else
+    state = zkocaml_enum_state_c2ml(zoo_state(handle->zhandle));
+
+  CAMLreturn(state);
+}
+
+/**
+ * Return the number of watchers currently subscribed to the given path,
+ * summed over its exists, data and child watches. Each (path, kind) pair
+ * holds at most one watch with the server regardless of this number.
+ */
+CAMLprim value
+zkocaml_watch_count(value zh, value path)
+{
+  CAMLparam2(zh, path);
+
+  zkocaml_watch_registry_t *registry = ZkO_handle_val(zh)->watches;
+  zkocaml_watch_entry_t *entry = NULL;
+  int count = 0;
+
+  pthread_mutex_lock(&registry->lock);
+  entry = zkocaml_watch_find(registry, zkocaml_ns_path(zh, path), ZKOCAML_WATCH_DATA);
+  if (entry != NULL) count += entry->count;
+  entry = zkocaml_watch_find(registry, zkocaml_ns_path(zh, path), ZKOCAML_WATCH_EXIST);
+  if (entry != NULL) count += entry->count;
+  entry = zkocaml_watch_find(registry, zkocaml_ns_path(zh, path), ZKOCAML_WATCH_CHILD);
+  if (entry != NULL) count += entry->count;
+  pthread_mutex_unlock(&registry->lock);
+
+  CAMLreturn(Val_int(count));
+}
+
+/**
+ * Enable or disable read coalescing on this handle.
+ *
+ * While enabled, aget, aexists and aget_children calls identical to a
+ * read still in flight (same path and watch flag) are not sent to the
+ * server; they are completed together with the pending read instead.
+ */
+CAMLprim value
+zkocaml_set_coalescing(value zh, value enabled)
+{
+  CAMLparam2(zh, enabled);
+
+  zkocaml_flight_table_t *table = ZkO_handle_val(zh)->flights;
+  pthread_mutex_lock(&table->lock);
+  table->enabled = Bool_val(enabled);
+  pthread_mutex_unlock(&table->lock);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Bound the number of async requests in flight on this handle.
+ *
+ * @limit the maximum number of requests in flight, 0 for no limit.
+ *
+ * @mode what an async call does when @limit is reached: Block waits
+ * for a slot with the runtime released, Reject returns ZTHROTTLEDOP,
+ * Queue n parks up to n calls and resubmits them as slots free up.
+ * A call made from a completion or a watcher does not wait: under
+ * Block it goes out over the limit.
+ */
+CAMLprim value
+zkocaml_set_max_inflight(value zh, value limit, value mode)
+{
+  CAMLparam3(zh, limit, mode);
+
+  zkocaml_window_t *window = ZkO_handle_val(zh)->window;
+  pthread_mutex_lock(&window->lock);
+  window->limit = Int_val(limit) > 0 ? Int_val(limit) : 0;
+  if (Is_long(mode)) {
+    window->mode = Int_val(mode) == 0 ? ZKOCAML_WINDOW_BLOCK : ZKOCAML_WINDOW_REJECT;
+    window->queue_limit = 0;
+  } else {
+    window->mode = ZKOCAML_WINDOW_QUEUE;
+    window->queue_limit = Int_val(Field(mode, 0));
+  }
+  pthread_cond_broadcast(&window->cond);
+  pthread_mutex_unlock(&window->lock);
+
+  zkocaml_window_drain(window);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Park @thunk, an async call refused with ZTHROTTLEDOP, in the window
+ * queue of this handle; it is run once a slot is free.
+ *
+ * @return ZOK, or ZTHROTTLEDOP if the handle is not in Queue mode or
+ * its queue is full.
+ */
+CAMLprim value
+zkocaml_window_defer(value zh, value thunk)
+{
+  CAMLparam2(zh, thunk);
+
+  int rc = ZKOCAML_THROTTLED;
+  zkocaml_window_t *window = ZkO_handle_val(zh)->window;
+  pthread_mutex_lock(&window->lock);
+  if (window->mode == ZKOCAML_WINDOW_QUEUE && window->queue_len < window->queue_limit) {
+    zkocaml_deferred_t *deferred = (zkocaml_deferred_t *)
+        malloc(sizeof(zkocaml_deferred_t));
+    deferred->thunk = thunk;
+    deferred->next = NULL;
+    caml_register_generational_global_root(&deferred->thunk);
+    if (window->queue_tail != NULL)
+      window->queue_tail->next = deferred;
+    else
+      window->queue_head = deferred;
+    window->queue_tail = deferred;
+    window->queue_len++;
+    rc = ZOK;
+  }
+  pthread_mutex_unlock(&window->lock);
+
+  /* The slot may have been freed before the thunk was parked. */
+  if (rc == ZOK) zkocaml_window_drain(window);
+
+  CAMLreturn(zkocaml_enum_error_c2ml(rc));
+}
+
+/**
+ * Return the in-flight window counters of this handle.
+ */
+CAMLprim value
+zkocaml_window_stats(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zkocaml_window_t *window = ZkO_handle_val(zh)->window;
+  result = caml_alloc(6, 0);
+  pthread_mutex_lock(&window->lock);
+  Store_field(result, 0, Val_int(window->limit));
+  Store_field(result, 1, Val_int(window->inflight));
+  Store_field(result, 2, Val_long(window->submitted));
+  Store_field(result, 3, Val_long(window->completed));
+  Store_field(result, 4, Val_long(window->throttled));
+  Store_field(result, 5, Val_int(window->queue_len));
+  pthread_mutex_unlock(&window->lock);
+
+  CAMLreturn(result);
+}
+/**
+ * Create a dispatch queue.
+ */
+CAMLprim value
+zkocaml_route_create(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(result);
+
+  zkocaml_route_t *route = (zkocaml_route_t *)calloc(1, sizeof(zkocaml_route_t));
+  pthread_mutex_init(&route->lock, NULL);
+  pthread_cond_init(&route->cond, NULL);
+  atomic_init(&route->refcount, 1);
+  result = caml_alloc_custom(&route_ops, sizeof(zkocaml_route_t *), 0, 1);
+  ZkO_route_val(result) = route;
+
+  CAMLreturn(result);
+}
+
+/**
+ * Route the completions of this handle, and of the namespaced handles
+ * sharing its session, to a dispatch queue, or back to the zookeeper
+ * completion thread with None. Completions still queued on the queue
+ * it leaves are run first, on the calling thread.
+ */
+CAMLprim value
+zkocaml_set_route(value zh, value queue)
+{
+  CAMLparam2(zh, queue);
+
+  zkocaml_window_t *window = ZkO_handle_val(zh)->window;
+  zkocaml_route_t *route = NULL, *old = NULL;
+  if (Is_block(queue))
+    route = zkocaml_route_hold(ZkO_route_val(Field(queue, 0)));
+  pthread_mutex_lock(&window->lock);
+  old = window->route;
+  window->route = route;
+  pthread_mutex_unlock(&window->lock);
+  if (old != route) zkocaml_route_flush(old, window);
+  zkocaml_route_release(old);
+  zkocaml_replay_raise();
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Run the completions routed to a dispatch queue on the calling thread.
+ *
+ * @timeout how long to wait for one with the runtime released, in
+ * milliseconds, forever if negative.
+ *
+ * @return the number of completions run, at most as many as were
+ * queued when they started to run, or -1 once the queue is closed
+ * and empty. An exception raised by a completion stops the run and
+ * is raised once that completion has been fully dispatched.
+ */
+CAMLprim value
+zkocaml_route_run(value queue, value timeout)
+{
+  CAMLparam2(queue, timeout);
+
+  zkocaml_route_t *route = ZkO_route_val(queue);
+  long wait_ms = Long_val(timeout);
+  struct timespec until;
+  int dispatched = 0, budget = 0, replaying = zkocaml_replaying;
+
+  zkocaml_route_drainer = route;
+
+  pthread_mutex_lock(&route->lock);
+  if (route->head == NULL && !route->closed && wait_ms != 0) {
+    pthread_mutex_unlock(&route->lock);
+    caml_enter_blocking_section();
+    clock_gettime(CLOCK_REALTIME, &until);
+    if (wait_ms > 0) {
+      until.tv_sec += wait_ms / 1000;
+      until.tv_nsec += (wait_ms % 1000) * 1000000;
+      if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+      }
+    }
+    pthread_mutex_lock(&route->lock);
+    while (route->head == NULL && !route->closed) {
+      if (wait_ms < 0)
+        pthread_cond_wait(&route->cond, &route->lock);
+      else if (pthread_cond_timedwait(&route->cond, &route->lock, &until) == ETIMEDOUT)
+        break;
+    }
+    pthread_mutex_unlock(&route->lock);
+    caml_leave_blocking_section();
+    pthread_mutex_lock(&route->lock);
+  }
+  if (route->head == NULL && route->closed) dispatched = -1;
+  budget = route->pending;
+
+  zkocaml_replaying = 1;
+  while (dispatched >= 0 && dispatched < budget && route->head != NULL) {
+    zkocaml_routed_t *routed = route->head;
+    route->head = routed->next;
+    if (route->head == NULL) route->tail = NULL;
+    route->pending--;
+    route->dispatched++;
+    pthread_mutex_unlock(&route->lock);
+
+    zkocaml_route_replay(routed);
+    zkocaml_routed_free(routed);
+    zkocaml_route_release(route);
+    dispatched++;
+
+    pthread_mutex_lock(&route->lock);
+    if (zkocaml_replay_exn != Val_unit) break;
+  }
+  pthread_mutex_unlock(&route->lock);
+  zkocaml_replaying = replaying;
+
+  /* Raised only now that the completion has been cleaned up after. */
+  zkocaml_replay_raise();
+
+  CAMLreturn(Val_int(dispatched));
+}
+
+/**
+ * Close a dispatch queue: threads waiting on it return once it is
+ * empty, and the handles still routed to it complete on the zookeeper
+ * completion thread again.
+ */
+CAMLprim value
+zkocaml_route_close(value queue)
+{
+  CAMLparam1(queue);
+
+  zkocaml_route_t *route = ZkO_route_val(queue);
+  pthread_mutex_lock(&route->lock);
+  route->closed = 1;
+  pthread_cond_broadcast(&route->cond);
+  pthread_mutex_unlock(&route->lock);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Return the counters of a dispatch queue.
+ */
+CAMLprim value
+zkocaml_route_stats(value queue)
+{
+  CAMLparam1(queue);
+  CAMLlocal1(result);
+
+  zkocaml_route_t *route = ZkO_route_val(queue);
+  result = caml_alloc(3, 0);
+  pthread_mutex_lock(&route->lock);
+  Store_field(result, 0, Val_long(route->routed));
+  Store_field(result, 1, Val_long(route->dispatched));
+  Store_field(result, 2, Val_int(route->pending));
+  pthread_mutex_unlock(&route->lock);
+
+  CAMLreturn(result);
+}
+
+
+/**
+ * Return the monotonic time in milliseconds @ms from now, for use as
+ * a call deadline.
+ */
+CAMLprim value
+zkocaml_deadline_after(value ms)
+{
+  CAMLparam1(ms);
+  CAMLreturn(Val_long(zkocaml_now_ms() + Long_val(ms)));
+}
+
+/**
+ * Return the deadline set for the calls of the current thread, 0 if
+ * none.
+ */
+CAMLprim value
+zkocaml_get_call_deadline(value unit)
+{
+  CAMLparam1(unit);
+  CAMLreturn(Val_long(zkocaml_call_deadline));
+}
+
+/**
+ * Set the deadline of the async calls made next by the current
+ * thread, 0 for none.
+ */
+CAMLprim value
+zkocaml_set_call_deadline(value deadline)
+{
+  CAMLparam1(deadline);
+  zkocaml_call_deadline = Long_val(deadline);
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Set the retry policy of this handle.
+ *
+ * Idempotent calls and version-guarded writes failing with
+ * ZCONNECTIONLOSS are retried up to @max_attempts times, after a
+ * backoff drawn uniformly between 0 and @base_delay * 2^attempt,
+ * capped at @max_delay. No more than @budget retries per second are
+ * made across the handle, 0 meaning no limit.
+ */
+CAMLprim value
+zkocaml_set_retry_policy(value zh, value policy)
+{
+  CAMLparam2(zh, policy);
+
+  zkocaml_retry_t *retry = ZkO_handle_val(zh)->retry;
+  pthread_mutex_lock(&retry->lock);
+  retry->max_attempts = Int_val(Field(policy, 0));
+  retry->base_ms = (int64_t)(Double_val(Field(policy, 1)) * 1000.0);
+  retry->max_ms = (int64_t)(Double_val(Field(policy, 2)) * 1000.0);
+  if (retry->base_ms < 1) retry->base_ms = 1;
+  if (retry->max_ms < retry->base_ms) retry->max_ms = retry->base_ms;
+  retry->budget = (double)Int_val(Field(policy, 3));
+  retry->tokens = retry->budget;
+  retry->refilled = zkocaml_now_ms();
+  pthread_mutex_unlock(&retry->lock);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Return the backoff in milliseconds before retrying an @op call for
+ * the @attempt-th time (from 0), or -1 if it must not be retried.
+ */
+CAMLprim value
+zkocaml_retry_delay(value zh, value op, value attempt)
+{
+  CAMLparam3(zh, op, attempt);
+
+  int64_t delay = 0;
+  zkocaml_retry_t *retry = ZkO_handle_val(zh)->retry;
+  pthread_mutex_lock(&retry->lock);
+  delay = zkocaml_retry_next(retry, (ZKOCAML_RETRY_OP)Int_val(op), Int_val(attempt));
+  pthread_mutex_unlock(&retry->lock);
+
+  CAMLreturn(Val_long(delay));
+}
+
+/**
+ * Run @thunk from the timer thread in @ms milliseconds.
+ */
+CAMLprim value
+zkocaml_retry_after(value ms, value thunk)
+{
+  CAMLparam2(ms, thunk);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)
+      calloc(1, sizeof(zkocaml_completion_context_t));
+  ctx->kind = ZKOCAML_COMPLETION_THUNK;
+  ctx->completion_callback = thunk;
+  caml_register_generational_global_root(&(ctx->completion_callback));
+  if (!zkocaml_timer_arm(ctx, zkocaml_now_ms() + Long_val(ms))) {
+    caml_remove_generational_global_root(&(ctx->completion_callback));
+    free(ctx);
+    caml_callback(thunk, Val_unit);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Return the retries made and given up for @op calls on this handle.
+ */
+CAMLprim value
+zkocaml_retry_stats(value zh, value op)
+{
+  CAMLparam2(zh, op);
+  CAMLlocal1(result);
+
+  zkocaml_retry_t *retry = ZkO_handle_val(zh)->retry;
+  result = caml_alloc(2, 0);
+  pthread_mutex_lock(&retry->lock);
+  Store_field(result, 0, Val_long(retry->retries[Int_val(op)]));
+  Store_field(result, 1, Val_long(retry->given_up[Int_val(op)]));
+  pthread_mutex_unlock(&retry->lock);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Create a node.
+ *
+ * This method will create a node in ZooKeeper. A node can only be created if
+ * it does not already exists. The Create Flags affect the creation of nodes.
+ * If ZOO_EPHEMERAL flag is set, the node will automatically get removed if the
+ * client session goes away. If the ZOO_SEQUENCE flag is set, a unique
+ * monotonically increasing sequence number is appended to the path name. The
+ * sequence number is always fixed length of 10 digits, 0 padded.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path The name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @value The data to be stored in the node.
+ *
+ * @acl The initial ACL of the node. The ACL must not be null or empty.
+ *
+ * @flags this parameter can be set to 0 for normal create or an OR
+ * of the Create Flags
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the parent node does not exist.
+ *   ZNODEEXISTS the node already exists
+ *   ZNOAUTH the client does not have permission.
+ *   ZNOCHILDRENFOREPHEMERALS cannot create children of ephemeral nodes.
+ *
+ * @data The data that will be passed to the completion routine when the
+ * function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+
+static value
+zkocaml_acreate_acl(value zh,
+                    value path,
+                    value val,
+                    const struct ACL_vector *acl,
+                    value flags,
+                    value completion,
+                    value data)
+{
+  CAMLparam5(zh, path, val, flags, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  int local_flags = zkocaml_create_mode(zkocaml_enum_create_flag_ml2c(flags), 0);
+  if (local_flags < 0) CAMLreturn(zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+  RETURN_IF_THROTTLED (zh, handle);
+
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STRING);
+  local_data->window = ZkO_handle_val(zh)->window;
+  local_data->strip = zkocaml_ns_len(zh);
+  zkocaml_flight_detach(ZkO_handle_val(zh), zkocaml_ns_path(zh, path));
+
+  int rc = zoo_acreate(handle,
+                       zkocaml_ns_path(zh, path),
+                       String_val(val),
+                       caml_string_length(val),
+                       acl,
+                       local_flags,
+                       string_completion_dispatch,
+                       local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_acreate_native(value zh,
+                       value path,
                        value val,
                        value acl,
                        value flags,
                        value completion,
                        value data)
 {
-  CAMLparam5(zh, path, val, acl, flags);
-  CAMLxparam2(completion, data);
+  CAMLparam5(zh, path, val, acl, flags);
+  CAMLxparam2(completion, data);
+  CAMLlocal1(result);
+
+  struct ACL_vector local_acl;
+  int r = zkocaml_parse_acls(acl, &local_acl);
+  result = zkocaml_acreate_acl(zh, path, val,
+                               r ? &local_acl : &ZOO_OPEN_ACL_UNSAFE,
+                               flags, completion, data);
+  if (r) zkocaml_free_acls(&local_acl);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_acreate_bytecode(value *argv, int argn)
+{
+  return zkocaml_acreate_native(argv[0], argv[1], argv[2], argv[3],
+                                argv[4], argv[5], argv[6]);
+}
+
+/**
+ * Create a node asynchronously with a prepared acl_handle.
+ */
+CAMLprim value
+zkocaml_acreate_prepared_native(value zh,
+                                value path,
+                                value val,
+                                value acl,
+                                value flags,
+                                value completion,
+                                value data)
+{
+  CAMLparam5(zh, path, val, acl, flags);
+  CAMLxparam2(completion, data);
+  CAMLreturn(zkocaml_acreate_acl(zh, path, val, ZkO_acl_val(acl),
+                                 flags, completion, data));
+}
+
+CAMLprim value
+zkocaml_acreate_prepared_bytecode(value *argv, int argn)
+{
+  return zkocaml_acreate_prepared_native(argv[0], argv[1], argv[2], argv[3],
+                                         argv[4], argv[5], argv[6]);
+}
+
+/**
+ * Create a node, completing with its stat as well as its path.
+ *
+ * Same as acreate, but for @ttl: if not 0, the node is a persistent
+ * node (sequential if ZOO_SEQUENCE is given) that the server deletes
+ * once it has had no children nor writes for @ttl milliseconds. The
+ * server must have extended types enabled for TTL nodes.
+ *
+ * @return ZOK on success, ZBADARGUMENTS if the flags and @ttl do not
+ * go together, or one of the errcodes of acreate.
+ */
+CAMLprim value
+zkocaml_acreate2_native(value zh,
+                        value path,
+                        value val,
+                        value acl,
+                        value flags,
+                        value ttl,
+                        value completion,
+                        value data)
+{
+  CAMLparam5(zh, path, val, acl, flags);
+  CAMLxparam3(ttl, completion, data);
+  CAMLlocal1(result);
+
+  struct ACL_vector local_acl;
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  int64_t local_ttl = Int64_val(ttl);
+  int local_flags = zkocaml_create_mode(zkocaml_enum_create_flag_ml2c(flags), local_ttl);
+  if (local_flags < 0) CAMLreturn(zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+  RETURN_IF_THROTTLED (zh, handle);
+
+  int r = zkocaml_parse_acls(acl, &local_acl);
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STRING_STAT);
+  local_data->window = ZkO_handle_val(zh)->window;
+  local_data->strip = zkocaml_ns_len(zh);
+  zkocaml_flight_detach(ZkO_handle_val(zh), zkocaml_ns_path(zh, path));
+
+  int rc = local_ttl == 0
+    ? zoo_acreate2(handle,
+                   zkocaml_ns_path(zh, path),
+                   String_val(val),
+                   caml_string_length(val),
+                   r ? &local_acl : &ZOO_OPEN_ACL_UNSAFE,
+                   local_flags,
+                   string_stat_completion_dispatch,
+                   local_data)
+    : zoo_acreate2_ttl(handle,
+                       zkocaml_ns_path(zh, path),
+                       String_val(val),
+                       caml_string_length(val),
+                       r ? &local_acl : &ZOO_OPEN_ACL_UNSAFE,
+                       local_flags,
+                       local_ttl,
+                       string_stat_completion_dispatch,
+                       local_data);
+  if (r) zkocaml_free_acls(&local_acl);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_acreate2_bytecode(value *argv, int argn)
+{
+  return zkocaml_acreate2_native(argv[0], argv[1], argv[2], argv[3],
+                                 argv[4], argv[5], argv[6], argv[7]);
+}
+
+/**
+ * Multi transactions.
+ *
+ * zoo_amulti serializes the operations of a multi as it is called, but
+ * the results and the buffers they point to (created paths, stats of
+ * set operations) must outlive the call: they live in a zkocaml_multi_t
+ * freed once the completion is dispatched.
+ *
+ * In OCaml, an operation is one of
+ *
+ *   Create_op of string * string * acls * create_flag array
+ *   Delete_op of string * int
+ *   Set_op of string * string * int
+ *   Check_op of string * int
+ *
+ * and a result is {op_error: error; op_path: string; op_stat: stat}.
+ */
+
+static void
+zkocaml_multi_free(zkocaml_multi_t *multi)
+{
+  int i = 0;
+  if (multi == NULL) return;
+  for (; i < multi->count; i++) {
+    free(multi->paths[i]);
+    free(multi->created[i]);
+    zkocaml_free_acls(&multi->acls[i]);
+  }
+  free(multi->ops);
+  free(multi->results);
+  free(multi->paths);
+  free(multi->created);
+  free(multi->stats);
+  free(multi->acls);
+  free(multi);
+}
+
+/**
+ * Builds the multi of the OCaml @ops as seen from @zh. The values of
+ * the operations point into the OCaml heap, so the multi must be
+ * submitted before the runtime is released. Returns NULL if a create
+ * operation has an invalid mode.
+ */
+static zkocaml_multi_t *
+zkocaml_multi_new(value zh, value ops)
+{
+  int i = 0, count = Wosize_val(ops);
+  zkocaml_multi_t *multi = (zkocaml_multi_t *)
+      calloc(1, sizeof(zkocaml_multi_t));
+
+  multi->count = count;
+  multi->ops = (zoo_op_t *) calloc(count + 1, sizeof(zoo_op_t));
+  multi->results = (zoo_op_result_t *) calloc(count + 1, sizeof(zoo_op_result_t));
+  multi->paths = (char **) calloc(count + 1, sizeof(char *));
+  multi->created = (char **) calloc(count + 1, sizeof(char *));
+  multi->stats = (struct Stat *) calloc(count + 1, sizeof(struct Stat));
+  multi->acls = (struct ACL_vector *) calloc(count + 1, sizeof(struct ACL_vector));
+
+  for (; i < count; i++) {
+    value op = Field(ops, i);
+    multi->paths[i] = strdup(zkocaml_ns_path(zh, Field(op, 0)));
+
+    switch (Tag_val(op)) {
+    case 0: {
+      int mode = zkocaml_create_mode(zkocaml_enum_create_flag_ml2c(Field(op, 3)), 0);
+      int len = strlen(multi->paths[i]) + 16;
+      if (mode < 0) {
+        zkocaml_multi_free(multi);
+        return NULL;
+      }
+      multi->created[i] = (char *) calloc(len, 1);
+      zoo_create_op_init(&multi->ops[i],
+                         multi->paths[i],
+                         String_val(Field(op, 1)),
+                         caml_string_length(Field(op, 1)),
+                         zkocaml_parse_acls(Field(op, 2), &multi->acls[i])
+                           ? &multi->acls[i] : &ZOO_OPEN_ACL_UNSAFE,
+                         mode,
+                         multi->created[i],
+                         len);
+      break;
+    }
+    case 1:
+      zoo_delete_op_init(&multi->ops[i], multi->paths[i], Int_val(Field(op, 1)));
+      break;
+    case 2:
+      zoo_set_op_init(&multi->ops[i],
+                      multi->paths[i],
+                      String_val(Field(op, 1)),
+                      caml_string_length(Field(op, 1)),
+                      Int_val(Field(op, 2)),
+                      &multi->stats[i]);
+      break;
+    case 3:
+      zoo_check_op_init(&multi->ops[i], multi->paths[i], Int_val(Field(op, 1)));
+      break;
+    }
+  }
+
+  return multi;
+}
+
+/**
+ * The OCaml results of @multi, completed with @rc. A multi that failed
+ * as a whole (connection loss, timeout) has no results.
+ */
+static value
+zkocaml_build_multi_results(const zkocaml_multi_t *multi, int rc, size_t strip)
+{
+  CAMLparam0();
+  CAMLlocal3(results, result, field);
+  int i = 0, failed = 0;
+
+  for (; rc != ZOK && i < multi->count; i++)
+    if (multi->results[i].err != ZOK) failed = 1;
+  if (multi->count == 0 || (rc != ZOK && !failed)) CAMLreturn(Atom(0));
+
+  results = caml_alloc(multi->count, 0);
+  for (i = 0; i < multi->count; i++) {
+    const zoo_op_result_t *r = &multi->results[i];
+    result = caml_alloc(3, 0);
+    Store_field(result, 0, zkocaml_enum_error_c2ml(r->err));
+    field = caml_copy_string(r->err == ZOK && r->value != NULL
+                             ? zkocaml_ns_strip(r->value, strip) : "");
+    Store_field(result, 1, field);
+    field = zkocaml_build_stat_struct(r->err == ZOK ? r->stat : NULL);
+    Store_field(result, 2, field);
+    Store_field(results, i, result);
+  }
+
+  CAMLreturn(results);
+}
+
+/**
+ * Called when a multi transaction completes and dispatches user
+ * provided callback with the results of its operations.
+ */
+static void
+multi_completion_dispatch(int rc, const void *data)
+{
+  if (zkocaml_route_defer((zkocaml_completion_context_t *)data,
+                          ZKOCAML_COMPLETION_MULTI, 0, rc,
+                          NULL, 0, NULL, NULL, NULL))
+    return;
+
+  zkocaml_enter_callback();
+  CAMLparam0();
+
+  CAMLlocal1(completion_callback);
+  CAMLlocal3(local_rc, local_results, local_data);
+
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  completion_callback = ctx->completion_callback;
+  zkocaml_window_release(ctx->window);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_results = zkocaml_build_multi_results(ctx->multi, rc, ctx->strip);
+  local_data = caml_copy_string(ctx->data);
+  zkocaml_multi_free(ctx->multi);
+  ctx->multi = NULL;
+
+  if (zkocaml_deadline_disarm(ctx))
+    zkocaml_callback3(completion_callback, local_rc, local_results, local_data);
+
+  zkocaml_window_drain(ctx->window);
+  zkocaml_completion_free(ctx);
+
+  CAMLdrop;
+  zkocaml_leave_callback();
+}
+/**
+ * Runs the dispatch a routed completion was queued from, with the
+ * runtime held by the draining thread.
+ */
+static void
+zkocaml_route_replay(zkocaml_routed_t *routed)
+{
+  zkocaml_completion_context_t *ctx = routed->ctx;
+  int rc = routed->rc;
+
+  /* No longer parked: the dispatch releases the slots. */
+  if (routed->lent > 0) {
+    pthread_mutex_lock(&ctx->window->lock);
+    ctx->window->parked -= routed->lent;
+    pthread_mutex_unlock(&ctx->window->lock);
+  }
+
+  switch (routed->kind) {
+  case ZKOCAML_COMPLETION_VOID:
+    void_completion_dispatch(rc, ctx);
+    break;
+  case ZKOCAML_COMPLETION_STAT:
+    if (routed->flight)
+      stat_flight_deliver(rc, routed->stat, ctx);
+    else
+      stat_completion_dispatch(rc, routed->stat, ctx);
+    break;
+  case ZKOCAML_COMPLETION_DATA:
+    if (routed->flight)
+      data_flight_deliver(rc, routed->val, routed->val_len, routed->stat, ctx);
+    else
+      data_completion_dispatch(rc, routed->val, routed->val_len, routed->stat, ctx);
+    break;
+  case ZKOCAML_COMPLETION_STRINGS:
+    if (routed->flight)
+      strings_flight_deliver(rc, routed->strings, ctx);
+    else
+      strings_completion_dispatch(rc, routed->strings, ctx);
+    break;
+  case ZKOCAML_COMPLETION_STRINGS_STAT:
+    strings_stat_completion_dispatch(rc, routed->strings, routed->stat, ctx);
+    break;
+  case ZKOCAML_COMPLETION_STRING:
+    string_completion_dispatch(rc, routed->val, ctx);
+    break;
+  case ZKOCAML_COMPLETION_STRING_STAT:
+    string_stat_completion_dispatch(rc, routed->val, routed->stat, ctx);
+    break;
+  case ZKOCAML_COMPLETION_ACL:
+    acl_completion_dispatch(rc, routed->acl, routed->stat, ctx);
+    break;
+  case ZKOCAML_COMPLETION_MULTI:
+    multi_completion_dispatch(rc, ctx);
+    break;
+  case ZKOCAML_COMPLETION_EXPIRED:
+    /* A copy, queued by zkocaml_deadline_route. */
+    zkocaml_deadline_expire(ctx);
+    zkocaml_completion_free(ctx);
+    break;
+  case ZKOCAML_COMPLETION_THUNK:
+    break;
+  }
+}
+
+
+/**
+ * Atomically commits multiple zookeeper operations.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @ops the operations to commit, all or none of them
+ *
+ * @completion the routine to invoke when the request completes, with
+ * the result of each operation. The completion will be triggered with
+ * ZOK if all of them succeeded, or with the error of the first that
+ * failed, all the others then failing with ZRUNTIMEINCONSISTENCY.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_amulti(value zh,
+               value ops,
+               value completion,
+               value data)
+{
+  CAMLparam4(zh, ops, completion, data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  /* Before the ops point into the values, which a wait may move. */
+  RETURN_IF_THROTTLED (zh, handle);
+  zkocaml_multi_t *multi = zkocaml_multi_new(zh, ops);
+  if (multi == NULL) {
+    zkocaml_window_cancel(ZkO_handle_val(zh)->window);
+    CAMLreturn(zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+  }
+
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  local_data->multi = multi;
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_MULTI);
+  local_data->window = ZkO_handle_val(zh)->window;
+  local_data->strip = zkocaml_ns_len(zh);
+  for (int i = 0; i < multi->count; i++)
+    zkocaml_flight_detach(ZkO_handle_val(zh), multi->paths[i]);
+
+  int rc = zoo_amulti(handle,
+                      multi->count,
+                      multi->ops,
+                      multi->results,
+                      multi_completion_dispatch,
+                      local_data);
+  if (rc != ZOK) {
+    zkocaml_multi_free(multi);
+    local_data->multi = NULL;
+    zkocaml_completion_abort(local_data);
+  }
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Atomically commits multiple zookeeper operations synchronously.
+ *
+ * @return a pair of the result code, as for amulti, and the results
+ * of the operations.
+ */
+CAMLprim value
+zkocaml_multi(value zh, value ops)
+{
+  CAMLparam2(zh, ops);
+  CAMLlocal2(result, results);
+
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  Store_field(result, 1, Atom(0));
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, result);
+
+  zkocaml_multi_t *multi = zkocaml_multi_new(zh, ops);
+  if (multi == NULL) {
+    Store_field(result, 0, zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+    CAMLreturn(result);
+  }
+
+  for (int i = 0; i < multi->count; i++)
+    zkocaml_flight_detach(ZkO_handle_val(zh), multi->paths[i]);
+  int rc = zoo_multi(handle, multi->count, multi->ops, multi->results);
+  results = zkocaml_build_multi_results(multi, rc, zkocaml_ns_len(zh));
+  zkocaml_multi_free(multi);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(rc));
+  Store_field(result, 1, results);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Delete a node in zookeeper.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @version the expected version of the node. The function will fail if the
+ * actual version of the node does not match the expected version.
+ * If -1 is used the version check will not take place.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *   ZBADVERSION expected version does not match actual version.
+ *   ZNOTEMPTY children are present; node cannot be deleted.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_adelete(value zh,
+                value path,
+                value version,
+                value completion,
+                value data)
+{
+  CAMLparam5(zh, path, version, completion, data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle,zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
+
+  const char *local_path = zkocaml_ns_path(zh, path);
+  int local_version = Int_val(version);
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_VOID);
+  local_data->window = ZkO_handle_val(zh)->window;
+  zkocaml_flight_detach(ZkO_handle_val(zh), local_path);
+
+  int rc = zoo_adelete(handle,
+                       local_path,
+                       local_version,
+                       void_completion_dispatch,
+                       local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Checks the existence of a node in zookeeper.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watch if nonzero, a watch will be set at the server to notify the
+ * client if the node changes. The watch will be set even if the node does not
+ * exist. This allows clients to watch for nodes to appear.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when the
+ * function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aexists(value zh,
+                value path,
+                value watch,
+                value completion,
+                value data)
+{
+  CAMLparam5(zh, path, watch, completion, data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle,zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
+
+  const char *local_path = zkocaml_ns_path(zh, path);
+  int local_watch = Int_val(watch);
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STAT);
+  zkocaml_flight_t *flight = NULL;
+  if (zkocaml_flight_join(ZkO_handle_val(zh), ZKOCAML_FLIGHT_EXISTS,
+                          local_path, local_watch, local_data, &flight)) {
+    zkocaml_window_release(ZkO_handle_val(zh)->window);
+    CAMLreturn(zkocaml_enum_error_c2ml(ZOK));
+  }
+  local_data->window = ZkO_handle_val(zh)->window;
+
+  int rc = zoo_aexists(handle,
+                       local_path,
+                       local_watch,
+                       flight ? stat_flight_dispatch : stat_completion_dispatch,
+                       flight ? (void *)flight : (void *)local_data);
+  if (rc != ZOK && flight != NULL)
+    zkocaml_flight_abort(flight, local_data, rc);
+  else if (rc != ZOK)
+    zkocaml_completion_abort(local_data);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Checks the existence of a node in zookeeper.
+ *
+ * This function is similar to zoo_axists except it allows one specify
+ * a watcher object - a function pointer and associated context. The function
+ * will be called once the watch has fired. The associated context data will be
+ * passed to the function as the watcher context parameter.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watcher if non-null a watch will set on the specified znode on the server.
+ * The watch will be set even if the node does not exist. This allows clients
+ * to watch for nodes to appear.
+ *
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ * Unlike the global context set by zookeeper_init, this watcher context
+ * is associated with the given instance of the watcher only.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when the
+ * function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_awexists_native(value zh,
+                        value path,
+                        value watcher_callback,
+                        value watcher_ctx,
+                        value completion,
+                        value data)
+{
+  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
+
+  const char *local_path = zkocaml_ns_path(zh, path);
+  uint64_t sub_id = 0;
+  zkocaml_watch_entry_t *local_ctx = zkocaml_watch_subscribe(zh, path, ZKOCAML_WATCH_EXIST,
+                                                             watcher_callback, watcher_ctx, &sub_id);
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STAT);
+  local_data->window = ZkO_handle_val(zh)->window;
+  local_data->watch = local_ctx;
+  local_data->watch_sub = sub_id;
+
+  int rc = zoo_awexists(handle,
+                        local_path,
+                        watch_registry_dispatch,
+                        local_ctx,
+                        stat_completion_dispatch,
+                        local_data);
+  if (rc != ZOK) {
+    zkocaml_completion_abort(local_data);
+    zkocaml_watch_done(local_ctx, sub_id, 0);
+  }
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_awexists_bytecode(value *argv, int argn)
+{
+  return zkocaml_awexists_native(argv[0], argv[1], argv[2],
+                                 argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Gets the data associated with a node.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aget(value zh,
+             value path,
+             value watch,
+             value completion,
+             value data)
+{
+  CAMLparam5(zh, path, watch, completion, data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
+
+  const char *local_path = zkocaml_ns_path(zh, path);
+  int local_watch = Int_val(watch);
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_DATA);
+  zkocaml_flight_t *flight = NULL;
+  if (zkocaml_flight_join(ZkO_handle_val(zh), ZKOCAML_FLIGHT_GET,
+                          local_path, local_watch, local_data, &flight)) {
+    zkocaml_window_release(ZkO_handle_val(zh)->window);
+    CAMLreturn(zkocaml_enum_error_c2ml(ZOK));
+  }
+  local_data->window = ZkO_handle_val(zh)->window;
+
+  int rc = zoo_aget(handle,
+                    local_path,
+                    local_watch,
+                    flight ? data_flight_dispatch : data_completion_dispatch,
+                    flight ? (void *)flight : (void *)local_data);
+  if (rc != ZOK && flight != NULL)
+    zkocaml_flight_abort(flight, local_data, rc);
+  else if (rc != ZOK)
+    zkocaml_completion_abort(local_data);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Gets the data associated with a node.
+ *
+ * This function is similar to zoo_aget except it allows one specify
+ * a watcher object rather than a boolean watch flag.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watcher if non-null, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ * Unlike the global context set by zookeeper_init, this watcher context
+ * is associated with the given instance of the watcher only.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_awget_native(value zh,
+                     value path,
+                     value watcher_callback,
+                     value watcher_ctx,
+                     value completion,
+                     value data)
+{
+  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
+
+  const char *local_path = zkocaml_ns_path(zh, path);
+  uint64_t sub_id = 0;
+  zkocaml_watch_entry_t *local_ctx = zkocaml_watch_subscribe(zh, path, ZKOCAML_WATCH_DATA,
+                                                             watcher_callback, watcher_ctx, &sub_id);
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_DATA);
+  local_data->window = ZkO_handle_val(zh)->window;
+  local_data->watch = local_ctx;
+  local_data->watch_sub = sub_id;
+
+  int rc = zoo_awget(handle,
+                     local_path,
+                     watch_registry_dispatch,
+                     local_ctx,
+                     data_completion_dispatch,
+                     local_data);
+  if (rc != ZOK) {
+    zkocaml_completion_abort(local_data);
+    zkocaml_watch_done(local_ctx, sub_id, 0);
+  }
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_awget_bytecode(value *argv, int argn)
+{
+  return zkocaml_awget_native(argv[0], argv[1], argv[2],
+                              argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Sets the data associated with a node.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @buffer the buffer holding data to be written to the node.
+ *
+ * @version the expected version of the node. The function will fail if
+ * the actual version of the node does not match the expected version. If -1 is
+ * used the version check will not take place. * completion: If null,
+ * the function will execute synchronously. Otherwise, the function will return
+ * immediately and invoke the completion routine when the request completes.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *   ZBADVERSION expected version does not match actual version.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aset_native(value zh,
+                    value path,
+                    value buffer,
+                    value version,
+                    value completion,
+                    value data)
+{
+  CAMLparam5(zh, path, buffer, version, completion);
+  CAMLxparam1(data);
   CAMLlocal1(result);
 
-  struct ACL_vector local_acl;
-
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
 
-  int r = zkocaml_parse_acls(acl, &local_acl);
-  if (r == 0) {
-    local_acl = ZOO_OPEN_ACL_UNSAFE;
-  }
-  int local_flags = zkocaml_enum_create_flag_ml2c(flags);
   zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STAT);
+  local_data->window = ZkO_handle_val(zh)->window;
+  zkocaml_flight_detach(ZkO_handle_val(zh), zkocaml_ns_path(zh, path));
 
-  int rc = zoo_acreate(handle,
-                       String_val(path),
-                       String_val(val),
-                       caml_string_length(val),
-                       (const struct ACL_vector *)&local_acl,
-                       local_flags,
-                       string_completion_dispatch,
-                       local_data);
+  int rc = zoo_aset(handle,
+                    zkocaml_ns_path(zh, path),
+                    String_val(buffer),
+                    caml_string_length(buffer),
+                    Int_val(version),
+                    stat_completion_dispatch,
+                    local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
 CAMLprim value
-zkocaml_acreate_bytecode(value *argv, int argn)
+zkocaml_aset_bytecode(value *argv, int argn)
 {
-  return zkocaml_acreate_native(argv[0], argv[1], argv[2], argv[3],
-                                argv[4], argv[5], argv[6]);
+  return zkocaml_aset_native(argv[0], argv[1], argv[2],
+                             argv[3], argv[4], argv[5]);
 }
 
 /**
- * Delete a node in zookeeper.
+ * Lists the children of a node.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @version the expected version of the node. The function will fail if the
- * actual version of the node does not match the expected version.
- * If -1 is used the version check will not take place.
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the node changes.
  *
  * @completion the routine to invoke when the request completes. The completion
  * will be triggered with one of the following codes passed in as the rc argument:
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *   ZBADVERSION expected version does not match actual version.
- *   ZNOTEMPTY children are present; node cannot be deleted.
  *
  * @data the data that will be passed to the completion routine when
  * the function completes.
@@ -1225,43 +5435,62 @@ zkocaml_acreate_bytecode(value *argv, int argn)
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_adelete(value zh,
-                value path,
-                value version,
-                value completion,
-                value data)
+zkocaml_aget_children(value zh,
+                      value path,
+                      value watch,
+                      value completion,
+                      value data)
 {
-  CAMLparam5(zh, path, version, completion, data);
+  CAMLparam5(zh, path, watch, completion, data);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle,zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
 
-  const char *local_path = String_val(path);
-  int local_version = Int_val(version);
+  const char *local_path = zkocaml_ns_path(zh, path);
+  int local_watch = Int_val(watch);
   zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STRINGS);
+  zkocaml_flight_t *flight = NULL;
+  if (zkocaml_flight_join(ZkO_handle_val(zh), ZKOCAML_FLIGHT_CHILDREN,
+                          local_path, local_watch, local_data, &flight)) {
+    zkocaml_window_release(ZkO_handle_val(zh)->window);
+    CAMLreturn(zkocaml_enum_error_c2ml(ZOK));
+  }
+  local_data->window = ZkO_handle_val(zh)->window;
 
-  int rc = zoo_adelete(handle,
-                       local_path,
-                       local_version,
-                       void_completion_dispatch,
-                       local_data);
+  int rc = zoo_aget_children(handle,
+                             local_path,
+                             local_watch,
+                             flight ? strings_flight_dispatch : strings_completion_dispatch,
+                             flight ? (void *)flight : (void *)local_data);
+  if (rc != ZOK && flight != NULL)
+    zkocaml_flight_abort(flight, local_data, rc);
+  else if (rc != ZOK)
+    zkocaml_completion_abort(local_data);
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
 /**
- * Checks the existence of a node in zookeeper.
+ * Lists the children of a node.
+ *
+ * This function is similar to zoo_aget_children except it allows one specify
+ * a watcher object rather than a boolean watch flag.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @watch if nonzero, a watch will be set at the server to notify the
- * client if the node changes. The watch will be set even if the node does not
- * exist. This allows clients to watch for nodes to appear.
+ * @watcher if non-null, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ * Unlike the global context set by zookeeper_init, this watcher context
+ * is associated with the given instance of the watcher only.
  *
  * @completion the routine to invoke when the request completes. The completion
  * will be triggered with one of the following codes passed in as the rc argument:
@@ -1269,8 +5498,8 @@ zkocaml_adelete(value zh,
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
  *
- * @data the data that will be passed to the completion routine when the
- * function completes.
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
  *
  * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
@@ -1278,48 +5507,126 @@ zkocaml_adelete(value zh,
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aexists(value zh,
-                value path,
-                value watch,
-                value completion,
-                value data)
+zkocaml_awget_children_native(value zh,
+                              value path,
+                              value watcher_callback,
+                              value watcher_ctx,
+                              value completion,
+                              value data)
+{
+  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
+
+  const char *local_path = zkocaml_ns_path(zh, path);
+  uint64_t sub_id = 0;
+  zkocaml_watch_entry_t *local_ctx = zkocaml_watch_subscribe(zh, path, ZKOCAML_WATCH_CHILD,
+                                                             watcher_callback, watcher_ctx, &sub_id);
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STRINGS);
+  local_data->window = ZkO_handle_val(zh)->window;
+  local_data->watch = local_ctx;
+  local_data->watch_sub = sub_id;
+
+  int rc = zoo_awget_children(handle,
+                              local_path,
+                              watch_registry_dispatch,
+                              local_ctx,
+                              strings_completion_dispatch,
+                              local_data);
+  if (rc != ZOK) {
+    zkocaml_completion_abort(local_data);
+    zkocaml_watch_done(local_ctx, sub_id, 0);
+  }
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_awget_children_bytecode(value *argv, int argn)
+{
+  return zkocaml_awget_children_native(argv[0], argv[1], argv[2],
+                                       argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Lists the children of a node, and get the parent stat.
+ *
+ * This function is new in version 3.3.0
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aget_children2(value zh,
+                       value path,
+                       value watch,
+                       value completion,
+                       value data)
 {
   CAMLparam5(zh, path, watch, completion, data);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle,zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
 
-  const char *local_path = String_val(path);
+  const char *local_path = zkocaml_ns_path(zh, path);
   int local_watch = Int_val(watch);
   zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STRINGS_STAT);
+  local_data->window = ZkO_handle_val(zh)->window;
 
-  int rc = zoo_aexists(handle,
-                       local_path,
-                       local_watch,
-                       stat_completion_dispatch,
-                       local_data);
+  int rc = zoo_aget_children2(handle,
+                              local_path,
+                              local_watch,
+                              strings_stat_completion_dispatch,
+                              local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
 /**
- * Checks the existence of a node in zookeeper.
+ * Lists the children of a node, and get the parent stat.
  *
- * This function is similar to zoo_axists except it allows one specify
- * a watcher object - a function pointer and associated context. The function
- * will be called once the watch has fired. The associated context data will be
- * passed to the function as the watcher context parameter.
+ * This function is similar to zoo_aget_children2 except it allows one specify
+ * a watcher object rather than a boolean watch flag.
+ *
+ * This function is new in version 3.3.0
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @watcher if non-null a watch will set on the specified znode on the server.
- * The watch will be set even if the node does not exist. This allows clients
- * to watch for nodes to appear.
+ * @watcher if non-null, a watch will be set at the server to notify
+ * the client if the node changes.
  *
  * @watcher_ctx user specific data, will be passed to the watcher callback.
  * Unlike the global context set by zookeeper_init, this watcher context
@@ -1331,8 +5638,8 @@ zkocaml_aexists(value zh,
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
  *
- * @data the data that will be passed to the completion routine when the
- * function completes.
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
  *
  * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
@@ -1340,12 +5647,12 @@ zkocaml_aexists(value zh,
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_awexists_native(value zh,
-                        value path,
-                        value watcher_callback,
-                        value watcher_ctx,
-                        value completion,
-                        value data)
+zkocaml_awget_children2_native(value zh,
+                               value path,
+                               value watcher_callback,
+                               value watcher_ctx,
+                               value completion,
+                               value data)
 {
   CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
   CAMLxparam1(data);
@@ -1353,40 +5660,96 @@ zkocaml_awexists_native(value zh,
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
 
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = make_watcher_context(watcher_ctx, watcher_callback, DISPOSABLE, zh);
+  const char *local_path = zkocaml_ns_path(zh, path);
+  uint64_t sub_id = 0;
+  zkocaml_watch_entry_t *local_ctx = zkocaml_watch_subscribe(zh, path, ZKOCAML_WATCH_CHILD,
+                                                             watcher_callback, watcher_ctx, &sub_id);
   zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STRINGS_STAT);
+  local_data->window = ZkO_handle_val(zh)->window;
+  local_data->watch = local_ctx;
+  local_data->watch_sub = sub_id;
 
-  int rc = zoo_awexists(handle,
-                        local_path,
-                        watcher_dispatch,
-                        local_ctx,
-                        stat_completion_dispatch,
-                        local_data);
+  int rc = zoo_awget_children2(handle,
+                               local_path,
+                               watch_registry_dispatch,
+                               local_ctx,
+                               strings_stat_completion_dispatch,
+                               local_data);
+  if (rc != ZOK) {
+    zkocaml_completion_abort(local_data);
+    zkocaml_watch_done(local_ctx, sub_id, 0);
+  }
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
 CAMLprim value
-zkocaml_awexists_bytecode(value *argv, int argn)
+zkocaml_awget_children2_bytecode(value *argv, int argn)
 {
-  return zkocaml_awexists_native(argv[0], argv[1], argv[2],
-                                 argv[3], argv[4], argv[5]);
+  return zkocaml_awget_children2_native(argv[0], argv[1], argv[2],
+                                        argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Flush leader channel.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_async(value zh, value path, value completion, value data)
+{
+  CAMLparam4(zh, path, completion, data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
+
+  const char *local_path = zkocaml_ns_path(zh, path);
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_STRING);
+  local_data->window = ZkO_handle_val(zh)->window;
+  local_data->strip = zkocaml_ns_len(zh);
+
+  int rc = zoo_async(handle,
+                     local_path,
+                     string_completion_dispatch,
+                     local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
 }
 
 /**
- * Gets the data associated with a node.
+ * Gets the acl associated with a node.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @watch if nonzero, a watch will be set at the server to notify
- * the client if the node changes.
- *
  * @completion the routine to invoke when the request completes. The completion
  * will be triggered with one of the following codes passed in as the rc argument:
  *   ZOK operation completed successfully
@@ -1398,127 +5761,160 @@ zkocaml_awexists_bytecode(value *argv, int argn)
  *
  * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aget(value zh,
-             value path,
-             value watch,
-             value completion,
-             value data)
+zkocaml_aget_acl(value zh, value path, value completion, value data)
 {
-  CAMLparam5(zh, path, watch, completion, data);
+  CAMLparam4(zh, path, completion, data);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
 
-  const char *local_path = String_val(path);
-  int local_watch = Int_val(watch);
+  const char *local_path = zkocaml_ns_path(zh, path);
   zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_ACL);
+  local_data->window = ZkO_handle_val(zh)->window;
 
-  int rc = zoo_aget(handle,
-                    local_path,
-                    local_watch,
-                    data_completion_dispatch,
-                    local_data);
+  int rc = zoo_aget_acl(handle,
+                        local_path,
+                        acl_completion_dispatch,
+                        local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
 /**
- * Gets the data associated with a node.
- *
- * This function is similar to zoo_aget except it allows one specify
- * a watcher object rather than a boolean watch flag.
+ * Sets the acl associated with a node.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @watcher if non-null, a watch will be set at the server to notify
- * the client if the node changes.
- *
- * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by zookeeper_init, this watcher context
- * is associated with the given instance of the watcher only.
+ * @buffer the buffer holding the acls to be written to the node.
  *
  * @completion the routine to invoke when the request completes. The completion
  * will be triggered with one of the following codes passed in as the rc argument:
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
+ *   ZINVALIDACL invalid ACL specified
+ *   ZBADVERSION expected version does not match actual version.
  *
  * @data the data that will be passed to the completion routine when
  * the function completes.
  *
  * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
-CAMLprim value
-zkocaml_awget_native(value zh,
+static value
+zkocaml_aset_acl_acl(value zh,
                      value path,
-                     value watcher_callback,
-                     value watcher_ctx,
+                     value version,
+                     const struct ACL_vector *acl,
                      value completion,
                      value data)
 {
-  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
-  CAMLxparam1(data);
+  CAMLparam5(zh, path, version, completion, data);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
 
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = make_watcher_context(watcher_ctx, watcher_callback, DISPOSABLE, zh);
+  const char *local_path = zkocaml_ns_path(zh, path);
+  int local_version = Int_val(version);
   zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_VOID);
+  local_data->window = ZkO_handle_val(zh)->window;
+  zkocaml_flight_detach(ZkO_handle_val(zh), local_path);
 
-  int rc = zoo_awget(handle,
-                     local_path,
-                     watcher_dispatch,
-                     local_ctx,
-                     data_completion_dispatch,
-                     local_data);
+  int rc = zoo_aset_acl(handle,
+                        local_path,
+                        local_version,
+                        (struct ACL_vector *)acl,
+                        void_completion_dispatch,
+                        local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
 CAMLprim value
-zkocaml_awget_bytecode(value *argv, int argn)
+zkocaml_aset_acl_native(value zh,
+                        value path,
+                        value version,
+                        value acl,
+                        value completion,
+                        value data)
 {
-  return zkocaml_awget_native(argv[0], argv[1], argv[2],
-                              argv[3], argv[4], argv[5]);
+  CAMLparam5(zh, path, version, acl, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  struct ACL_vector local_acl;
+  int r = zkocaml_parse_acls(acl, &local_acl);
+  result = zkocaml_aset_acl_acl(zh, path, version,
+                                r ? &local_acl : &ZOO_OPEN_ACL_UNSAFE,
+                                completion, data);
+  if (r) zkocaml_free_acls(&local_acl);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_aset_acl_bytecode(value *argv, int argn)
+{
+  return zkocaml_aset_acl_native(argv[0], argv[1], argv[2],
+                                 argv[3], argv[4], argv[5]);
 }
 
 /**
- * Sets the data associated with a node.
+ * Sets the acl associated with a node asynchronously from a prepared
+ * acl_handle.
+ */
+CAMLprim value
+zkocaml_aset_acl_prepared_native(value zh,
+                                 value path,
+                                 value version,
+                                 value acl,
+                                 value completion,
+                                 value data)
+{
+  CAMLparam5(zh, path, version, acl, completion);
+  CAMLxparam1(data);
+  CAMLreturn(zkocaml_aset_acl_acl(zh, path, version, ZkO_acl_val(acl),
+                                  completion, data));
+}
+
+CAMLprim value
+zkocaml_aset_acl_prepared_bytecode(value *argv, int argn)
+{
+  return zkocaml_aset_acl_prepared_native(argv[0], argv[1], argv[2],
+                                          argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Gets the last committed configuration of the ensemble.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @buffer the buffer holding data to be written to the node.
- *
- * @version the expected version of the node. The function will fail if
- * the actual version of the node does not match the expected version. If -1 is
- * used the version check will not take place. * completion: If null,
- * the function will execute synchronously. Otherwise, the function will return
- * immediately and invoke the completion routine when the request completes.
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the configuration changes.
  *
  * @completion the routine to invoke when the request completes. The completion
  * will be triggered with one of the following codes passed in as the rc argument:
  *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *   ZBADVERSION expected version does not match actual version.
  *
  * @data the data that will be passed to the completion routine when
  * the function completes.
@@ -1529,57 +5925,60 @@ zkocaml_awget_bytecode(value *argv, int argn)
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aset_native(value zh,
-                    value path,
-                    value buffer,
-                    value version,
-                    value completion,
-                    value data)
+zkocaml_agetconfig(value zh,
+                   value watch,
+                   value completion,
+                   value data)
 {
-  CAMLparam5(zh, path, buffer, version, completion);
-  CAMLxparam1(data);
+  CAMLparam4(zh, watch, completion, data);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
 
   zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
-
-  int rc = zoo_aset(handle,
-                    String_val(path),
-                    String_val(buffer),
-                    caml_string_length(buffer),
-                    Int_val(version),
-                    stat_completion_dispatch,
-                    local_data);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_DATA);
+  local_data->window = ZkO_handle_val(zh)->window;
+
+  int rc = zoo_agetconfig(handle,
+                          Int_val(watch),
+                          data_completion_dispatch,
+                          local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
-CAMLprim value
-zkocaml_aset_bytecode(value *argv, int argn)
-{
-  return zkocaml_aset_native(argv[0], argv[1], argv[2],
-                             argv[3], argv[4], argv[5]);
-}
-
 /**
- * Lists the children of a node.
+ * Reconfigures the ensemble.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
+ * @joining comma separated list of servers to be added, in the
+ * server.N=host:port:port[:role];[client host:]client port format,
+ * "" for none. Incremental, so @members must be "".
  *
- * @watch if nonzero, a watch will be set at the server to notify
- * the client if the node changes.
+ * @leaving comma separated list of the ids of the servers to be
+ * removed, "" for none. Incremental, so @members must be "".
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @members comma separated list of the new membership, "" for an
+ * incremental reconfiguration.
+ *
+ * @version the expected version of the current configuration, -1 for
+ * no check.
+ *
+ * @completion the routine to invoke when the request completes, with
+ * the new configuration. The completion will be triggered with one of
+ * the following codes passed in as the rc argument:
  *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
+ *   ZBADARGUMENTS invalid input parameters
+ *   ZNEWCONFIGNOQUORUM no quorum of the new config is connected and
+ *   up-to-date with the leader of the last committed config
+ *   ZRECONFIGINPROGRESS another reconfig is in progress
+ *   ZRECONFIGDISABLED reconfig is disabled on the servers
+ *   ZBADVERSION the configuration version does not match @version
  *
  * @data the data that will be passed to the completion routine when
  * the function completes.
@@ -1590,728 +5989,860 @@ zkocaml_aset_bytecode(value *argv, int argn)
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aget_children(value zh,
-                      value path,
-                      value watch,
-                      value completion,
-                      value data)
+zkocaml_areconfig_native(value zh,
+                         value joining,
+                         value leaving,
+                         value members,
+                         value version,
+                         value completion,
+                         value data)
 {
-  CAMLparam5(zh, path, watch, completion, data);
+  CAMLparam5(zh, joining, leaving, members, version);
+  CAMLxparam2(completion, data);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_THROTTLED (zh, handle);
 
-  const char *local_path = String_val(path);
-  int local_watch = Int_val(watch);
   zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
-
-  int rc = zoo_aget_children(handle,
-                             local_path,
-                             local_watch,
-                             strings_completion_dispatch,
-                             local_data);
+  zkocaml_deadline_arm(local_data, ZKOCAML_COMPLETION_DATA);
+  local_data->window = ZkO_handle_val(zh)->window;
+
+  int rc = zoo_areconfig(handle,
+                         zkocaml_null_if_empty(joining),
+                         zkocaml_null_if_empty(leaving),
+                         zkocaml_null_if_empty(members),
+                         Int64_val(version),
+                         data_completion_dispatch,
+                         local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
+CAMLprim value
+zkocaml_areconfig_bytecode(value *argv, int argn)
+{
+  return zkocaml_areconfig_native(argv[0], argv[1], argv[2], argv[3],
+                                  argv[4], argv[5], argv[6]);
+}
+
 /**
- * Lists the children of a node.
+ * Return an error string.
  *
- * This function is similar to zoo_aget_children except it allows one specify
- * a watcher object rather than a boolean watch flag.
+ * @rc return code.
+ * @return string corresponding to the return code
+ */
+CAMLprim value
+zkocaml_zerror(value rc)
+{
+  CAMLparam1(rc);
+  CAMLlocal1(result);
+
+  const char *errstr = zerror(Int_val(rc));
+  result = caml_copy_string(errstr);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Specify application credentials.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * The application calls this function to specify its credentials for purposes
+ * of authentication. The server will use the security provider specified by
+ * the scheme parameter to authenticate the client connection. If the
+ * authentication request has failed:
+ * - the server connection is dropped
+ * - the watcher is called with the ZOO_AUTH_FAILED_STATE value as the state
+ * parameter.
  *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
- * @watcher if non-null, a watch will be set at the server to notify
- * the client if the node changes.
+ * @scheme the id of authentication scheme. Natively supported:
+ * "digest" password-based authentication
  *
- * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by zookeeper_init, this watcher context
- * is associated with the given instance of the watcher only.
+ * @cert application credentials. The actual value depends on the scheme.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @completion the routine to invoke when the request completes. One of
+ * the following result codes may be passed into the completion callback:
  *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
+ *   ZAUTHFAILED authentication failed
  *
- * @data the data that will be passed to the completion routine when
- * the function completes.
+ * @data the data that will be passed to the completion routine when the
+ * function completes.
  *
  * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ *   ZSYSTEMERROR - a system error occured
  */
 CAMLprim value
-zkocaml_awget_children_native(value zh,
-                              value path,
-                              value watcher_callback,
-                              value watcher_ctx,
-                              value completion,
-                              value data)
+zkocaml_add_auth(value zh,
+                 value scheme,
+                 value cert,
+                 value completion,
+                 value data)
+{
+  CAMLparam5(zh, scheme, cert, completion, data);
+  CAMLlocal1(result);
+
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+
+  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+
+  int rc = zoo_add_auth(handle,
+                        String_val(scheme),
+                        String_val(cert),
+                        caml_string_length(cert),
+                        void_completion_dispatch,
+                        local_data);
+  if (rc != ZOK) zkocaml_completion_abort(local_data);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Checks if the current zookeeper connection state can't be recovered.
+ *
+ *  The application must close the zhandle and try to reconnect.
+ *
+ * @zh the zookeeper handle (see zookeeper_init)
+ * @return ZINVALIDSTATE if connection is unrecoverable
+ */
+CAMLprim value
+zkocaml_is_unrecoverable(value zh)
 {
-  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
-  CAMLxparam1(data);
+  CAMLparam1(zh);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = make_watcher_context(watcher_ctx, watcher_callback, DISPOSABLE, zh);
-  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
-
-  int rc = zoo_awget_children(handle,
-                              local_path,
-                              watcher_dispatch,
-                              local_ctx,
-                              strings_completion_dispatch,
-                              local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  int rc = is_unrecoverable(handle);
+  result = zkocaml_enum_event_c2ml(rc);
 
   CAMLreturn(result);
 }
 
+/**
+ * Sets the debugging level for the library
+ */
 CAMLprim value
-zkocaml_awget_children_bytecode(value *argv, int argn)
+zkocaml_set_debug_level(value log_level)
 {
-  return zkocaml_awget_children_native(argv[0], argv[1], argv[2],
-                                       argv[3], argv[4], argv[5]);
+  CAMLparam1(log_level);
+
+  ZooLogLevel level = zkocaml_enum_loglevel_ml2c(log_level);
+  switch(level) {
+  case ZOO_LOG_LEVEL_ERROR:
+    zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+    break;
+  case ZOO_LOG_LEVEL_WARN:
+    zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
+    break;
+  case ZOO_LOG_LEVEL_INFO:
+    zoo_set_debug_level(ZOO_LOG_LEVEL_INFO);
+    break;
+  case ZOO_LOG_LEVEL_DEBUG:
+    zoo_set_debug_level(ZOO_LOG_LEVEL_DEBUG);
+    break;
+  }
+
+  CAMLreturn(Val_unit);
 }
 
 /**
- * Lists the children of a node, and get the parent stat.
- *
- * This function is new in version 3.3.0
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watch if nonzero, a watch will be set at the server to notify
- * the client if the node changes.
- *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
+ * Sets the stream to be used by the library for logging
  *
- * @return ZOK on success or one of the following errcodes on failure:
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * The zookeeper library uses stderr as its default log stream. Application
+ * must make sure the stream is writable. Passing in NULL resets the stream
+ * to its default value (stderr). The stream is shared by every handle.
+ * A replaced stream is flushed but left open: the zookeeper threads may
+ * still be writing to it.
  */
 CAMLprim value
-zkocaml_aget_children2(value zh,
-                       value path,
-                       value watch,
-                       value completion,
-                       value data)
+zkocaml_set_log_stream(value log_stream)
 {
-  CAMLparam5(zh, path, watch, completion, data);
-  CAMLlocal1(result);
+  CAMLparam1(log_stream);
 
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  FILE *stream = fopen(String_val(log_stream), "w+");
+  if (stream == NULL) CAMLreturn(Val_unit);
+  pthread_mutex_lock(&zkocaml_log_lock);
+  zoo_set_log_stream(stream);
+  if (zkocaml_log_stream != NULL) fflush(zkocaml_log_stream);
+  zkocaml_log_stream = stream;
+  pthread_mutex_unlock(&zkocaml_log_lock);
 
-  const char *local_path = String_val(path);
-  int local_watch = Int_val(watch);
-  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  CAMLreturn(Val_unit);
+}
 
-  int rc = zoo_aget_children2(handle,
-                              local_path,
-                              local_watch,
-                              strings_stat_completion_dispatch,
-                              local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+/**
+ * Enable/disable quorum endpoint order randomization
+ *
+ * Note: typically this method should NOT be used outside of testing.
+ *
+ * If passed a non-zero value, will make the client connect to quorum peers
+ * in the order as specified in the zookeeper_init() call.
+ * A zero value causes zookeeper_init() to permute the peer endpoints
+ * which is good for more even client connection distribution among the
+ * quorum peers.
+ */
+CAMLprim value
+zkocaml_deterministic_conn_order(value yes_or_no)
+{
+  CAMLparam1(yes_or_no);
 
-  CAMLreturn(result);
+  int decision = Bool_val(yes_or_no);
+  zoo_deterministic_conn_order(decision);
+
+  CAMLreturn(Val_unit);
 }
 
 /**
- * Lists the children of a node, and get the parent stat.
- *
- * This function is similar to zoo_aget_children2 except it allows one specify
- * a watcher object rather than a boolean watch flag.
+ * Create a node synchronously.
  *
- * This function is new in version 3.3.0
+ * This method will create a node in ZooKeeper. A node can only be created if
+ * it does not already exists. The Create Flags affect the creation of nodes.
+ * If ZOO_EPHEMERAL flag is set, the node will automatically get removed if the
+ * client session goes away. If the ZOO_SEQUENCE flag is set, a unique
+ * monotonically increasing sequence number is appended to the path name.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to zookeeper_init.
  *
- * @path the name of the node. Expressed as a file name with slashes
+ * @path The name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @watcher if non-null, a watch will be set at the server to notify
- * the client if the node changes.
+ * @val The data to be stored in the node.
  *
- * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by zookeeper_init, this watcher context
- * is associated with the given instance of the watcher only.
+ * @acl The initial ACL of the node. The ACL must not be null or empty.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
+ * @flags this parameter can be set to 0 for normal create or an OR
+ * of the Create Flags
  *
- * @data the data that will be passed to the completion routine when
- * the function completes.
+ * @path_buffer Buffer which will be filled with the path of the
+ * new node (this might be different than the supplied path
+ * because of the ZOO_SEQUENCE flag).  The path string will always be
+ * null-terminated. This parameter may be NULL if path_buffer_len = 0.
  *
- * @return ZOK on success or one of the following errcodes on failure:
+ * @path_buffer_len Size of path buffer; if the path of the new
+ * node (including space for the null terminator) exceeds the buffer size,
+ * the path string will be truncated to fit.  The actual path of the
+ * new node in the server will not be affected by the truncation.
+ * The path string will always be null-terminated.
+ *
+ * @return one of the following codes are returned:
+ *   ZOK operation completed successfully
+ *   ZNONODE the parent node does not exist.
+ *   ZNODEEXISTS the node already exists
+ *   ZNOAUTH the client does not have permission.
+ *   ZNOCHILDRENFOREPHEMERALS cannot create children of ephemeral nodes.
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
-CAMLprim value
-zkocaml_awget_children2_native(value zh,
-                               value path,
-                               value watcher_callback,
-                               value watcher_ctx,
-                               value completion,
-                               value data)
+static value
+zkocaml_create_acl(value zh,
+                   value path,
+                   value val,
+                   const struct ACL_vector *acl,
+                   value flags)
 {
-  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
-  CAMLxparam1(data);
-  CAMLlocal1(result);
+  CAMLparam4(zh, path, val, flags);
+  CAMLlocal3(result, error, buffer);
 
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  Store_field(result, 1, caml_copy_string(""));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  RETURN_IF_NO_HANDLE (handle,result);
 
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = make_watcher_context(watcher_ctx, watcher_callback, DISPOSABLE, zh);
-  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  char path_buffer[ZKOCAML_MAX_PATH_BUFFER_SIZE];
+  path_buffer[0] = '\0';
+  int local_flags = zkocaml_create_mode(zkocaml_enum_create_flag_ml2c(flags), 0);
+  if (local_flags < 0) {
+    Store_field(result, 0, zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+    CAMLreturn(result);
+  }
 
-  int rc = zoo_awget_children2(handle,
-                               local_path,
-                               watcher_dispatch,
-                               local_ctx,
-                               strings_stat_completion_dispatch,
-                               local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  zkocaml_flight_detach(ZkO_handle_val(zh), zkocaml_ns_path(zh, path));
+  int rc = zoo_create(handle,
+                      zkocaml_ns_path(zh, path),
+                      String_val(val),
+                      caml_string_length(val),
+                      acl,
+                      local_flags,
+                      path_buffer,
+                      ZKOCAML_MAX_PATH_BUFFER_SIZE
+                      );
+
+  error = zkocaml_enum_error_c2ml(rc);
+  buffer = caml_copy_string(zkocaml_ns_strip(path_buffer, zkocaml_ns_len(zh)));
+  Store_field(result, 0, error);
+  Store_field(result, 1, buffer);
 
   CAMLreturn(result);
 }
 
 CAMLprim value
-zkocaml_awget_children2_bytecode(value *argv, int argn)
+zkocaml_create(value zh,
+               value path,
+               value val,
+               value acl,
+               value flags)
 {
-  return zkocaml_awget_children2_native(argv[0], argv[1], argv[2],
-                                        argv[3], argv[4], argv[5]);
+  CAMLparam5(zh, path, val, acl, flags);
+  CAMLlocal1(result);
+
+  struct ACL_vector local_acl;
+  int r = zkocaml_parse_acls(acl, &local_acl);
+  result = zkocaml_create_acl(zh, path, val,
+                              r ? &local_acl : &ZOO_OPEN_ACL_UNSAFE, flags);
+  if (r) zkocaml_free_acls(&local_acl);
+
+  CAMLreturn(result);
 }
 
 /**
- * Flush leader channel.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * Create a node synchronously with a prepared acl_handle.
  */
 CAMLprim value
-zkocaml_async(value zh, value path, value completion, value data)
+zkocaml_create_prepared(value zh,
+                        value path,
+                        value val,
+                        value acl,
+                        value flags)
 {
-  CAMLparam4(zh, path, completion, data);
+  CAMLparam5(zh, path, val, acl, flags);
+  CAMLreturn(zkocaml_create_acl(zh, path, val, ZkO_acl_val(acl), flags));
+}
+
+/**
+ * Create a node synchronously, returning its stat as well as its path.
+ * See acreate2 for @ttl.
+ */
+CAMLprim value
+zkocaml_create2_native(value zh,
+                       value path,
+                       value val,
+                       value acl,
+                       value flags,
+                       value ttl)
+{
+  CAMLparam5(zh, path, val, acl, flags);
+  CAMLxparam1(ttl);
   CAMLlocal1(result);
+  struct ACL_vector local_acl;
+  struct Stat local_stat;
+  char path_buffer[ZKOCAML_MAX_PATH_BUFFER_SIZE];
+
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  Store_field(result, 1, caml_copy_string(""));
+  Store_field(result, 2, zkocaml_build_stat_struct(NULL));
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, result);
 
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  int64_t local_ttl = Int64_val(ttl);
+  int local_flags = zkocaml_create_mode(zkocaml_enum_create_flag_ml2c(flags), local_ttl);
+  if (local_flags < 0) {
+    Store_field(result, 0, zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+    CAMLreturn(result);
+  }
 
-  const char *local_path = String_val(path);
-  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  path_buffer[0] = '\0';
+  int r = zkocaml_parse_acls(acl, &local_acl);
+  zkocaml_flight_detach(ZkO_handle_val(zh), zkocaml_ns_path(zh, path));
+  int rc = local_ttl == 0
+    ? zoo_create2(handle,
+                  zkocaml_ns_path(zh, path),
+                  String_val(val),
+                  caml_string_length(val),
+                  r ? &local_acl : &ZOO_OPEN_ACL_UNSAFE,
+                  local_flags,
+                  path_buffer,
+                  ZKOCAML_MAX_PATH_BUFFER_SIZE,
+                  &local_stat)
+    : zoo_create2_ttl(handle,
+                      zkocaml_ns_path(zh, path),
+                      String_val(val),
+                      caml_string_length(val),
+                      r ? &local_acl : &ZOO_OPEN_ACL_UNSAFE,
+                      local_flags,
+                      local_ttl,
+                      path_buffer,
+                      ZKOCAML_MAX_PATH_BUFFER_SIZE,
+                      &local_stat);
+  if (r) zkocaml_free_acls(&local_acl);
 
-  int rc = zoo_async(handle,
-                     local_path,
-                     string_completion_dispatch,
-                     local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(rc));
+  Store_field(result, 1, caml_copy_string(zkocaml_ns_strip(path_buffer, zkocaml_ns_len(zh))));
+  if (rc == ZOK)
+    Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
 
   CAMLreturn(result);
 }
 
+CAMLprim value
+zkocaml_create2_bytecode(value *argv, int argn)
+{
+  return zkocaml_create2_native(argv[0], argv[1], argv[2],
+                                argv[3], argv[4], argv[5]);
+}
+
 /**
- * Gets the acl associated with a node.
+ * Delete a node in zookeeper synchronously.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @version the expected version of the node. The function will fail if the
+ * actual version of the node does not match the expected version.
+ * If -1 is used the version check will not take place.
+ *
+ * @return one of the following values is returned.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADVERSION expected version does not match actual version.
+ *   ZNOTEMPTY children are present; node cannot be deleted.
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aget_acl(value zh, value path, value completion, value data)
+zkocaml_delete(value zh, value path, value version)
 {
-  CAMLparam4(zh, path, completion, data);
+  CAMLparam3(zh, path, version);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
 
-  const char *local_path = String_val(path);
-  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
+  const char *local_path = zkocaml_ns_path(zh, path);
+  int local_version = Int_val(version);
 
-  int rc = zoo_aget_acl(handle,
-                        local_path,
-                        acl_completion_dispatch,
-                        local_data);
+  zkocaml_flight_detach(ZkO_handle_val(zh), local_path);
+  int rc = zoo_delete(handle, local_path, local_version);
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
 /**
- * Sets the acl associated with a node.
+ * Checks the existence of a node in zookeeper synchronously.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @buffer the buffer holding the acls to be written to the node.
+ * @watch if nonzero, a watch will be set at the server to notify the
+ * client if the node changes. The watch will be set even if the node does not
+ * exist. This allows clients to watch for nodes to appear.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @stat the returned stat value of the node.
+ *
+ * @return return code of the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *   ZINVALIDACL invalid ACL specified
- *   ZBADVERSION expected version does not match actual version.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aset_acl_native(value zh,
-                        value path,
-                        value version,
-                        value acl,
-                        value completion,
-                        value data)
+zkocaml_exists(value zh, value path, value watch)
 {
-  CAMLparam5(zh, path, version, acl, completion);
-  CAMLxparam1(data);
-  CAMLlocal1(result);
-
-  struct ACL_vector local_acl;
+  CAMLparam3(zh, path, watch);
+  CAMLlocal3(result, error, stat);
+  struct Stat local_stat;
 
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  Store_field(result, 1, zkocaml_build_stat_struct(&local_stat));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-
-  const char *local_path = String_val(path);
-  int local_version = Int_val(version);
-  int r = zkocaml_parse_acls(acl, &local_acl);
-  if (r == 0) {
-    local_acl = ZOO_OPEN_ACL_UNSAFE;
-  }
-  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
-
-  int rc = zoo_aset_acl(handle,
-                        local_path,
-                        local_version,
-                        (struct ACL_vector *)&local_acl,
-                        void_completion_dispatch,
-                        local_data);
-  result = zkocaml_enum_error_c2ml(rc);
-
-  CAMLreturn(result);
-}
+  RETURN_IF_NO_HANDLE (handle, result);
 
-CAMLprim value
-zkocaml_aset_acl_bytecode(value *argv, int argn)
-{
-  return zkocaml_aset_acl_native(argv[0], argv[1], argv[2],
-                                 argv[3], argv[4], argv[5]);
-}
+  const char *local_path = zkocaml_ns_path(zh, path);
+  int local_watch = Int_val(watch);
 
-/**
- * Return an error string.
- *
- * @rc return code.
- * @return string corresponding to the return code
- */
-CAMLprim value
-zkocaml_zerror(value rc)
-{
-  CAMLparam1(rc);
-  CAMLlocal1(result);
+  int rc = zoo_exists(handle,
+                      local_path,
+                      local_watch,
+                      (struct Stat *)&local_stat);
 
-  const char *errstr = zerror(Int_val(rc));
-  result = caml_copy_string(errstr);
+  error = zkocaml_enum_error_c2ml(rc);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  Store_field(result, 0, error);
+  Store_field(result, 1, stat);
 
   CAMLreturn(result);
 }
 
 /**
- * Specify application credentials.
+ * Checks the existence of a node in zookeeper synchronously.
  *
- * The application calls this function to specify its credentials for purposes
- * of authentication. The server will use the security provider specified by
- * the scheme parameter to authenticate the client connection. If the
- * authentication request has failed:
- * - the server connection is dropped
- * - the watcher is called with the ZOO_AUTH_FAILED_STATE value as the state
- * parameter.
+ * This function is similar to zoo_exists except it allows one specify
+ * a watcher object rather than a boolean watch flag.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
- * @scheme the id of authentication scheme. Natively supported:
- * "digest" password-based authentication
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
  *
- * @cert application credentials. The actual value depends on the scheme.
+ * @watcher if non-null a watch will set on the specified znode on the server.
+ * The watch will be set even if the node does not exist. This allows clients
+ * to watch for nodes to appear.
  *
- * @completion the routine to invoke when the request completes. One of
- * the following result codes may be passed into the completion callback:
- *   ZOK operation completed successfully
- *   ZAUTHFAILED authentication failed
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ * Unlike the global context set by zookeeper_init, this watcher context
+ * is associated with the given instance of the watcher only.
  *
- * @data the data that will be passed to the completion routine when the
- * function completes.
+ * @stat the return stat value of the node.
  *
- * @return ZOK on success or one of the following errcodes on failure:
+ * @return return code of the function call.
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
- *   ZSYSTEMERROR - a system error occured
- */
-CAMLprim value
-zkocaml_add_auth(value zh,
-                 value scheme,
-                 value cert,
-                 value completion,
-                 value data)
-{
-  CAMLparam5(zh, scheme, cert, completion, data);
-  CAMLlocal1(result);
-
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-
-  zkocaml_completion_context_t *local_data = make_completion_context(data,completion);
-
-  int rc = zoo_add_auth(handle,
-                        String_val(scheme),
-                        String_val(cert),
-                        caml_string_length(cert),
-                        void_completion_dispatch,
-                        local_data);
-  result = zkocaml_enum_error_c2ml(rc);
-
-  CAMLreturn(result);
-}
-
-/**
- * Checks if the current zookeeper connection state can't be recovered.
- *
- *  The application must close the zhandle and try to reconnect.
- *
- * @zh the zookeeper handle (see zookeeper_init)
- * @return ZINVALIDSTATE if connection is unrecoverable
  */
 CAMLprim value
-zkocaml_is_unrecoverable(value zh)
+zkocaml_wexists(value zh,
+                value path,
+                value watcher_callback,
+                value watcher_ctx)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
+  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
+  CAMLlocal3(result, error, stat);
+  struct Stat local_stat;
 
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  Store_field(result, 1, zkocaml_build_stat_struct(&local_stat));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  int rc = is_unrecoverable(handle);
-  result = zkocaml_enum_event_c2ml(rc);
-
-  CAMLreturn(result);
-}
-
-/**
- * Sets the debugging level for the library
- */
-CAMLprim value
-zkocaml_set_debug_level(value log_level)
-{
-  CAMLparam1(log_level);
-
-  ZooLogLevel level = zkocaml_enum_loglevel_ml2c(log_level);
-  switch(level) {
-  case ZOO_LOG_LEVEL_ERROR:
-    zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
-    break;
-  case ZOO_LOG_LEVEL_WARN:
-    zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
-    break;
-  case ZOO_LOG_LEVEL_INFO:
-    zoo_set_debug_level(ZOO_LOG_LEVEL_INFO);
-    break;
-  case ZOO_LOG_LEVEL_DEBUG:
-    zoo_set_debug_level(ZOO_LOG_LEVEL_DEBUG);
-    break;
-  }
-
-  CAMLreturn(Val_unit);
-}
-
-/**
- * Sets the stream to be used by the library for logging
- *
- * The zookeeper library uses stderr as its default log stream. Application
- * must make sure the stream is writable. Passing in NULL resets the stream
- * to its default value (stderr).
- */
-CAMLprim value
-zkocaml_set_log_stream(value log_stream)
-{
-  CAMLparam1(log_stream);
+  RETURN_IF_NO_HANDLE (handle, result);
 
-  const char *stream_name = String_val(log_stream);
-  zkocaml_log_stream = fopen(stream_name, "w+");
-  if (zkocaml_log_stream == NULL) CAMLreturn(Val_unit);
-  zoo_set_log_stream(zkocaml_log_stream);
+  const char *local_path = zkocaml_ns_path(zh, path);
+  uint64_t sub_id = 0;
+  zkocaml_watch_entry_t *local_ctx = zkocaml_watch_subscribe(zh, path, ZKOCAML_WATCH_EXIST,
+                                                             watcher_callback, watcher_ctx, &sub_id);
+
+  int rc = zoo_wexists(handle,
+                       local_path,
+                       watch_registry_dispatch,
+                       local_ctx,
+                       (struct Stat *)&local_stat);
+  zkocaml_watch_done(local_ctx, sub_id, zkocaml_watch_armed(ZKOCAML_WATCH_EXIST, rc));
+
+  error = zkocaml_enum_error_c2ml(rc);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  Store_field(result, 0, error);
+  Store_field(result, 1, stat);
+
+  CAMLreturn(result);
 
-  CAMLreturn(Val_unit);
 }
 
 /**
- * Enable/disable quorum endpoint order randomization
+ * Gets the data associated with a node synchronously.
  *
- * Note: typically this method should NOT be used outside of testing.
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
- * If passed a non-zero value, will make the client connect to quorum peers
- * in the order as specified in the zookeeper_init() call.
- * A zero value causes zookeeper_init() to permute the peer endpoints
- * which is good for more even client connection distribution among the
- * quorum peers.
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @buffer the buffer holding the node data returned by the server
+ *
+ * @stat if not NULL, will hold the value of stat for the path on return.
+ *
+ * @return return value of the function call.
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_deterministic_conn_order(value yes_or_no)
+zkocaml_get(value zh,
+            value path,
+            value watch)
 {
-  CAMLparam1(yes_or_no);
+  CAMLparam3(zh, path, watch);
+  CAMLlocal4(result, error, buffer, stat);
+  struct Stat local_stat;
 
-  int decision = Bool_val(yes_or_no);
-  zoo_deterministic_conn_order(decision);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  Store_field(result, 1, caml_copy_string(""));
+  Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, result);
 
-  CAMLreturn(Val_unit);
+  int path_buffer_size = ZKOCAML_MAX_PATH_BUFFER_SIZE;
+  char *path_buffer = (char *)malloc(
+                      sizeof(char) * path_buffer_size);
+  memset(path_buffer, 0, path_buffer_size);
+  const char *local_path = zkocaml_ns_path(zh, path);
+  int local_watch = Int_val(watch);
+  int rc = zoo_get(handle,
+                   local_path,
+                   local_watch,
+                   path_buffer,
+                   &path_buffer_size,
+                   (struct Stat *)&local_stat);
+  error = zkocaml_enum_error_c2ml(rc);
+  buffer = caml_copy_string(path_buffer);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  Store_field(result, 0, error);
+  Store_field(result, 1, buffer);
+  Store_field(result, 2, stat);
+  free(path_buffer);
+
+  CAMLreturn(result);
 }
 
 /**
- * Create a node synchronously.
+ * Gets the data associated with a node synchronously.
  *
- * This method will create a node in ZooKeeper. A node can only be created if
- * it does not already exists. The Create Flags affect the creation of nodes.
- * If ZOO_EPHEMERAL flag is set, the node will automatically get removed if the
- * client session goes away. If the ZOO_SEQUENCE flag is set, a unique
- * monotonically increasing sequence number is appended to the path name.
+ * This function is similar to zoo_get except it allows one specify
+ * a watcher object rather than a boolean watch flag.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init.
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
- * @path The name of the node. Expressed as a file name with slashes
+ * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @val The data to be stored in the node.
- *
- * @acl The initial ACL of the node. The ACL must not be null or empty.
+ * @watcher if non-null, a watch will be set at the server to notify
+ * the client if the node changes.
  *
- * @flags this parameter can be set to 0 for normal create or an OR
- * of the Create Flags
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ * Unlike the global context set by \ref zookeeper_init, this watcher context
+ * is associated with the given instance of the watcher only.
  *
- * @path_buffer Buffer which will be filled with the path of the
- * new node (this might be different than the supplied path
- * because of the ZOO_SEQUENCE flag).  The path string will always be
- * null-terminated. This parameter may be NULL if path_buffer_len = 0.
+ * @buffer the buffer holding the node data returned by the server
  *
- * @path_buffer_len Size of path buffer; if the path of the new
- * node (including space for the null terminator) exceeds the buffer size,
- * the path string will be truncated to fit.  The actual path of the
- * new node in the server will not be affected by the truncation.
- * The path string will always be null-terminated.
+ * @stat if not NULL, will hold the value of stat for the path on return.
  *
- * @return one of the following codes are returned:
+ * @return return value of the function call.
  *   ZOK operation completed successfully
- *   ZNONODE the parent node does not exist.
- *   ZNODEEXISTS the node already exists
+ *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *   ZNOCHILDRENFOREPHEMERALS cannot create children of ephemeral nodes.
  *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_create(value zh,
-               value path,
-               value val,
-               value acl,
-               value flags)
+zkocaml_wget(value zh,
+             value path,
+             value watcher_callback,
+             value watcher_ctx)
 {
-  CAMLparam5(zh, path, val, acl, flags);
-  CAMLlocal3(result, error, buffer);
-  struct ACL_vector local_acl;
+  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
+  CAMLlocal4(result, error, buffer, stat);
+  struct Stat local_stat;
 
-  result = caml_alloc(2, 0);
+  result = caml_alloc(3, 0);
   Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
   Store_field(result, 1, caml_copy_string(""));
+  Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle,result);
+  RETURN_IF_NO_HANDLE (handle, result);
 
-  char *path_buffer = (char *)calloc(ZKOCAML_MAX_PATH_BUFFER_SIZE, sizeof(char));
-  int r = zkocaml_parse_acls(acl, &local_acl);
-  if (r == 0) {
-    local_acl = ZOO_OPEN_ACL_UNSAFE;
-  }
-  int local_flags = zkocaml_enum_create_flag_ml2c(flags);
+  int path_buffer_size = ZKOCAML_MAX_PATH_BUFFER_SIZE;
+  char *path_buffer = (char *)malloc(
+                      sizeof(char) * path_buffer_size);
+  memset(path_buffer, 0, path_buffer_size);
+  const char *local_path = zkocaml_ns_path(zh, path);
+  uint64_t sub_id = 0;
+  zkocaml_watch_entry_t *local_ctx = zkocaml_watch_subscribe(zh, path, ZKOCAML_WATCH_DATA,
+                                                             watcher_callback, watcher_ctx, &sub_id);
 
-  int rc = zoo_create(handle,
-                      String_val(path),
-                      String_val(val),
-                      caml_string_length(val),
-                      (const struct ACL_vector *)&local_acl,
-                      local_flags,
-                      path_buffer,
-                      ZKOCAML_MAX_PATH_BUFFER_SIZE
-                      );
+  int rc = zoo_wget(handle,
+                    local_path,
+                    watch_registry_dispatch,
+                    local_ctx,
+                    path_buffer,
+                    &path_buffer_size,
+                    (struct Stat *)&local_stat);
+  zkocaml_watch_done(local_ctx, sub_id, zkocaml_watch_armed(ZKOCAML_WATCH_DATA, rc));
 
   error = zkocaml_enum_error_c2ml(rc);
   buffer = caml_copy_string(path_buffer);
+  stat = zkocaml_build_stat_struct(&local_stat);
   Store_field(result, 0, error);
   Store_field(result, 1, buffer);
+  Store_field(result, 2, stat);
   free(path_buffer);
 
   CAMLreturn(result);
 }
 
 /**
- * Delete a node in zookeeper synchronously.
+ * Sets the data associated with a node. See zoo_set2 function if
+ * you require access to the stat information associated with the znode.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @version the expected version of the node. The function will fail if the
- * actual version of the node does not match the expected version.
- * If -1 is used the version check will not take place.
+ * @buffer the buffer holding data to be written to the node.
  *
- * @return one of the following values is returned.
+ * @version the expected version of the node. The function will fail if
+ * the actual version of the node does not match the expected version. If -1 is
+ * used the version check will not take place.
+ *
+ * @return the return code for the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
  *   ZBADVERSION expected version does not match actual version.
- *   ZNOTEMPTY children are present; node cannot be deleted.
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_delete(value zh, value path, value version)
+zkocaml_set(value zh, value path, value buffer, value version)
 {
-  CAMLparam3(zh, path, version);
+  CAMLparam4(zh, path, buffer, version);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
 
-  const char *local_path = String_val(path);
-  int local_version = Int_val(version);
-
-  int rc = zoo_delete(handle, local_path, local_version);
+  zkocaml_flight_detach(ZkO_handle_val(zh), zkocaml_ns_path(zh, path));
+  int rc = zoo_set(handle,
+                   zkocaml_ns_path(zh, path),
+                   String_val(buffer),
+                   caml_string_length(buffer),
+                   Int_val(version));
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
 /**
- * Checks the existence of a node in zookeeper synchronously.
+ * Sets the data associated with a node. This function is the same
+ * as zoo_set except that it also provides access to stat information
+ * associated with the znode.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @watch if nonzero, a watch will be set at the server to notify the
- * client if the node changes. The watch will be set even if the node does not
- * exist. This allows clients to watch for nodes to appear.
+ * @buffer the buffer holding data to be written to the node.
  *
- * @stat the returned stat value of the node.
+ * @version the expected version of the node. The function will fail if
+ * the actual version of the node does not match the expected version. If -1 is
+ * used the version check will not take place.
  *
- * @return return code of the function call.
+ * @stat if not NULL, will hold the value of stat for the path on return.
+ *
+ * @return the return code for the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
+ *   ZBADVERSION expected version does not match actual version.
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_exists(value zh, value path, value watch)
+zkocaml_set2(value zh, value path, value buffer, value version)
+{
+  CAMLparam4(zh, path, buffer, version);
+  CAMLlocal3(result, error, stat);
+  struct Stat local_stat;
+
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  Store_field(result, 1, zkocaml_build_stat_struct(&local_stat));
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, result);
+
+  zkocaml_flight_detach(ZkO_handle_val(zh), zkocaml_ns_path(zh, path));
+  int rc = zoo_set2(handle,
+                    zkocaml_ns_path(zh, path),
+                    String_val(buffer),
+                    caml_string_length(buffer),
+                    Int_val(version),
+                    &local_stat);
+
+  error = zkocaml_enum_error_c2ml(rc);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  Store_field(result, 0, error);
+  Store_field(result, 1, stat);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Lists the children of a node synchronously.
+ *
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @strings return value of children paths.
+ *
+ * @return the return code of the function.
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_get_children(value zh, value path, value watch)
 {
   CAMLparam3(zh, path, watch);
-  CAMLlocal3(result, error, stat);
-  struct Stat local_stat;
+  CAMLlocal3(result, error, strs);
+  struct String_vector local_strings;
 
   result = caml_alloc(2, 0);
   Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, zkocaml_build_stat_struct(&local_stat));
+  Store_field(result, 1, Atom(0));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, result);
 
-  const char *local_path = String_val(path);
+  const char *local_path = zkocaml_ns_path(zh, path);
   int local_watch = Int_val(watch);
 
-  int rc = zoo_exists(handle,
-                      local_path,
-                      local_watch,
-                      (struct Stat *)&local_stat);
+  int rc = zoo_get_children(handle,
+                            local_path,
+                            local_watch,
+                            (struct String_vector *)&local_strings);
 
   error = zkocaml_enum_error_c2ml(rc);
-  stat = zkocaml_build_stat_struct(&local_stat);
+  strs = zkocaml_build_strings_struct(&local_strings);
   Store_field(result, 0, error);
-  Store_field(result, 1, stat);
+  Store_field(result, 1, strs);
 
   CAMLreturn(result);
 }
 
 /**
- * Checks the existence of a node in zookeeper synchronously.
+ * Lists the children of a node synchronously.
  *
- * This function is similar to zoo_exists except it allows one specify
+ * This function is similar to zoo_get_children except it allows one specify
  * a watcher object rather than a boolean watch flag.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
@@ -2319,17 +6850,16 @@ zkocaml_exists(value zh, value path, value watch)
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @watcher if non-null a watch will set on the specified znode on the server.
- * The watch will be set even if the node does not exist. This allows clients
- * to watch for nodes to appear.
+ * @watcher if non-null, a watch will be set at the server to notify
+ * the client if the node changes.
  *
  * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by zookeeper_init, this watcher context
+ * Unlike the global context set by \ref zookeeper_init, this watcher context
  * is associated with the given instance of the watcher only.
  *
- * @stat the return stat value of the node.
+ * @strings return value of children paths.
  *
- * @return return code of the function call.
+ * @return the return code of the function.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
@@ -2338,43 +6868,47 @@ zkocaml_exists(value zh, value path, value watch)
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_wexists(value zh,
-                value path,
-                value watcher_callback,
-                value watcher_ctx)
+zkocaml_wget_children(value zh,
+                      value path,
+                      value watcher_callback,
+                      value watcher_ctx)
 {
   CAMLparam4(zh, path, watcher_callback, watcher_ctx);
-  CAMLlocal3(result, error, stat);
-  struct Stat local_stat;
+  CAMLlocal3(result, error, strs);
+  struct String_vector local_strings;
 
   result = caml_alloc(2, 0);
   Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, zkocaml_build_stat_struct(&local_stat));
+  Store_field(result, 1, Atom(0));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, result);
 
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = make_watcher_context(watcher_ctx, watcher_callback, DISPOSABLE, zh);
+  const char *local_path = zkocaml_ns_path(zh, path);
+  uint64_t sub_id = 0;
+  zkocaml_watch_entry_t *local_ctx = zkocaml_watch_subscribe(zh, path, ZKOCAML_WATCH_CHILD,
+                                                             watcher_callback, watcher_ctx, &sub_id);
 
-  int rc = zoo_wexists(handle,
-                       local_path,
-                       watcher_dispatch,
-                       local_ctx,
-                       (struct Stat *)&local_stat);
+  int rc = zoo_wget_children(handle,
+                             local_path,
+                             watch_registry_dispatch,
+                             local_ctx,
+                             (struct String_vector *)&local_strings);
+  zkocaml_watch_done(local_ctx, sub_id, zkocaml_watch_armed(ZKOCAML_WATCH_CHILD, rc));
 
   error = zkocaml_enum_error_c2ml(rc);
-  stat = zkocaml_build_stat_struct(&local_stat);
+  strs = zkocaml_build_strings_struct(&local_strings);
   Store_field(result, 0, error);
-  Store_field(result, 1, stat);
+  Store_field(result, 1, strs);
 
   CAMLreturn(result);
-
 }
 
 /**
- * Gets the data associated with a node synchronously.
+ * Lists the children of a node and get its stat synchronously.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * This function is new in version 3.3.0
+ *
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
@@ -2382,63 +6916,62 @@ zkocaml_wexists(value zh,
  * @watch if nonzero, a watch will be set at the server to notify
  * the client if the node changes.
  *
- * @buffer the buffer holding the node data returned by the server
+ * @strings return value of children paths.
  *
- * @stat if not NULL, will hold the value of stat for the path on return.
+ * @stat return value of node stat.
  *
- * @return return value of the function call.
+ * @return the return code of the function.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
  *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_get(value zh,
-            value path,
-            value watch)
+zkocaml_get_children2(value zh,
+                      value path,
+                      value watch)
 {
   CAMLparam3(zh, path, watch);
-  CAMLlocal4(result, error, buffer, stat);
+  CAMLlocal4(result, error, strs, stat);
+  struct String_vector local_strings;
   struct Stat local_stat;
 
   result = caml_alloc(3, 0);
   Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, caml_copy_string(""));
+  Store_field(result, 1, Atom(0));
   Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, result);
 
-  int path_buffer_size = ZKOCAML_MAX_PATH_BUFFER_SIZE;
-  char *path_buffer = (char *)malloc(
-                      sizeof(char) * path_buffer_size);
-  memset(path_buffer, 0, path_buffer_size);
-  const char *local_path = String_val(path);
+  const char *local_path = zkocaml_ns_path(zh, path);
   int local_watch = Int_val(watch);
-  int rc = zoo_get(handle,
-                   local_path,
-                   local_watch,
-                   path_buffer,
-                   &path_buffer_size,
-                   (struct Stat *)&local_stat);
+
+  int rc = zoo_get_children2(handle,
+                             local_path,
+                             local_watch,
+                             (struct String_vector *)&local_strings,
+                             (struct Stat *)&local_stat);
+
   error = zkocaml_enum_error_c2ml(rc);
-  buffer = caml_copy_string(path_buffer);
+  strs = zkocaml_build_strings_struct(&local_strings);
   stat = zkocaml_build_stat_struct(&local_stat);
   Store_field(result, 0, error);
-  Store_field(result, 1, buffer);
+  Store_field(result, 1, strs);
   Store_field(result, 2, stat);
-  free(path_buffer);
 
   CAMLreturn(result);
 }
 
 /**
- * Gets the data associated with a node synchronously.
+ * Lists the children of a node and get its stat synchronously.
  *
- * This function is similar to zoo_get except it allows one specify
+ * This function is similar to \ref zoo_get_children except it allows one specify
  * a watcher object rather than a boolean watch flag.
  *
+ * This function is new in version 3.3.0
+ *
  * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
@@ -2451,499 +6984,1259 @@ zkocaml_get(value zh,
  * Unlike the global context set by \ref zookeeper_init, this watcher context
  * is associated with the given instance of the watcher only.
  *
- * @buffer the buffer holding the node data returned by the server
+ * @strings return value of children paths.
  *
- * @stat if not NULL, will hold the value of stat for the path on return.
+ * @stat return value of node stat.
  *
- * @return return value of the function call.
+ * @return the return code of the function.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
  *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
+
 CAMLprim value
-zkocaml_wget(value zh,
-             value path,
-             value watcher_callback,
-             value watcher_ctx)
+zkocaml_wget_children2(value zh,
+                       value path,
+                       value watcher_callback,
+                       value watcher_ctx)
 {
   CAMLparam4(zh, path, watcher_callback, watcher_ctx);
-  CAMLlocal4(result, error, buffer, stat);
+  CAMLlocal4(result, error, strs, stat);
+  struct String_vector local_strings;
   struct Stat local_stat;
 
   result = caml_alloc(3, 0);
   Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, caml_copy_string(""));
+  Store_field(result, 1, Atom(0));
   Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, result);
 
-  int path_buffer_size = ZKOCAML_MAX_PATH_BUFFER_SIZE;
-  char *path_buffer = (char *)malloc(
-                      sizeof(char) * path_buffer_size);
-  memset(path_buffer, 0, path_buffer_size);
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = make_watcher_context(watcher_ctx, watcher_callback, DISPOSABLE, zh);
+  uint64_t sub_id = 0;
+  zkocaml_watch_entry_t *local_ctx = zkocaml_watch_subscribe(zh, path, ZKOCAML_WATCH_CHILD,
+                                                             watcher_callback, watcher_ctx, &sub_id);
 
-  int rc = zoo_wget(handle,
-                    local_path,
-                    watcher_dispatch,
-                    local_ctx,
-                    path_buffer,
-                    &path_buffer_size,
-                    (struct Stat *)&local_stat);
+  const char *local_path = zkocaml_ns_path(zh, path);
+
+  int rc = zoo_wget_children2(handle,
+                              local_path,
+                              watch_registry_dispatch,
+                              local_ctx,
+                              (struct String_vector *)&local_strings,
+                              (struct Stat *)&local_stat);
+  zkocaml_watch_done(local_ctx, sub_id, zkocaml_watch_armed(ZKOCAML_WATCH_CHILD, rc));
 
   error = zkocaml_enum_error_c2ml(rc);
-  buffer = caml_copy_string(path_buffer);
+  strs = zkocaml_build_strings_struct(&local_strings);
   stat = zkocaml_build_stat_struct(&local_stat);
   Store_field(result, 0, error);
-  Store_field(result, 1, buffer);
+  Store_field(result, 1, strs);
   Store_field(result, 2, stat);
-  free(path_buffer);
 
   CAMLreturn(result);
 }
 
 /**
- * Sets the data associated with a node. See zoo_set2 function if
- * you require access to the stat information associated with the znode.
+ * Gets the acl associated with a node synchronously.
  *
  * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @buffer the buffer holding data to be written to the node.
+ * @acl the return value of acls on the path.
  *
- * @version the expected version of the node. The function will fail if
- * the actual version of the node does not match the expected version. If -1 is
- * used the version check will not take place.
+ * @stat returns the stat of the path specified.
  *
  * @return the return code for the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *   ZBADVERSION expected version does not match actual version.
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_set(value zh, value path, value buffer, value version)
+zkocaml_get_acl(value zh, value path)
 {
-  CAMLparam4(zh, path, buffer, version);
+  CAMLparam2(zh, path);
+  CAMLlocal4(result, error, acls, stat);
+  struct ACL_vector local_acl;
+  struct Stat local_stat;
+
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
+  Store_field(result, 1, Atom(0));
+  Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
+  zhandle_t *handle = zkocaml_handle_struct_val(zh);
+  RETURN_IF_NO_HANDLE (handle, result);
+
+  const char *local_path = zkocaml_ns_path(zh, path);
+
+  int rc = zoo_get_acl(handle,
+                       local_path,
+                       (struct ACL_vector*)&local_acl,
+                       (struct Stat *)&local_stat);
+
+  error = zkocaml_enum_error_c2ml(rc);
+  acls = zkocaml_build_acls_struct(&local_acl);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  Store_field(result, 0, error);
+  Store_field(result, 1, acls);
+  Store_field(result, 2, stat);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Sets the acl associated with a node synchronously.
+ *
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @version the expected version of the path.
+ *
+ * @acl the acl to be set on the path.
+ *
+ * @return the return code for the function call.
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *   ZINVALIDACL invalid ACL specified
+ *   ZBADVERSION expected version does not match actual version.
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+static value
+zkocaml_set_acl_acl(value zh, value path, value version,
+                    const struct ACL_vector *acl)
+{
+  CAMLparam3(zh, path, version);
   CAMLlocal1(result);
 
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
 
-  int rc = zoo_set(handle,
-                   String_val(path),
-                   String_val(buffer),
-                   caml_string_length(buffer),
-                   Int_val(version));
+  const char *local_path = zkocaml_ns_path(zh, path);
+  int local_version = Int_val(version);
+  zkocaml_flight_detach(ZkO_handle_val(zh), local_path);
+  int rc = zoo_set_acl(handle,
+                       local_path,
+                       local_version,
+                       acl);
   result = zkocaml_enum_error_c2ml(rc);
 
   CAMLreturn(result);
 }
 
+CAMLprim value
+zkocaml_set_acl(value zh, value path, value version, value acl)
+{
+  CAMLparam4(zh, path, version, acl);
+  CAMLlocal1(result);
+
+  struct ACL_vector local_acl;
+  int r = zkocaml_parse_acls(acl, &local_acl);
+  result = zkocaml_set_acl_acl(zh, path, version,
+                               r ? &local_acl : &ZOO_OPEN_ACL_UNSAFE);
+  if (r) zkocaml_free_acls(&local_acl);
+
+  CAMLreturn(result);
+}
+
 /**
- * Sets the data associated with a node. This function is the same
- * as zoo_set except that it also provides access to stat information
- * associated with the znode.
+ * Sets the acl associated with a node synchronously from a prepared
+ * acl_handle.
+ */
+CAMLprim value
+zkocaml_set_acl_prepared(value zh, value path, value version, value acl)
+{
+  CAMLparam4(zh, path, version, acl);
+  CAMLreturn(zkocaml_set_acl_acl(zh, path, version, ZkO_acl_val(acl)));
+}
+
+/**
+ * Gets the last committed configuration of the ensemble synchronously.
  *
  * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @buffer the buffer holding data to be written to the node.
- *
- * @version the expected version of the node. The function will fail if
- * the actual version of the node does not match the expected version. If -1 is
- * used the version check will not take place.
- *
- * @stat if not NULL, will hold the value of stat for the path on return.
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the configuration changes.
  *
- * @return the return code for the function call.
+ * @return the return code, the configuration and its stat:
  *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *   ZBADVERSION expected version does not match actual version.
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_set2(value zh, value path, value buffer, value version)
+zkocaml_getconfig(value zh, value watch)
 {
-  CAMLparam4(zh, path, buffer, version);
-  CAMLlocal3(result, error, stat);
+  CAMLparam2(zh, watch);
+  CAMLlocal1(result);
   struct Stat local_stat;
 
-  result = caml_alloc(2, 0);
+  result = caml_alloc(3, 0);
   Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, zkocaml_build_stat_struct(&local_stat));
+  Store_field(result, 1, caml_copy_string(""));
+  Store_field(result, 2, zkocaml_build_stat_struct(NULL));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, result);
 
-  int rc = zoo_set2(handle,
-                    String_val(path),
-                    String_val(buffer),
-                    caml_string_length(buffer),
-                    Int_val(version),
-                    &local_stat);
+  int buffer_len = ZKOCAML_MAX_CONFIG_BUFFER_SIZE;
+  char *buffer = (char *)malloc(buffer_len);
+  int rc = zoo_getconfig(handle, Int_val(watch), buffer, &buffer_len, &local_stat);
 
-  error = zkocaml_enum_error_c2ml(rc);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  Store_field(result, 0, error);
-  Store_field(result, 1, stat);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(rc));
+  if (rc == ZOK) {
+    Store_field(result, 1, caml_alloc_initialized_string(buffer_len < 0 ? 0 : buffer_len, buffer));
+    Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
+  }
+  free(buffer);
 
   CAMLreturn(result);
 }
 
 /**
- * Lists the children of a node synchronously.
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watch if nonzero, a watch will be set at the server to notify
- * the client if the node changes.
- *
- * @strings return value of children paths.
+ * Reconfigures the ensemble synchronously. See areconfig for the
+ * arguments.
  *
- * @return the return code of the function.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * @return the return code, the new configuration and its stat.
  */
 CAMLprim value
-zkocaml_get_children(value zh, value path, value watch)
+zkocaml_reconfig(value zh,
+                 value joining,
+                 value leaving,
+                 value members,
+                 value version)
 {
-  CAMLparam3(zh, path, watch);
-  CAMLlocal3(result, error, strs);
-  struct String_vector local_strings;
+  CAMLparam5(zh, joining, leaving, members, version);
+  CAMLlocal1(result);
+  struct Stat local_stat;
 
-  result = caml_alloc(2, 0);
+  result = caml_alloc(3, 0);
   Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, Atom(0));
+  Store_field(result, 1, caml_copy_string(""));
+  Store_field(result, 2, zkocaml_build_stat_struct(NULL));
   zhandle_t *handle = zkocaml_handle_struct_val(zh);
   RETURN_IF_NO_HANDLE (handle, result);
 
-  const char *local_path = String_val(path);
-  int local_watch = Int_val(watch);
+  int buffer_len = ZKOCAML_MAX_CONFIG_BUFFER_SIZE;
+  char *buffer = (char *)malloc(buffer_len);
+  int rc = zoo_reconfig(handle,
+                        zkocaml_null_if_empty(joining),
+                        zkocaml_null_if_empty(leaving),
+                        zkocaml_null_if_empty(members),
+                        Int64_val(version),
+                        buffer,
+                        &buffer_len,
+                        &local_stat);
+
+  Store_field(result, 0, zkocaml_enum_error_c2ml(rc));
+  if (rc == ZOK) {
+    Store_field(result, 1, caml_alloc_initialized_string(buffer_len < 0 ? 0 : buffer_len, buffer));
+    Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
+  }
+  free(buffer);
 
-  int rc = zoo_get_children(handle,
-                            local_path,
-                            local_watch,
-                            (struct String_vector *)&local_strings);
+  CAMLreturn(result);
+}
 
-  error = zkocaml_enum_error_c2ml(rc);
-  strs = zkocaml_build_strings_struct(&local_strings);
-  Store_field(result, 0, error);
-  Store_field(result, 1, strs);
+/**
+ * Shared snapshots.
+ *
+ * A publisher writes the nodes of a subtree it keeps up to date into
+ * files that the other processes of the host map read-only. Every
+ * generation goes to a file of its own, @name.<generation>, renamed
+ * into place once complete, then published by storing its number in
+ * the control file @name. A reader compares that number with the
+ * generation it maps on every lookup, a plain memory load, and maps
+ * the new file only when it changed: lookups make no system call.
+ * The generation before the previous one is unlinked, readers still
+ * mapping it keep their pages. There is one publisher per name.
+ */
 
-  CAMLreturn(result);
+#define ZKOCAML_SNAPSHOT_MAGIC "ZKOSNAP1"
+#define ZKOCAML_SNAPSHOT_CONTROL_MAGIC "ZKOSCTL1"
+
+#define ZkO_snapshot_val(v) (*(zkocaml_snapshot_reader_t **)Data_custom_val(v))
+
+static char *
+zkocaml_snapshot_file(const char *name, uint64_t generation)
+{
+  size_t len = strlen(name) + 32;
+  char *file = (char *) malloc(len);
+  snprintf(file, len, "%s.%llu", name, (unsigned long long) generation);
+  return file;
 }
 
 /**
- * Lists the children of a node synchronously.
- *
- * This function is similar to zoo_get_children except it allows one specify
- * a watcher object rather than a boolean watch flag.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * Maps the control file @name, read-only unless @create, in which case
+ * it is created if needed. Returns NULL if it cannot.
+ */
+static zkocaml_snapshot_control_t *
+zkocaml_snapshot_control(const char *name, int create)
+{
+  struct stat st;
+  void *map = MAP_FAILED;
+  zkocaml_snapshot_control_t *control = NULL;
+  size_t len = sizeof(zkocaml_snapshot_control_t);
+  int fd = open(name, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) == 0) {
+    if (create && (size_t) st.st_size < len && ftruncate(fd, len) == 0)
+      st.st_size = len;
+    if ((size_t) st.st_size >= len)
+      map = mmap(NULL, len, create ? PROT_READ | PROT_WRITE : PROT_READ,
+                 MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  control = (zkocaml_snapshot_control_t *) map;
+  if (memcmp(control->magic, ZKOCAML_SNAPSHOT_CONTROL_MAGIC, 8) != 0) {
+    if (!create) {
+      munmap(map, len);
+      return NULL;
+    }
+    memcpy(control->magic, ZKOCAML_SNAPSHOT_CONTROL_MAGIC, 8);
+  }
+  return control;
+}
+
+/**
+ * Writes the snapshot in @buffer as the next generation of @name and
+ * publishes it. Runs with the runtime released.
  *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
+ * @return the generation published, or 0 if it could not be.
+ */
+static uint64_t
+zkocaml_snapshot_publish(const char *name, char *buffer, size_t size)
+{
+  zkocaml_snapshot_control_t *control = zkocaml_snapshot_control(name, 1);
+  uint64_t generation = 0;
+  char *file = NULL, *tmp = NULL;
+  size_t done = 0;
+  int fd = -1, ok = 0;
+
+  if (control == NULL) return 0;
+  generation = atomic_load(&control->generation) + 1;
+  ((zkocaml_snapshot_header_t *) buffer)->generation = generation;
+
+  file = zkocaml_snapshot_file(name, generation);
+  tmp = (char *) malloc(strlen(file) + 5);
+  sprintf(tmp, "%s.tmp", file);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    while (done < size) {
+      ssize_t n = write(fd, buffer + done, size - done);
+      if (n <= 0) break;
+      done += n;
+    }
+    ok = close(fd) == 0 && done == size && rename(tmp, file) == 0;
+    if (!ok) unlink(tmp);
+  }
+
+  if (ok) {
+    atomic_store(&control->generation, generation);
+    if (generation > 2) {
+      char *old = zkocaml_snapshot_file(name, generation - 2);
+      unlink(old);
+      free(old);
+    }
+  }
+  munmap(control, sizeof(zkocaml_snapshot_control_t));
+  free(file);
+  free(tmp);
+
+  return ok ? generation : 0;
+}
+
+static int
+zkocaml_snapshot_compare(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+  int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (c != 0) return c;
+  return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/**
+ * Write @entries, an array of (path, data, mzxid) sorted by path, as
+ * the next generation of the shared snapshot @name.
  *
- * @watcher if non-null, a watch will be set at the server to notify
- * the client if the node changes.
+ * @return the result code and the generation published:
+ *   ZOK the generation was published
+ *   ZBADARGUMENTS the entries are not sorted or hold a path twice
+ *   ZSYSTEMERROR the files could not be written
+ */
+CAMLprim value
+zkocaml_snapshot_write(value name, value entries)
+{
+  CAMLparam2(name, entries);
+  CAMLlocal1(result);
+
+  size_t i = 0, count = Wosize_val(entries);
+  size_t size = sizeof(zkocaml_snapshot_header_t) + count * sizeof(zkocaml_snapshot_entry_t);
+  size_t off = size;
+  uint64_t generation = 0;
+
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+  Store_field(result, 1, Val_int(0));
+
+  for (i = 0; i < count; i++) {
+    value entry = Field(entries, i);
+    size += caml_string_length(Field(entry, 0)) + caml_string_length(Field(entry, 1));
+    if (i > 0) {
+      value prev = Field(entries, i - 1);
+      if (zkocaml_snapshot_compare(String_val(Field(prev, 0)), caml_string_length(Field(prev, 0)),
+                                   String_val(Field(entry, 0)), caml_string_length(Field(entry, 0))) >= 0)
+        CAMLreturn(result);
+    }
+  }
+
+  char *buffer = (char *) malloc(size);
+  zkocaml_snapshot_header_t *header = (zkocaml_snapshot_header_t *) buffer;
+  zkocaml_snapshot_entry_t *index = (zkocaml_snapshot_entry_t *) (header + 1);
+  memcpy(header->magic, ZKOCAML_SNAPSHOT_MAGIC, 8);
+  header->generation = 0;
+  header->count = count;
+  header->size = size;
+  for (i = 0; i < count; i++) {
+    value entry = Field(entries, i);
+    index[i].path_off = off;
+    index[i].path_len = caml_string_length(Field(entry, 0));
+    memcpy(buffer + off, String_val(Field(entry, 0)), index[i].path_len);
+    off += index[i].path_len;
+    index[i].data_off = off;
+    index[i].data_len = caml_string_length(Field(entry, 1));
+    memcpy(buffer + off, String_val(Field(entry, 1)), index[i].data_len);
+    off += index[i].data_len;
+    index[i].mzxid = Int64_val(Field(entry, 2));
+  }
+
+  char *local_name = strdup(String_val(name));
+  caml_enter_blocking_section();
+  generation = zkocaml_snapshot_publish(local_name, buffer, size);
+  caml_leave_blocking_section();
+  free(local_name);
+  free(buffer);
+
+  Store_field(result, 0, zkocaml_enum_error_c2ml(generation ? ZOK : ZSYSTEMERROR));
+  Store_field(result, 1, Val_long(generation));
+  CAMLreturn(result);
+}
+
+static void
+zkocaml_snapshot_unmap(zkocaml_snapshot_reader_t *reader)
+{
+  if (reader->snapshot != NULL)
+    munmap((void *) reader->snapshot, reader->size);
+  reader->snapshot = NULL;
+  reader->size = 0;
+  reader->generation = 0;
+}
+
+/**
+ * Maps the generation published in the control file unless it is
+ * mapped already; keeps the current mapping if it cannot.
+ */
+static void
+zkocaml_snapshot_refresh(zkocaml_snapshot_reader_t *reader)
+{
+  uint64_t generation = atomic_load(&reader->control->generation);
+  const zkocaml_snapshot_header_t *header = NULL;
+  void *map = MAP_FAILED;
+  struct stat st;
+  char *file = NULL;
+  int fd = -1;
+
+  if (generation == reader->generation || generation == 0) return;
+  file = zkocaml_snapshot_file(reader->name, generation);
+  fd = open(file, O_RDONLY);
+  free(file);
+  if (fd < 0) return;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(zkocaml_snapshot_header_t))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return;
+
+  header = (const zkocaml_snapshot_header_t *) map;
+  if (memcmp(header->magic, ZKOCAML_SNAPSHOT_MAGIC, 8) != 0 ||
+      header->size != (uint64_t) st.st_size ||
+      header->count > (header->size - sizeof(zkocaml_snapshot_header_t))
+                      / sizeof(zkocaml_snapshot_entry_t)) {
+    munmap(map, st.st_size);
+    return;
+  }
+  zkocaml_snapshot_unmap(reader);
+  reader->snapshot = header;
+  reader->size = st.st_size;
+  reader->generation = generation;
+}
+
+static void
+snapshot_finalize(value v)
+{
+  zkocaml_snapshot_reader_t *reader = ZkO_snapshot_val(v);
+  zkocaml_snapshot_unmap(reader);
+  munmap(reader->control, sizeof(zkocaml_snapshot_control_t));
+  free(reader->name);
+  free(reader);
+}
+
+static struct custom_operations snapshot_ops = {
+  "zkocaml.snapshot_reader",
+  snapshot_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+/**
+ * Open a reader of the shared snapshot @name, or None if no publisher
+ * has created it yet.
+ */
+CAMLprim value
+zkocaml_snapshot_open(value name)
+{
+  CAMLparam1(name);
+  CAMLlocal2(result, reader_value);
+
+  zkocaml_snapshot_control_t *control = zkocaml_snapshot_control(String_val(name), 0);
+  if (control == NULL) CAMLreturn(Val_int(0));
+
+  zkocaml_snapshot_reader_t *reader = (zkocaml_snapshot_reader_t *)
+      calloc(1, sizeof(zkocaml_snapshot_reader_t));
+  reader->name = strdup(String_val(name));
+  reader->control = control;
+  zkocaml_snapshot_refresh(reader);
+
+  reader_value = caml_alloc_custom(&snapshot_ops, sizeof(zkocaml_snapshot_reader_t *), 0, 1);
+  ZkO_snapshot_val(reader_value) = reader;
+  result = caml_alloc(1, 0);
+  Store_field(result, 0, reader_value);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Look @path up in the latest generation of the snapshot.
  *
- * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by \ref zookeeper_init, this watcher context
- * is associated with the given instance of the watcher only.
+ * @return Some (data, mzxid), or None if the node is not in it
+ */
+CAMLprim value
+zkocaml_snapshot_find(value v, value path)
+{
+  CAMLparam2(v, path);
+  CAMLlocal3(result, data, found);
+
+  zkocaml_snapshot_reader_t *reader = ZkO_snapshot_val(v);
+  const zkocaml_snapshot_entry_t *index = NULL;
+  const char *base = NULL;
+  size_t lo = 0, hi = 0, len = caml_string_length(path);
+
+  zkocaml_snapshot_refresh(reader);
+  if (reader->snapshot == NULL) CAMLreturn(Val_int(0));
+
+  base = (const char *) reader->snapshot;
+  index = (const zkocaml_snapshot_entry_t *) (reader->snapshot + 1);
+  hi = reader->snapshot->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const zkocaml_snapshot_entry_t *entry = &index[mid];
+    int c = 0;
+    if (entry->path_off + entry->path_len > reader->size ||
+        entry->data_off + entry->data_len > reader->size)
+      CAMLreturn(Val_int(0));
+    c = zkocaml_snapshot_compare(base + entry->path_off, entry->path_len,
+                                 String_val(path), len);
+    if (c == 0) {
+      data = caml_alloc_initialized_string(entry->data_len, base + entry->data_off);
+      found = caml_alloc(2, 0);
+      Store_field(found, 0, data);
+      data = caml_copy_int64(entry->mzxid);
+      Store_field(found, 1, data);
+      result = caml_alloc(1, 0);
+      Store_field(result, 0, found);
+      CAMLreturn(result);
+    }
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+
+  CAMLreturn(Val_int(0));
+}
+
+/**
+ * The generation of the snapshot lookups currently see, 0 if none has
+ * been published yet.
+ */
+CAMLprim value
+zkocaml_snapshot_generation(value v)
+{
+  CAMLparam1(v);
+  zkocaml_snapshot_reader_t *reader = ZkO_snapshot_val(v);
+  zkocaml_snapshot_refresh(reader);
+  CAMLreturn(Val_long(reader->generation));
+}
+
+/**
+ * Error codes.
  *
- * @strings return value of children paths.
+ * The numeric ZooKeeper code of an error, and back, as the session
+ * proxy carries them.
+ */
+CAMLprim value
+zkocaml_error_code(value error)
+{
+  CAMLparam1(error);
+  CAMLreturn(Val_int(zkocaml_enum_error_ml2c(error)));
+}
+
+CAMLprim value
+zkocaml_error_of_code(value code)
+{
+  CAMLparam1(code);
+  CAMLreturn(zkocaml_enum_error_c2ml(Int_val(code)));
+}
+
+/**
+ * All the entries of the latest generation of the snapshot, in path
+ * order. The reader must not be used by another thread meanwhile.
  *
- * @return the return code of the function.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * @return an array of (path, data, mzxid)
  */
 CAMLprim value
-zkocaml_wget_children(value zh,
-                      value path,
-                      value watcher_callback,
-                      value watcher_ctx)
+zkocaml_snapshot_entries(value v)
 {
-  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
-  CAMLlocal3(result, error, strs);
-  struct String_vector local_strings;
+  CAMLparam1(v);
+  CAMLlocal3(result, entry, field);
+
+  zkocaml_snapshot_reader_t *reader = ZkO_snapshot_val(v);
+  const zkocaml_snapshot_entry_t *index = NULL;
+  const char *base = NULL;
+  size_t i = 0, count = 0;
+
+  zkocaml_snapshot_refresh(reader);
+  if (reader->snapshot == NULL) CAMLreturn(Atom(0));
+
+  base = (const char *) reader->snapshot;
+  index = (const zkocaml_snapshot_entry_t *) (reader->snapshot + 1);
+  for (; count < reader->snapshot->count; count++) {
+    const zkocaml_snapshot_entry_t *e = &index[count];
+    if (e->path_off + e->path_len > reader->size ||
+        e->data_off + e->data_len > reader->size)
+      break;
+  }
+  if (count == 0) CAMLreturn(Atom(0));
+
+  result = caml_alloc(count, 0);
+  for (i = 0; i < count; i++) {
+    entry = caml_alloc(3, 0);
+    field = caml_alloc_initialized_string(index[i].path_len, base + index[i].path_off);
+    Store_field(entry, 0, field);
+    field = caml_alloc_initialized_string(index[i].data_len, base + index[i].data_off);
+    Store_field(entry, 1, field);
+    field = caml_copy_int64(index[i].mzxid);
+    Store_field(entry, 2, field);
+    Store_field(result, i, entry);
+  }
 
-  result = caml_alloc(2, 0);
-  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, Atom(0));
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, result);
+  CAMLreturn(result);
+}
 
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = make_watcher_context(watcher_ctx, watcher_callback, DISPOSABLE, zh);
+/**
+ * ZooKeeper data files.
+ *
+ * Readers of the snapshots and transaction logs a ZooKeeper server
+ * keeps in its data directory, decoding their jute encoding straight
+ * out of a read-only mapping of the file, without copying it.
+ */
 
-  int rc = zoo_wget_children(handle,
-                             local_path,
-                             watcher_dispatch,
-                             local_ctx,
-                             (struct String_vector *)&local_strings);
+#define ZKOCAML_ZK_SNAPSHOT_MAGIC 0x5a4b534e /* "ZKSN" */
+#define ZKOCAML_ZK_TXNLOG_MAGIC 0x5a4b4c47 /* "ZKLG" */
+
+/* Transaction types, the opcodes of the requests they apply. */
+#define ZKOCAML_ZK_TXN_CREATE 1
+#define ZKOCAML_ZK_TXN_DELETE 2
+#define ZKOCAML_ZK_TXN_SETDATA 5
+#define ZKOCAML_ZK_TXN_SETACL 7
+#define ZKOCAML_ZK_TXN_CHECK 13
+#define ZKOCAML_ZK_TXN_MULTI 14
+#define ZKOCAML_ZK_TXN_CREATE2 15
+#define ZKOCAML_ZK_TXN_CREATE_CONTAINER 19
+#define ZKOCAML_ZK_TXN_DELETE_CONTAINER 20
+#define ZKOCAML_ZK_TXN_CREATE_TTL 21
+
+static const unsigned char *
+zkocaml_jute_take(zkocaml_jute_t *jute, size_t len)
+{
+  const unsigned char *pos = jute->pos;
+  if (!jute->ok || (size_t) (jute->end - jute->pos) < len) {
+    jute->ok = 0;
+    return NULL;
+  }
+  jute->pos += len;
+  return pos;
+}
+
+static int32_t
+zkocaml_jute_int(zkocaml_jute_t *jute)
+{
+  const unsigned char *p = zkocaml_jute_take(jute, 4);
+  if (p == NULL) return 0;
+  return (int32_t) ((uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+                    (uint32_t) p[2] << 8 | (uint32_t) p[3]);
+}
+
+static int64_t
+zkocaml_jute_long(zkocaml_jute_t *jute)
+{
+  uint64_t high = (uint32_t) zkocaml_jute_int(jute);
+  uint64_t low = (uint32_t) zkocaml_jute_int(jute);
+  return (int64_t) (high << 32 | low);
+}
+
+/**
+ * Reads a buffer or a string: a length, -1 for null, then its bytes.
+ */
+static const unsigned char *
+zkocaml_jute_buffer(zkocaml_jute_t *jute, size_t *len)
+{
+  int32_t n = zkocaml_jute_int(jute);
+  const unsigned char *p = zkocaml_jute_take(jute, n > 0 ? (size_t) n : 0);
+  *len = p != NULL && n > 0 ? (size_t) n : 0;
+  return p;
+}
+
+/**
+ * Maps @file read-only for a sequential scan.
+ *
+ * @return the mapping, or NULL if the file cannot be mapped
+ */
+static const unsigned char *
+zkocaml_zk_map(const char *file, size_t *size)
+{
+  struct stat st;
+  void *map = MAP_FAILED;
+  int fd = open(file, O_RDONLY);
+
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return (const unsigned char *) map;
+}
+
+/**
+ * Reads the file header of a snapshot or a log: its magic, a version
+ * and the database id.
+ */
+static int
+zkocaml_zk_header(zkocaml_jute_t *jute, int32_t magic)
+{
+  int32_t found = zkocaml_jute_int(jute);
+  zkocaml_jute_int(jute);
+  zkocaml_jute_long(jute);
+  return jute->ok && found == magic;
+}
+
+/**
+ * Hands @node to @f as (path, data, stat); the data is "" unless
+ * @with_data.
+ *
+ * @return the result of the callback, an exception result if it raised
+ */
+static value
+zkocaml_zk_node_emit(value f, value with_data, const zkocaml_zk_node_t *node)
+{
+  CAMLparam2(f, with_data);
+  CAMLlocal4(result, path, data, stat);
 
-  error = zkocaml_enum_error_c2ml(rc);
-  strs = zkocaml_build_strings_struct(&local_strings);
-  Store_field(result, 0, error);
-  Store_field(result, 1, strs);
+  if (node->path_len == 0)
+    path = caml_copy_string("/");
+  else
+    path = caml_alloc_initialized_string(node->path_len, (const char *) node->path);
+  if (Bool_val(with_data))
+    data = caml_alloc_initialized_string(node->data_len, (const char *) node->data);
+  else
+    data = caml_copy_string("");
+  stat = zkocaml_build_stat_struct(&node->stat);
+  result = caml_callback3_exn(f, path, data, stat);
 
   CAMLreturn(result);
 }
 
 /**
- * Lists the children of a node and get its stat synchronously.
- *
- * This function is new in version 3.3.0
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watch if nonzero, a watch will be set at the server to notify
- * the client if the node changes.
- *
- * @strings return value of children paths.
- *
- * @stat return value of node stat.
- *
- * @return the return code of the function.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * Whether the node at @parent is an ancestor of the one at @path.
  */
-CAMLprim value
-zkocaml_get_children2(value zh,
-                      value path,
-                      value watch)
+static int
+zkocaml_zk_ancestor(const zkocaml_zk_node_t *parent, const unsigned char *path, size_t len)
 {
-  CAMLparam3(zh, path, watch);
-  CAMLlocal4(result, error, strs, stat);
-  struct String_vector local_strings;
-  struct Stat local_stat;
+  return parent->path_len == 0 ||
+    (len > parent->path_len && path[parent->path_len] == '/' &&
+     memcmp(path, parent->path, parent->path_len) == 0);
+}
 
-  result = caml_alloc(3, 0);
-  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, Atom(0));
-  Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, result);
+/**
+ * Iterate the nodes of the ZooKeeper snapshot @file, calling @f on the
+ * path, data and stat of each. A snapshot stores the nodes parents
+ * first; they are handed out children first, once their children are
+ * counted into num_children. The data is "" unless @with_data.
+ *
+ * @return the result code:
+ *   ZOK the whole snapshot was read
+ *   ZSYSTEMERROR the file cannot be mapped
+ *   ZBADARGUMENTS the file is not a snapshot
+ *   ZMARSHALLINGERROR the snapshot is truncated
+ */
+CAMLprim value
+zkocaml_zk_snapshot_iter(value file, value with_data, value f)
+{
+  CAMLparam3(file, with_data, f);
+  CAMLlocal1(result);
 
-  const char *local_path = String_val(path);
-  int local_watch = Int_val(watch);
+  size_t size = 0, depth = 0, capacity = 64;
+  int32_t i = 0, n = 0;
+  enum ZOO_ERRORS rc = ZOK;
+  zkocaml_zk_node_t *stack = NULL;
+  zkocaml_jute_t jute;
+  const unsigned char *map = zkocaml_zk_map(String_val(file), &size);
+
+  if (map == NULL) CAMLreturn(zkocaml_enum_error_c2ml(ZSYSTEMERROR));
+  jute.pos = map;
+  jute.end = map + size;
+  jute.ok = 1;
+  if (!zkocaml_zk_header(&jute, ZKOCAML_ZK_SNAPSHOT_MAGIC)) {
+    munmap((void *) map, size);
+    CAMLreturn(zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+  }
 
-  int rc = zoo_get_children2(handle,
-                             local_path,
-                             local_watch,
-                             (struct String_vector *)&local_strings,
-                             (struct Stat *)&local_stat);
+  /* Sessions, then the ACL cache. */
+  n = zkocaml_jute_int(&jute);
+  for (i = 0; i < n && jute.ok; i++) {
+    zkocaml_jute_long(&jute);
+    zkocaml_jute_int(&jute);
+  }
+  n = zkocaml_jute_int(&jute);
+  for (i = 0; i < n && jute.ok; i++) {
+    int32_t j = 0, acls = 0;
+    zkocaml_jute_long(&jute);
+    acls = zkocaml_jute_int(&jute);
+    for (j = 0; j < acls && jute.ok; j++) {
+      size_t len = 0;
+      zkocaml_jute_int(&jute);
+      zkocaml_jute_buffer(&jute, &len);
+      zkocaml_jute_buffer(&jute, &len);
+    }
+  }
 
-  error = zkocaml_enum_error_c2ml(rc);
-  strs = zkocaml_build_strings_struct(&local_strings);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  Store_field(result, 0, error);
-  Store_field(result, 1, strs);
-  Store_field(result, 2, stat);
+  stack = (zkocaml_zk_node_t *) malloc(capacity * sizeof(zkocaml_zk_node_t));
+  while (jute.ok) {
+    zkocaml_zk_node_t node;
+    memset(&node, 0, sizeof(node));
+    node.path = zkocaml_jute_buffer(&jute, &node.path_len);
+    if (!jute.ok || (node.path_len == 1 && node.path[0] == '/')) break;
+
+    node.data = zkocaml_jute_buffer(&jute, &node.data_len);
+    zkocaml_jute_long(&jute);
+    node.stat.czxid = zkocaml_jute_long(&jute);
+    node.stat.mzxid = zkocaml_jute_long(&jute);
+    node.stat.ctime = zkocaml_jute_long(&jute);
+    node.stat.mtime = zkocaml_jute_long(&jute);
+    node.stat.version = zkocaml_jute_int(&jute);
+    node.stat.cversion = zkocaml_jute_int(&jute);
+    node.stat.aversion = zkocaml_jute_int(&jute);
+    node.stat.ephemeralOwner = zkocaml_jute_long(&jute);
+    node.stat.pzxid = zkocaml_jute_long(&jute);
+    node.stat.dataLength = node.data_len;
+    if (!jute.ok) break;
+
+    while (depth > 0 && !zkocaml_zk_ancestor(&stack[depth - 1], node.path, node.path_len)) {
+      result = zkocaml_zk_node_emit(f, with_data, &stack[--depth]);
+      if (Is_exception_result(result)) goto failed;
+    }
+    if (depth > 0) stack[depth - 1].stat.numChildren++;
+    if (depth == capacity) {
+      capacity *= 2;
+      stack = (zkocaml_zk_node_t *) realloc(stack, capacity * sizeof(zkocaml_zk_node_t));
+    }
+    stack[depth++] = node;
+  }
+  if (!jute.ok) rc = ZMARSHALLINGERROR;
 
-  CAMLreturn(result);
+  while (depth > 0) {
+    result = zkocaml_zk_node_emit(f, with_data, &stack[--depth]);
+    if (Is_exception_result(result)) goto failed;
+  }
+  free(stack);
+  munmap((void *) map, size);
+  CAMLreturn(zkocaml_enum_error_c2ml(rc));
+
+failed:
+  free(stack);
+  munmap((void *) map, size);
+  caml_raise(Extract_exception(result));
+  CAMLreturn(Val_unit);
 }
 
 /**
- * Lists the children of a node and get its stat synchronously.
- *
- * This function is similar to \ref zoo_get_children except it allows one specify
- * a watcher object rather than a boolean watch flag.
- *
- * This function is new in version 3.3.0
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watcher if non-null, a watch will be set at the server to notify
- * the client if the node changes.
- *
- * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by \ref zookeeper_init, this watcher context
- * is associated with the given instance of the watcher only.
- *
- * @strings return value of children paths.
+ * Hands a transaction with its header and the body in @jute, read as
+ * the one of type @type, to @f. The transactions of a multi are handed
+ * out one by one.
  *
- * @stat return value of node stat.
- *
- * @return the return code of the function.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * @return the result of the callback, an exception result if it raised
  */
+static value
+zkocaml_zk_txn_emit(value f, const int64_t *header, int32_t cxid, int32_t type,
+                    zkocaml_jute_t *jute)
+{
+  CAMLparam1(f);
+  CAMLlocal3(result, txn, field);
+
+  const unsigned char *path = NULL;
+  size_t path_len = 0, data_len = 0;
+  int32_t i = 0, n = 0;
+
+  switch (type) {
+  case ZKOCAML_ZK_TXN_CREATE:
+  case ZKOCAML_ZK_TXN_CREATE2:
+  case ZKOCAML_ZK_TXN_CREATE_CONTAINER:
+  case ZKOCAML_ZK_TXN_CREATE_TTL:
+  case ZKOCAML_ZK_TXN_SETDATA:
+    path = zkocaml_jute_buffer(jute, &path_len);
+    zkocaml_jute_buffer(jute, &data_len);
+    break;
+  case ZKOCAML_ZK_TXN_DELETE:
+  case ZKOCAML_ZK_TXN_DELETE_CONTAINER:
+  case ZKOCAML_ZK_TXN_SETACL:
+  case ZKOCAML_ZK_TXN_CHECK:
+    path = zkocaml_jute_buffer(jute, &path_len);
+    break;
+  case ZKOCAML_ZK_TXN_MULTI:
+    n = zkocaml_jute_int(jute);
+    result = Val_unit;
+    for (i = 0; i < n && jute->ok; i++) {
+      zkocaml_jute_t sub;
+      size_t len = 0;
+      int32_t sub_type = zkocaml_jute_int(jute);
+      sub.pos = zkocaml_jute_buffer(jute, &len);
+      if (!jute->ok) break;
+      sub.end = sub.pos + len;
+      sub.ok = 1;
+      result = zkocaml_zk_txn_emit(f, header, cxid, sub_type, &sub);
+      if (Is_exception_result(result)) break;
+    }
+    CAMLreturn(result);
+  default:
+    break;
+  }
 
+  txn = caml_alloc(7, 0);
+  field = caml_copy_int64(header[0]);
+  Store_field(txn, 0, field);
+  Store_field(txn, 1, Val_int(cxid));
+  field = caml_copy_int64(header[1]);
+  Store_field(txn, 2, field);
+  field = caml_copy_int64(header[2]);
+  Store_field(txn, 3, field);
+  Store_field(txn, 4, Val_int(type));
+  field = caml_alloc_initialized_string(path == NULL ? 0 : path_len, (const char *) path);
+  Store_field(txn, 5, field);
+  Store_field(txn, 6, Val_long(data_len));
+  result = caml_callback_exn(f, txn);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Iterate the transactions of the ZooKeeper transaction log @file, in
+ * order, calling @f on each. The log ends at its zero padding or at a
+ * last transaction written partially.
+ *
+ * @return the result code:
+ *   ZOK the whole log was read
+ *   ZSYSTEMERROR the file cannot be mapped
+ *   ZBADARGUMENTS the file is not a transaction log
+ *   ZMARSHALLINGERROR a transaction is corrupt
+ */
 CAMLprim value
-zkocaml_wget_children2(value zh,
-                       value path,
-                       value watcher_callback,
-                       value watcher_ctx)
+zkocaml_zk_txnlog_iter(value file, value f)
 {
-  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
-  CAMLlocal4(result, error, strs, stat);
-  struct String_vector local_strings;
-  struct Stat local_stat;
+  CAMLparam2(file, f);
+  CAMLlocal1(result);
 
-  result = caml_alloc(3, 0);
-  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, Atom(0));
-  Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, result);
+  size_t size = 0;
+  enum ZOO_ERRORS rc = ZOK;
+  zkocaml_jute_t jute;
+  const unsigned char *map = zkocaml_zk_map(String_val(file), &size);
+
+  if (map == NULL) CAMLreturn(zkocaml_enum_error_c2ml(ZSYSTEMERROR));
+  jute.pos = map;
+  jute.end = map + size;
+  jute.ok = 1;
+  if (!zkocaml_zk_header(&jute, ZKOCAML_ZK_TXNLOG_MAGIC)) {
+    munmap((void *) map, size);
+    CAMLreturn(zkocaml_enum_error_c2ml(ZBADARGUMENTS));
+  }
 
-  zkocaml_watcher_context_t *local_ctx = make_watcher_context(watcher_ctx, watcher_callback, DISPOSABLE, zh);
+  for (;;) {
+    zkocaml_jute_t entry;
+    const unsigned char *marker = NULL;
+    size_t len = 0;
+    int64_t header[3];
+    int32_t cxid = 0, type = 0;
+
+    zkocaml_jute_long(&jute);
+    entry.pos = zkocaml_jute_buffer(&jute, &len);
+    marker = zkocaml_jute_take(&jute, 1);
+    if (!jute.ok || len == 0 || marker[0] != 'B') break;
+    entry.end = entry.pos + len;
+    entry.ok = 1;
+
+    header[0] = zkocaml_jute_long(&entry);
+    cxid = zkocaml_jute_int(&entry);
+    header[1] = zkocaml_jute_long(&entry);
+    header[2] = zkocaml_jute_long(&entry);
+    type = zkocaml_jute_int(&entry);
+    if (!entry.ok) {
+      rc = ZMARSHALLINGERROR;
+      break;
+    }
+    result = zkocaml_zk_txn_emit(f, header, cxid, type, &entry);
+    if (Is_exception_result(result)) {
+      munmap((void *) map, size);
+      caml_raise(Extract_exception(result));
+    }
+  }
 
-  const char *local_path = String_val(path);
+  munmap((void *) map, size);
+  CAMLreturn(zkocaml_enum_error_c2ml(rc));
+}
 
-  int rc = zoo_wget_children2(handle,
-                              local_path,
-                              watcher_dispatch,
-                              local_ctx,
-                              (struct String_vector *)&local_strings,
-                              (struct Stat *)&local_stat);
+/**
+ * Value compression.
+ *
+ * An LZ4 block codec for the value codec: greedy matching over a
+ * small hash table, the block format of LZ4 itself, and a decoder
+ * checking every length and offset against its buffers.
+ */
 
-  error = zkocaml_enum_error_c2ml(rc);
-  strs = zkocaml_build_strings_struct(&local_strings);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  Store_field(result, 0, error);
-  Store_field(result, 1, strs);
-  Store_field(result, 2, stat);
+#define ZKOCAML_LZ4_HASH_LOG 12
+#define ZKOCAML_LZ4_MIN_MATCH 4
+#define ZKOCAML_LZ4_LAST_LITERALS 5
+#define ZKOCAML_LZ4_MATCH_LIMIT 12
+#define ZKOCAML_LZ4_MAX_OFFSET 65535
+#define ZKOCAML_LZ4_MAX_RATIO 255
 
-  CAMLreturn(result);
+static uint32_t
+zkocaml_lz4_read32(const unsigned char *p)
+{
+  uint32_t v = 0;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static unsigned char *
+zkocaml_lz4_length(unsigned char *op, size_t len)
+{
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = (unsigned char) len;
+  return op;
+}
+
+static unsigned char *
+zkocaml_lz4_literals(unsigned char *op, const unsigned char *anchor, size_t len,
+                     unsigned char **token)
+{
+  *token = op++;
+  **token = (unsigned char) ((len >= 15 ? 15 : len) << 4);
+  if (len >= 15) op = zkocaml_lz4_length(op, len - 15);
+  memcpy(op, anchor, len);
+  return op + len;
+}
+
+static size_t
+zkocaml_lz4_bound(size_t len)
+{
+  return len + len / 255 + 16;
 }
 
 /**
- * Gets the acl associated with a node synchronously.
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * Compresses the @len bytes of @src into @dst, which holds at least
+ * zkocaml_lz4_bound(@len) bytes.
  *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @acl the return value of acls on the path.
- *
- * @stat returns the stat of the path specified.
+ * @return the length of the block
+ */
+static size_t
+zkocaml_lz4_compress_block(const unsigned char *src, size_t len, unsigned char *dst)
+{
+  uint32_t table[1 << ZKOCAML_LZ4_HASH_LOG];
+  const unsigned char *ip = src, *anchor = src, *end = src + len;
+  unsigned char *op = dst, *token = NULL;
+
+  memset(table, 0, sizeof(table));
+  if (len > ZKOCAML_LZ4_MATCH_LIMIT) {
+    const unsigned char *match_start_limit = end - ZKOCAML_LZ4_MATCH_LIMIT;
+    const unsigned char *match_end_limit = end - ZKOCAML_LZ4_LAST_LITERALS;
+    ip++;
+    while (ip < match_start_limit) {
+      uint32_t sequence = zkocaml_lz4_read32(ip);
+      uint32_t h = (sequence * 2654435761u) >> (32 - ZKOCAML_LZ4_HASH_LOG);
+      const unsigned char *ref = src + table[h];
+      size_t match = ZKOCAML_LZ4_MIN_MATCH, offset = ip - ref;
+
+      table[h] = (uint32_t) (ip - src);
+      if (offset == 0 || offset > ZKOCAML_LZ4_MAX_OFFSET ||
+          zkocaml_lz4_read32(ref) != sequence) {
+        ip++;
+        continue;
+      }
+      while (ip + match < match_end_limit && ref[match] == ip[match])
+        match++;
+
+      op = zkocaml_lz4_literals(op, anchor, ip - anchor, &token);
+      *op++ = (unsigned char) (offset & 0xff);
+      *op++ = (unsigned char) (offset >> 8);
+      match -= ZKOCAML_LZ4_MIN_MATCH;
+      *token |= (unsigned char) (match >= 15 ? 15 : match);
+      if (match >= 15) op = zkocaml_lz4_length(op, match - 15);
+
+      ip += match + ZKOCAML_LZ4_MIN_MATCH;
+      anchor = ip;
+    }
+  }
+  op = zkocaml_lz4_literals(op, anchor, end - anchor, &token);
+
+  return op - dst;
+}
+
+/**
+ * Decompresses the block @src of @len bytes into the @size bytes of
+ * @dst.
  *
- * @return the return code for the function call.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * @return 0 if the block decodes to exactly @size bytes, -1 otherwise
  */
-CAMLprim value
-zkocaml_get_acl(value zh, value path)
+static int
+zkocaml_lz4_decompress_block(const unsigned char *src, size_t len,
+                             unsigned char *dst, size_t size)
 {
-  CAMLparam2(zh, path);
-  CAMLlocal4(result, error, acls, stat);
-  struct ACL_vector local_acl;
-  struct Stat local_stat;
+  const unsigned char *ip = src, *end = src + len;
+  unsigned char *op = dst, *out_end = dst + size;
+
+  while (ip < end) {
+    unsigned int token = *ip++, b = 0;
+    size_t literals = token >> 4, match = token & 15, offset = 0;
+
+    if (literals == 15)
+      do {
+        if (ip >= end) return -1;
+        b = *ip++;
+        literals += b;
+      } while (b == 255);
+    if ((size_t) (end - ip) < literals || (size_t) (out_end - op) < literals)
+      return -1;
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+    if (ip == end) break;
+
+    if (end - ip < 2) return -1;
+    offset = ip[0] | (size_t) ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > (size_t) (op - dst)) return -1;
+    if (match == 15)
+      do {
+        if (ip >= end) return -1;
+        b = *ip++;
+        match += b;
+      } while (b == 255);
+    match += ZKOCAML_LZ4_MIN_MATCH;
+    if ((size_t) (out_end - op) < match) return -1;
+    for (; match > 0; match--, op++)
+      *op = *(op - offset);
+  }
 
-  result = caml_alloc(3, 0);
-  Store_field(result, 0, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-  Store_field(result, 1, Atom(0));
-  Store_field(result, 2, zkocaml_build_stat_struct(&local_stat));
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, result);
+  return op == out_end ? 0 : -1;
+}
 
-  const char *local_path = String_val(path);
+/**
+ * Compress @data into an LZ4 block.
+ */
+CAMLprim value
+zkocaml_lz4_compress(value data)
+{
+  CAMLparam1(data);
+  CAMLlocal1(result);
 
-  int rc = zoo_get_acl(handle,
-                       local_path,
-                       (struct ACL_vector*)&local_acl,
-                       (struct Stat *)&local_stat);
+  size_t len = caml_string_length(data), compressed = 0;
+  unsigned char *src = (unsigned char *) malloc(len + 1);
+  unsigned char *dst = (unsigned char *) malloc(zkocaml_lz4_bound(len));
 
-  error = zkocaml_enum_error_c2ml(rc);
-  acls = zkocaml_build_acls_struct(&local_acl);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  Store_field(result, 0, error);
-  Store_field(result, 1, acls);
-  Store_field(result, 2, stat);
+  memcpy(src, String_val(data), len);
+  caml_enter_blocking_section();
+  compressed = zkocaml_lz4_compress_block(src, len, dst);
+  caml_leave_blocking_section();
+  result = caml_alloc_initialized_string(compressed, (const char *) dst);
+  free(src);
+  free(dst);
 
   CAMLreturn(result);
 }
 
 /**
- * Sets the acl associated with a node synchronously.
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * Decompress the LZ4 block @data into its @size bytes. A block cannot
+ * expand more than ZKOCAML_LZ4_MAX_RATIO times, so a larger @size is
+ * refused before anything is allocated.
  *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @version the expected version of the path.
- *
- * @acl the acl to be set on the path.
- *
- * @return the return code for the function call.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZINVALIDACL invalid ACL specified
- *   ZBADVERSION expected version does not match actual version.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * @return Some data, or None if the block is corrupt
  */
 CAMLprim value
-zkocaml_set_acl(value zh, value path, value version, value acl)
+zkocaml_lz4_decompress(value data, value size)
 {
-  CAMLparam4(zh, path, version, acl);
-  CAMLlocal1(result);
-  struct ACL_vector local_acl;
-
-  zhandle_t *handle = zkocaml_handle_struct_val(zh);
-  RETURN_IF_NO_HANDLE (handle, zkocaml_enum_error_c2ml(ZINVALIDSTATE));
-
-  const char *local_path = String_val(path);
-  int local_version = Int_val(version);
-  int r = zkocaml_parse_acls(acl, &local_acl);
-  if (r == 0) {
-    local_acl = ZOO_OPEN_ACL_UNSAFE;
+  CAMLparam2(data, size);
+  CAMLlocal2(result, decompressed);
+
+  size_t len = caml_string_length(data);
+  long out_len = Long_val(size);
+  unsigned char *src = NULL, *dst = NULL;
+  int rc = -1;
+
+  if (out_len < 0 || (size_t) out_len > len * ZKOCAML_LZ4_MAX_RATIO + 16)
+    CAMLreturn(Val_int(0));
+  src = (unsigned char *) malloc(len + 1);
+  dst = (unsigned char *) malloc(out_len + 1);
+  memcpy(src, String_val(data), len);
+  caml_enter_blocking_section();
+  rc = zkocaml_lz4_decompress_block(src, len, dst, out_len);
+  caml_leave_blocking_section();
+  free(src);
+  if (rc != 0) {
+    free(dst);
+    CAMLreturn(Val_int(0));
   }
-
-  int rc = zoo_set_acl(handle,
-                       local_path,
-                       local_version,
-                       (const struct ACL_vector *)&local_acl);
-  result = zkocaml_enum_error_c2ml(rc);
+  decompressed = caml_alloc_initialized_string(out_len, (const char *) dst);
+  free(dst);
+  result = caml_alloc(1, 0);
+  Store_field(result, 0, decompressed);
 
   CAMLreturn(result);
 }
@@ -21,6 +21,8 @@
 #define _ZKOCAML_H_
 
 #include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
@@ -32,15 +34,260 @@
 
 #include <zookeeper/zookeeper.h>
 
+/**
+ * The zkocaml_path_t is an interned znode path, shared by all the
+ * path handles made from the same string.
+ */
+typedef struct zkocaml_path_s_ {
+  int refs;
+  size_t hash;
+  size_t len;
+  struct zkocaml_path_s_ *next;
+  char name[];
+} zkocaml_path_t;
+
+/**
+ * The ZKOCAML_WATCH_KIND wraps the kind of a watch set with one of
+ * the "w" getters, which is part of the watch registry key.
+ */
+typedef enum ZKOCAML_WATCH_KIND {
+  ZKOCAML_WATCH_DATA,
+  ZKOCAML_WATCH_EXIST,
+  ZKOCAML_WATCH_CHILD
+} ZKOCAML_WATCH_KIND;
+
+/**
+ * The zkocaml_watch_sub_t is one OCaml subscriber of a watch.
+ */
+typedef struct zkocaml_watch_sub_s_ {
+  uint64_t id;
+  value interned;
+  value zh;
+  size_t strip;
+  char *watcher_ctx;
+  value watcher_callback;
+  struct zkocaml_watch_sub_s_ *next;
+} zkocaml_watch_sub_t;
+
+/**
+ * The zkocaml_watch_entry_t is the single zookeeper watcher context
+ * shared by all the subscribers of a (path, kind) pair. It counts the
+ * watch requests in flight for it and whether zookeeper may hold it.
+ */
+typedef struct zkocaml_watch_entry_s_ {
+  struct zkocaml_watch_registry_s_ *registry;
+  char *path;
+  ZKOCAML_WATCH_KIND kind;
+  int count;
+  int inflight;
+  int held;
+  zkocaml_watch_sub_t *subs;
+  struct zkocaml_watch_entry_s_ *next;
+} zkocaml_watch_entry_t;
+
+/**
+ * The zkocaml_watch_event_t is one watch event waiting in a batch.
+ */
+typedef struct zkocaml_watch_event_s_ {
+  int type;
+  int state;
+  char *path;
+  char *watcher_ctx;
+  struct zkocaml_watch_event_s_ *next;
+  struct zkocaml_watch_event_s_ *chain;
+} zkocaml_watch_event_t;
+
+/**
+ * The zkocaml_watch_batch_t queues the watch events of a handle until
+ * its flusher thread delivers them to the batch watcher as one array.
+ */
+typedef struct zkocaml_watch_batch_s_ {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int window_ms;
+  int coalesce;
+  int closed;
+  value zh;
+  value batch_callback;
+  zkocaml_watch_event_t *head;
+  zkocaml_watch_event_t *tail;
+  zkocaml_watch_event_t **index;
+  zkocaml_watch_sub_t *dead;
+} zkocaml_watch_batch_t;
+
+/**
+ * The zkocaml_watch_registry_t maps (path, kind) pairs to their
+ * watch entries, one registry per zookeeper handle.
+ */
+typedef struct zkocaml_watch_registry_s_ {
+  pthread_mutex_t lock;
+  uint64_t next_id;
+  size_t size;
+  size_t nbuckets;
+  zkocaml_watch_entry_t **buckets;
+  zkocaml_watch_batch_t *batch;
+} zkocaml_watch_registry_t;
+
+/**
+ * The ZKOCAML_FLIGHT_OP wraps the reads that can be coalesced.
+ */
+typedef enum ZKOCAML_FLIGHT_OP {
+  ZKOCAML_FLIGHT_GET,
+  ZKOCAML_FLIGHT_EXISTS,
+  ZKOCAML_FLIGHT_CHILDREN
+} ZKOCAML_FLIGHT_OP;
+
+/**
+ * The zkocaml_flight_t is one read in flight with the server, along
+ * with the completion contexts of every caller waiting for it.
+ */
+typedef struct zkocaml_flight_s_ {
+  struct zkocaml_flight_table_s_ *table;
+  char *path;
+  ZKOCAML_FLIGHT_OP op;
+  int watch;
+  struct zkocaml_completion_context_s_ *waiters;
+  struct zkocaml_flight_s_ *next;
+} zkocaml_flight_t;
+
+/**
+ * The zkocaml_flight_table_t maps (op, path, watch) to the read
+ * currently in flight for it, one table per zookeeper handle.
+ */
+typedef struct zkocaml_flight_table_s_ {
+  pthread_mutex_t lock;
+  int enabled;
+  size_t nbuckets;
+  zkocaml_flight_t **buckets;
+} zkocaml_flight_table_t;
+
+/**
+ * The ZKOCAML_WINDOW_MODE wraps what an async call does when the
+ * in-flight window of its handle is full.
+ */
+typedef enum ZKOCAML_WINDOW_MODE {
+  ZKOCAML_WINDOW_BLOCK,
+  ZKOCAML_WINDOW_REJECT,
+  ZKOCAML_WINDOW_QUEUE
+} ZKOCAML_WINDOW_MODE;
+
+/**
+ * The zkocaml_deferred_t is one async call parked in the window
+ * queue, as an OCaml thunk resubmitting it.
+ */
+typedef struct zkocaml_deferred_s_ {
+  value thunk;
+  struct zkocaml_deferred_s_ *next;
+} zkocaml_deferred_t;
+
+/**
+ * The zkocaml_window_t bounds the number of async requests in flight
+ * on a zookeeper handle and keeps its counters.
+ */
+typedef struct zkocaml_window_s_ {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int limit;
+  ZKOCAML_WINDOW_MODE mode;
+  int inflight;
+  int parked;
+  int draining;
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t throttled;
+  int queue_limit;
+  int queue_len;
+  zkocaml_deferred_t *queue_head;
+  zkocaml_deferred_t *queue_tail;
+  struct zkocaml_route_s_ *route;
+} zkocaml_window_t;
+
+/**
+ * The ZKOCAML_RETRY_OP wraps the kinds of calls the retry policy
+ * keeps counters for.
+ */
+typedef enum ZKOCAML_RETRY_OP {
+  ZKOCAML_RETRY_GET,
+  ZKOCAML_RETRY_EXISTS,
+  ZKOCAML_RETRY_GET_CHILDREN,
+  ZKOCAML_RETRY_GET_ACL,
+  ZKOCAML_RETRY_SET,
+  ZKOCAML_RETRY_DELETE,
+  ZKOCAML_RETRY_SET_ACL,
+  ZKOCAML_RETRY_SYNC,
+  ZKOCAML_RETRY_OPS
+} ZKOCAML_RETRY_OP;
+
+/**
+ * The zkocaml_retry_t is the retry policy of a zookeeper handle: capped
+ * exponential backoff with full jitter, and a token bucket bounding the
+ * retries per second across the handle.
+ */
+typedef struct zkocaml_retry_s_ {
+  pthread_mutex_t lock;
+  int max_attempts;
+  int64_t base_ms;
+  int64_t max_ms;
+  double budget;
+  double tokens;
+  int64_t refilled;
+  uint64_t seed;
+  uint64_t retries[ZKOCAML_RETRY_OPS];
+  uint64_t given_up[ZKOCAML_RETRY_OPS];
+} zkocaml_retry_t;
+
 /**
  * The zkocaml_handle_t wraps a zookeeper connection handle
  * which indicates a zookeeper session that corresponds to that handle.
  */
 typedef struct zkocaml_handle_s_ {
   atomic_int* refcount;
-  zhandle_t* zhandle;
+  zhandle_t* _Atomic zhandle;
+  zkocaml_watch_registry_t *watches;
+  zkocaml_flight_table_t *flights;
+  zkocaml_window_t *window;
+  zkocaml_retry_t *retry;
+  struct zkocaml_watcher_context_s_ *context;
+  value close_callback;
+  int closing;
+  int reiniting;
 } zkocaml_handle_t;
 
+/**
+ * The zkocaml_namespace_t is the path prefix of a namespaced handle,
+ * which shares the zkocaml_handle_t of its parent.
+ */
+typedef struct zkocaml_namespace_s_ {
+  uint64_t id;
+  value parent;
+  size_t len;
+  char prefix[];
+} zkocaml_namespace_t;
+
+/**
+ * The ZKOCAML_REAP_OP wraps what the reaper thread does to a handle:
+ * close its session, free it once the handle has been collected, or
+ * close a stale session it has been re-initialized away from.
+ */
+typedef enum ZKOCAML_REAP_OP {
+  ZKOCAML_REAP_CLOSE,
+  ZKOCAML_REAP_FREE,
+  ZKOCAML_REAP_SESSION
+} ZKOCAML_REAP_OP;
+
+/**
+ * The zkocaml_reap_t is one job of the reaper thread.
+ */
+typedef struct zkocaml_reap_s_ {
+  zkocaml_handle_t *handle;
+  zhandle_t *stale;
+  ZKOCAML_REAP_OP op;
+  int waited;
+  int done;
+  int rc;
+  struct zkocaml_reap_s_ *next;
+} zkocaml_reap_t;
+
 /**
  * The zkocaml_watcher_context_t wraps a zookeeper watcher context.
  */
@@ -51,14 +298,177 @@ typedef struct zkocaml_watcher_context_s_ {
   value zh;
 } zkocaml_watcher_context_t;
 
+/**
+ * The ZKOCAML_COMPLETION_KIND wraps the signature of the OCaml
+ * completion callback of an async call.
+ */
+typedef enum ZKOCAML_COMPLETION_KIND {
+  ZKOCAML_COMPLETION_VOID,
+  ZKOCAML_COMPLETION_STAT,
+  ZKOCAML_COMPLETION_DATA,
+  ZKOCAML_COMPLETION_STRINGS,
+  ZKOCAML_COMPLETION_STRINGS_STAT,
+  ZKOCAML_COMPLETION_STRING,
+  ZKOCAML_COMPLETION_STRING_STAT,
+  ZKOCAML_COMPLETION_ACL,
+  ZKOCAML_COMPLETION_MULTI,
+  ZKOCAML_COMPLETION_THUNK,
+  ZKOCAML_COMPLETION_EXPIRED
+} ZKOCAML_COMPLETION_KIND;
+
+/**
+ * The ZKOCAML_DEADLINE_STATE wraps where an async call stands with
+ * respect to its deadline.
+ */
+typedef enum ZKOCAML_DEADLINE_STATE {
+  ZKOCAML_DEADLINE_NONE,
+  ZKOCAML_DEADLINE_ARMED,
+  ZKOCAML_DEADLINE_FIRED,
+  ZKOCAML_DEADLINE_DONE
+} ZKOCAML_DEADLINE_STATE;
+
+/**
+ * The zkocaml_multi_t holds the operations of a multi transaction and
+ * the results zookeeper fills in, with the buffers they point to.
+ */
+typedef struct zkocaml_multi_s_ {
+  int count;
+  zoo_op_t *ops;
+  zoo_op_result_t *results;
+  char **paths;
+  char **created;
+  struct Stat *stats;
+  struct ACL_vector *acls;
+} zkocaml_multi_t;
+
+/**
+ * The zkocaml_rearm_t is the completion data of a watch re-armed on
+ * the new session of a re-initialized handle.
+ */
+typedef struct zkocaml_rearm_s_ {
+  zhandle_t *zhandle;
+  zkocaml_watch_entry_t *entry;
+} zkocaml_rearm_t;
+
 /**
  * The zkocaml_completion_context_t wraps a zookeeper completion data.
  */
 typedef struct zkocaml_completion_context_s_ {
   void *data;
   value completion_callback;
+  zkocaml_watch_entry_t *watch;
+  uint64_t watch_sub;
+  zkocaml_window_t *window;
+  zkocaml_multi_t *multi;
+  size_t strip;
+  ZKOCAML_COMPLETION_KIND kind;
+  ZKOCAML_DEADLINE_STATE deadline_state;
+  int64_t deadline;
+  size_t timer_slot;
+  struct zkocaml_completion_context_s_ *timer_prev;
+  struct zkocaml_completion_context_s_ *timer_next;
+  struct zkocaml_completion_context_s_ *next;
 } zkocaml_completion_context_t;
 
+/**
+ * The zkocaml_routed_t is one completion parked in a dispatch queue,
+ * with its own copies of the results zookeeper passed in.
+ */
+typedef struct zkocaml_routed_s_ {
+  ZKOCAML_COMPLETION_KIND kind;
+  int flight;
+  zkocaml_completion_context_t *ctx;
+  int rc;
+  char *val;
+  int val_len;
+  struct Stat *stat;
+  struct String_vector *strings;
+  struct ACL_vector *acl;
+  int lent;
+  struct zkocaml_routed_s_ *next;
+} zkocaml_routed_t;
+
+/**
+ * The zkocaml_route_t is a dispatch queue: the completions of the
+ * handles routed to it are run by the thread draining it rather than
+ * by the zookeeper completion thread.
+ */
+typedef struct zkocaml_route_s_ {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  atomic_int refcount;
+  int closed;
+  int orphaned;
+  uint64_t routed;
+  uint64_t dispatched;
+  int pending;
+  zkocaml_routed_t *head;
+  zkocaml_routed_t *tail;
+} zkocaml_route_t;
+
+/**
+ * The zkocaml_snapshot_control_t is the control file of a shared
+ * snapshot, naming the generation readers should map.
+ */
+typedef struct zkocaml_snapshot_control_s_ {
+  char magic[8];
+  _Atomic uint64_t generation;
+} zkocaml_snapshot_control_t;
+
+/**
+ * The zkocaml_snapshot_header_t starts a snapshot generation file. Its
+ * entries follow, sorted by path, then the paths and data they point
+ * to as offsets from the start of the file.
+ */
+typedef struct zkocaml_snapshot_header_s_ {
+  char magic[8];
+  uint64_t generation;
+  uint64_t count;
+  uint64_t size;
+} zkocaml_snapshot_header_t;
+
+typedef struct zkocaml_snapshot_entry_s_ {
+  uint64_t path_off;
+  uint64_t data_off;
+  uint32_t path_len;
+  uint32_t data_len;
+  int64_t mzxid;
+} zkocaml_snapshot_entry_t;
+
+/**
+ * The zkocaml_snapshot_reader_t maps the control file of a shared
+ * snapshot and its current generation.
+ */
+typedef struct zkocaml_snapshot_reader_s_ {
+  char *name;
+  zkocaml_snapshot_control_t *control;
+  uint64_t generation;
+  const zkocaml_snapshot_header_t *snapshot;
+  size_t size;
+} zkocaml_snapshot_reader_t;
+
+/**
+ * The zkocaml_jute_t is a cursor over jute-encoded bytes. Reading past
+ * its end clears ok and yields zeros.
+ */
+typedef struct zkocaml_jute_s_ {
+  const unsigned char *pos;
+  const unsigned char *end;
+  int ok;
+} zkocaml_jute_t;
+
+/**
+ * The zkocaml_zk_node_t is a node read from a ZooKeeper snapshot and
+ * not yet handed out, while its children are counted.
+ */
+typedef struct zkocaml_zk_node_s_ {
+  const unsigned char *path;
+  size_t path_len;
+  const unsigned char *data;
+  size_t data_len;
+  struct Stat stat;
+} zkocaml_zk_node_t;
+
 /**
  * The ZOO_EPHEMERAL_AUX wraps zookeeper event type.
  */
@@ -79,7 +489,8 @@ typedef enum ZOO_STATE_AUX {
   ZOO_AUTH_FAILED_STATE_AUX,
   ZOO_CONNECTING_STATE_AUX,
   ZOO_ASSOCIATING_STATE_AUX,
-  ZOO_CONNECTED_STATE_AUX
+  ZOO_CONNECTED_STATE_AUX,
+  ZOO_READONLY_STATE_AUX
 } ZOO_STATE_AUX ;
 
 /**
@@ -99,7 +510,8 @@ typedef enum ZOO_PERM_AUX {
  */
 typedef enum ZOO_CREATE_FLAG_AUX {
   ZOO_EPHEMERAL_AUX,
-  ZOO_SEQUENCE_AUX
+  ZOO_SEQUENCE_AUX,
+  ZOO_CONTAINER_AUX
 } ZOO_CREATE_FLAG_AUX;
 
 #endif  // _ZKOCAML_H_
@@ -41,6 +41,11 @@ type client_id = {client_id: int64; passwd: string}
 type acl = {perms: int; scheme: string; id: string}
 type acls = acl array
 
+(**
+ * acls marshalled once for the *_prepared calls.
+ *)
+type acl_handle
+
 type strings = string array
 
 type stat = {
@@ -95,6 +100,11 @@ type error =
   | ZCLOSING               (*!< ZooKeeper is closing *)
   | ZNOTHING               (*!< (not error) no server responses to process *)
   | ZSESSIONMOVED          (*!<session moved to another server, so operation is ignored *)
+  | ZTHROTTLEDOP           (*!< Operation was throttled and not executed at all *)
+  | ZNEWCONFIGNOQUORUM     (*!< No quorum of new config is connected and up-to-date with the leader of last commmitted config *)
+  | ZRECONFIGINPROGRESS    (*!< Reconfiguration requested while another reconfiguration is currently in progress *)
+  | ZRECONFIGDISABLED      (*!< Attempts to perform a reconfiguration operation when reconfiguration feature is disabled *)
+  | ZNOTREADONLY           (*!< State-changing request is passed to read-only server *)
 
 (**
  * Watch types.
@@ -167,6 +177,7 @@ type state =
   | ZOO_CONNECTING_STATE
   | ZOO_ASSOCIATING_STATE
   | ZOO_CONNECTED_STATE
+  | ZOO_READONLY_STATE
 
 (**
  * Create flags
@@ -177,6 +188,76 @@ type state =
 type create_flag =
   ZOO_EPHEMERAL
   | ZOO_SEQUENCE
+  | ZOO_CONTAINER
+
+(**
+ * In-flight window backpressure.
+ *
+ * What an async call does when the in-flight window of its handle
+ * is full (see set_max_inflight).
+ **)
+type backpressure =
+  Block        (* wait for a slot, other threads keep running; from a
+                * callback, go out over the limit instead *)
+  | Reject     (* return ZTHROTTLEDOP *)
+  | Queue of int (* park up to n calls, then return ZTHROTTLEDOP *)
+
+type window_stats = {
+  max_inflight: int;
+  inflight: int;
+  submitted: int;
+  completed: int;
+  throttled: int;
+  queued: int
+}
+
+(**
+ * Dispatch queues.
+ *
+ * The async completions of a handle routed to a dispatch queue are
+ * run by the thread draining it (see run_dispatch_queue) rather than
+ * by the zookeeper completion thread, so that each domain may drive
+ * the traffic of its own handles. Watchers are not routed.
+ **)
+type dispatch_queue
+
+type dispatch_stats = {
+  routed: int;
+  dispatched: int;
+  pending: int
+}
+
+(**
+ * Retry policy.
+ *
+ * Idempotent calls and version-guarded writes failing with
+ * ZCONNECTIONLOSS are retried up to [max_attempts] times, after a
+ * backoff drawn uniformly between 0 and [base_delay] * 2^attempt
+ * seconds, capped at [max_delay]. At most [budget] retries per second
+ * are made across the handle, 0 meaning no limit.
+ **)
+type retry_policy = {
+  max_attempts: int;
+  base_delay: float;
+  max_delay: float;
+  budget: int
+}
+
+(* Kinds of calls retry counters are kept for *)
+type retry_op =
+  Op_get
+  | Op_exists
+  | Op_get_children
+  | Op_get_acl
+  | Op_set
+  | Op_delete
+  | Op_set_acl
+  | Op_sync
+
+type retry_stats = {
+  retries: int;
+  given_up: int
+}
 
 (* Debug levels *)
 type log_level =
@@ -211,7 +292,34 @@ type log_level =
  * type is ZOO_SESSION_EVENT
  * \param watcherCtx watcher context.
  **)
-type watcher_callback = zhandle -> event -> state -> string -> string -> unit
+type 'p watcher = zhandle -> event -> state -> 'p -> string -> unit
+type watcher_callback = string watcher
+
+(**
+ * znode path interned once by intern_path. Watches set through a path
+ * report their events with that same path.
+ *
+ * The externals taking a ['p] path read either a string or a path.
+ **)
+type path
+type path_watcher_callback = path watcher
+
+(**
+ * A watch event as delivered to a batch watcher, along with the
+ * watcher context of the watch it triggered.
+ **)
+type watch_event = {
+  event: event;
+  state: state;
+  path: string;
+  watcher_ctx: string
+}
+
+(**
+ * Signature of a batch watcher, which receives the watch events of a
+ * handle in arrays, in the order they arrived, see set_batch_watcher.
+ **)
+type batch_watcher_callback = zhandle -> watch_event array -> unit
 
 (**
  * Signature of a completion function for a call that returns void.
@@ -368,6 +476,14 @@ type strings_stat_completion_callback = error -> strings -> stat -> string -> un
  *)
 type string_completion_callback = error -> string -> string -> unit
 
+(**
+ * Signature of a completion function that returns a string and a stat.
+ *
+ * This method will be invoked at the end of an asynchronous call,
+ * like string_completion_callback, with the stat of the node as well.
+ *)
+type string_stat_completion_callback = error -> string -> stat -> string -> unit
+
 
 (**
  * Signature of a completion function that returns an ACL.
@@ -398,6 +514,33 @@ type string_completion_callback = error -> string -> string -> unit
  *)
 type acl_completion_callback = error -> acls -> stat -> string -> unit
 
+(**
+ * One operation of a multi transaction: create a node, delete it or
+ * set its data if its version matches, or only check its version.
+ **)
+type multi_op =
+  Create_op of string * string * acls * create_flag array
+  | Delete_op of string * int
+  | Set_op of string * string * int
+  | Check_op of string * int
+
+(**
+ * The result of one operation of a multi transaction: the path of the
+ * node a Create_op created, the stat of the node a Set_op updated.
+ **)
+type op_result = {
+  op_error: error;
+  op_path: string;
+  op_stat: stat
+}
+
+(**
+ * Signature of a completion function for a multi transaction, with
+ * the results of its operations in order. A multi failing as a whole,
+ * on connection loss or timeout, has no results.
+ **)
+type multi_completion_callback = error -> op_result array -> string -> unit
+
 let show_error e =
   match e with
   | ZOK                   -> "Everything is OK"
@@ -424,6 +567,11 @@ let show_error e =
   | ZCLOSING               -> "ZooKeeper is closing"
   | ZNOTHING               -> "(not error) no server responses to process"
   | ZSESSIONMOVED          -> "Session moved to another server, so operation is ignored"
+  | ZTHROTTLEDOP           -> "Operation was throttled and not executed at all"
+  | ZNEWCONFIGNOQUORUM     -> "No quorum of new config is connected and up-to-date with the leader of last commmitted config"
+  | ZRECONFIGINPROGRESS    -> "Another reconfiguration is in progress"
+  | ZRECONFIGDISABLED      -> "Reconfiguration is disabled"
+  | ZNOTREADONLY           -> "State-changing request is passed to read-only server"
 
 let show_event e =
   match e with
@@ -441,6 +589,7 @@ let show_state s =
   | ZOO_CONNECTING_STATE -> "ZOO_CONNECTING_STATE"
   | ZOO_ASSOCIATING_STATE -> "ZOO_ASSOCIATING_STATE"
   | ZOO_CONNECTED_STATE -> "ZOO_CONNECTED_STATE"
+  | ZOO_READONLY_STATE -> "ZOO_READONLY_STATE"
 
 (*
 
@@ -471,8 +620,12 @@ external init:
   -> int
   -> zhandle = "zkocaml_init_bytecode" "zkocaml_init_native"
 
-let init servers cb timeout cid ctx unusedflag =
-  let handle = init servers cb timeout cid ctx unusedflag in
+(** Init flag allowing the session to connect to a read-only server
+ * while the ensemble has lost its quorum. *)
+let zoo_readonly = 1
+
+let init servers cb timeout cid ctx flags =
+  let handle = init servers cb timeout cid ctx flags in
   Thread.delay 0.05; (* empirical :\ *)
   handle
 
@@ -480,9 +633,19 @@ external close:
      zhandle
   -> error = "zkocaml_close"
 
-let close zhandle =
-  Thread.delay 0.025; (* empirical :\ *)
-  close zhandle
+external close_async:
+     zhandle
+  -> (error -> unit)
+  -> unit = "zkocaml_close_async"
+
+external namespace:
+     zhandle
+  -> string
+  -> zhandle = "zkocaml_namespace"
+
+external namespace_prefix:
+     zhandle
+  -> string = "zkocaml_namespace_prefix"
 
 external client_id:
      zhandle
@@ -506,14 +669,207 @@ external set_watcher:
   -> watcher_callback
   -> watcher_callback = "zkocaml_set_watcher"
 
+(**
+ * While a batch watcher is set, the watch events of the handle are no
+ * longer delivered to the watchers of their watches: they are queued
+ * and delivered to the batch watcher instead, as one array per runtime
+ * acquisition, gathered for up to [window] seconds. With [coalesce],
+ * an event with the same type, path and watcher context as one still
+ * queued is dropped. Session events still go to every watcher.
+ * [None] goes back to per-watch delivery.
+ *)
+external set_batch_watcher:
+     zhandle
+  -> int
+  -> bool
+  -> batch_watcher_callback option
+  -> error = "zkocaml_set_batch_watcher"
+
+let set_batch_watcher ?(window = 0.) ?(coalesce = false) zh cb =
+  set_batch_watcher zh (int_of_float (window *. 1000.)) coalesce cb
+
 external get_connected_host:
      zhandle
   -> string = "zkocaml_get_connected_host"
 
+external set_servers:
+     zhandle
+  -> string
+  -> error = "zkocaml_set_servers"
+
+external get_current_server:
+     zhandle
+  -> string = "zkocaml_get_current_server"
+
 external zstate:
      zhandle
   -> state = "zkocaml_state"
 
+(** Whether the session is connected to a read-only server. *)
+let is_readonly zh = zstate zh = ZOO_READONLY_STATE
+
+(**
+ * The handle to send a read to: @primary while it is connected to a
+ * quorum, else @fallback, a session opened with zoo_readonly, while it
+ * is connected at all. Reads through the fallback may be stale.
+ *)
+let read_handle primary fallback =
+  match zstate primary with
+  | ZOO_CONNECTED_STATE -> primary
+  | _ ->
+    match zstate fallback with
+    | ZOO_CONNECTED_STATE | ZOO_READONLY_STATE -> fallback
+    | _ -> primary
+
+external watch_count:
+     zhandle
+  -> string
+  -> int = "zkocaml_watch_count"
+
+external set_coalescing:
+     zhandle
+  -> bool
+  -> unit = "zkocaml_set_coalescing"
+
+external set_max_inflight:
+     zhandle
+  -> int
+  -> backpressure
+  -> unit = "zkocaml_set_max_inflight"
+
+external window_stats:
+     zhandle
+  -> window_stats = "zkocaml_window_stats"
+
+external window_defer:
+     zhandle
+  -> (unit -> unit)
+  -> error = "zkocaml_window_defer"
+
+external dispatch_queue:
+     unit
+  -> dispatch_queue = "zkocaml_route_create"
+
+external set_dispatch_queue:
+     zhandle
+  -> dispatch_queue option
+  -> unit = "zkocaml_set_route"
+
+external run_dispatch_queue:
+     dispatch_queue
+  -> int
+  -> int = "zkocaml_route_run"
+
+external close_dispatch_queue:
+     dispatch_queue
+  -> unit = "zkocaml_route_close"
+
+external dispatch_stats:
+     dispatch_queue
+  -> dispatch_stats = "zkocaml_route_stats"
+
+(* Runs the completions routed to [queue] on the calling thread until
+ * the queue is closed and drained. *)
+let rec drive_dispatch_queue queue =
+  if run_dispatch_queue queue (-1) >= 0 then drive_dispatch_queue queue
+
+external deadline_after:
+     int
+  -> int = "zkocaml_deadline_after"
+
+external get_call_deadline:
+     unit
+  -> int = "zkocaml_get_call_deadline"
+
+external set_call_deadline:
+     int
+  -> unit = "zkocaml_set_call_deadline"
+
+(* Runs [f] with the async calls it makes on this thread bounded by
+ * [deadline]; 0 means none. *)
+let with_deadline deadline f =
+  let saved = get_call_deadline () in
+  set_call_deadline deadline;
+  match f () with
+  | result -> set_call_deadline saved; result
+  | exception e -> set_call_deadline saved; raise e
+
+let with_timeout timeout f =
+  match timeout with
+  | None -> f ()
+  | Some seconds -> with_deadline (deadline_after (int_of_float (seconds *. 1000.))) f
+
+let empty_stat = {
+  czxid = 0L; mzxid = 0L; ctime = 0L; mtime = 0L;
+  version = 0; cversion = 0; aversion = 0; ephemeral_owner = 0L;
+  data_length = 0; num_children = 0; pzxid = 0
+}
+
+(* Submits an async call; if the window refuses it, parks it when the
+ * handle queues, completing it with [fail] should the resubmit fail. *)
+let windowed zhandle submit fail =
+  match submit () with
+  | ZTHROTTLEDOP ->
+    let deadline = get_call_deadline () in
+    window_defer zhandle (fun () ->
+        match with_deadline deadline submit with
+        | ZOK -> ()
+        | err -> fail err)
+  | err -> err
+
+external set_retry_policy:
+     zhandle
+  -> retry_policy
+  -> unit = "zkocaml_set_retry_policy"
+
+external retry_stats:
+     zhandle
+  -> retry_op
+  -> retry_stats = "zkocaml_retry_stats"
+
+external retry_delay:
+     zhandle
+  -> retry_op
+  -> int
+  -> int = "zkocaml_retry_delay"
+
+external retry_after:
+     int
+  -> (unit -> unit)
+  -> unit = "zkocaml_retry_after"
+
+(* Submits an async call and resubmits it after a backoff when it
+ * completes with ZCONNECTIONLOSS, [guarded] holds and the policy of
+ * the handle allows. The completion built by [submit] must first call
+ * the predicate it is given: true means the result is dropped as the
+ * call was rescheduled. *)
+let retried zhandle op guarded fail submit =
+  let deadline = get_call_deadline () in
+  let rec attempt n =
+    submit (fun err ->
+        guarded && err = ZCONNECTIONLOSS &&
+        let delay = retry_delay zhandle op n in
+        delay >= 0 && begin
+          retry_after delay (fun () ->
+              match with_deadline deadline (fun () -> attempt (n + 1)) with
+              | ZOK -> ()
+              | err -> fail err);
+          true
+        end)
+  in
+  attempt 0
+
+let retried_sync zhandle op guarded rc call =
+  let rec attempt n =
+    let result = call () in
+    if guarded && rc result = ZCONNECTIONLOSS then
+      let delay = retry_delay zhandle op n in
+      if delay < 0 then result
+      else (Thread.delay (float_of_int delay /. 1000.); attempt (n + 1))
+    else result
+  in
+  attempt 0
+
 external acreate:
      zhandle
   -> string
@@ -524,6 +880,53 @@ external acreate:
   -> string
   -> error = "zkocaml_acreate_bytecode" "zkocaml_acreate_native"
 
+let acreate ?timeout zh path value acls flags completion data =
+  with_timeout timeout @@ fun () ->
+  windowed zh
+    (fun () -> acreate zh path value acls flags completion data)
+    (fun err -> completion err "" data)
+
+external acl_handle:
+     acls
+  -> acl_handle = "zkocaml_acl_handle"
+
+external acl_handle_acls:
+     acl_handle
+  -> acls = "zkocaml_acl_handle_acls"
+
+external acreate_prepared:
+     zhandle
+  -> string
+  -> string
+  -> acl_handle
+  -> create_flag array
+  -> string_completion_callback
+  -> string
+  -> error = "zkocaml_acreate_prepared_bytecode" "zkocaml_acreate_prepared_native"
+
+let acreate_prepared ?timeout zh path value acl flags completion data =
+  with_timeout timeout @@ fun () ->
+  windowed zh
+    (fun () -> acreate_prepared zh path value acl flags completion data)
+    (fun err -> completion err "" data)
+
+external acreate2:
+     zhandle
+  -> string
+  -> string
+  -> acls
+  -> create_flag array
+  -> int64
+  -> string_stat_completion_callback
+  -> string
+  -> error = "zkocaml_acreate2_bytecode" "zkocaml_acreate2_native"
+
+let acreate2 ?timeout ?(ttl = 0L) zh path value acls flags completion data =
+  with_timeout timeout @@ fun () ->
+  windowed zh
+    (fun () -> acreate2 zh path value acls flags ttl completion data)
+    (fun err -> completion err "" empty_stat data)
+
 external adelete:
      zhandle
   -> string
@@ -532,48 +935,138 @@ external adelete:
   -> string
   -> error = "zkocaml_adelete"
 
-external aexists:
+let adelete ?timeout zh path version completion data =
+  let fail err = completion err data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_delete (version <> -1) fail @@ fun again ->
+  windowed zh
+    (fun () -> adelete zh path version (fun err data ->
+         if not (again err) then completion err data) data)
+    fail
+
+external amulti:
      zhandle
+  -> multi_op array
+  -> multi_completion_callback
   -> string
+  -> error = "zkocaml_amulti"
+
+let amulti ?timeout zh ops completion data =
+  let fail err = completion err [||] data in
+  with_timeout timeout @@ fun () ->
+  windowed zh (fun () -> amulti zh ops completion data) fail
+
+(* Splits [ops] into batches of at most [max_ops] operations and about
+ * [max_bytes] of payload each, to stay under the request size limit
+ * of the servers (jute.maxbuffer, 1 MB by default). *)
+let multi_batches ?(max_ops = 1000) ?(max_bytes = 512 * 1024) ops =
+  let size = function
+    | Create_op (path, value, acls, _) ->
+      String.length path + String.length value + 64 * Array.length acls + 32
+    | Set_op (path, value, _) -> String.length path + String.length value + 16
+    | Delete_op (path, _) | Check_op (path, _) -> String.length path + 16
+  in
+  let batches = ref [] and batch = ref [] and count = ref 0 and bytes = ref 0 in
+  let flush () =
+    if !batch <> [] then batches := Array.of_list (List.rev !batch) :: !batches;
+    batch := []; count := 0; bytes := 0
+  in
+  List.iter (fun op ->
+      let n = size op in
+      if !count >= max_ops || (!count > 0 && !bytes + n > max_bytes) then flush ();
+      batch := op :: !batch;
+      incr count;
+      bytes := !bytes + n) ops;
+  flush ();
+  List.rev !batches
+
+external aexists:
+     zhandle
+  -> 'p
   -> int
   -> stat_completion_callback
   -> string
   -> error = "zkocaml_aexists"
 
+let aexists ?timeout zh path watch completion data =
+  let fail err = completion err empty_stat data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_exists true fail @@ fun again ->
+  windowed zh
+    (fun () -> aexists zh path watch (fun err stat data ->
+         if not (again err) then completion err stat data) data)
+    fail
+
 external awexists:
      zhandle
-  -> string
-  -> watcher_callback
+  -> 'p
+  -> 'p watcher
   -> string
   -> stat_completion_callback
   -> string
-  -> error = "zkocaml_awexists_native" "zkocaml_awexists_bytecode"
+  -> error = "zkocaml_awexists_bytecode" "zkocaml_awexists_native"
+
+let awexists ?timeout zh path watcher watcher_ctx completion data =
+  let fail err = completion err empty_stat data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_exists true fail @@ fun again ->
+  windowed zh
+    (fun () -> awexists zh path watcher watcher_ctx (fun err stat data ->
+         if not (again err) then completion err stat data) data)
+    fail
 
 external aget:
      zhandle
-  -> string
+  -> 'p
   -> int
   -> data_completion_callback
   -> string
   -> error = "zkocaml_aget"
 
+let aget ?timeout zh path watch completion data =
+  let fail err = completion err "" 0 empty_stat data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_get true fail @@ fun again ->
+  windowed zh
+    (fun () -> aget zh path watch (fun err value len stat data ->
+         if not (again err) then completion err value len stat data) data)
+    fail
+
 external awget:
      zhandle
-  -> string
-  -> watcher_callback
+  -> 'p
+  -> 'p watcher
   -> string
   -> data_completion_callback
   -> string
-  -> error = "zkocaml_awget_native" "zkocaml_awget_bytecode"
+  -> error = "zkocaml_awget_bytecode" "zkocaml_awget_native"
+
+let awget ?timeout zh path watcher watcher_ctx completion data =
+  let fail err = completion err "" 0 empty_stat data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_get true fail @@ fun again ->
+  windowed zh
+    (fun () -> awget zh path watcher watcher_ctx (fun err value len stat data ->
+         if not (again err) then completion err value len stat data) data)
+    fail
 
 external aset:
      zhandle
-  -> string
+  -> 'p
   -> string
   -> int
   -> stat_completion_callback
   -> string
-  -> error = "zkocaml_aset_native" "zkocaml_aset_bytecode"
+  -> error = "zkocaml_aset_bytecode" "zkocaml_aset_native"
+
+let aset ?timeout zh path buffer version completion data =
+  let fail err = completion err empty_stat data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_set (version <> -1) fail @@ fun again ->
+  windowed zh
+    (fun () -> aset zh path buffer version (fun err stat data ->
+         if not (again err) then completion err stat data) data)
+    fail
 
 external aget_children:
      zhandle
@@ -583,6 +1076,15 @@ external aget_children:
   -> string
   -> error = "zkocaml_aget_children"
 
+let aget_children ?timeout zh path watch completion data =
+  let fail err = completion err [||] data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_get_children true fail @@ fun again ->
+  windowed zh
+    (fun () -> aget_children zh path watch (fun err children data ->
+         if not (again err) then completion err children data) data)
+    fail
+
 external awget_children:
      zhandle
   -> string
@@ -590,7 +1092,16 @@ external awget_children:
   -> string
   -> strings_completion_callback
   -> string
-  -> error = "zkocaml_awget_children_native" "zkocaml_awget_children_bytecode"
+  -> error = "zkocaml_awget_children_bytecode" "zkocaml_awget_children_native"
+
+let awget_children ?timeout zh path watcher watcher_ctx completion data =
+  let fail err = completion err [||] data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_get_children true fail @@ fun again ->
+  windowed zh
+    (fun () -> awget_children zh path watcher watcher_ctx (fun err children data ->
+         if not (again err) then completion err children data) data)
+    fail
 
 external aget_children2:
      zhandle
@@ -600,6 +1111,15 @@ external aget_children2:
   -> string
   -> error = "zkocaml_aget_children2"
 
+let aget_children2 ?timeout zh path watch completion data =
+  let fail err = completion err [||] empty_stat data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_get_children true fail @@ fun again ->
+  windowed zh
+    (fun () -> aget_children2 zh path watch (fun err children stat data ->
+         if not (again err) then completion err children stat data) data)
+    fail
+
 external awget_children2:
      zhandle
   -> string
@@ -607,7 +1127,16 @@ external awget_children2:
   -> string
   -> strings_stat_completion_callback
   -> string
-  -> error = "zkocaml_awget_children2_native" "zkocaml_awget_children2_bytecode"
+  -> error = "zkocaml_awget_children2_bytecode" "zkocaml_awget_children2_native"
+
+let awget_children2 ?timeout zh path watcher watcher_ctx completion data =
+  let fail err = completion err [||] empty_stat data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_get_children true fail @@ fun again ->
+  windowed zh
+    (fun () -> awget_children2 zh path watcher watcher_ctx (fun err children stat data ->
+         if not (again err) then completion err children stat data) data)
+    fail
 
 external async:
      zhandle
@@ -616,14 +1145,50 @@ external async:
   -> string
   -> error = "zkocaml_async"
 
+let async ?timeout zh path completion data =
+  let fail err = completion err "" data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_sync true fail @@ fun again ->
+  windowed zh
+    (fun () -> async zh path (fun err value data ->
+         if not (again err) then completion err value data) data)
+    fail
+
 external aset_acl:
      zhandle
   -> string
   -> int
   -> acls
-  -> acl_completion_callback
+  -> void_completion_callback
+  -> string
+  -> error = "zkocaml_aset_acl_bytecode" "zkocaml_aset_acl_native"
+
+let aset_acl ?timeout zh path version acls completion data =
+  let fail err = completion err data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_set_acl (version <> -1) fail @@ fun again ->
+  windowed zh
+    (fun () -> aset_acl zh path version acls (fun err data ->
+         if not (again err) then completion err data) data)
+    fail
+
+external aset_acl_prepared:
+     zhandle
   -> string
-  -> error = "zkocaml_aset_acl_native" "zkocaml_aset_acl_bytecode"
+  -> int
+  -> acl_handle
+  -> void_completion_callback
+  -> string
+  -> error = "zkocaml_aset_acl_prepared_bytecode" "zkocaml_aset_acl_prepared_native"
+
+let aset_acl_prepared ?timeout zh path version acl completion data =
+  let fail err = completion err data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_set_acl (version <> -1) fail @@ fun again ->
+  windowed zh
+    (fun () -> aset_acl_prepared zh path version acl (fun err data ->
+         if not (again err) then completion err data) data)
+    fail
 
 external aget_acl:
      zhandle
@@ -632,6 +1197,47 @@ external aget_acl:
   -> string
   -> error = "zkocaml_aget_acl"
 
+let aget_acl ?timeout zh path completion data =
+  let fail err = completion err [||] empty_stat data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_get_acl true fail @@ fun again ->
+  windowed zh
+    (fun () -> aget_acl zh path (fun err acls stat data ->
+         if not (again err) then completion err acls stat data) data)
+    fail
+
+external agetconfig:
+     zhandle
+  -> int
+  -> data_completion_callback
+  -> string
+  -> error = "zkocaml_agetconfig"
+
+let agetconfig ?timeout zh watch completion data =
+  let fail err = completion err "" 0 empty_stat data in
+  with_timeout timeout @@ fun () ->
+  retried zh Op_get true fail @@ fun again ->
+  windowed zh
+    (fun () -> agetconfig zh watch (fun err value len stat data ->
+         if not (again err) then completion err value len stat data) data)
+    fail
+
+external areconfig:
+     zhandle
+  -> string
+  -> string
+  -> string
+  -> int64
+  -> data_completion_callback
+  -> string
+  -> error = "zkocaml_areconfig_bytecode" "zkocaml_areconfig_native"
+
+let areconfig ?timeout zh joining leaving members version completion data =
+  with_timeout timeout @@ fun () ->
+  windowed zh
+    (fun () -> areconfig zh joining leaving members version completion data)
+    (fun err -> completion err "" 0 empty_stat data)
+
 external zerror:
      int
   -> string = "zkocaml_zerror"
@@ -660,6 +1266,58 @@ external deterministic_conn_order:
      bool
   -> unit = "zkocaml_deterministic_conn_order"
 
+module type SUSPEND = sig
+  (* [suspend register] calls [register resume] and suspends the
+   * calling fiber until [resume v] is called, once, from any thread
+   * and possibly before [register] returns; it then returns [v]. *)
+  val suspend : (('a -> unit) -> unit) -> 'a
+end
+
+(* Suspends the calling system thread. *)
+module Thread_suspend = struct
+  let suspend register =
+    let mutex = Mutex.create () and cond = Condition.create () in
+    let result = ref None in
+    register (fun v ->
+        Mutex.lock mutex;
+        result := Some v;
+        Condition.signal cond;
+        Mutex.unlock mutex);
+    Mutex.lock mutex;
+    let rec wait () =
+      match !result with
+      | Some v -> v
+      | None -> Condition.wait cond mutex; wait ()
+    in
+    let v = wait () in
+    Mutex.unlock mutex;
+    v
+end
+
+module Suspended (S : SUSPEND) = struct
+  (* Suspends until the completion of [async] resumes the caller, or
+   * returns [fail err] if the call could not be submitted. *)
+  let call async fail =
+    S.suspend (fun resume ->
+        match async resume with
+        | ZOK -> ()
+        | err -> resume (fail err))
+end
+
+module Blocking = Suspended (Thread_suspend)
+
+(* Submits an async call and waits for the value its completion hands
+ * to the continuation [async] is given. *)
+let await = Blocking.call
+
+(* Runs a sync call bounded by [timeout] as its async counterpart,
+ * which the binding completes with ZOPERATIONTIMEOUT once the deadline
+ * passes, and waits for its completion. *)
+let bounded timeout sync async fail =
+  match timeout with
+  | None -> sync ()
+  | Some _ -> await (fun complete -> with_timeout timeout (fun () -> async complete)) fail
+
 external create:
      zhandle
   -> string
@@ -668,45 +1326,139 @@ external create:
   -> create_flag array
   -> error * string = "zkocaml_create"
 
+let create ?timeout zh path value acls flags =
+  bounded timeout
+    (fun () -> create zh path value acls flags)
+    (fun k -> acreate zh path value acls flags (fun err path _ -> k (err, path)) "")
+    (fun err -> err, "")
+
+external create_prepared:
+     zhandle
+  -> string
+  -> string
+  -> acl_handle
+  -> create_flag array
+  -> error * string = "zkocaml_create_prepared"
+
+let create_prepared ?timeout zh path value acl flags =
+  bounded timeout
+    (fun () -> create_prepared zh path value acl flags)
+    (fun k -> acreate_prepared zh path value acl flags (fun err path _ -> k (err, path)) "")
+    (fun err -> err, "")
+
+external create2:
+     zhandle
+  -> string
+  -> string
+  -> acls
+  -> create_flag array
+  -> int64
+  -> error * string * stat = "zkocaml_create2_bytecode" "zkocaml_create2_native"
+
+let create2 ?timeout ?(ttl = 0L) zh path value acls flags =
+  bounded timeout
+    (fun () -> create2 zh path value acls flags ttl)
+    (fun k -> acreate2 ~ttl zh path value acls flags (fun err path stat _ -> k (err, path, stat)) "")
+    (fun err -> err, "", empty_stat)
+
 external delete:
      zhandle
   -> string
   -> int
   -> error = "zkocaml_delete"
 
+let delete ?timeout zh path version =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_delete (version <> -1) (fun err -> err) @@ fun () ->
+       delete zh path version)
+    (fun k -> adelete zh path version (fun err _ -> k err) "")
+    (fun err -> err)
+
+external multi:
+     zhandle
+  -> multi_op array
+  -> error * op_result array = "zkocaml_multi"
+
+let multi ?timeout zh ops =
+  bounded timeout
+    (fun () -> multi zh ops)
+    (fun k -> amulti zh ops (fun err results _ -> k (err, results)) "")
+    (fun err -> err, [||])
+
 external exists:
      zhandle
-  -> string
+  -> 'p
   -> int
   -> error * stat = "zkocaml_exists"
 
+let exists ?timeout zh path watch =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_exists true fst @@ fun () ->
+       exists zh path watch)
+    (fun k -> aexists zh path watch (fun err stat _ -> k (err, stat)) "")
+    (fun err -> err, empty_stat)
+
 external wexists:
      zhandle
-  -> string
-  -> watcher_callback
+  -> 'p
+  -> 'p watcher
   -> string
   -> error * stat = "zkocaml_wexists"
 
+let wexists ?timeout zh path watcher watcher_ctx =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_exists true fst @@ fun () ->
+       wexists zh path watcher watcher_ctx)
+    (fun k -> awexists zh path watcher watcher_ctx (fun err stat _ -> k (err, stat)) "")
+    (fun err -> err, empty_stat)
+
 external get:
      zhandle
-  -> string
+  -> 'p
   -> int
   -> error * string * stat = "zkocaml_get"
 
+let get ?timeout zh path watch =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_get true (fun (err, _, _) -> err) @@ fun () ->
+       get zh path watch)
+    (fun k -> aget zh path watch (fun err value _ stat _ -> k (err, value, stat)) "")
+    (fun err -> err, "", empty_stat)
+
 external wget:
      zhandle
-  -> string
-  -> watcher_callback
+  -> 'p
+  -> 'p watcher
   -> string
   -> error * string * stat = "zkocaml_wget"
 
+let wget ?timeout zh path watcher watcher_ctx =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_get true (fun (err, _, _) -> err) @@ fun () ->
+       wget zh path watcher watcher_ctx)
+    (fun k -> awget zh path watcher watcher_ctx (fun err value _ stat _ -> k (err, value, stat)) "")
+    (fun err -> err, "", empty_stat)
+
 external set:
      zhandle
-  -> string
+  -> 'p
   -> string
   -> int
   -> error = "zkocaml_set"
 
+let set ?timeout zh path buffer version =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_set (version <> -1) (fun err -> err) @@ fun () ->
+       set zh path buffer version)
+    (fun k -> aset zh path buffer version (fun err _ _ -> k err) "")
+    (fun err -> err)
+
 external set2:
      zhandle
   -> string
@@ -714,12 +1466,28 @@ external set2:
   -> int
   -> error * stat = "zkocaml_set2"
 
+let set2 ?timeout zh path buffer version =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_set (version <> -1) fst @@ fun () ->
+       set2 zh path buffer version)
+    (fun k -> aset zh path buffer version (fun err stat _ -> k (err, stat)) "")
+    (fun err -> err, empty_stat)
+
 external get_children:
      zhandle
   -> string
   -> int
   -> error * strings = "zkocaml_get_children"
 
+let get_children ?timeout zh path watch =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_get_children true fst @@ fun () ->
+       get_children zh path watch)
+    (fun k -> aget_children zh path watch (fun err children _ -> k (err, children)) "")
+    (fun err -> err, [||])
+
 external wget_children:
      zhandle
   -> string
@@ -727,12 +1495,28 @@ external wget_children:
   -> string
   -> error * strings = "zkocaml_wget_children"
 
+let wget_children ?timeout zh path watcher watcher_ctx =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_get_children true fst @@ fun () ->
+       wget_children zh path watcher watcher_ctx)
+    (fun k -> awget_children zh path watcher watcher_ctx (fun err children _ -> k (err, children)) "")
+    (fun err -> err, [||])
+
 external get_children2:
      zhandle
   -> string
   -> int
   -> error * strings * stat = "zkocaml_get_children2"
 
+let get_children2 ?timeout zh path watch =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_get_children true (fun (err, _, _) -> err) @@ fun () ->
+       get_children2 zh path watch)
+    (fun k -> aget_children2 zh path watch (fun err children stat _ -> k (err, children, stat)) "")
+    (fun err -> err, [||], empty_stat)
+
 external wget_children2:
      zhandle
   -> string
@@ -740,14 +1524,1867 @@ external wget_children2:
   -> string
   -> error * strings * stat = "zkocaml_wget_children2"
 
+let wget_children2 ?timeout zh path watcher watcher_ctx =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_get_children true (fun (err, _, _) -> err) @@ fun () ->
+       wget_children2 zh path watcher watcher_ctx)
+    (fun k -> awget_children2 zh path watcher watcher_ctx (fun err children stat _ -> k (err, children, stat)) "")
+    (fun err -> err, [||], empty_stat)
+
 external get_acl:
      zhandle
   -> string
   -> error * acls * stat = "zkocaml_get_acl"
 
+let get_acl ?timeout zh path =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_get_acl true (fun (err, _, _) -> err) @@ fun () ->
+       get_acl zh path)
+    (fun k -> aget_acl zh path (fun err acls stat _ -> k (err, acls, stat)) "")
+    (fun err -> err, [||], empty_stat)
+
+external getconfig:
+     zhandle
+  -> int
+  -> error * string * stat = "zkocaml_getconfig"
+
+let getconfig ?timeout zh watch =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_get true (fun (err, _, _) -> err) @@ fun () ->
+       getconfig zh watch)
+    (fun k -> agetconfig zh watch (fun err value _ stat _ -> k (err, value, stat)) "")
+    (fun err -> err, "", empty_stat)
+
+external reconfig:
+     zhandle
+  -> string
+  -> string
+  -> string
+  -> int64
+  -> error * string * stat = "zkocaml_reconfig"
+
+let reconfig ?timeout zh joining leaving members version =
+  bounded timeout
+    (fun () -> reconfig zh joining leaving members version)
+    (fun k -> areconfig zh joining leaving members version
+        (fun err value _ stat _ -> k (err, value, stat)) "")
+    (fun err -> err, "", empty_stat)
+
+(* The client addresses of the servers of a dynamic configuration,
+ * as the comma separated host:port list set_servers takes. Servers
+ * listening on all interfaces are reached through their quorum host. *)
+let servers_of_config config =
+  let client_address line =
+    let prefix = "server." in
+    let lp = String.length prefix in
+    if String.length line <= lp || String.sub line 0 lp <> prefix then None
+    else match String.index line '=', String.index line ';' with
+      | eq, semi when eq < semi ->
+        let server = String.sub line (eq + 1) (semi - eq - 1) in
+        let host =
+          try String.sub server 0 (String.index server ':')
+          with Not_found -> server
+        in
+        let client =
+          String.trim (String.sub line (semi + 1) (String.length line - semi - 1))
+        in
+        let client_host, port =
+          try
+            let i = String.rindex client ':' in
+            String.sub client 0 i, String.sub client (i + 1) (String.length client - i - 1)
+          with Not_found -> "", client
+        in
+        let client_host =
+          if client_host = "" || client_host = "0.0.0.0" then host else client_host
+        in
+        Some (client_host ^ ":" ^ port)
+      | _ -> None
+      | exception Not_found -> None
+  in
+  String.split_on_char '\n' config
+  |> List.fold_left (fun acc line ->
+      match client_address (String.trim line) with
+      | Some address -> address :: acc
+      | None -> acc) []
+  |> List.rev
+  |> String.concat ","
+
+(* Keeps the server list of [zh] in line with the dynamic configuration
+ * of the ensemble: watches /zookeeper/config and hands the servers of
+ * every new configuration to set_servers, so that clients spread onto
+ * the servers a reconfig adds without restarting. [on_change] gets each
+ * new list and the result of set_servers. [zh] must not be namespaced. *)
+let follow_config ?(on_change = fun _ _ -> ()) zh =
+  let current = ref "" in
+  let rec arm () =
+    awget zh "/zookeeper/config"
+      (fun _ event _ _ _ -> if event <> ZOO_SESSION_EVENT then ignore (arm ())) ""
+      (fun err config _ _ _ ->
+         let servers = if err = ZOK then servers_of_config config else "" in
+         if servers <> "" && servers <> !current then begin
+           current := servers;
+           on_change servers (set_servers zh servers)
+         end) ""
+  in
+  arm ()
+
 external set_acl:
      zhandle
   -> string
   -> int
   -> acls
   -> error = "zkocaml_set_acl"
+
+let set_acl ?timeout zh path version acls =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_set_acl (version <> -1) (fun err -> err) @@ fun () ->
+       set_acl zh path version acls)
+    (fun k -> aset_acl zh path version acls (fun err _ -> k err) "")
+    (fun err -> err)
+
+external set_acl_prepared:
+     zhandle
+  -> string
+  -> int
+  -> acl_handle
+  -> error = "zkocaml_set_acl_prepared"
+
+let set_acl_prepared ?timeout zh path version acl =
+  bounded timeout
+    (fun () ->
+       retried_sync zh Op_set_acl (version <> -1) (fun err -> err) @@ fun () ->
+       set_acl_prepared zh path version acl)
+    (fun k -> aset_acl_prepared zh path version acl (fun err _ -> k err) "")
+    (fun err -> err)
+
+(* Runs [f] with [lock] held. *)
+let locked lock f =
+  Mutex.lock lock;
+  match f () with
+  | v -> Mutex.unlock lock; v
+  | exception e -> Mutex.unlock lock; raise e
+
+(* The path of the child [child] of [path]. *)
+let child_path path child = if path = "/" then "/" ^ child else path ^ "/" ^ child
+
+(**
+ * Pipelines.
+ *
+ * A pipeline runs the async calls submitted to it with at most a
+ * window of them in flight, queueing the others. A call is given the
+ * function to complete it with; once the pipeline is sealed and all
+ * its calls have completed, its finish function is called with the
+ * first error they were completed with.
+ *)
+type pipeline = {
+  pipe_lock: Mutex.t;
+  pipe_room: Condition.t;
+  pipe_queue: ((error -> unit) -> error) Queue.t;
+  pipe_window: int;
+  mutable pipe_inflight: int;
+  mutable pipe_pending: int;
+  mutable pipe_failed: error;
+  pipe_finish: error -> unit
+}
+
+let pipeline window finish = {
+  pipe_lock = Mutex.create ();
+  pipe_room = Condition.create ();
+  pipe_queue = Queue.create ();
+  pipe_window = max 1 window;
+  pipe_inflight = 0;
+  pipe_pending = 1;
+  pipe_failed = ZOK;
+  pipe_finish = finish
+}
+
+(* Settles a call, returning the queued call to start in its place. *)
+let pipeline_settle p err =
+  Mutex.lock p.pipe_lock;
+  if err <> ZOK && p.pipe_failed = ZOK then p.pipe_failed <- err;
+  p.pipe_pending <- p.pipe_pending - 1;
+  let next = Queue.take_opt p.pipe_queue in
+  (match next with
+   | Some _ -> ()
+   | None -> p.pipe_inflight <- p.pipe_inflight - 1);
+  Condition.broadcast p.pipe_room;
+  let last = p.pipe_pending = 0 and failed = p.pipe_failed in
+  Mutex.unlock p.pipe_lock;
+  if last then p.pipe_finish failed;
+  next
+
+let rec pipeline_start p call =
+  let complete err =
+    match pipeline_settle p err with
+    | Some next -> pipeline_start p next
+    | None -> ()
+  in
+  match call complete with
+  | ZOK -> ()
+  | err ->
+    match pipeline_settle p err with
+    | Some next -> pipeline_start p next
+    | None -> ()
+
+let pipeline_submit p call =
+  Mutex.lock p.pipe_lock;
+  p.pipe_pending <- p.pipe_pending + 1;
+  let now = p.pipe_inflight < p.pipe_window in
+  if now then p.pipe_inflight <- p.pipe_inflight + 1
+  else Queue.push call p.pipe_queue;
+  Mutex.unlock p.pipe_lock;
+  if now then pipeline_start p call
+
+(* Waits until a call submitted would start at once. Not to be called
+ * from a completion. *)
+let pipeline_throttle p =
+  Mutex.lock p.pipe_lock;
+  while not (Queue.is_empty p.pipe_queue) || p.pipe_inflight >= p.pipe_window do
+    Condition.wait p.pipe_room p.pipe_lock
+  done;
+  Mutex.unlock p.pipe_lock
+
+(* Submits the creates of [batch] to [p] as one multi. A batch failing
+ * as a whole, as when one of its nodes exists already, falls back to
+ * [create_one path value acls flags] for each of them. *)
+let pipeline_create_batch p zh create_one batch =
+  pipeline_submit p @@ fun complete ->
+  amulti zh batch (fun err results _ ->
+      if err = ZOK || Array.length results = 0 then complete err
+      else begin
+        Array.iter (function
+            | Create_op (path, value, acls, flags) -> create_one path value acls flags
+            | _ -> ()) batch;
+        complete ZOK
+      end) ""
+
+let pipeline_seal p =
+  Mutex.lock p.pipe_lock;
+  p.pipe_pending <- p.pipe_pending - 1;
+  let last = p.pipe_pending = 0 and failed = p.pipe_failed in
+  Mutex.unlock p.pipe_lock;
+  if last then p.pipe_finish failed
+
+(* Walks the subtree under [root] with pipelined aget_children2 calls,
+ * all bounded by the deadline of the caller, calling [visit path
+ * children stat] for every node with the walk lock held, then [finish]
+ * once with ZOK or the first error. Nodes deleted during the walk are
+ * skipped. *)
+let walk zh root visit finish =
+  let deadline = get_call_deadline () in
+  let p = pipeline max_int finish in
+  let rec visit_node path =
+    pipeline_submit p @@ fun complete ->
+    let completion err children stat _ =
+      match err with
+      | ZOK ->
+        Mutex.lock p.pipe_lock;
+        let walking = p.pipe_failed = ZOK in
+        if walking then visit path children stat;
+        Mutex.unlock p.pipe_lock;
+        if walking then
+          Array.iter (fun child ->
+              visit_node (child_path path child))
+            children;
+        complete ZOK
+      | ZNONODE when path <> root -> complete ZOK
+      | err -> complete err
+    in
+    with_deadline deadline (fun () -> aget_children2 zh path 0 completion "")
+  in
+  visit_node root;
+  pipeline_seal p;
+  ZOK
+
+(* The C client has no getAllChildrenNumber nor getEphemerals request,
+ * so both are computed from a pipelined walk of the subtree: one round
+ * trip per level rather than per node. *)
+let aget_all_children_number ?timeout zh path completion data =
+  let total = ref 0 in
+  with_timeout timeout @@ fun () ->
+  walk zh path
+    (fun _ children _ -> total := !total + Array.length children)
+    (fun err -> completion err (if err = ZOK then !total else 0) data)
+
+let aget_ephemerals ?timeout zh path completion data =
+  let owner = (client_id zh).client_id in
+  let found = ref [] in
+  with_timeout timeout @@ fun () ->
+  walk zh path
+    (fun path _ stat -> if stat.ephemeral_owner = owner then found := path :: !found)
+    (fun err ->
+       completion err (if err = ZOK then Array.of_list (List.rev !found) else [||]) data)
+
+let get_all_children_number ?timeout zh path =
+  await
+    (fun k -> aget_all_children_number ?timeout zh path (fun err n _ -> k (err, n)) "")
+    (fun err -> err, 0)
+
+let get_ephemerals ?timeout zh path =
+  await
+    (fun k -> aget_ephemerals ?timeout zh path (fun err paths _ -> k (err, paths)) "")
+    (fun err -> err, [||])
+
+external reinit:
+     zhandle
+  -> string
+  -> int
+  -> int
+  -> error = "zkocaml_reinit"
+
+external rearm_watches:
+     zhandle
+  -> int = "zkocaml_rearm_watches"
+
+(**
+ * Recovering handle.
+ *
+ * A handle surviving the expiry of its session: it is re-initialized
+ * in place on a new session, so that the zhandle held by the
+ * application stays valid, then the watches set on it are re-armed
+ * and the ephemerals registered through it are created again, all
+ * pipelined, which takes a few round trips rather than one per node.
+ *)
+type recovering = {
+  zh: zhandle;
+  servers: string;
+  timeout: int;
+  flags: int;
+  lock: Mutex.t;
+  ephemerals: (string, string * acls) Hashtbl.t;
+  mutable recovering: bool;
+  on_recover: error -> unit
+}
+
+let recovering_handle r = r.zh
+
+(* Creates the ephemerals of [ops] again with pipelined multi batches.
+ * A batch failing as a whole, as when one of its nodes still exists,
+ * falls back to one create per node. A node that exists already is
+ * restored only if this session owns it, and a conflict otherwise.
+ * Calls [finish] with the first error, ZNODEEXISTS for a conflict. *)
+let restore_ephemerals zh ops finish =
+  let owner = (client_id zh).client_id in
+  let p = pipeline max_int finish in
+  let rec create_one path value acls flags =
+    (* Gone again by the time it is looked at: create it once more. *)
+    let owned complete err stat _ =
+      if err = ZNONODE then create_one path value acls flags;
+      complete (match err with
+          | ZOK when stat.ephemeral_owner <> owner -> ZNODEEXISTS
+          | ZNONODE -> ZOK
+          | err -> err)
+    in
+    pipeline_submit p @@ fun complete ->
+    acreate zh path value acls flags (fun err _ _ ->
+        if err = ZNODEEXISTS then
+          pipeline_submit p (fun complete -> aexists zh path 0 (owned complete) "");
+        complete (if err = ZNODEEXISTS then ZOK else err)) ""
+  in
+  List.iter (pipeline_create_batch p zh create_one) (multi_batches ops);
+  pipeline_seal p
+
+let rec wait_connected zh ticks =
+  match zstate zh with
+  | ZOO_CONNECTED_STATE | ZOO_READONLY_STATE -> true
+  | _ when ticks <= 0 -> false
+  | _ -> Thread.delay 0.01; wait_connected zh (ticks - 1)
+
+(* Moves [r] onto a new session and restores its watches and
+ * ephemerals, unless a recovery is already running. *)
+let recover r =
+  Mutex.lock r.lock;
+  let running = r.recovering in
+  r.recovering <- true;
+  let ops =
+    Hashtbl.fold (fun path (value, acls) ops ->
+        Create_op (path, value, acls, [|ZOO_EPHEMERAL|]) :: ops) r.ephemerals []
+  in
+  Mutex.unlock r.lock;
+  if running then ZOK
+  else begin
+    let result =
+      match reinit r.zh r.servers r.timeout r.flags with
+      | ZOK when wait_connected r.zh (r.timeout / 10) ->
+        ignore (rearm_watches r.zh);
+        await (fun k -> restore_ephemerals r.zh ops k; ZOK) (fun err -> err)
+      | ZOK -> ZOPERATIONTIMEOUT
+      | err -> err
+    in
+    Mutex.lock r.lock;
+    r.recovering <- false;
+    Mutex.unlock r.lock;
+    r.on_recover result;
+    result
+  end
+
+(* Like init, but the handle recovers from the expiry of its session
+ * on a thread of its own, calling [on_recover] with the outcome. *)
+let recovering_init ?(on_recover = fun _ -> ()) servers cb timeout ctx flags =
+  let self = ref None in
+  let watcher zh event state path watcher_ctx =
+    cb zh event state path watcher_ctx;
+    match !self with
+    | Some r when event = ZOO_SESSION_EVENT && state = ZOO_EXPIRED_SESSION_STATE
+                  && zstate zh = ZOO_EXPIRED_SESSION_STATE ->
+      ignore (Thread.create recover r)
+    | _ -> ()
+  in
+  let zh = init servers watcher timeout {client_id = 0L; passwd = ""} ctx flags in
+  let r = {
+    zh; servers; timeout; flags;
+    lock = Mutex.create ();
+    ephemerals = Hashtbl.create 64;
+    recovering = false;
+    on_recover
+  } in
+  self := Some r;
+  r
+
+(* Creates an ephemeral node restored on every recovery, until it is
+ * unregistered. Sequential nodes cannot be restored under their name,
+ * so [path] is created as is. *)
+let register_ephemeral ?timeout r path value acls =
+  let err, _ = create ?timeout r.zh path value acls [|ZOO_EPHEMERAL|] in
+  if err = ZOK then begin
+    Mutex.lock r.lock;
+    Hashtbl.replace r.ephemerals path (value, acls);
+    Mutex.unlock r.lock
+  end;
+  err
+
+let unregister_ephemeral ?timeout r path =
+  Mutex.lock r.lock;
+  Hashtbl.remove r.ephemerals path;
+  Mutex.unlock r.lock;
+  delete ?timeout r.zh path (-1)
+
+(**
+ * Shared snapshots.
+ *
+ * One process of a host keeps a subtree up to date through watches and
+ * publishes it in a memory-mapped file; the other processes read it
+ * through a snapshot_reader without a session of their own, and
+ * without a system call per lookup.
+ *)
+type snapshot_reader
+
+external snapshot_write:
+     string
+  -> (string * string * int64) array
+  -> error * int = "zkocaml_snapshot_write"
+
+external snapshot_open:
+     string
+  -> snapshot_reader option = "zkocaml_snapshot_open"
+
+external snapshot_find:
+     snapshot_reader
+  -> string
+  -> (string * int64) option = "zkocaml_snapshot_find"
+
+external snapshot_generation:
+     snapshot_reader
+  -> int = "zkocaml_snapshot_generation"
+
+(* Keeps the subtree under [root] in a table through a data and a child
+ * watch on every node, and writes it as a new generation of the shared
+ * snapshot [name] at most every [interval] seconds while it changes,
+ * the first one once the whole subtree is loaded. Returns a function
+ * stopping the publisher. Watches do not survive the expiry of the
+ * session: use a recovering handle. *)
+let publish_snapshot ?(interval = 0.05) zh root name =
+  let lock = Mutex.create () in
+  let nodes = Hashtbl.create 1024 and known = Hashtbl.create 1024 in
+  let dirty = ref true and loaded = ref false and published = ref false in
+  let stopped = ref false in
+  (* Finished once the first loads drain, and again by later ones. *)
+  let p = pipeline max_int (fun _ -> locked lock (fun () -> loaded := true)) in
+  let forget path =
+    locked lock (fun () ->
+        Hashtbl.remove nodes path;
+        Hashtbl.remove known path;
+        dirty := true)
+  in
+  let rec load_data path =
+    pipeline_submit p @@ fun complete ->
+    awget zh path
+      (fun _ event _ _ _ ->
+         if not !stopped then
+           match event with
+           | ZOO_CHANGED_EVENT -> load_data path
+           | ZOO_DELETED_EVENT -> forget path
+           | _ -> ()) ""
+      (fun err value _ stat _ ->
+         (match err with
+          | ZOK ->
+            locked lock (fun () ->
+                if Hashtbl.mem known path then begin
+                  Hashtbl.replace nodes path (value, stat.mzxid);
+                  dirty := true
+                end)
+          | ZNONODE -> forget path
+          | _ -> ());
+         complete ZOK) ""
+  and load_children path =
+    pipeline_submit p @@ fun complete ->
+    awget_children zh path
+      (fun _ event _ _ _ ->
+         if not !stopped && event = ZOO_CHILD_EVENT then load_children path) ""
+      (fun err children _ ->
+         if err = ZOK then
+           Array.iter (fun child ->
+               load (child_path path child))
+             children;
+         complete ZOK) ""
+  and load path =
+    let fresh =
+      locked lock (fun () ->
+          not (Hashtbl.mem known path) && (Hashtbl.replace known path (); true))
+    in
+    if fresh then begin
+      load_data path;
+      load_children path
+    end
+  in
+  let rec flush () =
+    Thread.delay interval;
+    let entries =
+      locked lock (fun () ->
+          if !dirty && not !stopped && (!published || !loaded) then begin
+            dirty := false;
+            published := true;
+            Some (Hashtbl.fold (fun path (value, mzxid) entries ->
+                (path, value, mzxid) :: entries) nodes [])
+          end else None)
+    in
+    (match entries with
+     | Some entries ->
+       let entries = Array.of_list entries in
+       Array.sort (fun (a, _, _) (b, _, _) -> compare a b) entries;
+       ignore (snapshot_write name entries)
+     | None -> ());
+    if not !stopped then flush ()
+  in
+  load root;
+  pipeline_seal p;
+  ignore (Thread.create flush ());
+  fun () -> stopped := true
+
+external snapshot_entries:
+     snapshot_reader
+  -> (string * string * int64) array = "zkocaml_snapshot_entries"
+
+(**
+ * Warm caches.
+ *
+ * A copy of a subtree kept on disk as a shared snapshot, so that a
+ * service restarts from its last copy at once, while the copy is
+ * validated against the service in the background.
+ *)
+type warm_cache = {
+  warm_lock: Mutex.t;
+  warm_nodes: (string, string * int64) Hashtbl.t;
+  mutable warm_valid: bool
+}
+
+let warm_cache_find c path =
+  Mutex.lock c.warm_lock;
+  let found = Hashtbl.find_opt c.warm_nodes path in
+  Mutex.unlock c.warm_lock;
+  match found with
+  | Some (value, _) -> Some value
+  | None -> None
+
+let warm_cache_valid c = c.warm_valid
+
+let warm_cache_save c name =
+  Mutex.lock c.warm_lock;
+  let entries =
+    Hashtbl.fold (fun path (value, mzxid) entries ->
+        (path, value, mzxid) :: entries) c.warm_nodes []
+  in
+  Mutex.unlock c.warm_lock;
+  let entries = Array.of_list entries in
+  Array.sort (fun (a, _, _) (b, _, _) -> compare a b) entries;
+  fst (snapshot_write name entries)
+
+(* Loads the copy of the subtree under [root] saved in [name], then
+ * validates it with one get_children2 per node: the data of a node is
+ * fetched again only if its mzxid changed, new nodes are added and
+ * the nodes gone dropped. Once the whole subtree is validated, the
+ * copy is saved back and [on_valid] called with ZOK; on another error
+ * the loaded copy is kept as is and [on_valid] called with it. The
+ * copy is not kept up to date afterwards. *)
+let warm_cache ?(on_valid = fun _ -> ()) zh root name =
+  let c = {warm_lock = Mutex.create (); warm_nodes = Hashtbl.create 1024; warm_valid = false} in
+  (match snapshot_open name with
+   | Some reader ->
+     Array.iter (fun (path, value, mzxid) ->
+         Hashtbl.replace c.warm_nodes path (value, mzxid)) (snapshot_entries reader)
+   | None -> ());
+  let seen = Hashtbl.create 1024 in
+  let finish err =
+    if err = ZOK then
+      locked c.warm_lock (fun () ->
+          Hashtbl.filter_map_inplace (fun path node ->
+              if Hashtbl.mem seen path then Some node else None) c.warm_nodes;
+          c.warm_valid <- true);
+    on_valid (if err = ZOK then warm_cache_save c name else err)
+  in
+  let p = pipeline max_int finish in
+  (* A node deleted meanwhile is just left out. *)
+  let settle complete err = complete (if err = ZNONODE then ZOK else err) in
+  let rec visit path =
+    pipeline_submit p @@ fun complete ->
+    aget_children2 zh path 0
+      (fun err children stat _ ->
+         if err = ZOK then begin
+           let stale =
+             locked c.warm_lock (fun () ->
+                 Hashtbl.replace seen path ();
+                 match Hashtbl.find_opt c.warm_nodes path with
+                 | Some (_, mzxid) -> mzxid <> stat.mzxid
+                 | None -> true)
+           in
+           if stale then fetch path;
+           Array.iter (fun child ->
+               visit (child_path path child))
+             children
+         end;
+         settle complete err) ""
+  and fetch path =
+    pipeline_submit p @@ fun complete ->
+    aget zh path 0
+      (fun err value _ stat _ ->
+         (match err with
+          | ZOK ->
+            locked c.warm_lock (fun () ->
+                Hashtbl.replace c.warm_nodes path (value, stat.mzxid))
+          | ZNONODE -> locked c.warm_lock (fun () -> Hashtbl.remove seen path)
+          | _ -> ());
+         settle complete err) ""
+  in
+  visit root;
+  pipeline_seal p;
+  c
+
+(**
+ * Session proxy.
+ *
+ * A local daemon holds a few sessions and serves the processes of a
+ * host over a Unix domain socket, so that they connect without opening
+ * sessions of their own. A frame is a 32-bit big-endian length and its
+ * payload. A request carries its id, an opcode and its arguments; the
+ * daemon pipelines them and answers in completion order with the id,
+ * the ZooKeeper error code and, on ZOK, the results. Watch events are
+ * forwarded as frames of their own, carrying the id of the request
+ * which set the watch, and run on a thread of their own so that a
+ * watcher may call the proxy.
+ *
+ * Ephemeral creates are refused with ZBADARGUMENTS: the node would
+ * belong to the shared session of the daemon and outlive its client.
+ *)
+type proxy_watcher = event -> state -> string -> unit
+
+type wire = {wire: string; mutable wire_pos: int}
+
+let wire_max = 16 * 1024 * 1024
+
+external error_code:
+     error
+  -> int = "zkocaml_error_code"
+
+external error_of_code:
+     int
+  -> error = "zkocaml_error_of_code"
+
+let event_code = function
+  | ZOO_CREATED_EVENT -> 1
+  | ZOO_DELETED_EVENT -> 2
+  | ZOO_CHANGED_EVENT -> 3
+  | ZOO_CHILD_EVENT -> 4
+  | ZOO_SESSION_EVENT -> -1
+  | ZOO_NOTWATCHING_EVENT -> -2
+
+let event_of_code = function
+  | 1 -> ZOO_CREATED_EVENT
+  | 2 -> ZOO_DELETED_EVENT
+  | 3 -> ZOO_CHANGED_EVENT
+  | 4 -> ZOO_CHILD_EVENT
+  | -2 -> ZOO_NOTWATCHING_EVENT
+  | _ -> ZOO_SESSION_EVENT
+
+let state_code = function
+  | ZOO_EXPIRED_SESSION_STATE -> -112
+  | ZOO_AUTH_FAILED_STATE -> -113
+  | ZOO_CONNECTING_STATE -> 1
+  | ZOO_ASSOCIATING_STATE -> 2
+  | ZOO_CONNECTED_STATE -> 3
+  | ZOO_READONLY_STATE -> 5
+
+let state_of_code = function
+  | -113 -> ZOO_AUTH_FAILED_STATE
+  | 1 -> ZOO_CONNECTING_STATE
+  | 2 -> ZOO_ASSOCIATING_STATE
+  | 3 -> ZOO_CONNECTED_STATE
+  | 5 -> ZOO_READONLY_STATE
+  | _ -> ZOO_EXPIRED_SESSION_STATE
+
+let create_flags_code flags =
+  Array.fold_left (fun code flag ->
+      code lor (match flag with
+          | ZOO_EPHEMERAL -> 1
+          | ZOO_SEQUENCE -> 2
+          | ZOO_CONTAINER -> 4)) 0 flags
+
+let create_flags_of_code code =
+  List.filter (fun (bit, _) -> code land bit <> 0)
+    [1, ZOO_EPHEMERAL; 2, ZOO_SEQUENCE; 4, ZOO_CONTAINER]
+  |> List.map snd |> Array.of_list
+
+let wire_put_int b n = Buffer.add_int32_be b (Int32.of_int n)
+
+let wire_put_string b s =
+  wire_put_int b (String.length s);
+  Buffer.add_string b s
+
+let wire_put_stat b s =
+  Buffer.add_int64_be b s.czxid;
+  Buffer.add_int64_be b s.mzxid;
+  Buffer.add_int64_be b s.ctime;
+  Buffer.add_int64_be b s.mtime;
+  wire_put_int b s.version;
+  wire_put_int b s.cversion;
+  wire_put_int b s.aversion;
+  Buffer.add_int64_be b s.ephemeral_owner;
+  wire_put_int b s.data_length;
+  wire_put_int b s.num_children;
+  Buffer.add_int64_be b (Int64.of_int s.pzxid)
+
+let wire_put_array b put a =
+  wire_put_int b (Array.length a);
+  Array.iter (put b) a
+
+let wire_put_acl b acl =
+  wire_put_int b acl.perms;
+  wire_put_string b acl.scheme;
+  wire_put_string b acl.id
+
+(* Readers raise Invalid_argument on a truncated frame. *)
+let wire_int w =
+  let n = Int32.to_int (String.get_int32_be w.wire w.wire_pos) in
+  w.wire_pos <- w.wire_pos + 4;
+  n
+
+let wire_int64 w =
+  let n = String.get_int64_be w.wire w.wire_pos in
+  w.wire_pos <- w.wire_pos + 8;
+  n
+
+let wire_byte w =
+  let n = String.get_uint8 w.wire w.wire_pos in
+  w.wire_pos <- w.wire_pos + 1;
+  n
+
+let wire_string w =
+  let n = wire_int w in
+  let s = String.sub w.wire w.wire_pos n in
+  w.wire_pos <- w.wire_pos + n;
+  s
+
+let wire_stat w =
+  let czxid = wire_int64 w in
+  let mzxid = wire_int64 w in
+  let ctime = wire_int64 w in
+  let mtime = wire_int64 w in
+  let version = wire_int w in
+  let cversion = wire_int w in
+  let aversion = wire_int w in
+  let ephemeral_owner = wire_int64 w in
+  let data_length = wire_int w in
+  let num_children = wire_int w in
+  let pzxid = Int64.to_int (wire_int64 w) in
+  {czxid; mzxid; ctime; mtime; version; cversion; aversion;
+   ephemeral_owner; data_length; num_children; pzxid}
+
+let wire_array w read =
+  let n = wire_int w in
+  if n < 0 || n > String.length w.wire - w.wire_pos then invalid_arg "wire_array";
+  Array.init n (fun _ -> read w)
+
+let wire_acl w =
+  let perms = wire_int w in
+  let scheme = wire_string w in
+  let id = wire_string w in
+  {perms; scheme; id}
+
+let wire_send out payload =
+  output_binary_int out (String.length payload);
+  output_string out payload;
+  flush out
+
+let wire_receive input =
+  let n = input_binary_int input in
+  if n < 0 || n > wire_max then failwith "wire_receive";
+  {wire = really_input_string input n; wire_pos = 0}
+
+(* A write to a peer gone away fails with EPIPE instead of killing
+ * the process. *)
+let ignore_sigpipe () =
+  try Sys.set_signal Sys.sigpipe Sys.Signal_ignore with Invalid_argument _ -> ()
+
+let proxy_op_create = 1
+let proxy_op_delete = 2
+let proxy_op_exists = 3
+let proxy_op_get = 4
+let proxy_op_set = 5
+let proxy_op_get_children = 6
+
+(* Writes the frames queued for a client of the proxy, off the
+ * completion and watcher threads which queue them, until the client
+ * is closed. *)
+let rec serve_proxy_write fd out lock ready frames queued closed =
+  Mutex.lock lock;
+  while Queue.is_empty frames && not !closed do Condition.wait ready lock done;
+  let pending = if !closed then [] else List.of_seq (Queue.to_seq frames) in
+  Queue.clear frames;
+  queued := 0;
+  Mutex.unlock lock;
+  if pending <> [] then begin
+    match List.iter (wire_send out) pending with
+    | () -> serve_proxy_write fd out lock ready frames queued closed
+    | exception Sys_error _ ->
+      (try Unix.shutdown fd Unix.SHUTDOWN_ALL with Unix.Unix_error _ -> ())
+  end
+
+(* Serves one client of the proxy on [zh] until it disconnects. The
+ * replies and events are queued for a writer thread of the client: a
+ * client falling more than [max_queued] bytes behind is dropped. *)
+let serve_proxy_client max_queued zh fd =
+  let input = Unix.in_channel_of_descr fd and out = Unix.out_channel_of_descr fd in
+  let lock = Mutex.create () and ready = Condition.create () in
+  let frames = Queue.create () and queued = ref 0 and closed = ref false in
+  let writer =
+    Thread.create (fun () -> serve_proxy_write fd out lock ready frames queued closed) ()
+  in
+  let send kind id code body =
+    let b = Buffer.create 256 in
+    Buffer.add_uint8 b kind;
+    wire_put_int b id;
+    wire_put_int b code;
+    body b;
+    Mutex.lock lock;
+    if not !closed then begin
+      if !queued + Buffer.length b > max_queued then begin
+        (* The reader sees the connection drop and closes it. *)
+        closed := true;
+        Condition.signal ready;
+        (try Unix.shutdown fd Unix.SHUTDOWN_ALL with Unix.Unix_error _ -> ())
+      end else begin
+        Queue.add (Buffer.contents b) frames;
+        queued := !queued + Buffer.length b;
+        Condition.signal ready
+      end
+    end;
+    Mutex.unlock lock
+  in
+  let reply id err body = send 0 id (error_code err) (fun b -> if err = ZOK then body b) in
+  let watcher id _ event state path _ =
+    send 1 id (event_code event) (fun b ->
+        wire_put_int b (state_code state);
+        wire_put_string b path)
+  in
+  let serve id op w =
+    let path = wire_string w in
+    if op = proxy_op_create then begin
+      let value = wire_string w in
+      let acls = wire_array w wire_acl in
+      let flags = create_flags_of_code (wire_int w) in
+      if Array.mem ZOO_EPHEMERAL flags then ZBADARGUMENTS
+      else
+        acreate zh path value acls flags
+          (fun err path _ -> reply id err (fun b -> wire_put_string b path)) ""
+    end else if op = proxy_op_delete then
+      adelete zh path (wire_int w) (fun err _ -> reply id err ignore) ""
+    else if op = proxy_op_exists then begin
+      let completion err stat _ = reply id err (fun b -> wire_put_stat b stat) in
+      if wire_byte w = 0 then aexists zh path 0 completion ""
+      else awexists zh path (watcher id) "" completion ""
+    end else if op = proxy_op_get then begin
+      let completion err value _ stat _ =
+        reply id err (fun b -> wire_put_string b value; wire_put_stat b stat)
+      in
+      if wire_byte w = 0 then aget zh path 0 completion ""
+      else awget zh path (watcher id) "" completion ""
+    end else if op = proxy_op_set then begin
+      let value = wire_string w in
+      aset zh path value (wire_int w)
+        (fun err stat _ -> reply id err (fun b -> wire_put_stat b stat)) ""
+    end else if op = proxy_op_get_children then begin
+      let completion err children _ =
+        reply id err (fun b -> wire_put_array b wire_put_string children)
+      in
+      if wire_byte w = 0 then aget_children zh path 0 completion ""
+      else awget_children zh path (watcher id) "" completion ""
+    end else ZUNIMPLEMENTED
+  in
+  let rec loop () =
+    match wire_receive input with
+    | w ->
+      (match wire_int w with
+       | id ->
+         (match serve id (wire_byte w) w with
+          | ZOK -> ()
+          | err -> reply id err ignore
+          | exception Invalid_argument _ -> reply id ZMARSHALLINGERROR ignore)
+       | exception Invalid_argument _ -> ());
+      loop ()
+    | exception (End_of_file | Sys_error _ | Failure _) -> ()
+  in
+  loop ();
+  (* Completions and watches still pending find the connection closed,
+   * and the writer is done before the descriptor can be reused. *)
+  Mutex.lock lock;
+  closed := true;
+  Condition.signal ready;
+  Mutex.unlock lock;
+  (try Unix.shutdown fd Unix.SHUTDOWN_ALL with Unix.Unix_error _ -> ());
+  Thread.join writer;
+  (try Unix.close fd with Unix.Unix_error _ -> ())
+
+(* Serves the clients connecting to the Unix domain socket [socket],
+ * spreading them over the sessions [zhs] in turn. Returns a function
+ * which stops accepting clients; the connected ones are served until
+ * they disconnect, or until [max_queued] bytes are waiting to be
+ * written to them. *)
+let serve_proxy ?(backlog = 128) ?(max_queued = 16 * 1024 * 1024) socket zhs =
+  if Array.length zhs = 0 then invalid_arg "serve_proxy";
+  ignore_sigpipe ();
+  (try Unix.unlink socket with Unix.Unix_error _ -> ());
+  let listener = Unix.socket Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+  Unix.bind listener (Unix.ADDR_UNIX socket);
+  Unix.chmod socket 0o600;
+  Unix.listen listener backlog;
+  let stopped = ref false and next = ref 0 in
+  let rec accept () =
+    match Unix.accept listener with
+    | fd, _ ->
+      let zh = zhs.(!next mod Array.length zhs) in
+      incr next;
+      ignore (Thread.create (serve_proxy_client max_queued zh) fd);
+      accept ()
+    | exception Unix.Unix_error ((Unix.EINTR | Unix.ECONNABORTED), _, _) when not !stopped ->
+      accept ()
+    | exception Unix.Unix_error _ ->
+      (try Unix.close listener with Unix.Unix_error _ -> ())
+  in
+  ignore (Thread.create accept ());
+  fun () ->
+    stopped := true;
+    (try Unix.shutdown listener Unix.SHUTDOWN_ALL with Unix.Unix_error _ -> ());
+    (try Unix.unlink socket with Unix.Unix_error _ -> ())
+
+type proxy = {
+  proxy_fd: Unix.file_descr;
+  proxy_in: in_channel;
+  proxy_out: out_channel;
+  proxy_lock: Mutex.t;
+  proxy_writer: Mutex.t;
+  mutable proxy_next: int;
+  mutable proxy_closed: bool;
+  proxy_pending: (int, error -> wire -> unit) Hashtbl.t;
+  proxy_watchers: (int, proxy_watcher) Hashtbl.t;
+  proxy_events: (unit -> unit) Queue.t;
+  proxy_event: Condition.t
+}
+
+(* Decodes one frame from the daemon into the action it calls for. *)
+let proxy_frame p =
+  let w = wire_receive p.proxy_in in
+  let kind = wire_byte w in
+  let id = wire_int w in
+  let code = wire_int w in
+  if kind = 0 then begin
+    Mutex.lock p.proxy_lock;
+    let complete = Hashtbl.find_opt p.proxy_pending id in
+    Hashtbl.remove p.proxy_pending id;
+    Mutex.unlock p.proxy_lock;
+    match complete with
+    | Some complete -> fun () -> complete (error_of_code code) w
+    | None -> ignore
+  end else begin
+    let event = event_of_code code in
+    let state = state_of_code (wire_int w) in
+    let path = wire_string w in
+    Mutex.lock p.proxy_lock;
+    (match Hashtbl.find_opt p.proxy_watchers id with
+     | Some watcher ->
+       Queue.add (fun () -> watcher event state path) p.proxy_events;
+       Condition.signal p.proxy_event
+     | None -> ());
+    if event <> ZOO_SESSION_EVENT then Hashtbl.remove p.proxy_watchers id;
+    Mutex.unlock p.proxy_lock;
+    ignore
+  end
+
+(* Runs the watch events of [p] in order, off the reader thread which
+ * completes the calls a watcher may make, until the connection drops
+ * and the events left have run. *)
+let rec proxy_deliver p =
+  Mutex.lock p.proxy_lock;
+  while Queue.is_empty p.proxy_events && not p.proxy_closed do
+    Condition.wait p.proxy_event p.proxy_lock
+  done;
+  let event = Queue.take_opt p.proxy_events in
+  Mutex.unlock p.proxy_lock;
+  match event with
+  | Some event -> (try event () with _ -> ()); proxy_deliver p
+  | None -> ()
+
+(* Dispatches the frames of the daemon until the connection drops, then
+ * fails the requests still pending with ZCONNECTIONLOSS. *)
+let rec proxy_read p =
+  match proxy_frame p with
+  | action -> action (); proxy_read p
+  | exception (End_of_file | Sys_error _ | Failure _ | Invalid_argument _) ->
+    Mutex.lock p.proxy_writer;
+    p.proxy_closed <- true;
+    (try Unix.close p.proxy_fd with Unix.Unix_error _ -> ());
+    Mutex.unlock p.proxy_writer;
+    Mutex.lock p.proxy_lock;
+    let pending = Hashtbl.fold (fun _ complete l -> complete :: l) p.proxy_pending [] in
+    Hashtbl.reset p.proxy_pending;
+    Hashtbl.reset p.proxy_watchers;
+    Condition.broadcast p.proxy_event;
+    Mutex.unlock p.proxy_lock;
+    let empty = {wire = ""; wire_pos = 0} in
+    List.iter (fun complete -> complete ZCONNECTIONLOSS empty) pending
+
+(* Connects to the proxy serving the Unix domain socket [socket], None
+ * if no daemon listens on it. *)
+let proxy_connect socket =
+  ignore_sigpipe ();
+  let fd = Unix.socket Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+  match Unix.connect fd (Unix.ADDR_UNIX socket) with
+  | () ->
+    let p = {
+      proxy_fd = fd;
+      proxy_in = Unix.in_channel_of_descr fd;
+      proxy_out = Unix.out_channel_of_descr fd;
+      proxy_lock = Mutex.create ();
+      proxy_writer = Mutex.create ();
+      proxy_next = 1;
+      proxy_closed = false;
+      proxy_pending = Hashtbl.create 64;
+      proxy_watchers = Hashtbl.create 64;
+      proxy_events = Queue.create ();
+      proxy_event = Condition.create ()
+    } in
+    ignore (Thread.create proxy_read p);
+    ignore (Thread.create proxy_deliver p);
+    Some p
+  | exception Unix.Unix_error _ ->
+    Unix.close fd;
+    None
+
+(* Disconnects from the daemon, failing the requests still pending. *)
+let proxy_close p =
+  Mutex.lock p.proxy_writer;
+  if not p.proxy_closed then
+    (try Unix.shutdown p.proxy_fd Unix.SHUTDOWN_ALL with Unix.Unix_error _ -> ());
+  Mutex.unlock p.proxy_writer
+
+let proxy_put_watch b = function
+  | Some _ -> Buffer.add_uint8 b 1
+  | None -> Buffer.add_uint8 b 0
+
+(* Sends a request and waits for its reply, decoded by [decode] on
+ * ZOK and replaced by [fail] otherwise. *)
+let proxy_call p ?watcher op encode decode fail =
+  await (fun k ->
+      Mutex.lock p.proxy_lock;
+      let id = p.proxy_next in
+      p.proxy_next <- id + 1;
+      Hashtbl.replace p.proxy_pending id (fun err w ->
+          k (if err <> ZOK then fail err
+             else try decode w with Invalid_argument _ -> fail ZMARSHALLINGERROR));
+      (match watcher with
+       | Some watcher -> Hashtbl.replace p.proxy_watchers id watcher
+       | None -> ());
+      Mutex.unlock p.proxy_lock;
+      let b = Buffer.create 256 in
+      wire_put_int b id;
+      Buffer.add_uint8 b op;
+      encode b;
+      Mutex.lock p.proxy_writer;
+      let sent =
+        try not p.proxy_closed && (wire_send p.proxy_out (Buffer.contents b); true)
+        with Sys_error _ -> false
+      in
+      Mutex.unlock p.proxy_writer;
+      if sent then ZOK
+      else begin
+        Mutex.lock p.proxy_lock;
+        Hashtbl.remove p.proxy_pending id;
+        Hashtbl.remove p.proxy_watchers id;
+        Mutex.unlock p.proxy_lock;
+        ZCONNECTIONLOSS
+      end)
+    fail
+
+let proxy_create p path value acls flags =
+  proxy_call p proxy_op_create
+    (fun b ->
+       wire_put_string b path;
+       wire_put_string b value;
+       wire_put_array b wire_put_acl acls;
+       wire_put_int b (create_flags_code flags))
+    (fun w -> ZOK, wire_string w)
+    (fun err -> err, "")
+
+let proxy_delete p path version =
+  proxy_call p proxy_op_delete
+    (fun b -> wire_put_string b path; wire_put_int b version)
+    (fun _ -> ZOK)
+    (fun err -> err)
+
+let proxy_exists ?watcher p path =
+  proxy_call p ?watcher proxy_op_exists
+    (fun b -> wire_put_string b path; proxy_put_watch b watcher)
+    (fun w -> ZOK, wire_stat w)
+    (fun err -> err, empty_stat)
+
+let proxy_get ?watcher p path =
+  proxy_call p ?watcher proxy_op_get
+    (fun b -> wire_put_string b path; proxy_put_watch b watcher)
+    (fun w ->
+       let value = wire_string w in
+       ZOK, value, wire_stat w)
+    (fun err -> err, "", empty_stat)
+
+let proxy_set p path value version =
+  proxy_call p proxy_op_set
+    (fun b -> wire_put_string b path; wire_put_string b value; wire_put_int b version)
+    (fun w -> ZOK, wire_stat w)
+    (fun err -> err, empty_stat)
+
+let proxy_get_children ?watcher p path =
+  proxy_call p ?watcher proxy_op_get_children
+    (fun b -> wire_put_string b path; proxy_put_watch b watcher)
+    (fun w -> ZOK, wire_array w wire_string)
+    (fun err -> err, [||])
+
+(**
+ * Subtree export.
+ *
+ * An export file is a magic string followed by one record per node,
+ * parents first: its path relative to the root exported, "" for the
+ * root itself, then its data, each as a 32-bit big-endian length and
+ * its bytes. Ephemeral nodes, and /zookeeper, are left out.
+ *)
+let export_magic = "ZKOEXP01"
+
+let export_read input =
+  match input_binary_int input with
+  | exception End_of_file -> None
+  | n ->
+    let path = really_input_string input n in
+    let n = input_binary_int input in
+    Some (path, really_input_string input n)
+
+(* Writes the subtree under [root] to [file], walking it with at most
+ * [window] calls in flight: one get per node, and one get_children
+ * per node having children. Returns the first error met, ZNONODE
+ * aside, and the number of nodes written. *)
+let export_subtree ?(window = 256) zh root file =
+  match open_out_bin file with
+  | exception Sys_error _ -> ZSYSTEMERROR, 0
+  | out ->
+    let lock = Mutex.create () and count = ref 0 in
+    let base = if root = "/" then "" else root in
+    let write path value =
+      let rel = if path = root then "" else
+          String.sub path (String.length base) (String.length path - String.length base)
+      in
+      Mutex.lock lock;
+      match
+        output_binary_int out (String.length rel);
+        output_string out rel;
+        output_binary_int out (String.length value);
+        output_string out value
+      with
+      | () -> incr count; Mutex.unlock lock; ZOK
+      | exception Sys_error _ -> Mutex.unlock lock; ZSYSTEMERROR
+    in
+    let tolerant err = if err = ZNONODE then ZOK else err in
+    let err =
+      await (fun k ->
+          let p = pipeline window k in
+          let rec visit path =
+            if path = root || path <> "/zookeeper" then
+              pipeline_submit p @@ fun complete ->
+              aget zh path 0
+                (fun err value _ stat _ ->
+                   match err with
+                   | ZOK when stat.ephemeral_owner = 0L ->
+                     let err = write path value in
+                     if err = ZOK && stat.num_children > 0 then list path;
+                     complete err
+                   | _ -> complete (tolerant err)) ""
+          and list path =
+            pipeline_submit p @@ fun complete ->
+            aget_children zh path 0
+              (fun err children _ ->
+                 if err = ZOK then
+                   Array.iter (fun child ->
+                       visit (child_path path child))
+                     children;
+                 complete (tolerant err)) ""
+          in
+          output_string out export_magic;
+          visit root;
+          pipeline_seal p;
+          ZOK)
+        (fun err -> err)
+    in
+    match close_out out with
+    | () -> err, !count
+    | exception Sys_error _ -> (if err = ZOK then ZSYSTEMERROR else err), !count
+
+(* Creates the nodes exported to [file] under [root] with [acls], in
+ * multi batches split by multi_batches with at most [window] of them
+ * in flight, reading the file as they complete. A batch failing as a
+ * whole, as when one of its nodes exists already, falls back to one
+ * create per node. Returns the first error other than ZNODEEXISTS and
+ * the number of nodes read. *)
+let import_subtree ?(window = 16) ?(max_ops = 1000) ?max_bytes zh file root acls =
+  match open_in_bin file with
+  | exception Sys_error _ -> ZSYSTEMERROR, 0
+  | input ->
+    let count = ref 0 in
+    let base = if root = "/" then "" else root in
+    let tolerant err = if err = ZNODEEXISTS then ZOK else err in
+    let err =
+      await (fun k ->
+          let p = pipeline window k in
+          let create_one path value acls flags =
+            pipeline_submit p @@ fun complete ->
+            acreate zh path value acls flags (fun err _ _ -> complete (tolerant err)) ""
+          in
+          let submit batch =
+            pipeline_throttle p;
+            pipeline_create_batch p zh create_one batch
+          in
+          let rec read ops n =
+            match export_read input with
+            | Some (rel, value) ->
+              incr count;
+              let path = if rel = "" then root else base ^ rel in
+              let ops =
+                if path = "/" then ops else Create_op (path, value, acls, [||]) :: ops
+              in
+              if n + 1 < max_ops then read ops (n + 1)
+              else (List.iter submit (multi_batches ~max_ops ?max_bytes (List.rev ops)); read [] 0)
+            | None -> List.iter submit (multi_batches ~max_ops ?max_bytes (List.rev ops))
+          in
+          (match really_input_string input (String.length export_magic) with
+           | magic when magic = export_magic ->
+             (try read [] 0 with
+              | End_of_file | Invalid_argument _ | Sys_error _ ->
+                pipeline_submit p (fun _ -> ZMARSHALLINGERROR))
+           | _ -> pipeline_submit p (fun _ -> ZBADARGUMENTS)
+           | exception End_of_file -> pipeline_submit p (fun _ -> ZBADARGUMENTS));
+          pipeline_seal p;
+          ZOK)
+        (fun err -> err)
+    in
+    close_in input;
+    err, !count
+
+(**
+ * ZooKeeper data files.
+ *
+ * Offline readers of the snapshot.* and log.* files in the data
+ * directory of a ZooKeeper server, which decode them straight from a
+ * mapping of the file.
+ *)
+
+(* A transaction of a log: the session and the cxid of the request it
+ * applied, its zxid and time, its type, which is the opcode of that
+ * request (1 create, 2 delete, 5 set data, 7 set acl, 15 create2,
+ * -10 create session, -11 close session, -1 error, ...), and for the
+ * transactions on a node its path and the length of the data written.
+ * The transactions of a multi come one by one with its header. *)
+type txn = {
+  txn_session: int64;
+  txn_cxid: int;
+  txn_zxid: int64;
+  txn_time: int64;
+  txn_type: int;
+  txn_path: string;
+  txn_data_length: int
+}
+
+external zk_snapshot_iter:
+     string
+  -> bool
+  -> (string -> string -> stat -> unit)
+  -> error = "zkocaml_zk_snapshot_iter"
+
+external zk_txnlog_iter:
+     string
+  -> (txn -> unit)
+  -> error = "zkocaml_zk_txnlog_iter"
+
+(**
+ * Value codec.
+ *
+ * A value written through the codec starts with a header: the magic
+ * "\000ZKC", its kind and its length. An inline value follows its
+ * header, raw or as an LZ4 block, whichever is smaller. A value
+ * stored larger than a chunk goes to children of its node instead,
+ * "<path>/.chunk-<generation>-<index>", all written before a multi
+ * swaps the header of the node to their generation and deletes the
+ * chunks of the previous one: readers see either value whole, and
+ * there is no ceiling but the chunk count. The generation is the
+ * cversion of the node, which every chunk created or deleted moves
+ * on, so it is never reused. Values without a header read as they
+ * are.
+ *)
+external lz4_compress:
+     string
+  -> string = "zkocaml_lz4_compress"
+
+external lz4_decompress:
+     string
+  -> int
+  -> string option = "zkocaml_lz4_decompress"
+
+type codec_stored =
+  | Stored_plain of string
+  | Stored_inline of bool * int * string
+  | Stored_chunked of bool * int * int * int
+
+let codec_magic = "\000ZKC"
+
+let codec_header kind length =
+  let b = Buffer.create 64 in
+  Buffer.add_string b codec_magic;
+  Buffer.add_uint8 b kind;
+  Buffer.add_int32_be b (Int32.of_int length);
+  b
+
+(* Kinds are 0 raw, 1 compressed, 2 raw chunks, 3 compressed chunks. *)
+let codec_decode value =
+  let n = String.length codec_magic in
+  let field off = Int32.to_int (String.get_int32_be value off) land 0xffffffff in
+  if String.length value < n + 5 || String.sub value 0 n <> codec_magic then Stored_plain value
+  else
+    let kind = String.get_uint8 value n and length = field (n + 1) in
+    match kind with
+    | 0 | 1 -> Stored_inline (kind = 1, length, String.sub value (n + 5) (String.length value - n - 5))
+    | (2 | 3) when String.length value >= n + 13 && field (n + 9) <= max 1 length ->
+      Stored_chunked (kind = 3, length, field (n + 5), field (n + 9))
+    | _ -> Stored_plain value
+
+let codec_chunk path generation index = Printf.sprintf "%s/.chunk-%08x-%d" path generation index
+
+let codec_chunks path = function
+  | Stored_chunked (_, _, generation, count) ->
+    List.init count (fun i -> Delete_op (codec_chunk path generation i, -1))
+  | _ -> []
+
+let codec_value compressed length stored =
+  if not compressed then Some stored else lz4_decompress stored length
+
+(* Reads the value of [path] written through the codec, fetching its
+ * chunks with pipelined gets, again if they were replaced meanwhile.
+ * The stat is the one of the node, its data length the one stored. *)
+let rec codec_get ?(attempts = 3) zh path =
+  let err, value, stat = get zh path 0 in
+  let decoded = function
+    | Some value -> ZOK, value, stat
+    | None -> ZMARSHALLINGERROR, "", stat
+  in
+  if err <> ZOK then err, "", stat
+  else match codec_decode value with
+    | Stored_plain value -> ZOK, value, stat
+    | Stored_inline (compressed, length, stored) ->
+      decoded (codec_value compressed length stored)
+    | Stored_chunked (compressed, length, generation, count) ->
+      let chunks = Array.make count "" in
+      let err =
+        await (fun k ->
+            let p = pipeline 16 k in
+            for i = 0 to count - 1 do
+              pipeline_submit p @@ fun complete ->
+              aget zh (codec_chunk path generation i) 0
+                (fun err value _ _ _ ->
+                   if err = ZOK then chunks.(i) <- value;
+                   complete err) ""
+            done;
+            pipeline_seal p;
+            ZOK)
+          (fun err -> err)
+      in
+      match err with
+      | ZOK -> decoded (codec_value compressed length (String.concat "" (Array.to_list chunks)))
+      | ZNONODE when attempts > 1 -> codec_get ~attempts:(attempts - 1) zh path
+      | err -> err, "", stat
+
+(* Writes [value] to the existing node [path] if its version matches
+ * [version], -1 matching any; compressed unless [compress] is false,
+ * and split into chunks of [chunk_size] bytes if it stores larger.
+ * Chunks take the ACL of the node; ephemeral nodes cannot have any. *)
+let codec_set ?(compress = true) ?(chunk_size = 512 * 1024) zh path value version =
+  let compressed, stored =
+    if not compress then false, value
+    else
+      let c = lz4_compress value in
+      if String.length c < String.length value then true, c else false, value
+  in
+  let kind = if compressed then 1 else 0 in
+  let err, current, stat = get zh path 0 in
+  if err <> ZOK then err
+  else if version <> -1 && version <> stat.version then ZBADVERSION
+  else
+    let stale = codec_chunks path (codec_decode current) in
+    if String.length stored <= chunk_size then begin
+      let b = codec_header kind (String.length value) in
+      Buffer.add_string b stored;
+      if stale = [] then set zh path (Buffer.contents b) stat.version
+      else fst (multi zh (Array.of_list (Set_op (path, Buffer.contents b, stat.version) :: stale)))
+    end else begin
+      let count = (String.length stored + chunk_size - 1) / chunk_size in
+      let generation = stat.cversion land 0xffffffff in
+      let created = Array.make count false in
+      let err, acls, _ = get_acl zh path in
+      let err =
+        if err <> ZOK then err
+        else
+          await (fun k ->
+              let p = pipeline 16 k in
+              for i = 0 to count - 1 do
+                let off = i * chunk_size in
+                let chunk = String.sub stored off (min chunk_size (String.length stored - off)) in
+                pipeline_submit p @@ fun complete ->
+                acreate zh (codec_chunk path generation i) chunk acls [||]
+                  (fun err _ _ -> created.(i) <- err = ZOK; complete err) ""
+              done;
+              pipeline_seal p;
+              ZOK)
+            (fun err -> err)
+      in
+      let b = codec_header (kind + 2) (String.length value) in
+      Buffer.add_int32_be b (Int32.of_int generation);
+      Buffer.add_int32_be b (Int32.of_int count);
+      let err =
+        if err <> ZOK then err
+        else fst (multi zh (Array.of_list (Set_op (path, Buffer.contents b, stat.version) :: stale)))
+      in
+      (* Chunks of a concurrent writer of the same generation stay. *)
+      if err <> ZOK then
+        Array.iteri (fun i created ->
+            if created then
+              ignore (adelete zh (codec_chunk path generation i) (-1) (fun _ _ -> ()) ""))
+          created;
+      err
+    end
+
+(* Creates [path] and writes [value] to it through the codec. *)
+let codec_create ?compress ?chunk_size zh path value acls flags =
+  let err, created = create zh path "" acls flags in
+  if err <> ZOK then err, created
+  else codec_set ?compress ?chunk_size zh created value 0, created
+
+(* Deletes [path] with its chunks if its version matches [version]. *)
+let codec_delete zh path version =
+  let err, current, stat = get zh path 0 in
+  if err <> ZOK then err
+  else if version <> -1 && version <> stat.version then ZBADVERSION
+  else
+    match codec_chunks path (codec_decode current) with
+    | [] -> delete zh path stat.version
+    | chunks -> fst (multi zh (Array.of_list (chunks @ [Delete_op (path, stat.version)])))
+
+(**
+ * Decoded-value caches.
+ *
+ * Caches the values of nodes decoded by the decoder registered for
+ * the longest prefix of their path. A watch keeps every cached value
+ * current: a change fetches the node again and decodes it only if its
+ * mzxid moved, a deletion or the expiry of the session drops it, and
+ * so does a value failing to decode. A path has one watch at most,
+ * however often it is fetched. A lookup of a cached value costs
+ * neither a round trip nor a decode.
+ *)
+type 'a decoded = {
+  decoded_value: 'a;
+  decoded_mzxid: int64;
+  mutable decoded_fresh: bool
+}
+
+type 'a decoded_cache = {
+  dc_zh: zhandle;
+  dc_lock: Mutex.t;
+  mutable dc_decoders: (string * (string -> 'a)) list;
+  dc_entries: (string, 'a decoded) Hashtbl.t;
+  dc_armed: (string, unit) Hashtbl.t
+}
+
+let decoded_cache zh = {
+  dc_zh = zh;
+  dc_lock = Mutex.create ();
+  dc_decoders = [];
+  dc_entries = Hashtbl.create 64;
+  dc_armed = Hashtbl.create 64
+}
+
+let register_decoder c prefix decode =
+  locked c.dc_lock (fun () ->
+      c.dc_decoders <- (prefix, decode) :: List.remove_assoc prefix c.dc_decoders)
+
+let decoder_for c path =
+  let n = String.length path in
+  List.fold_left (fun best (prefix, decode) ->
+      let m = String.length prefix in
+      if m > n || String.sub path 0 m <> prefix then best
+      else match best with
+        | Some (l, _) when l >= m -> best
+        | _ -> Some (m, decode))
+    None c.dc_decoders
+
+(* Fetches [path], with a watch unless one is armed already, and
+ * decodes it unless its mzxid is the one cached, then calls [complete]
+ * with the value. *)
+let rec decoded_load c path complete =
+  let arming =
+    locked c.dc_lock (fun () ->
+        not (Hashtbl.mem c.dc_armed path) && (Hashtbl.replace c.dc_armed path (); true))
+  in
+  (* A get failing sets no watch. *)
+  let disarm () =
+    if arming then locked c.dc_lock (fun () -> Hashtbl.remove c.dc_armed path)
+  in
+  let completion err value _ stat _ =
+    if err <> ZOK then disarm ();
+    let cached =
+      locked c.dc_lock (fun () ->
+          match err, Hashtbl.find_opt c.dc_entries path with
+          | ZOK, Some e when e.decoded_mzxid = stat.mzxid ->
+            e.decoded_fresh <- true;
+            Some e.decoded_value
+          | ZNONODE, _ -> Hashtbl.remove c.dc_entries path; None
+          | _ -> None)
+    in
+    match err, cached, decoder_for c path with
+    | ZOK, Some v, _ -> complete ZOK (Some v)
+    | ZOK, None, Some (_, decode) ->
+      (match decode value with
+       | v ->
+         locked c.dc_lock (fun () ->
+             Hashtbl.replace c.dc_entries path
+               {decoded_value = v; decoded_mzxid = stat.mzxid; decoded_fresh = true});
+         complete ZOK (Some v)
+       | exception _ ->
+         locked c.dc_lock (fun () -> Hashtbl.remove c.dc_entries path);
+         complete ZMARSHALLINGERROR None)
+    | ZOK, None, None -> complete ZBADARGUMENTS None
+    | err, _, _ -> complete err None
+  in
+  let err =
+    if arming then awget c.dc_zh path (decoded_watcher c) "" completion ""
+    else aget c.dc_zh path 0 completion ""
+  in
+  if err <> ZOK then disarm ();
+  err
+
+and decoded_watcher c _ event state path _ =
+  let fired f = locked c.dc_lock (fun () -> Hashtbl.remove c.dc_armed path; f ()) in
+  match event with
+  | ZOO_CHANGED_EVENT ->
+    fired (fun () ->
+        match Hashtbl.find_opt c.dc_entries path with
+        | Some e -> e.decoded_fresh <- false
+        | None -> ());
+    ignore (decoded_load c path (fun _ _ -> ()))
+  | ZOO_DELETED_EVENT | ZOO_NOTWATCHING_EVENT ->
+    fired (fun () -> Hashtbl.remove c.dc_entries path)
+  | ZOO_SESSION_EVENT when state = ZOO_EXPIRED_SESSION_STATE ->
+    fired (fun () -> Hashtbl.remove c.dc_entries path)
+  | _ -> ()
+
+let decoded_aget c path completion =
+  let cached =
+    locked c.dc_lock (fun () ->
+        match Hashtbl.find_opt c.dc_entries path with
+        | Some e when e.decoded_fresh -> Some e.decoded_value
+        | _ -> None)
+  in
+  match cached with
+  | Some v -> completion ZOK (Some v); ZOK
+  | None ->
+    match decoder_for c path with
+    | Some _ -> decoded_load c path completion
+    | None -> ZBADARGUMENTS
+
+let decoded_get c path =
+  await (fun k -> decoded_aget c path (fun err v -> k (err, v))) (fun err -> err, None)
+
+(**
+ * Write batchers.
+ *
+ * A write batcher gathers the writes submitted to it for a window, or
+ * until it holds max_ops of them, and flushes them as multi batches
+ * split by multi_batches, delivering every write its own result. An
+ * unversioned set to a path whose last pending write is one too takes
+ * its place, and both get the result of the last value. Batching does
+ * not change the result of a write: a multi fails as a whole, so the
+ * writes of a failed batch other than the one failing it are submitted
+ * again, in order. The batches of a batcher go out one at a time, and
+ * a flush after the ones still running, so that the writes submitted
+ * again come before any later one.
+ *)
+type batched = {
+  mutable batched_op: multi_op;
+  mutable batched_completions: (op_result -> unit) list
+}
+
+type write_batcher = {
+  wb_zh: zhandle;
+  wb_lock: Mutex.t;
+  wb_max_ops: int;
+  mutable wb_pending: batched list;
+  mutable wb_count: int;
+  wb_last: (string, batched) Hashtbl.t;
+  mutable wb_queue: batched list;
+  mutable wb_flushing: bool;
+  mutable wb_closed: bool
+}
+
+let batched_failed err = {op_error = err; op_path = ""; op_stat = empty_stat}
+
+let batched_deliver e result = List.iter (fun k -> k result) (List.rev e.batched_completions)
+
+(* Submits the first batch of the queue, if any, once the previous one
+ * completed. *)
+let rec batcher_next b =
+  Mutex.lock b.wb_lock;
+  let part =
+    match multi_batches (List.map (fun e -> e.batched_op) b.wb_queue) with
+    | [] -> b.wb_flushing <- false; [||]
+    | batch :: _ ->
+      let rec split n queue =
+        match n, queue with
+        | 0, _ | _, [] -> [], queue
+        | n, e :: queue -> let part, rest = split (n - 1) queue in e :: part, rest
+      in
+      let part, rest = split (Array.length batch) b.wb_queue in
+      b.wb_queue <- rest;
+      Array.of_list part
+  in
+  Mutex.unlock b.wb_lock;
+  if Array.length part > 0 then begin
+    let complete err results _ = batcher_complete b part err results in
+    match amulti b.wb_zh (Array.map (fun e -> e.batched_op) part) complete "" with
+    | ZOK -> ()
+    | err -> complete err [||] ""
+  end
+
+and batcher_complete b part err results =
+  let rolled_back result =
+    match result.op_error with
+    | ZOK | ZRUNTIMEINCONSISTENCY -> true
+    | _ -> false
+  in
+  let settled, again =
+    if Array.length results <> Array.length part || Array.for_all rolled_back results then
+      Array.to_list (Array.map (fun e -> e, batched_failed err) part), []
+    else if err = ZOK then
+      Array.to_list (Array.mapi (fun i e -> e, results.(i)) part), []
+    else
+      let settled, again =
+        List.partition (fun (_, result) -> not (rolled_back result))
+          (Array.to_list (Array.mapi (fun i e -> e, results.(i)) part))
+      in
+      settled, List.map fst again
+  in
+  Mutex.lock b.wb_lock;
+  b.wb_queue <- again @ b.wb_queue;
+  Mutex.unlock b.wb_lock;
+  (* A raising completion must not stall the writes behind it. *)
+  match List.iter (fun (e, result) -> batched_deliver e result) settled with
+  | () -> batcher_next b
+  | exception exn -> batcher_next b; raise exn
+
+let batcher_flush b =
+  Mutex.lock b.wb_lock;
+  b.wb_queue <- b.wb_queue @ List.rev b.wb_pending;
+  b.wb_pending <- [];
+  b.wb_count <- 0;
+  Hashtbl.reset b.wb_last;
+  let start = not b.wb_flushing && b.wb_queue <> [] in
+  if start then b.wb_flushing <- true;
+  Mutex.unlock b.wb_lock;
+  if start then batcher_next b
+
+let batcher_close b =
+  Mutex.lock b.wb_lock;
+  b.wb_closed <- true;
+  Mutex.unlock b.wb_lock;
+  batcher_flush b
+
+(* Flushes the writes of [zh] submitted to the batcher every [window]
+ * seconds, or once it holds [max_ops] of them. *)
+let write_batcher ?(window = 0.01) ?(max_ops = 1000) zh =
+  let b = {
+    wb_zh = zh;
+    wb_lock = Mutex.create ();
+    wb_max_ops = max_ops;
+    wb_pending = [];
+    wb_count = 0;
+    wb_last = Hashtbl.create 64;
+    wb_queue = [];
+    wb_flushing = false;
+    wb_closed = false
+  } in
+  let rec flush () =
+    Thread.delay window;
+    if not b.wb_closed then begin
+      batcher_flush b;
+      flush ()
+    end
+  in
+  ignore (Thread.create flush ());
+  b
+
+let batched_write b path op completion =
+  Mutex.lock b.wb_lock;
+  let closed = b.wb_closed in
+  if not closed then begin
+    match op, Hashtbl.find_opt b.wb_last path with
+    | Set_op (_, _, -1), Some ({batched_op = Set_op (_, _, -1); _} as e) ->
+      e.batched_op <- op;
+      e.batched_completions <- completion :: e.batched_completions
+    | _ ->
+      let e = {batched_op = op; batched_completions = [completion]} in
+      b.wb_pending <- e :: b.wb_pending;
+      b.wb_count <- b.wb_count + 1;
+      Hashtbl.replace b.wb_last path e
+  end;
+  let full = b.wb_count >= b.wb_max_ops in
+  Mutex.unlock b.wb_lock;
+  if closed then completion (batched_failed ZCLOSING)
+  else if full then batcher_flush b
+
+let batched_set b path value version completion =
+  batched_write b path (Set_op (path, value, version)) completion
+
+let batched_create b path value acls flags completion =
+  batched_write b path (Create_op (path, value, acls, flags)) completion
+
+let batched_delete b path version completion =
+  batched_write b path (Delete_op (path, version)) completion
+
+(**
+ * Direct-style calls for cooperative schedulers.
+ *
+ * Direct (S) makes the async calls read like the sync ones to a fiber:
+ * each call suspends the calling fiber until its completion resumes
+ * it, so that many fibers share a handle without a system thread of
+ * their own. With Eio, for instance:
+ *
+ *   module Zk = Zookeeper.Direct (struct
+ *     let suspend register =
+ *       let p, r = Eio.Promise.create () in
+ *       register (fun v -> ignore (Eio.Promise.try_resolve r v));
+ *       Eio.Promise.await p
+ *   end)
+ *
+ * A fiber cancelled while suspended, by the failure of its switch say,
+ * leaves its request to complete unobserved: zookeeper requests
+ * cannot be withdrawn once sent. Direct (Thread_suspend) blocks the
+ * calling thread instead, as the sync calls do.
+ **)
+module Direct (S : SUSPEND) = struct
+  include Suspended (S)
+
+  let create ?timeout zh path value acls flags =
+    call
+      (fun k -> acreate ?timeout zh path value acls flags (fun err path _ -> k (err, path)) "")
+      (fun err -> err, "")
+
+  let delete ?timeout zh path version =
+    call
+      (fun k -> adelete ?timeout zh path version (fun err _ -> k err) "")
+      (fun err -> err)
+
+  let exists ?timeout zh path watch =
+    call
+      (fun k -> aexists ?timeout zh path watch (fun err stat _ -> k (err, stat)) "")
+      (fun err -> err, empty_stat)
+
+  let get ?timeout zh path watch =
+    call
+      (fun k -> aget ?timeout zh path watch (fun err value _ stat _ -> k (err, value, stat)) "")
+      (fun err -> err, "", empty_stat)
+
+  let set ?timeout zh path value version =
+    call
+      (fun k -> aset ?timeout zh path value version (fun err _ _ -> k err) "")
+      (fun err -> err)
+
+  let get_children ?timeout zh path watch =
+    call
+      (fun k -> aget_children ?timeout zh path watch (fun err children _ -> k (err, children)) "")
+      (fun err -> err, [||])
+
+  let get_children2 ?timeout zh path watch =
+    call
+      (fun k -> aget_children2 ?timeout zh path watch (fun err children stat _ -> k (err, children, stat)) "")
+      (fun err -> err, [||], empty_stat)
+
+  let get_acl ?timeout zh path =
+    call
+      (fun k -> aget_acl ?timeout zh path (fun err acls stat _ -> k (err, acls, stat)) "")
+      (fun err -> err, [||], empty_stat)
+
+  let set_acl ?timeout zh path version acls =
+    call
+      (fun k -> aset_acl ?timeout zh path version acls (fun err _ -> k err) "")
+      (fun err -> err)
+
+  let multi ?timeout zh ops =
+    call
+      (fun k -> amulti ?timeout zh ops (fun err results _ -> k (err, results)) "")
+      (fun err -> err, [||])
+
+  let sync ?timeout zh path =
+    call
+      (fun k -> async ?timeout zh path (fun err _ _ -> k err) "")
+      (fun err -> err)
+end
+
+external intern_path:
+     string
+  -> path = "zkocaml_path_intern"
+
+external path_name:
+     path
+  -> string = "zkocaml_path_name"
+
+let aexists_path = aexists
+let awexists_path = awexists
+let aget_path = aget
+let awget_path = awget
+let aset_path = aset
+let exists_path = exists
+let wexists_path = wexists
+let get_path = get
+let wget_path = wget
+let set_path = set
@@ -2,6 +2,7 @@ type zhandle
 type client_id = { client_id : int64; passwd : string; }
 type acl = { perms : int; scheme : string; id : string; }
 type acls = acl array
+type acl_handle
 type strings = string array
 type stat = {
   czxid : int64;
@@ -41,6 +42,11 @@ type error =
   | ZCLOSING
   | ZNOTHING
   | ZSESSIONMOVED
+  | ZTHROTTLEDOP
+  | ZNEWCONFIGNOQUORUM
+  | ZRECONFIGINPROGRESS
+  | ZRECONFIGDISABLED
+  | ZNOTREADONLY
 type event =
     ZOO_CREATED_EVENT
   | ZOO_DELETED_EVENT
@@ -61,94 +67,317 @@ type state =
   | ZOO_CONNECTING_STATE
   | ZOO_ASSOCIATING_STATE
   | ZOO_CONNECTED_STATE
-type create_flag = ZOO_EPHEMERAL | ZOO_SEQUENCE
+  | ZOO_READONLY_STATE
+type create_flag = ZOO_EPHEMERAL | ZOO_SEQUENCE | ZOO_CONTAINER
+type backpressure = Block | Reject | Queue of int
+type window_stats = {
+  max_inflight : int;
+  inflight : int;
+  submitted : int;
+  completed : int;
+  throttled : int;
+  queued : int;
+}
+type dispatch_queue
+type dispatch_stats = { routed : int; dispatched : int; pending : int; }
+type retry_policy = {
+  max_attempts : int;
+  base_delay : float;
+  max_delay : float;
+  budget : int;
+}
+type retry_op =
+    Op_get
+  | Op_exists
+  | Op_get_children
+  | Op_get_acl
+  | Op_set
+  | Op_delete
+  | Op_set_acl
+  | Op_sync
+type retry_stats = { retries : int; given_up : int; }
 type log_level =
     ZOO_LOG_LEVEL_ERROR
   | ZOO_LOG_LEVEL_WARN
   | ZOO_LOG_LEVEL_INFO
   | ZOO_LOG_LEVEL_DEBUG
-type watcher_callback = zhandle -> event -> state -> string -> string -> unit
+type 'p watcher = zhandle -> event -> state -> 'p -> string -> unit
+type watcher_callback = string watcher
+type path
+type path_watcher_callback = path watcher
+type watch_event = {
+  event : event;
+  state : state;
+  path : string;
+  watcher_ctx : string;
+}
+type batch_watcher_callback = zhandle -> watch_event array -> unit
 type void_completion_callback = error -> string -> unit
 type stat_completion_callback = error -> stat -> string -> unit
 type data_completion_callback = error -> string -> int -> stat -> string -> unit
 type strings_completion_callback = error -> strings -> string -> unit
 type strings_stat_completion_callback = error -> strings -> stat -> string -> unit
 type string_completion_callback = error -> string -> string -> unit
+type string_stat_completion_callback = error -> string -> stat -> string -> unit
 type acl_completion_callback = error -> acls -> stat -> string -> unit
+type multi_op =
+    Create_op of string * string * acls * create_flag array
+  | Delete_op of string * int
+  | Set_op of string * string * int
+  | Check_op of string * int
+type op_result = { op_error : error; op_path : string; op_stat : stat; }
+type multi_completion_callback = error -> op_result array -> string -> unit
 
 val show_error : error -> string
 val show_event : event -> string
 val show_state : state -> string
 
+val zoo_readonly : int
 val init :
   string -> watcher_callback -> int -> client_id -> string -> int -> zhandle
   (* = "zkocaml_init_bytecode" "zkocaml_init_native" *)
-val close : zhandle -> error
-  (* = "zkocaml_close" *)
+external close : zhandle -> error = "zkocaml_close"
+external close_async : zhandle -> (error -> unit) -> unit = "zkocaml_close_async"
+external namespace : zhandle -> string -> zhandle = "zkocaml_namespace"
+external namespace_prefix : zhandle -> string = "zkocaml_namespace_prefix"
 external client_id : zhandle -> client_id = "zkocaml_client_id"
 external recv_timeout : zhandle -> int = "zkocaml_recv_timeout"
 external get_context : zhandle -> string = "zkocaml_get_context"
 external set_context : zhandle -> string -> unit = "zkocaml_set_context"
-(* external set_watcher : zhandle -> watcher_callback -> watcher_callback = "zkocaml_set_watcher" *)
-(* external get_connected_host : zhandle -> string = "zkocaml_get_connected_host" *)
+external set_watcher : zhandle -> watcher_callback -> watcher_callback = "zkocaml_set_watcher"
+val set_batch_watcher :
+  ?window:float -> ?coalesce:bool -> zhandle -> batch_watcher_callback option -> error
+  (* = "zkocaml_set_batch_watcher" *)
+external get_connected_host : zhandle -> string = "zkocaml_get_connected_host"
+external set_servers : zhandle -> string -> error = "zkocaml_set_servers"
+external get_current_server : zhandle -> string = "zkocaml_get_current_server"
 external zstate : zhandle -> state = "zkocaml_state"
-external acreate :
-  zhandle -> string -> string -> acls -> create_flag array -> string_completion_callback -> string -> error
-  = "zkocaml_acreate_bytecode" "zkocaml_acreate_native"
-external adelete :
-  zhandle -> string -> int -> void_completion_callback -> string -> error
-  = "zkocaml_adelete"
-external aexists :
-  zhandle -> string -> int -> stat_completion_callback -> string -> error
-  = "zkocaml_aexists"
-external awexists :
-  zhandle -> string -> watcher_callback -> string -> stat_completion_callback -> string -> error
-  = "zkocaml_awexists_native" "zkocaml_awexists_bytecode"
-external aget :
-  zhandle -> string -> int -> data_completion_callback -> string -> error
-  = "zkocaml_aget"
-external awget :
-  zhandle -> string -> watcher_callback -> string -> data_completion_callback -> string -> error
-  = "zkocaml_awget_native" "zkocaml_awget_bytecode"
-external aset :
-  zhandle -> string -> string -> int -> stat_completion_callback -> string -> error
-  = "zkocaml_aset_native" "zkocaml_aset_bytecode"
-external aget_children :
-  zhandle -> string -> int -> strings_completion_callback -> string -> error
-  = "zkocaml_aget_children"
-external awget_children :
-  zhandle -> string -> watcher_callback -> string -> strings_completion_callback -> string -> error
-  = "zkocaml_awget_children_native" "zkocaml_awget_children_bytecode"
-external aget_children2 :
-  zhandle -> string -> int -> strings_stat_completion_callback -> string -> error
-  = "zkocaml_aget_children2"
-external awget_children2 :
-  zhandle -> string -> watcher_callback -> string -> strings_stat_completion_callback -> string -> error
-  = "zkocaml_awget_children2_native" "zkocaml_awget_children2_bytecode"
-external async :
-  zhandle -> string -> string_completion_callback -> string -> error = "zkocaml_async"
-external aset_acl :
-  zhandle -> string -> int -> acls -> acl_completion_callback -> string -> error
-  = "zkocaml_aset_acl_native" "zkocaml_aset_acl_bytecode"
-external aget_acl :
-  zhandle -> string -> acl_completion_callback -> string -> error = "zkocaml_aget_acl"
+val is_readonly : zhandle -> bool
+val read_handle : zhandle -> zhandle -> zhandle
+external watch_count : zhandle -> string -> int = "zkocaml_watch_count"
+external set_coalescing : zhandle -> bool -> unit = "zkocaml_set_coalescing"
+external set_max_inflight : zhandle -> int -> backpressure -> unit = "zkocaml_set_max_inflight"
+external window_stats : zhandle -> window_stats = "zkocaml_window_stats"
+external dispatch_queue : unit -> dispatch_queue = "zkocaml_route_create"
+external set_dispatch_queue : zhandle -> dispatch_queue option -> unit = "zkocaml_set_route"
+external run_dispatch_queue : dispatch_queue -> int -> int = "zkocaml_route_run"
+external close_dispatch_queue : dispatch_queue -> unit = "zkocaml_route_close"
+external dispatch_stats : dispatch_queue -> dispatch_stats = "zkocaml_route_stats"
+val drive_dispatch_queue : dispatch_queue -> unit
+external set_retry_policy : zhandle -> retry_policy -> unit = "zkocaml_set_retry_policy"
+external retry_stats : zhandle -> retry_op -> retry_stats = "zkocaml_retry_stats"
+val acreate :
+  ?timeout:float -> zhandle -> string -> string -> acls -> create_flag array -> string_completion_callback -> string -> error
+  (* = "zkocaml_acreate_bytecode" "zkocaml_acreate_native" *)
+external acl_handle : acls -> acl_handle = "zkocaml_acl_handle"
+external acl_handle_acls : acl_handle -> acls = "zkocaml_acl_handle_acls"
+val acreate_prepared :
+  ?timeout:float -> zhandle -> string -> string -> acl_handle -> create_flag array -> string_completion_callback -> string -> error
+  (* = "zkocaml_acreate_prepared_bytecode" "zkocaml_acreate_prepared_native" *)
+val acreate2 :
+  ?timeout:float -> ?ttl:int64 -> zhandle -> string -> string -> acls -> create_flag array -> string_stat_completion_callback -> string -> error
+  (* = "zkocaml_acreate2_bytecode" "zkocaml_acreate2_native" *)
+val adelete :
+  ?timeout:float -> zhandle -> string -> int -> void_completion_callback -> string -> error
+  (* = "zkocaml_adelete" *)
+val amulti :
+  ?timeout:float -> zhandle -> multi_op array -> multi_completion_callback -> string -> error
+  (* = "zkocaml_amulti" *)
+val multi_batches : ?max_ops:int -> ?max_bytes:int -> multi_op list -> multi_op array list
+val aexists :
+  ?timeout:float -> zhandle -> string -> int -> stat_completion_callback -> string -> error
+  (* = "zkocaml_aexists" *)
+val awexists :
+  ?timeout:float -> zhandle -> string -> watcher_callback -> string -> stat_completion_callback -> string -> error
+  (* = "zkocaml_awexists_bytecode" "zkocaml_awexists_native" *)
+val aget :
+  ?timeout:float -> zhandle -> string -> int -> data_completion_callback -> string -> error
+  (* = "zkocaml_aget" *)
+val awget :
+  ?timeout:float -> zhandle -> string -> watcher_callback -> string -> data_completion_callback -> string -> error
+  (* = "zkocaml_awget_bytecode" "zkocaml_awget_native" *)
+val aset :
+  ?timeout:float -> zhandle -> string -> string -> int -> stat_completion_callback -> string -> error
+  (* = "zkocaml_aset_bytecode" "zkocaml_aset_native" *)
+val aget_children :
+  ?timeout:float -> zhandle -> string -> int -> strings_completion_callback -> string -> error
+  (* = "zkocaml_aget_children" *)
+val awget_children :
+  ?timeout:float -> zhandle -> string -> watcher_callback -> string -> strings_completion_callback -> string -> error
+  (* = "zkocaml_awget_children_bytecode" "zkocaml_awget_children_native" *)
+val aget_children2 :
+  ?timeout:float -> zhandle -> string -> int -> strings_stat_completion_callback -> string -> error
+  (* = "zkocaml_aget_children2" *)
+val awget_children2 :
+  ?timeout:float -> zhandle -> string -> watcher_callback -> string -> strings_stat_completion_callback -> string -> error
+  (* = "zkocaml_awget_children2_bytecode" "zkocaml_awget_children2_native" *)
+val async :
+  ?timeout:float -> zhandle -> string -> string_completion_callback -> string -> error
+  (* = "zkocaml_async" *)
+val aset_acl :
+  ?timeout:float -> zhandle -> string -> int -> acls -> void_completion_callback -> string -> error
+  (* = "zkocaml_aset_acl_bytecode" "zkocaml_aset_acl_native" *)
+val aset_acl_prepared :
+  ?timeout:float -> zhandle -> string -> int -> acl_handle -> void_completion_callback -> string -> error
+  (* = "zkocaml_aset_acl_prepared_bytecode" "zkocaml_aset_acl_prepared_native" *)
+val aget_acl :
+  ?timeout:float -> zhandle -> string -> acl_completion_callback -> string -> error
+  (* = "zkocaml_aget_acl" *)
+val agetconfig :
+  ?timeout:float -> zhandle -> int -> data_completion_callback -> string -> error
+  (* = "zkocaml_agetconfig" *)
+val areconfig :
+  ?timeout:float -> zhandle -> string -> string -> string -> int64 -> data_completion_callback -> string -> error
+  (* = "zkocaml_areconfig_bytecode" "zkocaml_areconfig_native" *)
 (* external zerror : int -> string = "zkocaml_zerror" *)
 external add_auth : zhandle -> string -> string -> void_completion_callback -> string -> error = "zkocaml_add_auth"
 external set_debug_level : log_level -> unit = "zkocaml_set_debug_level"
 external set_log_stream : string -> unit = "zkocaml_set_log_stream"
 external is_unrecoverable : zhandle -> error = "zkocaml_is_unrecoverable"
 external deterministic_conn_order : bool -> unit  = "zkocaml_deterministic_conn_order"
-external create : zhandle -> string -> string -> acls -> create_flag array -> error * string = "zkocaml_create"
-external delete : zhandle -> string -> int -> error = "zkocaml_delete"
-external exists : zhandle -> string -> int -> error * stat = "zkocaml_exists"
-external wexists : zhandle -> string -> watcher_callback -> string -> error * stat = "zkocaml_wexists"
-external get : zhandle -> string -> int -> error * string * stat = "zkocaml_get"
-external wget : zhandle -> string -> watcher_callback -> string -> error * string * stat = "zkocaml_wget"
-external set : zhandle -> string -> string -> int -> error = "zkocaml_set"
-external set2 : zhandle -> string -> string -> int -> error * stat = "zkocaml_set2"
-external get_children : zhandle -> string -> int -> error * strings = "zkocaml_get_children"
-external wget_children : zhandle -> string -> watcher_callback -> string -> error * strings = "zkocaml_wget_children"
-external get_children2 : zhandle -> string -> int -> error * strings * stat = "zkocaml_get_children2"
-external wget_children2 : zhandle -> string -> watcher_callback -> string -> error * strings * stat = "zkocaml_wget_children2"
-external get_acl : zhandle -> string -> error * acls * stat = "zkocaml_get_acl"
-external set_acl : zhandle -> string -> int -> acls -> error = "zkocaml_set_acl"
+val create : ?timeout:float -> zhandle -> string -> string -> acls -> create_flag array -> error * string
+  (* = "zkocaml_create" *)
+val create_prepared : ?timeout:float -> zhandle -> string -> string -> acl_handle -> create_flag array -> error * string
+  (* = "zkocaml_create_prepared" *)
+val create2 : ?timeout:float -> ?ttl:int64 -> zhandle -> string -> string -> acls -> create_flag array -> error * string * stat
+  (* = "zkocaml_create2_bytecode" "zkocaml_create2_native" *)
+val delete : ?timeout:float -> zhandle -> string -> int -> error
+  (* = "zkocaml_delete" *)
+val multi : ?timeout:float -> zhandle -> multi_op array -> error * op_result array
+  (* = "zkocaml_multi" *)
+val exists : ?timeout:float -> zhandle -> string -> int -> error * stat
+  (* = "zkocaml_exists" *)
+val wexists : ?timeout:float -> zhandle -> string -> watcher_callback -> string -> error * stat
+  (* = "zkocaml_wexists" *)
+val get : ?timeout:float -> zhandle -> string -> int -> error * string * stat
+  (* = "zkocaml_get" *)
+val wget : ?timeout:float -> zhandle -> string -> watcher_callback -> string -> error * string * stat
+  (* = "zkocaml_wget" *)
+val set : ?timeout:float -> zhandle -> string -> string -> int -> error
+  (* = "zkocaml_set" *)
+val set2 : ?timeout:float -> zhandle -> string -> string -> int -> error * stat
+  (* = "zkocaml_set2" *)
+val get_children : ?timeout:float -> zhandle -> string -> int -> error * strings
+  (* = "zkocaml_get_children" *)
+val wget_children : ?timeout:float -> zhandle -> string -> watcher_callback -> string -> error * strings
+  (* = "zkocaml_wget_children" *)
+val get_children2 : ?timeout:float -> zhandle -> string -> int -> error * strings * stat
+  (* = "zkocaml_get_children2" *)
+val wget_children2 : ?timeout:float -> zhandle -> string -> watcher_callback -> string -> error * strings * stat
+  (* = "zkocaml_wget_children2" *)
+val get_acl : ?timeout:float -> zhandle -> string -> error * acls * stat
+  (* = "zkocaml_get_acl" *)
+val getconfig : ?timeout:float -> zhandle -> int -> error * string * stat
+  (* = "zkocaml_getconfig" *)
+val reconfig : ?timeout:float -> zhandle -> string -> string -> string -> int64 -> error * string * stat
+  (* = "zkocaml_reconfig" *)
+val servers_of_config : string -> string
+val follow_config : ?on_change:(string -> error -> unit) -> zhandle -> error
+val set_acl : ?timeout:float -> zhandle -> string -> int -> acls -> error
+  (* = "zkocaml_set_acl" *)
+val set_acl_prepared : ?timeout:float -> zhandle -> string -> int -> acl_handle -> error
+  (* = "zkocaml_set_acl_prepared" *)
+val aget_all_children_number :
+  ?timeout:float -> zhandle -> string -> (error -> int -> string -> unit) -> string -> error
+val aget_ephemerals :
+  ?timeout:float -> zhandle -> string -> strings_completion_callback -> string -> error
+val get_all_children_number : ?timeout:float -> zhandle -> string -> error * int
+val get_ephemerals : ?timeout:float -> zhandle -> string -> error * strings
+external reinit : zhandle -> string -> int -> int -> error = "zkocaml_reinit"
+external rearm_watches : zhandle -> int = "zkocaml_rearm_watches"
+type recovering
+val recovering_init :
+  ?on_recover:(error -> unit) -> string -> watcher_callback -> int -> string -> int -> recovering
+val recovering_handle : recovering -> zhandle
+val recover : recovering -> error
+val register_ephemeral : ?timeout:float -> recovering -> string -> string -> acls -> error
+val unregister_ephemeral : ?timeout:float -> recovering -> string -> error
+type snapshot_reader
+external snapshot_write : string -> (string * string * int64) array -> error * int = "zkocaml_snapshot_write"
+external snapshot_open : string -> snapshot_reader option = "zkocaml_snapshot_open"
+external snapshot_find : snapshot_reader -> string -> (string * int64) option = "zkocaml_snapshot_find"
+external snapshot_generation : snapshot_reader -> int = "zkocaml_snapshot_generation"
+val publish_snapshot : ?interval:float -> zhandle -> string -> string -> (unit -> unit)
+external snapshot_entries : snapshot_reader -> (string * string * int64) array = "zkocaml_snapshot_entries"
+type warm_cache
+val warm_cache : ?on_valid:(error -> unit) -> zhandle -> string -> string -> warm_cache
+val warm_cache_find : warm_cache -> string -> string option
+val warm_cache_valid : warm_cache -> bool
+val warm_cache_save : warm_cache -> string -> error
+type proxy
+type proxy_watcher = event -> state -> string -> unit
+val serve_proxy : ?backlog:int -> ?max_queued:int -> string -> zhandle array -> (unit -> unit)
+val proxy_connect : string -> proxy option
+val proxy_close : proxy -> unit
+val proxy_create : proxy -> string -> string -> acls -> create_flag array -> error * string
+val proxy_delete : proxy -> string -> int -> error
+val proxy_exists : ?watcher:proxy_watcher -> proxy -> string -> error * stat
+val proxy_get : ?watcher:proxy_watcher -> proxy -> string -> error * string * stat
+val proxy_set : proxy -> string -> string -> int -> error * stat
+val proxy_get_children : ?watcher:proxy_watcher -> proxy -> string -> error * strings
+val export_subtree : ?window:int -> zhandle -> string -> string -> error * int
+val import_subtree :
+  ?window:int -> ?max_ops:int -> ?max_bytes:int -> zhandle -> string -> string -> acls -> error * int
+type txn = {
+  txn_session: int64;
+  txn_cxid: int;
+  txn_zxid: int64;
+  txn_time: int64;
+  txn_type: int;
+  txn_path: string;
+  txn_data_length: int
+}
+external zk_snapshot_iter : string -> bool -> (string -> string -> stat -> unit) -> error = "zkocaml_zk_snapshot_iter"
+external zk_txnlog_iter : string -> (txn -> unit) -> error = "zkocaml_zk_txnlog_iter"
+external lz4_compress : string -> string = "zkocaml_lz4_compress"
+external lz4_decompress : string -> int -> string option = "zkocaml_lz4_decompress"
+val codec_get : ?attempts:int -> zhandle -> string -> error * string * stat
+val codec_set : ?compress:bool -> ?chunk_size:int -> zhandle -> string -> string -> int -> error
+val codec_create :
+  ?compress:bool -> ?chunk_size:int -> zhandle -> string -> string -> acls -> create_flag array -> error * string
+val codec_delete : zhandle -> string -> int -> error
+type 'a decoded_cache
+val decoded_cache : zhandle -> 'a decoded_cache
+val register_decoder : 'a decoded_cache -> string -> (string -> 'a) -> unit
+val decoded_aget : 'a decoded_cache -> string -> (error -> 'a option -> unit) -> error
+val decoded_get : 'a decoded_cache -> string -> error * 'a option
+type write_batcher
+val write_batcher : ?window:float -> ?max_ops:int -> zhandle -> write_batcher
+val batched_set : write_batcher -> string -> string -> int -> (op_result -> unit) -> unit
+val batched_create :
+  write_batcher -> string -> string -> acls -> create_flag array -> (op_result -> unit) -> unit
+val batched_delete : write_batcher -> string -> int -> (op_result -> unit) -> unit
+val batcher_flush : write_batcher -> unit
+val batcher_close : write_batcher -> unit
+module type SUSPEND = sig val suspend : (('a -> unit) -> unit) -> 'a end
+module Thread_suspend : SUSPEND
+module Direct (S : SUSPEND) : sig
+  val create : ?timeout:float -> zhandle -> string -> string -> acls -> create_flag array -> error * string
+  val delete : ?timeout:float -> zhandle -> string -> int -> error
+  val exists : ?timeout:float -> zhandle -> string -> int -> error * stat
+  val get : ?timeout:float -> zhandle -> string -> int -> error * string * stat
+  val set : ?timeout:float -> zhandle -> string -> string -> int -> error
+  val get_children : ?timeout:float -> zhandle -> string -> int -> error * strings
+  val get_children2 : ?timeout:float -> zhandle -> string -> int -> error * strings * stat
+  val get_acl : ?timeout:float -> zhandle -> string -> error * acls * stat
+  val set_acl : ?timeout:float -> zhandle -> string -> int -> acls -> error
+  val multi : ?timeout:float -> zhandle -> multi_op array -> error * op_result array
+  val sync : ?timeout:float -> zhandle -> string -> error
+end
+external intern_path : string -> path = "zkocaml_path_intern"
+external path_name : path -> string = "zkocaml_path_name"
+val aexists_path :
+  ?timeout:float -> zhandle -> path -> int -> stat_completion_callback -> string -> error
+val awexists_path :
+  ?timeout:float -> zhandle -> path -> path_watcher_callback -> string -> stat_completion_callback -> string -> error
+val aget_path :
+  ?timeout:float -> zhandle -> path -> int -> data_completion_callback -> string -> error
+val awget_path :
+  ?timeout:float -> zhandle -> path -> path_watcher_callback -> string -> data_completion_callback -> string -> error
+val aset_path :
+  ?timeout:float -> zhandle -> path -> string -> int -> stat_completion_callback -> string -> error
+val exists_path : ?timeout:float -> zhandle -> path -> int -> error * stat
+val wexists_path : ?timeout:float -> zhandle -> path -> path_watcher_callback -> string -> error * stat
+val get_path : ?timeout:float -> zhandle -> path -> int -> error * string * stat
+val wget_path : ?timeout:float -> zhandle -> path -> path_watcher_callback -> string -> error * string * stat
+val set_path : ?timeout:float -> zhandle -> path -> string -> int -> error